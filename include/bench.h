@@ -0,0 +1,91 @@
+/* ------------------------------------------------------------------
+ * Little Tftp Benchmark - Shared Project Header
+ * ------------------------------------------------------------------ */
+
+#include "loop.h"
+
+#ifndef LTFTP_BENCH_H
+#define LTFTP_BENCH_H
+
+#ifndef NULL
+#define NULL ((void*) 0)
+#endif
+
+/* Maximum events handled per loop iteration */
+#define TFTP_BENCH_EVENTS_LIMIT 64
+
+/* Maximum values swept per parameter */
+#define TFTP_BENCH_LIST_LIMIT 16
+
+/* Maximum number of concurrent clients */
+#define TFTP_BENCH_CLIENTS_LIMIT 1024
+
+/* Default number of transfers per scenario */
+#define TFTP_BENCH_TRANSFERS 64
+
+/* Chunk written while preparing benchmark files */
+#define TFTP_BENCH_CHUNK 65536
+
+/* Minimum time each translation kernel is measured for in microseconds */
+#define TFTP_BENCH_KERNEL_USEC 200000
+
+/* Longest line of generated text */
+#define TFTP_BENCH_LINE_MAX 80
+
+/* Swept parameter values */
+struct tftp_bench_list
+{
+    size_t count;
+    size_t values[TFTP_BENCH_LIST_LIMIT];
+};
+
+/* Simulated client transfer structure */
+struct tftp_bench_op
+{
+    int status;
+    size_t nbytes;
+    unsigned long long started;
+    unsigned long long first_data;
+    unsigned long long elapsed;
+    struct tftp_xfer *xfer;
+};
+
+/* Benchmark scenario, one point of parameter sweep */
+struct tftp_bench_scenario
+{
+    int role;
+    size_t file_size;
+    size_t blksize;
+    size_t windowsize;
+    size_t nclients;
+    size_t ntransfers;
+};
+
+/* Benchmark scenario results */
+struct tftp_bench_result
+{
+    size_t nfailed;
+    unsigned long long nbytes;
+    unsigned long long elapsed;
+    unsigned long long ttfb_p50;
+    unsigned long long ttfb_p99;
+    unsigned long long p50;
+    unsigned long long p99;
+    unsigned long long p999;
+};
+
+/* Benchmark context structure */
+struct tftp_bench
+{
+    const char *root;
+    struct sockaddr_in addr;
+    struct tftp_bench_list roles;
+    struct tftp_bench_list sizes;
+    struct tftp_bench_list blksizes;
+    struct tftp_bench_list windows;
+    struct tftp_bench_list clients;
+    size_t ntransfers;
+    int kernels;
+};
+
+#endif
@@ -0,0 +1,90 @@
+/* ------------------------------------------------------------------
+ * Little Tftp - Shared File Cache Header
+ * ------------------------------------------------------------------ */
+
+#include "tftp.h"
+
+#ifndef LTFTP_CACHE_H
+#define LTFTP_CACHE_H
+
+/* Number of cache lookup buckets */
+#define TFTP_CACHE_BUCKETS 256
+
+/* Files queued to be read into cache at most, further misses are not cached */
+#define TFTP_CACHE_FILLS 64
+
+/* Cached file contents structure */
+struct tftp_cache_entry
+{
+    dev_t dev;
+    ino_t ino;
+    size_t size;
+    struct timespec mtime;
+    unsigned int refs;
+    int linked;
+    unsigned char *data;
+    struct tftp_cache_entry *prev;
+    struct tftp_cache_entry *next;
+    struct tftp_cache_entry *bucket_next;
+};
+
+/* Opened file queued to be read into cache */
+struct tftp_cache_fill
+{
+    int fd;
+    dev_t dev;
+    ino_t ino;
+    struct tftp_cache_fill *next;
+};
+
+/* Cache counters structure */
+struct tftp_cache_stats
+{
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long evictions;
+    size_t used;
+    size_t budget;
+};
+
+/* File cache shared by all workers */
+struct tftp_cache
+{
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_t thread;
+    int running;
+    int stopping;
+    struct tftp_cache_stats stats;
+    size_t nfills;
+    struct tftp_cache_fill *fills;
+    struct tftp_cache_fill *fills_tail;
+    struct tftp_cache_fill *filling;
+    struct tftp_cache_entry *head;
+    struct tftp_cache_entry *tail;
+    struct tftp_cache_entry *buckets[TFTP_CACHE_BUCKETS];
+};
+
+/* Initialize file cache with byte budget */
+extern int tftp_cache_init ( struct tftp_cache *cache, size_t budget );
+
+/* Start background thread reading missed files into cache */
+extern int tftp_cache_start ( struct tftp_cache *cache );
+
+/* Stop background thread and release all cached files */
+extern void tftp_cache_free ( struct tftp_cache *cache );
+
+/* Get referenced contents of opened file, NULL on miss; missed file is read into cache in
+   background */
+extern struct tftp_cache_entry *tftp_cache_acquire ( struct tftp_cache *cache, int fd );
+
+/* Drop reference to cached contents */
+extern void tftp_cache_release ( struct tftp_cache *cache, struct tftp_cache_entry *entry );
+
+/* Load file into cache ahead of requests */
+extern int tftp_cache_preload ( struct tftp_cache *cache, const char *path );
+
+/* Get snapshot of cache counters */
+extern void tftp_cache_get_stats ( struct tftp_cache *cache, struct tftp_cache_stats *stats );
+
+#endif
@@ -2,7 +2,7 @@
  * Little Tftp Client - Shared Project Header
  * ------------------------------------------------------------------ */
 
-#include "tftp.h"
+#include "loop.h"
 
 #ifndef LTFTP_CLIENT_H
 #define LTFTP_CLIENT_H
@@ -11,4 +11,35 @@
 #define NULL ((void*) 0)
 #endif
 
+/* Maximum events handled per loop iteration */
+#define TFTP_EVENTS_LIMIT 64
+
+/* Maximum number of concurrent batch transfers */
+#define TFTP_JOBS_LIMIT 256
+
+/* Maximum length of manifest line */
+#define TFTP_MANIFEST_LINE_LIMIT 512
+
+/* Batch operation structure */
+struct tftp_batch_op
+{
+    int role;
+    int resume;
+    int multicast;
+    int status;
+    size_t nbytes;
+    unsigned long long elapsed;
+    struct tftp_xfer *xfer;
+    char path[256];
+};
+
+/* Client context structure */
+struct tftp_client
+{
+    int mode;
+    unsigned int njobs;
+    struct tftp_sess sess;
+    struct tftp_opts opts;
+};
+
 #endif
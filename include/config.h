@@ -2,20 +2,44 @@
  * Little Tftp - Config Header
  * ------------------------------------------------------------------ */
 
+/* recvmmsg and sendmmsg are GNU extensions */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <errno.h>
 #include <fcntl.h>
+#include <stdarg.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <ctype.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/udp.h>
 #include <sys/time.h>
 #include <sys/types.h>
-#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <linux/filter.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <signal.h>
+#include <linux/io_uring.h>
+#include <time.h>
 #include <unistd.h>
+
+/* vector scanners are built for x86-64, others use scalar one */
+#if defined ( __x86_64__ )
+#include <immintrin.h>
+#endif
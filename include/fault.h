@@ -0,0 +1,80 @@
+/* ------------------------------------------------------------------
+ * Little Tftp - Fault Injection Header
+ * ------------------------------------------------------------------ */
+
+#include "config.h"
+
+#ifndef LTFTP_FAULT_H
+#define LTFTP_FAULT_H
+
+/* Environment variable holding fault injection settings */
+#define TFTP_FAULT_ENV "TFTP_FAULTS"
+
+/* Datagrams held back per thread, further ones are sent at once */
+#define TFTP_FAULT_QUEUE_LIMIT 4096
+
+/* Default delay of reordered datagram in microseconds */
+#define TFTP_FAULT_GAP_USEC 1000
+
+/* Delay distributions */
+#define TFTP_FAULT_DIST_UNIFORM 0
+#define TFTP_FAULT_DIST_NORMAL 1
+
+/* Fault injection settings, probabilities are in parts per million */
+struct tftp_fault_config
+{
+    int enabled;
+    int dist;
+    unsigned long long seed;
+    unsigned int drop;
+    unsigned int dup;
+    unsigned int reorder;
+    unsigned long long delay;
+    unsigned long long jitter;
+    unsigned long long gap;
+};
+
+/* Datagram held back until its release time */
+struct tftp_fault_packet
+{
+    unsigned long long release;
+    unsigned long long seq;
+    int sock;
+    int named;
+    struct sockaddr_in addr;
+    size_t len;
+    unsigned char data[];
+};
+
+/* Per thread fault state, held datagrams form heap ordered by release time */
+struct tftp_fault_line
+{
+    unsigned long long rng;
+    unsigned long long seq;
+    size_t count;
+    struct tftp_fault_packet *heap[TFTP_FAULT_QUEUE_LIMIT];
+};
+
+/* Enable fault injection from settings, environment variable is used if spec is NULL */
+extern int tftp_fault_setup ( const char *spec );
+
+/* Check whether fault injection is enabled */
+extern int tftp_fault_enabled ( void );
+
+/* Send datagram through fault injection, it may be dropped, duplicated or held back */
+extern int tftp_fault_sendmsg ( int sock, const struct msghdr *msg, unsigned long long now );
+
+/* Send datagrams through fault injection, returns count consumed */
+extern int tftp_fault_sendmmsg ( int sock, struct mmsghdr *msgs, unsigned int count,
+    unsigned long long now );
+
+/* Send held datagrams of socket at once in order they were sent, it is about to be closed */
+extern void tftp_fault_close ( int sock );
+
+/* Get release time of next held datagram of calling thread, 0 if none */
+extern unsigned long long tftp_fault_deadline ( void );
+
+/* Send held datagrams of calling thread whose release time has come */
+extern void tftp_fault_release ( unsigned long long now );
+
+#endif
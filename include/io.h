@@ -0,0 +1,98 @@
+/* ------------------------------------------------------------------
+ * Little Tftp - Batched Datagram I/O Header
+ * ------------------------------------------------------------------ */
+
+#include "tftp.h"
+
+#ifndef LTFTP_IO_H
+#define LTFTP_IO_H
+
+/* Maximum datagrams moved by single syscall */
+#define TFTP_BATCH_LIMIT 32
+
+/* Maximum bytes buffered by transfer send batch */
+#define TFTP_BATCH_BYTES (256 << 10)
+
+/* Scattered parts of each datagram, header and payload */
+#define TFTP_SLOT_IOVS 2
+
+/* Largest datagram accepted */
+#define TFTP_DATAGRAM_LIMIT 65536
+
+/* Largest UDP payload over IPv4 */
+#define TFTP_UDP_PAYLOAD_MAX 65507
+
+/* Maximum segments of single GSO super-datagram */
+#define TFTP_GSO_SEGMENTS 64
+
+/* Control message carrying GSO segment size */
+union tftp_io_cmsg
+{
+    char buffer[CMSG_SPACE ( sizeof ( uint16_t ) )];
+    struct cmsghdr align;
+};
+
+/* Datagram batch structure */
+struct tftp_io_batch
+{
+    unsigned int count;
+    unsigned int limit;
+    size_t slot_size;
+    size_t gso_size;
+    unsigned char *buffers;
+    struct mmsghdr *msgs;
+    struct iovec *iovs;
+    struct sockaddr_in *addrs;
+    struct mmsghdr *gso_msgs;
+    unsigned int *gso_nslots;
+    union tftp_io_cmsg *gso_cmsgs;
+};
+
+/* Batched I/O statistics structure */
+struct tftp_io_stats
+{
+    unsigned long long rx_calls;
+    unsigned long long rx_packets;
+    unsigned long long tx_calls;
+    unsigned long long tx_packets;
+    unsigned long long tx_segmented;
+};
+
+/* Allocate batch of datagram slots */
+extern int tftp_io_batch_init ( struct tftp_io_batch *batch, unsigned int limit,
+    size_t slot_size );
+
+/* Release batch of datagram slots */
+extern void tftp_io_batch_free ( struct tftp_io_batch *batch );
+
+/* Send runs of full slots as GSO super-datagrams if socket supports it */
+extern int tftp_io_batch_gso ( struct tftp_io_batch *batch, int sock );
+
+/* Get next free slot buffer, NULL if batch is full */
+extern unsigned char *tftp_io_batch_slot ( struct tftp_io_batch *batch );
+
+/* Queue datagram prepared in next free slot, addr is needed on unconnected sockets */
+extern void tftp_io_batch_commit ( struct tftp_io_batch *batch, size_t len,
+    const struct sockaddr_in *addr );
+
+/* Queue datagram made of header in next free slot followed by external data */
+extern void tftp_io_batch_commit_data ( struct tftp_io_batch *batch, size_t len,
+    const void *data, size_t datalen, const struct sockaddr_in *addr );
+
+/* Receive datagrams into batch, returns count received */
+extern int tftp_io_recv ( int sock, struct tftp_io_batch *batch, struct tftp_io_stats *stats );
+
+/* Send queued datagrams, returns count sent and keeps unsent ones queued */
+extern int tftp_io_flush ( int sock, struct tftp_io_batch *batch, struct tftp_io_stats *stats );
+
+/* Get messages sending queued datagrams, runs of full slots are coalesced under GSO */
+extern struct mmsghdr *tftp_io_batch_msgs ( struct tftp_io_batch *batch, unsigned int *count );
+
+/* Drop datagrams of first messages sent elsewhere, unsent ones stay queued */
+extern void tftp_io_batch_sent ( struct tftp_io_batch *batch, unsigned int nmsgs,
+    struct tftp_io_stats *stats );
+
+/* Add statistics counters */
+extern void tftp_io_stats_add ( struct tftp_io_stats *total, const struct tftp_io_stats *stats );
+
+#endif
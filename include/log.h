@@ -0,0 +1,72 @@
+/* ------------------------------------------------------------------
+ * Little Tftp - Logging Header
+ * ------------------------------------------------------------------ */
+
+#include "config.h"
+
+#ifndef LTFTP_LOG_H
+#define LTFTP_LOG_H
+
+/* Log levels, each one includes messages of previous ones */
+#define TFTP_LOG_ERROR 0
+#define TFTP_LOG_INFO 1
+#define TFTP_LOG_DEBUG 2
+#define TFTP_LOG_TRACE 3
+
+/* Messages queued for writer, must be power of two */
+#define TFTP_LOG_SLOTS 1024
+
+/* Maximum message length, longer ones are truncated */
+#define TFTP_LOG_LINE 512
+
+/* Messages written by writer at once */
+#define TFTP_LOG_BATCH 65536
+
+/* Minimum interval between progress lines of transfer */
+#define TFTP_LOG_PROGRESS_USEC 1000000
+
+/* Queued message structure, sequence tells whether it is ready to be written */
+struct tftp_log_slot
+{
+    unsigned long long seq;
+    int level;
+    unsigned int len;
+    char text[TFTP_LOG_LINE];
+};
+
+/* Logger structure, slots are filled by any thread and drained by writer */
+struct tftp_logger
+{
+    int level;
+    int wake;
+    int sleeping;
+    int stopping;
+    pthread_t thread;
+    struct tftp_log_slot *slots;
+    unsigned long long head;
+    unsigned long long tail;
+    unsigned long long written;
+    unsigned long long dropped;
+    char *batch;
+};
+
+/* Parse log level name, returns -1 if unknown */
+extern int tftp_log_parse_level ( const char *name );
+
+/* Set level of messages to be logged */
+extern void tftp_log_set_level ( int level );
+
+/* Check whether messages of level are logged */
+extern int tftp_log_enabled ( int level );
+
+/* Queue formatted message for writer, it is written at once if writer is not running */
+extern void tftp_log ( int level, const char *format, ... )
+    __attribute__ ( ( format ( printf, 2, 3 ) ) );
+
+/* Start background writer, queued messages are written out at exit */
+extern int tftp_log_start ( void );
+
+/* Wait until queued messages are written */
+extern void tftp_log_flush ( void );
+
+#endif
@@ -0,0 +1,107 @@
+/* ------------------------------------------------------------------
+ * Little Tftp - Event Loop Header
+ * ------------------------------------------------------------------ */
+
+#include "xfer.h"
+#include "uring.h"
+
+#ifndef LTFTP_LOOP_H
+#define LTFTP_LOOP_H
+
+/* Number of peer lookup buckets */
+#define TFTP_LOOP_BUCKETS 1024
+
+/* Maximum file descriptors watched by io_uring engine besides transfers */
+#define TFTP_LOOP_WATCHES 4
+
+/* io_uring request kinds, kept in low bits of user data next to object pointer */
+#define TFTP_LOOP_OP_WATCH 0
+#define TFTP_LOOP_OP_RECV 1
+#define TFTP_LOOP_OP_MRECV 2
+#define TFTP_LOOP_OP_OUTPUT 3
+#define TFTP_LOOP_OP_SEND 4
+#define TFTP_LOOP_OP_STALE 5
+#define TFTP_LOOP_OP_WRITE 6
+#define TFTP_LOOP_OP_FSYNC 7
+#define TFTP_LOOP_OP_MASK 7
+
+/* Background writer of loop, jobs that have run are reported through eventfd */
+struct tftp_loop_writer
+{
+    int wake;
+    int stopping;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct tftp_wbuf_job *queue;
+    struct tftp_wbuf_job *queue_tail;
+    struct tftp_wbuf_job *done;
+};
+
+/* Watched file descriptor structure */
+struct tftp_loop_watch
+{
+    int fd;
+    void *ptr;
+};
+
+/* Event loop structure */
+struct tftp_loop
+{
+    int epfd;
+    size_t nxfers;
+    size_t limit;
+    struct tftp_xfer **heap;
+    struct tftp_xfer *buckets[TFTP_LOOP_BUCKETS];
+    struct tftp_io_batch rx;
+    struct tftp_uring *uring;
+    struct tftp_xfer *flush;
+    unsigned long long wakeup;
+    unsigned int nwrites;
+    struct tftp_loop_writer *writer;
+    unsigned int nwatches;
+    struct tftp_loop_watch watches[TFTP_LOOP_WATCHES];
+};
+
+/* Initialize event loop */
+extern int tftp_loop_init ( struct tftp_loop *loop );
+
+/* Release event loop resources */
+extern void tftp_loop_free ( struct tftp_loop *loop );
+
+/* Drive loop by io_uring instead of epoll, must precede any watch */
+extern int tftp_loop_enable_uring ( struct tftp_loop *loop );
+
+/* Watch file descriptor for input, ptr is passed back with events */
+extern int tftp_loop_watch ( struct tftp_loop *loop, int fd, void *ptr );
+
+/* Register transfer in event loop */
+extern int tftp_loop_add ( struct tftp_loop *loop, struct tftp_xfer *xfer );
+
+/* Unregister transfer from event loop */
+extern void tftp_loop_remove ( struct tftp_loop *loop, struct tftp_xfer *xfer );
+
+/* Reschedule transfer after its deadline or output interest has changed */
+extern void tftp_loop_update ( struct tftp_loop *loop, struct tftp_xfer *xfer );
+
+/* Receive pending packets of transfer, io_uring engine has processed them already */
+extern void tftp_loop_input ( struct tftp_loop *loop, struct tftp_xfer *xfer );
+
+/* Send packets queued by transfer, io_uring engine batches them into next wait */
+extern void tftp_loop_flush ( struct tftp_loop *loop, struct tftp_xfer *xfer );
+
+/* Find transfer by peer address, NULL if none */
+extern struct tftp_xfer *tftp_loop_find ( const struct tftp_loop *loop,
+    const struct sockaddr_in *peer );
+
+/* Get milliseconds until nearest deadline, -1 if none */
+extern int tftp_loop_timeout ( const struct tftp_loop *loop );
+
+/* Get transfer with expired deadline, NULL if none */
+extern struct tftp_xfer *tftp_loop_expired ( const struct tftp_loop *loop,
+    unsigned long long now );
+
+/* Wait for events */
+extern int tftp_loop_wait ( struct tftp_loop *loop, struct epoll_event *events, int limit );
+
+#endif
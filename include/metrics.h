@@ -0,0 +1,83 @@
+/* ------------------------------------------------------------------
+ * Little Tftp - Server Metrics Header
+ * ------------------------------------------------------------------ */
+
+#include "shape.h"
+
+#ifndef LTFTP_METRICS_H
+#define LTFTP_METRICS_H
+
+/* Requests are counted by opcode, unknown ones at index zero */
+#define TFTP_METRICS_OPCODES ( TFTP_OPCODE_OACK + 1 )
+
+/* Errors are counted by TFTP error code */
+#define TFTP_METRICS_CODES ( TFTP_ERROR_OPTION_NEGOTIATION + 1 )
+
+/* Maximum histogram bucket bounds, overflow bucket is extra */
+#define TFTP_HISTOGRAM_BOUNDS 16
+
+/* Maximum length of scrape response */
+#define TFTP_METRICS_RESPONSE_LIMIT 16384
+
+/* Pending scrape connections */
+#define TFTP_METRICS_BACKLOG 16
+
+/* Pause after failed accept in microseconds, descriptors or memory may be short */
+#define TFTP_METRICS_BACKOFF_USEC 100000
+
+/* Minimum interval between logged accept failures in microseconds */
+#define TFTP_METRICS_LOG_USEC 10000000
+
+/* Histogram structure, bounds are in units observed */
+struct tftp_histogram
+{
+    const unsigned long long *bounds;
+    unsigned int nbounds;
+    double scale;
+    unsigned long long counts[TFTP_HISTOGRAM_BOUNDS + 1];
+    unsigned long long sum;
+    unsigned long long count;
+};
+
+/* Server metrics structure, counters are updated by all workers */
+struct tftp_metrics
+{
+    int sock;
+    pthread_t thread;
+    unsigned long long active;
+    unsigned long long requests[TFTP_METRICS_OPCODES];
+    unsigned long long succeeded;
+    unsigned long long failed;
+    unsigned long long bytes_sent;
+    unsigned long long bytes_received;
+    unsigned long long retransmits;
+    unsigned long long duplicates;
+    unsigned long long timeouts;
+    unsigned long long errors[TFTP_METRICS_CODES];
+    unsigned long long shape_limits[TFTP_SHAPE_SCOPES];
+    unsigned long long throttled[TFTP_SHAPE_SCOPES];
+    unsigned long long shaped_usec;
+    struct tftp_histogram first_data;
+    struct tftp_histogram throughput;
+};
+
+/* Initialize metrics with empty counters */
+extern void tftp_metrics_init ( struct tftp_metrics *metrics );
+
+/* Add value to counter, wrapping addition subtracts from gauge */
+extern void tftp_metrics_add ( unsigned long long *counter, unsigned long long value );
+
+/* Record observation in histogram */
+extern void tftp_metrics_observe ( struct tftp_histogram *histogram, unsigned long long value );
+
+/* Format metrics in Prometheus text format, returns length */
+extern size_t tftp_metrics_format ( struct tftp_metrics *metrics, char *buffer, size_t limit );
+
+/* Listen for scrapes on TCP [address:]port or Unix socket path, remote ones only if public */
+extern int tftp_metrics_listen ( struct tftp_metrics *metrics, const char *endpoint,
+    int public );
+
+/* Serve scrapes from background thread */
+extern int tftp_metrics_start ( struct tftp_metrics *metrics );
+
+#endif
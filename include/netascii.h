@@ -0,0 +1,44 @@
+/* ------------------------------------------------------------------
+ * Little Tftp - Netascii Translation Header
+ * ------------------------------------------------------------------ */
+
+#include "config.h"
+
+#ifndef LTFTP_NETASCII_H
+#define LTFTP_NETASCII_H
+
+/* Line end scanners, best one supported by CPU is used by default */
+#define TFTP_NETASCII_SCALAR 0
+#define TFTP_NETASCII_SSE2 1
+#define TFTP_NETASCII_AVX2 2
+#define TFTP_NETASCII_KERNELS 3
+
+/* Find first byte equal to a or b, returns len if there is none */
+typedef size_t ( *tftp_netascii_scan_t ) ( const unsigned char *data, size_t len, int a, int b );
+
+/* Position of block in local file, split holds line end byte whose translation
+   did not fit into previous block */
+struct tftp_netascii_mark
+{
+    unsigned long long offset;
+    int split;
+};
+
+/* Get name of scanner */
+extern const char *tftp_netascii_name ( int kernel );
+
+/* Check whether CPU supports scanner */
+extern int tftp_netascii_supported ( int kernel );
+
+/* Use given scanner from now on, returns -1 if CPU does not support it */
+extern int tftp_netascii_select ( int kernel );
+
+/* Translate local text into netascii until block is full, returns length of block */
+extern size_t tftp_netascii_encode ( const unsigned char *src, size_t len, size_t *consumed,
+    unsigned char *dst, size_t limit, int *split );
+
+/* Translate netascii block into local text, dst holds len + 1 bytes; returns its length */
+extern size_t tftp_netascii_decode ( const unsigned char *src, size_t len, unsigned char *dst,
+    int *cr );
+
+#endif
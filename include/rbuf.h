@@ -0,0 +1,42 @@
+/* ------------------------------------------------------------------
+ * Little Tftp - Read-Ahead Buffer Header
+ * ------------------------------------------------------------------ */
+
+#include "tftp.h"
+
+#ifndef LTFTP_RBUF_H
+#define LTFTP_RBUF_H
+
+/* Read-ahead chunk size limits */
+#define TFTP_RBUF_MIN (64 << 10)
+#define TFTP_RBUF_MAX (4 << 20)
+
+/* Read-ahead buffer structure */
+struct tftp_rbuf
+{
+    int fd;
+    int eof;
+    size_t size;
+    size_t len;
+    unsigned long long offset;
+    unsigned long long advised;
+    unsigned char *data;
+};
+
+/* Initialize read-ahead buffer of file, memory is allocated on first read */
+extern void tftp_rbuf_init ( struct tftp_rbuf *rbuf, int fd );
+
+/* Size chunks read at once, file is then hinted to be read sequentially */
+extern void tftp_rbuf_setup ( struct tftp_rbuf *rbuf, size_t size );
+
+/* Ask kernel to read chunk following offset in background, file needs no buffer then */
+extern void tftp_rbuf_advise ( struct tftp_rbuf *rbuf, unsigned long long offset );
+
+/* Copy file data at offset from buffer, chunk holding it is read first; returns length */
+extern ssize_t tftp_rbuf_read ( struct tftp_rbuf *rbuf, void *dst, size_t len,
+    unsigned long long offset );
+
+/* Release read-ahead buffer */
+extern void tftp_rbuf_free ( struct tftp_rbuf *rbuf );
+
+#endif
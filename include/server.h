@@ -2,7 +2,9 @@
  * Little Tftp Server - Shared Project Header
  * ------------------------------------------------------------------ */
 
-#include "tftp.h"
+#include "loop.h"
+#include "cache.h"
+#include "metrics.h"
 
 #ifndef LTFTP_SERVER_H
 #define LTFTP_SERVER_H
@@ -11,4 +13,60 @@
 #define NULL ((void*) 0)
 #endif
 
+/* Maximum events handled per loop iteration */
+#define TFTP_EVENTS_LIMIT 64
+
+/* Maximum number of worker threads */
+#define TFTP_WORKERS_LIMIT 256
+
+/* Maximum length of preload list line */
+#define TFTP_PRELOAD_LINE_LIMIT 512
+
+/* Multicast ports assigned to sessions in turn, starting at configured port */
+#define TFTP_MCAST_PORTS 256
+
+/* Maximum multicast requests waiting for worker owning sessions */
+#define TFTP_HANDOFF_LIMIT 1024
+
+/* Multicast request handed over between workers */
+struct tftp_handoff
+{
+    struct sockaddr_in peer;
+    size_t len;
+    unsigned char *request;
+    struct tftp_handoff *next;
+};
+
+/* Multicast requests queued for worker owning sessions, it is woken through eventfd */
+struct tftp_hub
+{
+    int wake;
+    pthread_mutex_t lock;
+    size_t nqueued;
+    struct tftp_handoff *queue;
+    struct tftp_handoff *queue_tail;
+};
+
+/* Server worker context structure */
+struct tftp_server
+{
+    unsigned int id;
+    int uring;
+    int sync_policy;
+    size_t sync_period;
+    unsigned int timeout_min;
+    unsigned int timeout_max;
+    unsigned int *mcast_seq;
+    struct sockaddr_in mcast;
+    struct tftp_hub *hub;
+    pthread_t thread;
+    struct tftp_sess sess;
+    struct tftp_loop loop;
+    struct tftp_io_batch tx;
+    struct tftp_io_stats io;
+    struct tftp_shaper shaper;
+    struct tftp_cache *cache;
+    struct tftp_metrics *metrics;
+};
+
 #endif
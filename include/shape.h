@@ -0,0 +1,109 @@
+/* ------------------------------------------------------------------
+ * Little Tftp - Bandwidth Shaping Header
+ * ------------------------------------------------------------------ */
+
+#include "tftp.h"
+
+#ifndef LTFTP_SHAPE_H
+#define LTFTP_SHAPE_H
+
+/* Rate limit scopes */
+#define TFTP_SHAPE_TRANSFER 0
+#define TFTP_SHAPE_SUBNET 1
+#define TFTP_SHAPE_GLOBAL 2
+#define TFTP_SHAPE_SCOPES 3
+
+/* Default burst tolerance in microseconds of rate */
+#define TFTP_SHAPE_BURST_USEC 10000
+
+/* Default prefix length grouping clients into subnets */
+#define TFTP_SHAPE_PREFIX 24
+
+/* Number of subnet buckets, further subnets share them */
+#define TFTP_SHAPE_SUBNETS 4096
+
+/* Bytes added to deficit of transfer on its turn */
+#define TFTP_SHAPE_QUANTUM 8192
+
+/* Transfer state machine, shaped transfers are queued in it */
+struct tftp_xfer;
+
+/* Rate limit in bytes per second, zero rate means unlimited and zero burst means default */
+struct tftp_shape_rate
+{
+    size_t rate;
+    size_t burst;
+};
+
+/* Token bucket kept as theoretical arrival time of next byte in nanoseconds, packet
+   conforms unless that time is further ahead than burst tolerance */
+struct tftp_bucket
+{
+    unsigned long long rate;
+    unsigned long long burst;
+    unsigned long long tat;
+};
+
+/* Subnet bucket, tag holds prefix shifted left with lowest bit set once slot is taken */
+struct tftp_shape_subnet
+{
+    unsigned long long tag;
+    struct tftp_bucket bucket;
+};
+
+/* Shaping settings and buckets shared by workers */
+struct tftp_shape
+{
+    int enabled;
+    unsigned int prefix;
+    struct tftp_shape_rate limits[TFTP_SHAPE_SCOPES];
+    struct tftp_bucket global;
+    struct tftp_shape_subnet *subnets;
+};
+
+/* Per worker scheduler, backlogged transfers take turns in deficit round robin order */
+struct tftp_shaper
+{
+    struct tftp_shape *shape;
+    struct tftp_xfer *head;
+    struct tftp_xfer *tail;
+    struct tftp_xfer *sent;
+    size_t count;
+    unsigned long long deadline;
+    unsigned long long throttled[TFTP_SHAPE_SCOPES];
+};
+
+/* Parse rate[:burst] limit with optional /prefix length if prefix is requested */
+extern int tftp_shape_parse ( const char *spec, struct tftp_shape_rate *limit,
+    unsigned int *prefix );
+
+/* Prepare buckets shared by workers for limits given by scope */
+extern int tftp_shape_init ( struct tftp_shape *shape, const struct tftp_shape_rate *limits,
+    unsigned int prefix );
+
+/* Release shared buckets */
+extern void tftp_shape_free ( struct tftp_shape *shape );
+
+/* Initialize worker scheduler */
+extern void tftp_shaper_init ( struct tftp_shaper *shaper, struct tftp_shape *shape );
+
+/* Shape transfer from now on, its buckets are chosen by peer address */
+extern void tftp_shaper_attach ( struct tftp_shaper *shaper, struct tftp_xfer *xfer );
+
+/* Queue transfer having packets to send, it is sent on its turn */
+extern void tftp_shaper_wake ( struct tftp_shaper *shaper, struct tftp_xfer *xfer );
+
+/* Take transfer out of queue, it is about to be released */
+extern void tftp_shaper_remove ( struct tftp_shaper *shaper, struct tftp_xfer *xfer );
+
+/* Charge buckets of transfer with bytes sent or received */
+extern void tftp_shaper_charge ( struct tftp_shaper *shaper, struct tftp_xfer *xfer, size_t len,
+    unsigned long long now );
+
+/* Give queued transfers turns while tokens last, deadline tells when missing ones are back */
+extern void tftp_shaper_run ( struct tftp_shaper *shaper, unsigned long long now );
+
+/* Get next transfer that queued packets during run, NULL if none is left */
+extern struct tftp_xfer *tftp_shaper_next ( struct tftp_shaper *shaper );
+
+#endif
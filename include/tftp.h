@@ -3,15 +3,34 @@
  * ------------------------------------------------------------------ */
 
 #include "config.h"
+#include "log.h"
+#include "fault.h"
 
 #ifndef LTFTP_H
 #define LTFTP_H
 
 /* TFTP data block size */
 #define TFTP_BLOCKSIZE 512
+#define TFTP_BLOCKSIZE_MIN 8
+#define TFTP_BLOCKSIZE_MAX 65464
 
-/* TFTP timeout settings */
+/* TFTP window size limit */
+#define TFTP_WINDOWSIZE_MAX 65535
+
+/* TFTP timeout settings, initial timeout is used until round trip is measured */
 #define TFTP_TIMEOUT_MSEC 1000
+#define TFTP_RTO_MIN_MSEC 50
+#define TFTP_RTO_MAX_MSEC 10000
+#define TFTP_RETRIES_LIMIT 8
+
+/* TFTP timeout option limits in seconds */
+#define TFTP_TIMEOUT_MIN_SEC 1
+#define TFTP_TIMEOUT_MAX_SEC 255
+
+/* Reply classes of retransmission state machine */
+#define TFTP_RETX_DUPLICATE 0
+#define TFTP_RETX_EXPECTED 1
+#define TFTP_RETX_AHEAD 2
 
 /* TFTP opcodes list */
 #define TFTP_OPCODE_RRQ 1
@@ -19,6 +38,7 @@
 #define TFTP_OPCODE_DATA 3
 #define TFTP_OPCODE_ACK 4
 #define TFTP_OPCODE_ERROR 5
+#define TFTP_OPCODE_OACK 6
 
 /* TFTP error codes list */
 #define TFTP_ERROR_NOT_DEFINED 0
@@ -29,6 +49,18 @@
 #define TFTP_ERROR_UNKNOWN_TRANSFER_ID 5
 #define TFTP_ERROR_FILE_ALREADY_EXISTS 6
 #define TFTP_ERROR_NO_SUCH_USER 7
+#define TFTP_ERROR_OPTION_NEGOTIATION 8
+
+/* TFTP options list */
+#define TFTP_OPTION_BLKSIZE (1 << 0)
+#define TFTP_OPTION_WINDOWSIZE (1 << 1)
+#define TFTP_OPTION_TSIZE (1 << 2)
+#define TFTP_OPTION_TIMEOUT (1 << 3)
+#define TFTP_OPTION_OFFSET (1 << 4)
+#define TFTP_OPTION_MULTICAST (1 << 5)
+
+/* Highest block of multicast transfer, block numbers do not wrap around there */
+#define TFTP_MCAST_BLOCKS_MAX 65535
 
 /* TFTP transfer modes */
 #define TFTP_TRANSFER_MODE_NETASCII 0
@@ -39,10 +71,47 @@ struct tftp_sess
 {
     int exit_flag;
     int sock;
+    struct sockaddr_in addr;
     struct sockaddr_in saddr;
     const char *progname;
 };
 
+/* Round trip estimator structure, times in microseconds */
+struct tftp_rtt
+{
+    unsigned long long srtt;
+    unsigned long long rttvar;
+    unsigned long long rto;
+    unsigned long long rto_max;
+    unsigned long long start;
+    unsigned long long seq;
+};
+
+/* Retransmission state structure, keyed on block whose reply is awaited */
+struct tftp_retx
+{
+    struct tftp_rtt rtt;
+    unsigned long long expected;
+    unsigned int retries;
+    unsigned long long timeouts;
+    unsigned long long retransmits;
+    unsigned long long duplicates;
+};
+
+/* TFTP options structure */
+struct tftp_opts
+{
+    unsigned int mask;
+    size_t blksize;
+    unsigned int windowsize;
+    unsigned long long tsize;
+    unsigned int timeout;
+    unsigned long long offset;
+    struct in_addr mcast_addr;
+    unsigned short mcast_port;
+    unsigned int mcast_master;
+};
+
 /* TFTP ACK packet structure */
 struct ack_packet
 {
@@ -62,6 +131,58 @@ struct error_packet
 extern ssize_t tftp_prepare_header ( unsigned char *header, size_t limit, unsigned short opcode,
     const char **params );
 
+/* Initialize round trip estimator with initial timeout */
+extern void tftp_rtt_init ( struct tftp_rtt *rtt );
+
+/* Start timing reply to packet unless another one is being timed */
+extern void tftp_rtt_start ( struct tftp_rtt *rtt, unsigned long long seq, unsigned long long now );
+
+/* Finish timing if reply covers timed packet and update timeout */
+extern void tftp_rtt_complete ( struct tftp_rtt *rtt, unsigned long long seq,
+    unsigned long long now );
+
+/* Double timeout after expiry, timed packet is ambiguous now */
+extern void tftp_rtt_backoff ( struct tftp_rtt *rtt );
+
+/* Limit timeout, limit is also used as timeout until round trip is measured */
+extern void tftp_rtt_bound ( struct tftp_rtt *rtt, unsigned long long limit );
+
+/* Map wire block number to newest sequence not above top */
+extern unsigned long long tftp_block_seq ( unsigned long long top, unsigned short block );
+
+/* Initialize retransmission state awaiting reply for given block */
+extern void tftp_retx_init ( struct tftp_retx *retx, unsigned long long expected );
+
+/* Classify reply by its block, duplicates are counted and never answered by resending */
+extern int tftp_retx_match ( struct tftp_retx *retx, unsigned long long seq );
+
+/* Accept reply for given block, reply for the following one is awaited next */
+extern void tftp_retx_accept ( struct tftp_retx *retx, unsigned long long seq,
+    unsigned long long now );
+
+/* Handle expired timer, returns -1 once retries are exhausted */
+extern int tftp_retx_expire ( struct tftp_retx *retx );
+
+/* Count packets sent again */
+extern void tftp_retx_resent ( struct tftp_retx *retx, unsigned int count );
+
+/* Initialize options with protocol defaults */
+extern void tftp_opts_init ( struct tftp_opts *opts );
+
+/* Parse single option name and value, returns 1 if option is unknown */
+extern int tftp_opts_parse ( struct tftp_opts *opts, const char *name, const char *value );
+
+/* Load options from name and value string pairs */
+extern int tftp_opts_load ( struct tftp_opts *opts, const unsigned char *buffer, size_t len );
+
+/* Store options as name and value string pairs */
+extern ssize_t tftp_opts_store ( const struct tftp_opts *opts, unsigned char *buffer,
+    size_t limit );
+
+/* Prepare OACK packet */
+extern ssize_t tftp_prepare_oack ( unsigned char *packet, size_t limit,
+    const struct tftp_opts *opts );
+
 /* Validate packet length */
 extern int tftp_packet_check_length ( const char *prefix, size_t expected, size_t got );
 
@@ -74,14 +195,25 @@ extern void tfp_store_ushort_ns ( unsigned char *buffer, unsigned short value );
 /* Dump tftp packet */
 extern void tftp_dump_packet ( const char *prefix, const unsigned char *packet, size_t len );
 
+/* Map errno value to tftp error code */
+extern unsigned short tftp_errno_to_code ( int status );
+
+/* Reserve disk space for file of given size, unsupported file systems are skipped */
+extern int tftp_preallocate ( int fd, unsigned long long size );
+
+/* Get monotonic time in microseconds */
+extern unsigned long long tftp_time_usec ( void );
+
 /* Send ACK packet over tftp protocol */
 extern int tftp_send_ack_packet ( struct tftp_sess *sess, unsigned short block );
 
+/* Prepare ERROR packet for error code */
+extern ssize_t tftp_prepare_error ( unsigned char *packet, size_t limit, unsigned short code );
+
 /* Send ERROR packet over tftp protocol */
 extern int tftp_send_error_packet ( struct tftp_sess *sess, unsigned short code );
 
-/* Sendto with autoretry on timeout feature */
-extern ssize_t sendto_autoretry ( int sockfd, const void *buf, size_t len, int flags,
-    const struct sockaddr *dest_addr, socklen_t addrlen );
+/* Parse size with optional binary unit suffix */
+extern int tftp_parse_size ( const char *str, size_t *size );
 
 #endif
@@ -0,0 +1,103 @@
+/* ------------------------------------------------------------------
+ * Little Tftp - io_uring Ring Header
+ * ------------------------------------------------------------------ */
+
+#include "io.h"
+
+#ifndef LTFTP_URING_H
+#define LTFTP_URING_H
+
+/* Submission queue size, completion queue is twice as large */
+#define TFTP_URING_ENTRIES 1024
+
+/* Received datagram buffers provided to kernel, power of two */
+#define TFTP_URING_BUFFERS 64
+
+/* Buffer group of received datagrams */
+#define TFTP_URING_BUFFER_GROUP 0
+
+/* Received datagram buffer holds header, source address and payload */
+#define TFTP_URING_BUFFER_SIZE ( sizeof ( struct io_uring_recvmsg_out ) \
+    + sizeof ( struct sockaddr_in ) + TFTP_DATAGRAM_LIMIT )
+
+/* io_uring ring structure */
+struct tftp_uring
+{
+    int fd;
+    unsigned int pending;
+    unsigned int sq_mask;
+    unsigned int cq_mask;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_array;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_size;
+    unsigned char *buffers;
+    struct msghdr recv_msg;
+    unsigned long long enters;
+    unsigned long long submitted;
+};
+
+/* Set up ring with provided buffers for received datagrams */
+extern int tftp_uring_init ( struct tftp_uring *ring );
+
+/* Release ring, pending requests are dropped */
+extern void tftp_uring_free ( struct tftp_uring *ring );
+
+/* Get free submission entry, NULL if queue is full */
+extern struct io_uring_sqe *tftp_uring_sqe ( struct tftp_uring *ring );
+
+/* Get count of free submission entries */
+extern unsigned int tftp_uring_space ( const struct tftp_uring *ring );
+
+/* Prepare readiness poll, multishot poll keeps reporting until canceled */
+extern int tftp_uring_poll ( struct tftp_uring *ring, int fd, unsigned int events,
+    int multishot, unsigned long long user_data );
+
+/* Prepare multishot receive, each datagram completes into provided buffer */
+extern int tftp_uring_recv ( struct tftp_uring *ring, int fd, unsigned long long user_data );
+
+/* Prepare send of message, linked send runs only once previous one succeeded */
+extern int tftp_uring_sendmsg ( struct tftp_uring *ring, int fd, const struct msghdr *msg,
+    int link, unsigned long long user_data );
+
+/* Prepare write of data at file offset, linked entry runs only once write succeeded */
+extern int tftp_uring_write ( struct tftp_uring *ring, int fd, const void *data, size_t len,
+    unsigned long long offset, int link, unsigned long long user_data );
+
+/* Prepare sync of file data written so far */
+extern int tftp_uring_fsync ( struct tftp_uring *ring, int fd, unsigned long long user_data );
+
+/* Submit pending entries and wait for completions or timeout, negative timeout waits forever */
+extern int tftp_uring_enter ( struct tftp_uring *ring, unsigned int min_complete,
+    long long timeout_usec );
+
+/* Get count of completions ready */
+extern unsigned int tftp_uring_ready ( const struct tftp_uring *ring );
+
+/* Get ready completion by its index */
+extern struct io_uring_cqe *tftp_uring_cqe ( struct tftp_uring *ring, unsigned int i );
+
+/* Release completions that were handled */
+extern void tftp_uring_advance ( struct tftp_uring *ring, unsigned int count );
+
+/* Locate datagram in provided buffer of completion, NULL if it was truncated */
+extern const unsigned char *tftp_uring_datagram ( const struct tftp_uring *ring,
+    const struct io_uring_cqe *cqe, struct sockaddr_in *addr, size_t *len );
+
+/* Hand provided buffer of completion back to kernel */
+extern void tftp_uring_recycle ( struct tftp_uring *ring, const struct io_uring_cqe *cqe );
+
+/* Cancel all requests of file descriptor and wait until they are gone */
+extern int tftp_uring_cancel ( struct tftp_uring *ring, int fd );
+
+#endif
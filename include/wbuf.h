@@ -0,0 +1,108 @@
+/* ------------------------------------------------------------------
+ * Little Tftp - Write-Behind Buffer Header
+ * ------------------------------------------------------------------ */
+
+#include "tftp.h"
+
+#ifndef LTFTP_WBUF_H
+#define LTFTP_WBUF_H
+
+/* Buffered bytes that trigger write, buffer has room for one more datagram */
+#define TFTP_WBUF_SIZE (1 << 20)
+
+/* Writes end at multiple of this file offset, partial page stays buffered */
+#define TFTP_WBUF_ALIGN 4096
+
+/* Bytes handed to background writes above which receiver holds window ACK back */
+#define TFTP_WBUF_BACKLOG (4 << 20)
+
+/* Durability policies of received files */
+#define TFTP_SYNC_NONE 0
+#define TFTP_SYNC_END 1
+#define TFTP_SYNC_PERIODIC 2
+
+struct tftp_wbuf;
+
+/* Background write of buffered data, it owns its data and file descriptor so that it may
+   outlive its buffer */
+struct tftp_wbuf_job
+{
+    int fd;
+    int sync;
+    int status;
+    unsigned int waiting;
+    size_t len;
+    unsigned long long offset;
+    unsigned char *data;
+    struct tftp_wbuf *wbuf;
+    void *owner;
+    struct tftp_wbuf_job *next;
+    struct tftp_wbuf_job *queue_next;
+};
+
+/* Hand job over to be run in background, returns -1 if it cannot be taken */
+typedef int ( *tftp_wbuf_submit_t ) ( void *ctx, struct tftp_wbuf_job *job );
+
+/* Write-behind buffer structure */
+struct tftp_wbuf
+{
+    int fd;
+    int policy;
+    int running;
+    int status;
+    size_t period;
+    size_t len;
+    size_t unsynced;
+    size_t backlog;
+    unsigned long long offset;
+    unsigned long long writes;
+    unsigned long long syncs;
+    unsigned char *data;
+    tftp_wbuf_submit_t submit;
+    void *submit_ctx;
+    void *owner;
+    struct tftp_wbuf_job *jobs;
+    struct tftp_wbuf_job *jobs_tail;
+};
+
+/* Initialize write-behind buffer of file, memory is allocated on first write */
+extern void tftp_wbuf_init ( struct tftp_wbuf *wbuf, int fd );
+
+/* Set durability policy, periodic one syncs after each period of bytes written */
+extern void tftp_wbuf_policy ( struct tftp_wbuf *wbuf, int policy, size_t period );
+
+/* Write in background from now on, jobs of buffer run one at a time in order */
+extern void tftp_wbuf_async ( struct tftp_wbuf *wbuf, tftp_wbuf_submit_t submit, void *ctx,
+    void *owner );
+
+/* Buffer data to be written at file offset, non-adjacent data flushes buffer first */
+extern int tftp_wbuf_write ( struct tftp_wbuf *wbuf, const void *data, size_t len,
+    unsigned long long offset );
+
+/* Check whether enough data is buffered to be written */
+extern int tftp_wbuf_due ( const struct tftp_wbuf *wbuf );
+
+/* Write buffered data up to aligned file offset, all of it if tail is set */
+extern int tftp_wbuf_flush ( struct tftp_wbuf *wbuf, int tail );
+
+/* Check whether background writes fall so far behind that sender should wait */
+extern int tftp_wbuf_busy ( const struct tftp_wbuf *wbuf );
+
+/* Check whether background writes are still pending */
+extern int tftp_wbuf_pending ( const struct tftp_wbuf *wbuf );
+
+/* Write all buffered data and make it durable as policy demands, returns 1 if background
+   writes are still pending */
+extern int tftp_wbuf_finish ( struct tftp_wbuf *wbuf );
+
+/* Run job in calling thread, status tells result */
+extern void tftp_wbuf_run ( struct tftp_wbuf_job *job );
+
+/* Settle job that has run, next one of its buffer is started; returns owner of buffer or
+   NULL if buffer is gone already */
+extern void *tftp_wbuf_done ( struct tftp_wbuf_job *job );
+
+/* Release write-behind buffer, data still buffered is written out first */
+extern void tftp_wbuf_free ( struct tftp_wbuf *wbuf );
+
+#endif
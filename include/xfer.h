@@ -0,0 +1,173 @@
+/* ------------------------------------------------------------------
+ * Little Tftp - Transfer State Machine Header
+ * ------------------------------------------------------------------ */
+
+#include "io.h"
+#include "wbuf.h"
+#include "rbuf.h"
+#include "netascii.h"
+#include "shape.h"
+
+#ifndef LTFTP_XFER_H
+#define LTFTP_XFER_H
+
+/* Transfer roles */
+#define TFTP_XFER_ROLE_SEND 0
+#define TFTP_XFER_ROLE_RECV 1
+
+/* Socket buffer size limit for windowed transfers */
+#define TFTP_WINDOW_BUFFER_MAX (4 << 20)
+
+/* Transfer states */
+#define TFTP_XFER_STATE_ACTIVE 0
+#define TFTP_XFER_STATE_DONE 1
+#define TFTP_XFER_STATE_FAILED 2
+
+/* Shared file contents, owned by cache */
+struct tftp_cache_entry;
+
+/* Transfer structure */
+struct tftp_xfer
+{
+    int sock;
+    int msock;
+    int fd;
+    int role;
+    int state;
+    int status;
+    int request;
+    int handshake;
+    int want_output;
+    int gap_acked;
+    int dally;
+    int quiet;
+    unsigned int events;
+    unsigned int wincount;
+    unsigned long long sent;
+    unsigned long long acked;
+    unsigned long long received;
+    unsigned long long lastseq;
+    unsigned long long frontier;
+    size_t lastlen;
+    size_t nblocks;
+    size_t nbytes;
+    size_t packet_len;
+    size_t packet_limit;
+    size_t heap_index;
+    size_t bucket;
+    struct tftp_xfer *bucket_next;
+    unsigned long long deadline;
+    unsigned long long started;
+    unsigned long long progress_at;
+    struct tftp_opts opts;
+    struct tftp_retx retx;
+    struct sockaddr_in peer;
+    const char *progname;
+    char path[256];
+    unsigned char *packet;
+    const unsigned char *map;
+    size_t map_size;
+    struct timespec map_mtime;
+    struct tftp_cache_entry *cached;
+    struct tftp_io_batch tx;
+    struct tftp_io_stats io;
+    struct tftp_wbuf wbuf;
+    struct tftp_rbuf rbuf;
+    unsigned char *blocks;
+    struct sockaddr_in group;
+    struct sockaddr_in *members;
+    size_t nmembers;
+    size_t members_limit;
+    int first_data;
+    unsigned long long reported_bytes;
+    unsigned long long reported_retransmits;
+    unsigned long long reported_duplicates;
+    unsigned long long reported_timeouts;
+    struct tftp_xfer *flush_next;
+    int flush_queued;
+    int flush_status;
+    unsigned int flush_pending;
+    unsigned int flush_sent;
+    int storing;
+    int store_ack;
+    int netascii;
+    int ascii_cr;
+    unsigned long long ascii_offset;
+    unsigned long long ascii_size;
+    size_t ascii_nmarks;
+    struct tftp_netascii_mark *ascii_marks;
+    unsigned char *ascii;
+    struct tftp_shaper *shaper;
+    struct tftp_bucket shape_bucket;
+    struct tftp_bucket *shape_subnet;
+    struct tftp_xfer *shape_prev;
+    struct tftp_xfer *shape_next;
+    struct tftp_xfer *shape_sent_next;
+    int shape_queued;
+    int shape_sent;
+    int shape_ack;
+    size_t shape_deficit;
+    unsigned long long shape_blocked;
+    unsigned long long shape_delay;
+    unsigned long long reported_shape_delay;
+};
+
+/* Allocate transfer socket bound to local address and connected to peer */
+extern int tftp_xfer_socket ( const struct sockaddr_in *laddr, const struct sockaddr_in *peer );
+
+/* Allocate unconnected transfer socket sending to multicast group over local interface */
+extern int tftp_xfer_mcast_socket ( const struct sockaddr_in *laddr );
+
+/* Allocate transfer structure with packet buffer fitting block size */
+extern struct tftp_xfer *tftp_xfer_new ( int sock, int fd, int role,
+    const struct sockaddr_in *peer, const struct tftp_opts *opts, const char *progname );
+
+/* Release transfer structure, its socket and file */
+extern void tftp_xfer_free ( struct tftp_xfer *xfer );
+
+/* Send cached file contents instead of mapping file, entry reference is kept by caller */
+extern void tftp_xfer_attach ( struct tftp_xfer *xfer, struct tftp_cache_entry *entry,
+    const unsigned char *data, size_t size );
+
+/* Translate file contents from and to netascii, must precede start of transfer */
+extern int tftp_xfer_netascii ( struct tftp_xfer *xfer );
+
+/* Start transfer by sending first OACK, DATA or ACK packet */
+extern int tftp_xfer_start ( struct tftp_xfer *xfer );
+
+/* Start transfer by sending RRQ or WRQ packet to request address */
+extern int tftp_xfer_request ( struct tftp_xfer *xfer, const char *path );
+
+/* Add member to multicast session and send it OACK, master is chosen by session */
+extern int tftp_xfer_join ( struct tftp_xfer *xfer, const struct sockaddr_in *peer );
+
+/* Process datagram received on transfer or multicast group socket */
+extern void tftp_xfer_receive ( struct tftp_xfer *xfer, const struct sockaddr_in *addr,
+    const unsigned char *packet, size_t len );
+
+/* Receive and process all pending packets using given receive batch */
+extern void tftp_xfer_input ( struct tftp_xfer *xfer, struct tftp_io_batch *rx );
+
+/* Continue sending window once socket becomes writable */
+extern void tftp_xfer_output ( struct tftp_xfer *xfer );
+
+/* Get bytes next packet held back by shaper accounts for, 0 if there is none */
+extern size_t tftp_xfer_pending ( const struct tftp_xfer *xfer );
+
+/* Queue next packet held back by shaper, returns bytes it accounts for or -1 if it was not
+   queued */
+extern ssize_t tftp_xfer_send_next ( struct tftp_xfer *xfer );
+
+/* Go on with transfer once background write of received data has run */
+extern void tftp_xfer_written ( struct tftp_xfer *xfer );
+
+/* Send all queued packets at once, returns 1 if socket buffer is full */
+extern int tftp_xfer_flush ( struct tftp_xfer *xfer );
+
+/* Handle transfer retransmission timeout */
+extern void tftp_xfer_timeout ( struct tftp_xfer *xfer );
+
+/* Abort transfer and notify peer with ERROR packet */
+extern void tftp_xfer_abort ( struct tftp_xfer *xfer, int status );
+
+#endif
@@ -0,0 +1,858 @@
+/* ------------------------------------------------------------------
+ * Little Tftp Benchmark - Main Program File
+ * ------------------------------------------------------------------ */
+
+#include "bench.h"
+
+/* Show program usage message */
+static void show_usage ( void )
+{
+    fprintf ( stderr,
+        "usage: tftpbench [-o get|put,...] [-f file_size[k|m|g],...] [-b blksize,...]\n"
+        "                 [-w windowsize,...] [-c clients,...] [-n transfers]\n"
+        "                 [-l error|info|debug|trace] [-F fault_spec] addr port root\n"
+        "       tftpbench -k [-f file_size[k|m|g],...] [-b blksize,...]\n" );
+}
+
+/* Parse comma separated list of sizes */
+static int tftp_bench_parse_list ( const char *str, struct tftp_bench_list *list,
+    size_t min, size_t max )
+{
+    size_t len;
+    size_t value;
+    char item[32];
+
+    list->count = 0;
+
+    while ( *str )
+    {
+        len = strcspn ( str, "," );
+
+        if ( len >= sizeof ( item ) || list->count == TFTP_BENCH_LIST_LIMIT )
+        {
+            return -1;
+        }
+
+        memcpy ( item, str, len );
+        item[len] = '\0';
+
+        if ( tftp_parse_size ( item, &value ) < 0 || value < min || value > max )
+        {
+            return -1;
+        }
+
+        list->values[list->count++] = value;
+        str += len + ( str[len] == ',' );
+    }
+
+    return list->count ? 0 : -1;
+}
+
+/* Parse comma separated list of operations */
+static int tftp_bench_parse_roles ( const char *str, struct tftp_bench_list *list )
+{
+    size_t len;
+
+    list->count = 0;
+
+    while ( *str )
+    {
+        len = strcspn ( str, "," );
+
+        if ( list->count == TFTP_BENCH_LIST_LIMIT )
+        {
+            return -1;
+        }
+
+        if ( len == 3 && !strncmp ( str, "get", len ) )
+        {
+            list->values[list->count++] = TFTP_XFER_ROLE_RECV;
+
+        } else if ( len == 3 && !strncmp ( str, "put", len ) )
+        {
+            list->values[list->count++] = TFTP_XFER_ROLE_SEND;
+
+        } else
+        {
+            return -1;
+        }
+
+        str += len + ( str[len] == ',' );
+    }
+
+    return list->count ? 0 : -1;
+}
+
+/* Create file of given size in server root unless it is there already */
+static int tftp_bench_prepare_file ( const char *root, size_t size )
+{
+    int fd;
+    size_t i;
+    size_t len;
+    struct stat st;
+    char path[512];
+    unsigned char chunk[TFTP_BENCH_CHUNK];
+
+    snprintf ( path, sizeof ( path ), "%s/bench-%lu.bin", root, ( unsigned long ) size );
+
+    if ( stat ( path, &st ) >= 0 && ( size_t ) st.st_size == size )
+    {
+        return 0;
+    }
+
+    if ( ( fd = open ( path, O_CREAT | O_WRONLY | O_TRUNC, 0644 ) ) < 0 )
+    {
+        return -1;
+    }
+
+    for ( i = 0; i < sizeof ( chunk ); i++ )
+    {
+        chunk[i] = ( unsigned char ) ( i * 31 + 7 );
+    }
+
+    for ( i = 0; i < size; i += len )
+    {
+        len = size - i < sizeof ( chunk ) ? size - i : sizeof ( chunk );
+
+        if ( write ( fd, chunk, len ) != ( ssize_t ) len )
+        {
+            close ( fd );
+            return -1;
+        }
+    }
+
+    close ( fd );
+
+    return 0;
+}
+
+/* Start transfer of simulated client, upload target is unique among concurrent ones */
+static int tftp_bench_begin ( struct tftp_bench *bench,
+    const struct tftp_bench_scenario *scenario, struct tftp_loop *loop,
+    struct tftp_bench_op *op, size_t slot )
+{
+    int fd;
+    int sock;
+    int status;
+    struct tftp_opts opts;
+    struct tftp_xfer *xfer;
+    char path[512];
+
+    /* downloaded data is discarded, uploaded one comes from served file */
+    if ( scenario->role == TFTP_XFER_ROLE_RECV )
+    {
+        fd = open ( "/dev/null", O_WRONLY );
+    } else
+    {
+        snprintf ( path, sizeof ( path ), "%s/bench-%lu.bin", bench->root,
+            ( unsigned long ) scenario->file_size );
+        fd = open ( path, O_RDONLY );
+    }
+
+    if ( fd < 0 )
+    {
+        return errno;
+    }
+
+    if ( ( sock = socket ( AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 ) ) < 0 )
+    {
+        status = errno;
+        close ( fd );
+        return status;
+    }
+
+    tftp_opts_init ( &opts );
+    opts.blksize = scenario->blksize;
+    opts.windowsize = scenario->windowsize;
+    opts.mask |= TFTP_OPTION_BLKSIZE | TFTP_OPTION_WINDOWSIZE;
+
+    if ( scenario->role == TFTP_XFER_ROLE_SEND )
+    {
+        opts.tsize = scenario->file_size;
+        opts.mask |= TFTP_OPTION_TSIZE;
+    }
+
+    if ( !( xfer = tftp_xfer_new ( sock, fd, scenario->role, &bench->addr, &opts, "bench" ) ) )
+    {
+        close ( sock );
+        close ( fd );
+        return ENOMEM;
+    }
+
+    if ( scenario->role == TFTP_XFER_ROLE_SEND )
+    {
+        snprintf ( xfer->path, sizeof ( xfer->path ), "bench-put-%lu.bin",
+            ( unsigned long ) slot );
+    } else
+    {
+        snprintf ( xfer->path, sizeof ( xfer->path ), "bench-%lu.bin",
+            ( unsigned long ) scenario->file_size );
+    }
+
+    xfer->quiet = 1;
+
+    if ( tftp_loop_add ( loop, xfer ) < 0 )
+    {
+        status = errno;
+        tftp_xfer_free ( xfer );
+        return status;
+    }
+
+    op->xfer = xfer;
+    op->started = tftp_time_usec (  );
+    tftp_xfer_request ( xfer, xfer->path );
+
+    return 0;
+}
+
+/* Find simulated client driven by transfer */
+static struct tftp_bench_op *tftp_bench_find_op ( struct tftp_bench_op *ops, size_t nops,
+    const struct tftp_xfer *xfer )
+{
+    size_t i;
+
+    for ( i = 0; i < nops; i++ )
+    {
+        if ( ops[i].xfer == xfer )
+        {
+            return &ops[i];
+        }
+    }
+
+    return NULL;
+}
+
+/* Flush queued packets and record first data, returns 1 once transfer is finished */
+static int tftp_bench_settle ( struct tftp_loop *loop, struct tftp_bench_op *op )
+{
+    struct tftp_xfer *xfer = op->xfer;
+
+    tftp_xfer_flush ( xfer );
+
+    /* first block received or acknowledged */
+    if ( !op->first_data && ( xfer->received || xfer->acked ) )
+    {
+        op->first_data = tftp_time_usec (  ) - op->started;
+    }
+
+    if ( xfer->state == TFTP_XFER_STATE_ACTIVE )
+    {
+        tftp_loop_update ( loop, xfer );
+        return 0;
+    }
+
+    tftp_loop_remove ( loop, xfer );
+
+    op->status = xfer->state == TFTP_XFER_STATE_DONE ? 0 : xfer->status;
+    op->nbytes = xfer->nbytes;
+    op->elapsed = tftp_time_usec (  ) - op->started;
+    op->xfer = NULL;
+
+    tftp_xfer_free ( xfer );
+
+    return 1;
+}
+
+/* Order latencies ascending */
+static int tftp_bench_compare ( const void *a, const void *b )
+{
+    unsigned long long x = *( const unsigned long long * ) a;
+    unsigned long long y = *( const unsigned long long * ) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Get percentile of sorted latencies, given in tenths of percent */
+static unsigned long long tftp_bench_percentile ( const unsigned long long *values, size_t count,
+    unsigned int permille )
+{
+    size_t rank;
+
+    if ( !count )
+    {
+        return 0;
+    }
+
+    /* nearest rank */
+    rank = ( count * permille + 999 ) / 1000;
+
+    return values[rank ? rank - 1 : 0];
+}
+
+/* Summarize finished transfers of scenario */
+static int tftp_bench_summarize ( const struct tftp_bench_op *ops, size_t nops,
+    struct tftp_bench_result *result )
+{
+    size_t i;
+    size_t count = 0;
+    unsigned long long *latency;
+    unsigned long long *ttfb;
+
+    if ( !( latency = ( unsigned long long * ) malloc ( 2 * nops
+                * sizeof ( unsigned long long ) ) ) )
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    ttfb = latency + nops;
+
+    for ( i = 0; i < nops; i++ )
+    {
+        if ( ops[i].status )
+        {
+            result->nfailed++;
+            continue;
+        }
+
+        result->nbytes += ops[i].nbytes;
+        latency[count] = ops[i].elapsed;
+        ttfb[count] = ops[i].first_data ? ops[i].first_data : ops[i].elapsed;
+        count++;
+    }
+
+    qsort ( latency, count, sizeof ( unsigned long long ), tftp_bench_compare );
+    qsort ( ttfb, count, sizeof ( unsigned long long ), tftp_bench_compare );
+
+    result->ttfb_p50 = tftp_bench_percentile ( ttfb, count, 500 );
+    result->ttfb_p99 = tftp_bench_percentile ( ttfb, count, 990 );
+    result->p50 = tftp_bench_percentile ( latency, count, 500 );
+    result->p99 = tftp_bench_percentile ( latency, count, 990 );
+    result->p999 = tftp_bench_percentile ( latency, count, 999 );
+
+    free ( latency );
+
+    return 0;
+}
+
+/* Run transfers of scenario, at most one per simulated client at once */
+static int tftp_bench_run ( struct tftp_bench *bench, const struct tftp_bench_scenario *scenario,
+    struct tftp_bench_result *result )
+{
+    int i;
+    int nevents;
+    int status = 0;
+    size_t slot;
+    size_t next = 0;
+    size_t nactive = 0;
+    unsigned long long started;
+    size_t *busy;
+    struct tftp_xfer *xfer;
+    struct tftp_bench_op *op;
+    struct tftp_bench_op *ops;
+    struct tftp_loop loop;
+    struct epoll_event events[TFTP_BENCH_EVENTS_LIMIT];
+
+    memset ( result, '\0', sizeof ( struct tftp_bench_result ) );
+
+    if ( !( ops = ( struct tftp_bench_op * ) calloc ( scenario->ntransfers,
+                sizeof ( struct tftp_bench_op ) ) ) )
+    {
+        return ENOMEM;
+    }
+
+    /* busy[i] holds index of transfer run by client i plus one */
+    if ( !( busy = ( size_t * ) calloc ( scenario->nclients, sizeof ( size_t ) ) ) )
+    {
+        free ( ops );
+        return ENOMEM;
+    }
+
+    if ( tftp_loop_init ( &loop ) < 0 )
+    {
+        status = errno;
+        free ( busy );
+        free ( ops );
+        return status;
+    }
+
+    started = tftp_time_usec (  );
+
+    while ( next < scenario->ntransfers || nactive )
+    {
+        /* idle clients start next transfer */
+        for ( slot = 0; slot < scenario->nclients && next < scenario->ntransfers; slot++ )
+        {
+            if ( busy[slot] )
+            {
+                continue;
+            }
+
+            op = &ops[next++];
+
+            if ( ( op->status = tftp_bench_begin ( bench, scenario, &loop, op, slot ) ) )
+            {
+                continue;
+            }
+
+            /* request goes out at once */
+            busy[slot] = next;
+            nactive += !tftp_bench_settle ( &loop, op );
+        }
+
+        if ( !nactive )
+        {
+            continue;
+        }
+
+        if ( ( nevents = tftp_loop_wait ( &loop, events, TFTP_BENCH_EVENTS_LIMIT ) ) < 0 )
+        {
+            if ( errno == EINTR )
+            {
+                continue;
+            }
+            status = errno;
+            break;
+        }
+
+        for ( i = 0; i < nevents; i++ )
+        {
+            xfer = ( struct tftp_xfer * ) events[i].data.ptr;
+            op = tftp_bench_find_op ( ops, next, xfer );
+
+            if ( events[i].events & EPOLLOUT )
+            {
+                tftp_xfer_output ( xfer );
+            }
+
+            tftp_xfer_input ( xfer, &loop.rx );
+            nactive -= tftp_bench_settle ( &loop, op );
+        }
+
+        /* handle retransmission timeouts */
+        while ( ( xfer = tftp_loop_expired ( &loop, tftp_time_usec (  ) ) ) )
+        {
+            tftp_xfer_timeout ( xfer );
+            nactive -= tftp_bench_settle ( &loop, tftp_bench_find_op ( ops, next, xfer ) );
+        }
+
+        /* release clients of finished transfers */
+        for ( slot = 0; slot < scenario->nclients; slot++ )
+        {
+            if ( busy[slot] && !ops[busy[slot] - 1].xfer )
+            {
+                busy[slot] = 0;
+            }
+        }
+    }
+
+    result->elapsed = tftp_time_usec (  ) - started;
+
+    /* abort pending transfers */
+    while ( loop.nxfers )
+    {
+        tftp_xfer_abort ( loop.heap[0], ECANCELED );
+        tftp_bench_settle ( &loop, tftp_bench_find_op ( ops, next, loop.heap[0] ) );
+    }
+
+    tftp_loop_free ( &loop );
+
+    if ( tftp_bench_summarize ( ops, next, result ) < 0 )
+    {
+        status = errno;
+    }
+
+    free ( busy );
+    free ( ops );
+
+    return status;
+}
+
+/* Print scenario results as one JSON object per line */
+static void tftp_bench_print ( const struct tftp_bench_scenario *scenario,
+    const struct tftp_bench_result *result )
+{
+    double seconds = result->elapsed / 1e6;
+
+    printf ( "{\"op\":\"%s\",\"file_size\":%lu,\"blksize\":%lu,\"windowsize\":%lu,"
+        "\"clients\":%lu,\"transfers\":%lu,\"failed\":%lu,\"seconds\":%.3f,"
+        "\"mb_per_s\":%.2f,\"req_per_s\":%.2f,\"ttfb_p50_ms\":%.3f,\"ttfb_p99_ms\":%.3f,"
+        "\"p50_ms\":%.3f,\"p99_ms\":%.3f,\"p999_ms\":%.3f}\n",
+        scenario->role == TFTP_XFER_ROLE_RECV ? "get" : "put",
+        ( unsigned long ) scenario->file_size, ( unsigned long ) scenario->blksize,
+        ( unsigned long ) scenario->windowsize, ( unsigned long ) scenario->nclients,
+        ( unsigned long ) scenario->ntransfers, ( unsigned long ) result->nfailed, seconds,
+        seconds > 0 ? result->nbytes / 1e6 / seconds : 0.0,
+        seconds > 0 ? ( scenario->ntransfers - result->nfailed ) / seconds : 0.0,
+        result->ttfb_p50 / 1e3, result->ttfb_p99 / 1e3, result->p50 / 1e3, result->p99 / 1e3,
+        result->p999 / 1e3 );
+    fflush ( stdout );
+}
+
+/* Fill buffer with text of lines of varying length */
+static void tftp_bench_text ( unsigned char *text, size_t size )
+{
+    size_t i;
+    size_t line = 0;
+    unsigned int nlines = 0;
+    unsigned int len = 0;
+
+    for ( i = 0; i < size; i++ )
+    {
+        if ( line == len )
+        {
+            text[i] = '\n';
+            len = ( ++nlines * 2654435761U >> 16 ) % TFTP_BENCH_LINE_MAX;
+            line = 0;
+        } else
+        {
+            text[i] = ' ' + ( i * 31 + nlines ) % 95;
+            line++;
+        }
+    }
+}
+
+/* Translate text into netascii blocks as sender does, returns length of translated text */
+static size_t tftp_bench_encode ( const unsigned char *text, size_t size, unsigned char *wire,
+    size_t blksize )
+{
+    int split = 0;
+    size_t len;
+    size_t pos = 0;
+    size_t out = 0;
+    size_t consumed;
+
+    do
+    {
+        len = tftp_netascii_encode ( text + pos, size - pos, &consumed, wire + out, blksize,
+            &split );
+        pos += consumed;
+        out += len;
+    } while ( len == blksize );
+
+    return out;
+}
+
+/* Translate netascii blocks into text as receiver does, returns length of text */
+static size_t tftp_bench_decode ( const unsigned char *wire, size_t size, unsigned char *text,
+    size_t blksize )
+{
+    int cr = 0;
+    size_t len;
+    size_t pos;
+    size_t out = 0;
+
+    for ( pos = 0; pos < size; pos += len )
+    {
+        len = size - pos < blksize ? size - pos : blksize;
+        out += tftp_netascii_decode ( wire + pos, len, text + out, &cr );
+    }
+
+    if ( cr )
+    {
+        text[out++] = '\r';
+    }
+
+    return out;
+}
+
+/* Measure netascii translation of text by given scanner, throughput is of local text */
+static int tftp_bench_kernel ( int kernel, const unsigned char *text, size_t size,
+    unsigned char *wire, unsigned char *back, size_t blksize )
+{
+    size_t wirelen = 0;
+    unsigned long long i;
+    unsigned long long started;
+    unsigned long long elapsed[2];
+    unsigned long long nrounds[2] = { 0, 0 };
+
+    tftp_netascii_select ( kernel );
+
+    started = tftp_time_usec (  );
+    while ( ( elapsed[0] = tftp_time_usec (  ) - started ) < TFTP_BENCH_KERNEL_USEC )
+    {
+        for ( i = 0; i < 16; i++, nrounds[0]++ )
+        {
+            wirelen = tftp_bench_encode ( text, size, wire, blksize );
+        }
+    }
+
+    started = tftp_time_usec (  );
+    while ( ( elapsed[1] = tftp_time_usec (  ) - started ) < TFTP_BENCH_KERNEL_USEC )
+    {
+        for ( i = 0; i < 16; i++, nrounds[1]++ )
+        {
+            tftp_bench_decode ( wire, wirelen, back, blksize );
+        }
+    }
+
+    /* translation must be undone exactly */
+    if ( tftp_bench_decode ( wire, wirelen, back, blksize ) != size || memcmp ( back, text,
+            size ) )
+    {
+        errno = EILSEQ;
+        return -1;
+    }
+
+    printf ( "{\"kernel\":\"%s\",\"file_size\":%lu,\"blksize\":%lu,\"wire_size\":%lu,"
+        "\"encode_mb_per_s\":%.2f,\"decode_mb_per_s\":%.2f}\n", tftp_netascii_name ( kernel ),
+        ( unsigned long ) size, ( unsigned long ) blksize, ( unsigned long ) wirelen,
+        ( double ) nrounds[0] * size / elapsed[0], ( double ) nrounds[1] * size / elapsed[1] );
+    fflush ( stdout );
+
+    return 0;
+}
+
+/* Measure netascii translation by every supported scanner, returns number of failed runs */
+static size_t tftp_bench_kernels ( struct tftp_bench *bench )
+{
+    int kernel;
+    size_t f, b;
+    size_t size;
+    size_t nfailed = 0;
+    unsigned char *text;
+    unsigned char *wire;
+    unsigned char *back;
+
+    for ( f = 0; f < bench->sizes.count; f++ )
+    {
+        size = bench->sizes.values[f];
+
+        /* every byte may take two on the wire, decoding may run one byte ahead */
+        text = ( unsigned char * ) malloc ( size );
+        wire = ( unsigned char * ) malloc ( 2 * size );
+        back = ( unsigned char * ) malloc ( size + 1 );
+
+        if ( !text || !wire || !back )
+        {
+            tftp_log ( TFTP_LOG_ERROR, "[bench] failed to allocate %lu bytes of text\n",
+                ( unsigned long ) size );
+            free ( text );
+            free ( wire );
+            free ( back );
+            nfailed++;
+            continue;
+        }
+
+        tftp_bench_text ( text, size );
+
+        for ( b = 0; b < bench->blksizes.count; b++ )
+        {
+            for ( kernel = 0; kernel < TFTP_NETASCII_KERNELS; kernel++ )
+            {
+                if ( tftp_netascii_supported ( kernel )
+                    && tftp_bench_kernel ( kernel, text, size, wire, back,
+                        bench->blksizes.values[b] ) < 0 )
+                {
+                    tftp_log ( TFTP_LOG_ERROR, "[bench] %s kernel failed: %i\n",
+                        tftp_netascii_name ( kernel ), errno );
+                    nfailed++;
+                }
+            }
+        }
+
+        free ( text );
+        free ( wire );
+        free ( back );
+    }
+
+    return nfailed;
+}
+
+/* Run every combination of swept parameters, returns number of failed transfers */
+static size_t tftp_bench_sweep ( struct tftp_bench *bench )
+{
+    int status;
+    size_t o, f, b, w, c;
+    size_t nfailed = 0;
+    struct tftp_bench_scenario scenario;
+    struct tftp_bench_result result;
+
+    scenario.ntransfers = bench->ntransfers;
+
+    for ( o = 0; o < bench->roles.count; o++ )
+    {
+        scenario.role = bench->roles.values[o];
+
+        for ( f = 0; f < bench->sizes.count; f++ )
+        {
+            scenario.file_size = bench->sizes.values[f];
+
+            for ( b = 0; b < bench->blksizes.count; b++ )
+            {
+                scenario.blksize = bench->blksizes.values[b];
+
+                for ( w = 0; w < bench->windows.count; w++ )
+                {
+                    scenario.windowsize = bench->windows.values[w];
+
+                    for ( c = 0; c < bench->clients.count; c++ )
+                    {
+                        scenario.nclients = bench->clients.values[c];
+
+                        if ( ( status = tftp_bench_run ( bench, &scenario, &result ) ) )
+                        {
+                            tftp_log ( TFTP_LOG_ERROR, "[bench] scenario failed: %i\n",
+                                status );
+                            nfailed += scenario.ntransfers;
+                            continue;
+                        }
+
+                        tftp_bench_print ( &scenario, &result );
+                        nfailed += result.nfailed;
+                    }
+                }
+            }
+        }
+    }
+
+    return nfailed;
+}
+
+/* Program main function */
+int main ( int argc, char *argv[] )
+{
+    int opt;
+    int log_level;
+    size_t i;
+    size_t ntransfers;
+    unsigned int addr;
+    unsigned int port;
+    struct tftp_bench bench;
+
+    memset ( &bench, '\0', sizeof ( bench ) );
+
+    /* single download scenario by default */
+    bench.roles.count = 1;
+    bench.roles.values[0] = TFTP_XFER_ROLE_RECV;
+    bench.sizes.count = 1;
+    bench.sizes.values[0] = 1 << 20;
+    bench.blksizes.count = 1;
+    bench.blksizes.values[0] = 1428;
+    bench.windows.count = 1;
+    bench.windows.values[0] = 16;
+    bench.clients.count = 1;
+    bench.clients.values[0] = 1;
+    bench.ntransfers = TFTP_BENCH_TRANSFERS;
+
+    /* transfer progress and statistics would mix with results */
+    tftp_log_set_level ( TFTP_LOG_ERROR );
+
+    /* faults may be requested through environment by any program */
+    if ( tftp_fault_setup ( NULL ) < 0 )
+    {
+        tftp_log ( TFTP_LOG_ERROR, "[bench] invalid %s settings\n", TFTP_FAULT_ENV );
+        return 1;
+    }
+
+    /* parse optional arguments */
+    while ( ( opt = getopt ( argc, argv, "o:f:b:w:c:n:kF:l:" ) ) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'o':
+            if ( tftp_bench_parse_roles ( optarg, &bench.roles ) < 0 )
+            {
+                show_usage (  );
+                return 1;
+            }
+            break;
+        case 'f':
+            if ( tftp_bench_parse_list ( optarg, &bench.sizes, 0, ( size_t ) -1 ) < 0 )
+            {
+                show_usage (  );
+                return 1;
+            }
+            break;
+        case 'b':
+            if ( tftp_bench_parse_list ( optarg, &bench.blksizes, TFTP_BLOCKSIZE_MIN,
+                    TFTP_BLOCKSIZE_MAX ) < 0 )
+            {
+                show_usage (  );
+                return 1;
+            }
+            break;
+        case 'w':
+            if ( tftp_bench_parse_list ( optarg, &bench.windows, 1, TFTP_WINDOWSIZE_MAX ) < 0 )
+            {
+                show_usage (  );
+                return 1;
+            }
+            break;
+        case 'c':
+            if ( tftp_bench_parse_list ( optarg, &bench.clients, 1,
+                    TFTP_BENCH_CLIENTS_LIMIT ) < 0 )
+            {
+                show_usage (  );
+                return 1;
+            }
+            break;
+        case 'n':
+            if ( tftp_parse_size ( optarg, &ntransfers ) < 0 || !ntransfers )
+            {
+                show_usage (  );
+                return 1;
+            }
+            bench.ntransfers = ntransfers;
+            break;
+        case 'k':
+            bench.kernels = 1;
+            break;
+        case 'F':
+            if ( tftp_fault_setup ( optarg ) < 0 )
+            {
+                show_usage (  );
+                return 1;
+            }
+            break;
+        case 'l':
+            if ( ( log_level = tftp_log_parse_level ( optarg ) ) < 0 )
+            {
+                show_usage (  );
+                return 1;
+            }
+            tftp_log_set_level ( log_level );
+            break;
+        default:
+            show_usage (  );
+            return 1;
+        }
+    }
+
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    /* translation kernels run in memory without server */
+    if ( bench.kernels )
+    {
+        return tftp_bench_kernels ( &bench ) ? 1 : 0;
+    }
+
+    /* validate arguments count */
+    if ( argc < 4 )
+    {
+        show_usage (  );
+        return 1;
+    }
+
+    /* parse IPv4 address */
+    if ( inet_pton ( AF_INET, argv[1], &addr ) <= 0 )
+    {
+        show_usage (  );
+        return 1;
+    }
+
+    /* parse port number */
+    if ( sscanf ( argv[2], "%u", &port ) <= 0 || !port || port >= 65536 )
+    {
+        show_usage (  );
+        return 1;
+    }
+
+    bench.root = argv[3];
+    bench.addr.sin_family = AF_INET;
+    bench.addr.sin_addr.s_addr = addr;
+    bench.addr.sin_port = htons ( port );
+
+    /* downloaded and uploaded files live in server root */
+    for ( i = 0; i < bench.sizes.count; i++ )
+    {
+        if ( tftp_bench_prepare_file ( bench.root, bench.sizes.values[i] ) < 0 )
+        {
+            tftp_log ( TFTP_LOG_ERROR, "[bench] failed to prepare file: %i\n", errno );
+            return 1;
+        }
+    }
+
+    return tftp_bench_sweep ( &bench ) ? 1 : 0;
+}
@@ -0,0 +1,530 @@
+/* ------------------------------------------------------------------
+ * Little Tftp - Shared File Cache
+ * ------------------------------------------------------------------ */
+
+#include "cache.h"
+
+/* Initialize file cache with byte budget */
+int tftp_cache_init ( struct tftp_cache *cache, size_t budget )
+{
+    memset ( cache, '\0', sizeof ( struct tftp_cache ) );
+
+    if ( ( errno = pthread_mutex_init ( &cache->lock, NULL ) ) )
+    {
+        return -1;
+    }
+
+    if ( ( errno = pthread_cond_init ( &cache->wake, NULL ) ) )
+    {
+        pthread_mutex_destroy ( &cache->lock );
+        return -1;
+    }
+
+    cache->stats.budget = budget;
+
+    return 0;
+}
+
+/* Stop background thread and release all cached files */
+void tftp_cache_free ( struct tftp_cache *cache )
+{
+    struct tftp_cache_fill *fill;
+    struct tftp_cache_entry *entry;
+
+    if ( cache->running )
+    {
+        pthread_mutex_lock ( &cache->lock );
+        cache->stopping = 1;
+        pthread_cond_signal ( &cache->wake );
+        pthread_mutex_unlock ( &cache->lock );
+        pthread_join ( cache->thread, NULL );
+    }
+
+    while ( ( fill = cache->fills ) )
+    {
+        cache->fills = fill->next;
+        close ( fill->fd );
+        free ( fill );
+    }
+
+    while ( ( entry = cache->head ) )
+    {
+        cache->head = entry->next;
+        free ( entry->data );
+        free ( entry );
+    }
+
+    pthread_cond_destroy ( &cache->wake );
+    pthread_mutex_destroy ( &cache->lock );
+}
+
+/* Get lookup bucket index of file */
+static size_t tftp_cache_bucket ( dev_t dev, ino_t ino )
+{
+    return ( ( ino ^ dev * 0x9e3779b1u ) >> 3 ) % TFTP_CACHE_BUCKETS;
+}
+
+/* Find cached file by device and inode, lock must be held */
+static struct tftp_cache_entry *tftp_cache_find ( struct tftp_cache *cache, dev_t dev, ino_t ino )
+{
+    struct tftp_cache_entry *entry;
+
+    for ( entry = cache->buckets[tftp_cache_bucket ( dev, ino )]; entry;
+        entry = entry->bucket_next )
+    {
+        if ( entry->dev == dev && entry->ino == ino )
+        {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+/* Check if cached contents match file state */
+static int tftp_cache_fresh ( const struct tftp_cache_entry *entry, const struct stat *st )
+{
+    return entry->size == ( size_t ) st->st_size
+        && entry->mtime.tv_sec == st->st_mtim.tv_sec
+        && entry->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/* Release entry memory once it is unlinked and unreferenced, lock must be held */
+static void tftp_cache_drop ( struct tftp_cache *cache, struct tftp_cache_entry *entry )
+{
+    if ( !entry->linked && !entry->refs )
+    {
+        cache->stats.used -= entry->size;
+        free ( entry->data );
+        free ( entry );
+    }
+}
+
+/* Remove entry from recency list, lock must be held */
+static void tftp_cache_list_remove ( struct tftp_cache *cache, struct tftp_cache_entry *entry )
+{
+    if ( entry->prev )
+    {
+        entry->prev->next = entry->next;
+    } else
+    {
+        cache->head = entry->next;
+    }
+
+    if ( entry->next )
+    {
+        entry->next->prev = entry->prev;
+    } else
+    {
+        cache->tail = entry->prev;
+    }
+}
+
+/* Insert entry into recency list as most recently used, lock must be held */
+static void tftp_cache_list_insert ( struct tftp_cache *cache, struct tftp_cache_entry *entry )
+{
+    entry->prev = NULL;
+    entry->next = cache->head;
+
+    if ( cache->head )
+    {
+        cache->head->prev = entry;
+    } else
+    {
+        cache->tail = entry;
+    }
+
+    cache->head = entry;
+}
+
+/* Remove entry from lookup and recency list, lock must be held */
+static void tftp_cache_unlink ( struct tftp_cache *cache, struct tftp_cache_entry *entry )
+{
+    struct tftp_cache_entry **link;
+
+    for ( link = &cache->buckets[tftp_cache_bucket ( entry->dev, entry->ino )]; *link;
+        link = &( *link )->bucket_next )
+    {
+        if ( *link == entry )
+        {
+            *link = entry->bucket_next;
+            break;
+        }
+    }
+
+    tftp_cache_list_remove ( cache, entry );
+    entry->linked = 0;
+
+    /* transfers still sending it keep memory alive */
+    tftp_cache_drop ( cache, entry );
+}
+
+/* Insert entry as most recently used, lock must be held */
+static void tftp_cache_link ( struct tftp_cache *cache, struct tftp_cache_entry *entry )
+{
+    size_t bucket;
+
+    tftp_cache_list_insert ( cache, entry );
+
+    bucket = tftp_cache_bucket ( entry->dev, entry->ino );
+    entry->bucket_next = cache->buckets[bucket];
+    cache->buckets[bucket] = entry;
+    entry->linked = 1;
+}
+
+/* Read whole file into new entry */
+static struct tftp_cache_entry *tftp_cache_load ( int fd, const struct stat *st )
+{
+    size_t offset;
+    ssize_t len;
+    struct stat after;
+    struct tftp_cache_entry *entry;
+
+    if ( !( entry =
+            ( struct tftp_cache_entry * ) calloc ( 1, sizeof ( struct tftp_cache_entry ) ) ) )
+    {
+        return NULL;
+    }
+
+    if ( !( entry->data = ( unsigned char * ) malloc ( st->st_size ) ) )
+    {
+        free ( entry );
+        return NULL;
+    }
+
+    entry->dev = st->st_dev;
+    entry->ino = st->st_ino;
+    entry->size = st->st_size;
+    entry->mtime = st->st_mtim;
+
+    /* read file data */
+    for ( offset = 0; offset < entry->size; offset += len )
+    {
+        if ( ( len = pread ( fd, entry->data + offset, entry->size - offset, offset ) ) <= 0 )
+        {
+            break;
+        }
+    }
+
+    /* file changed while being read, contents are inconsistent */
+    if ( offset < entry->size || fstat ( fd, &after ) < 0 || !tftp_cache_fresh ( entry, &after ) )
+    {
+        free ( entry->data );
+        free ( entry );
+        errno = ESTALE;
+        return NULL;
+    }
+
+    return entry;
+}
+
+/* Evict least recently used entries until size fits budget, lock must be held; returns -1
+   without evicting anything if entries being sent leave no room */
+static int tftp_cache_reserve ( struct tftp_cache *cache, size_t size )
+{
+    size_t evictable = 0;
+    struct tftp_cache_entry *entry;
+    struct tftp_cache_entry *prev;
+
+    if ( cache->stats.used + size <= cache->stats.budget )
+    {
+        return 0;
+    }
+
+    for ( entry = cache->head; entry; entry = entry->next )
+    {
+        if ( !entry->refs )
+        {
+            evictable += entry->size;
+        }
+    }
+
+    /* referenced entries keep their memory until released */
+    if ( cache->stats.used - evictable + size > cache->stats.budget )
+    {
+        return -1;
+    }
+
+    for ( entry = cache->tail; entry && cache->stats.used + size > cache->stats.budget;
+        entry = prev )
+    {
+        prev = entry->prev;
+
+        if ( !entry->refs )
+        {
+            tftp_cache_unlink ( cache, entry );
+            cache->stats.evictions++;
+        }
+    }
+
+    return 0;
+}
+
+/* Insert loaded entry, returns 1 if same contents are cached already and -1 if there is
+   no room; lock must be held */
+static int tftp_cache_insert ( struct tftp_cache *cache, struct tftp_cache_entry *loaded )
+{
+    struct tftp_cache_entry *entry;
+
+    if ( ( entry = tftp_cache_find ( cache, loaded->dev, loaded->ino ) ) )
+    {
+        if ( entry->size == loaded->size && entry->mtime.tv_sec == loaded->mtime.tv_sec
+            && entry->mtime.tv_nsec == loaded->mtime.tv_nsec )
+        {
+            return 1;
+        }
+
+        tftp_cache_unlink ( cache, entry );
+    }
+
+    if ( tftp_cache_reserve ( cache, loaded->size ) < 0 )
+    {
+        return -1;
+    }
+
+    cache->stats.used += loaded->size;
+    tftp_cache_link ( cache, loaded );
+
+    return 0;
+}
+
+/* Read opened file into cache, returns -1 if it is not cacheable */
+static int tftp_cache_fill_file ( struct tftp_cache *cache, int fd )
+{
+    int status;
+    struct stat st;
+    struct tftp_cache_entry *loaded;
+
+    if ( fstat ( fd, &st ) < 0 )
+    {
+        return -1;
+    }
+
+    /* empty, special or oversized files are not cached */
+    if ( !S_ISREG ( st.st_mode ) || !st.st_size || ( size_t ) st.st_size > cache->stats.budget )
+    {
+        errno = EFBIG;
+        return -1;
+    }
+
+    /* read file without holding lock, workers keep serving */
+    if ( !( loaded = tftp_cache_load ( fd, &st ) ) )
+    {
+        return -1;
+    }
+
+    pthread_mutex_lock ( &cache->lock );
+    status = tftp_cache_insert ( cache, loaded );
+    pthread_mutex_unlock ( &cache->lock );
+
+    if ( !status )
+    {
+        return 0;
+    }
+
+    free ( loaded->data );
+    free ( loaded );
+
+    if ( status < 0 )
+    {
+        errno = EFBIG;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Check whether file is queued or being read into cache, lock must be held */
+static int tftp_cache_queued ( struct tftp_cache *cache, dev_t dev, ino_t ino )
+{
+    struct tftp_cache_fill *fill;
+
+    if ( cache->filling && cache->filling->dev == dev && cache->filling->ino == ino )
+    {
+        return 1;
+    }
+
+    for ( fill = cache->fills; fill; fill = fill->next )
+    {
+        if ( fill->dev == dev && fill->ino == ino )
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* Queue opened file to be read into cache by background thread, lock must be held */
+static void tftp_cache_queue ( struct tftp_cache *cache, int fd, const struct stat *st )
+{
+    struct tftp_cache_fill *fill;
+
+    if ( !cache->running || cache->nfills >= TFTP_CACHE_FILLS
+        || tftp_cache_queued ( cache, st->st_dev, st->st_ino ) )
+    {
+        return;
+    }
+
+    if ( !( fill = ( struct tftp_cache_fill * ) malloc ( sizeof ( struct tftp_cache_fill ) ) ) )
+    {
+        return;
+    }
+
+    /* transfer may close its file before it is read */
+    if ( ( fill->fd = fcntl ( fd, F_DUPFD_CLOEXEC, 0 ) ) < 0 )
+    {
+        free ( fill );
+        return;
+    }
+
+    fill->dev = st->st_dev;
+    fill->ino = st->st_ino;
+    fill->next = NULL;
+
+    if ( cache->fills_tail )
+    {
+        cache->fills_tail->next = fill;
+    } else
+    {
+        cache->fills = fill;
+    }
+
+    cache->fills_tail = fill;
+    cache->nfills++;
+    pthread_cond_signal ( &cache->wake );
+}
+
+/* Read queued files into cache until stopped */
+static void *tftp_cache_run ( void *arg )
+{
+    struct tftp_cache *cache = ( struct tftp_cache * ) arg;
+    struct tftp_cache_fill *fill;
+
+    pthread_mutex_lock ( &cache->lock );
+
+    for ( ;; )
+    {
+        while ( !cache->fills && !cache->stopping )
+        {
+            pthread_cond_wait ( &cache->wake, &cache->lock );
+        }
+
+        if ( cache->stopping )
+        {
+            break;
+        }
+
+        fill = cache->fills;
+        if ( !( cache->fills = fill->next ) )
+        {
+            cache->fills_tail = NULL;
+        }
+        cache->filling = fill;
+        pthread_mutex_unlock ( &cache->lock );
+
+        /* file may have changed or outgrown budget meanwhile */
+        tftp_cache_fill_file ( cache, fill->fd );
+        close ( fill->fd );
+
+        pthread_mutex_lock ( &cache->lock );
+        cache->filling = NULL;
+        cache->nfills--;
+        free ( fill );
+    }
+
+    pthread_mutex_unlock ( &cache->lock );
+
+    return NULL;
+}
+
+/* Start background thread reading missed files into cache */
+int tftp_cache_start ( struct tftp_cache *cache )
+{
+    if ( ( errno = pthread_create ( &cache->thread, NULL, tftp_cache_run, cache ) ) )
+    {
+        return -1;
+    }
+
+    cache->running = 1;
+
+    return 0;
+}
+
+/* Get referenced contents of opened file, NULL on miss; missed file is read into cache in
+   background */
+struct tftp_cache_entry *tftp_cache_acquire ( struct tftp_cache *cache, int fd )
+{
+    struct stat st;
+    struct tftp_cache_entry *entry;
+
+    if ( fstat ( fd, &st ) < 0 )
+    {
+        return NULL;
+    }
+
+    pthread_mutex_lock ( &cache->lock );
+
+    if ( ( entry = tftp_cache_find ( cache, st.st_dev, st.st_ino ) ) )
+    {
+        if ( tftp_cache_fresh ( entry, &st ) )
+        {
+            /* mark as most recently used */
+            tftp_cache_list_remove ( cache, entry );
+            tftp_cache_list_insert ( cache, entry );
+            entry->refs++;
+            cache->stats.hits++;
+            pthread_mutex_unlock ( &cache->lock );
+            return entry;
+        }
+
+        /* file was modified since cached */
+        tftp_cache_unlink ( cache, entry );
+    }
+
+    cache->stats.misses++;
+
+    /* requester is served from file meanwhile */
+    if ( S_ISREG ( st.st_mode ) && st.st_size && ( size_t ) st.st_size <= cache->stats.budget )
+    {
+        tftp_cache_queue ( cache, fd, &st );
+    }
+
+    pthread_mutex_unlock ( &cache->lock );
+
+    return NULL;
+}
+
+/* Drop reference to cached contents */
+void tftp_cache_release ( struct tftp_cache *cache, struct tftp_cache_entry *entry )
+{
+    pthread_mutex_lock ( &cache->lock );
+    entry->refs--;
+    tftp_cache_drop ( cache, entry );
+    pthread_mutex_unlock ( &cache->lock );
+}
+
+/* Load file into cache ahead of requests */
+int tftp_cache_preload ( struct tftp_cache *cache, const char *path )
+{
+    int fd;
+    int status;
+
+    if ( ( fd = open ( path, O_RDONLY ) ) < 0 )
+    {
+        return -1;
+    }
+
+    status = tftp_cache_fill_file ( cache, fd );
+    close ( fd );
+
+    return status;
+}
+
+/* Get snapshot of cache counters */
+void tftp_cache_get_stats ( struct tftp_cache *cache, struct tftp_cache_stats *stats )
+{
+    pthread_mutex_lock ( &cache->lock );
+    *stats = cache->stats;
+    pthread_mutex_unlock ( &cache->lock );
+}
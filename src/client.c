@@ -7,312 +7,487 @@
 /* Show program usage message */
 static void show_usage ( void )
 {
-    fprintf ( stderr, "usage: tftp addr port [-c put|get filename]\n" );
+    fprintf ( stderr, "usage: tftp addr port [-b blksize] [-w windowsize] [-t timeout]\n"
+        "            [-c [re]put|[re]get|join filename] [-f manifest [-j jobs]]\n"
+        "            [-m octet|netascii] [-l error|info|debug|trace] [-F fault_spec]\n" );
 }
 
 /* Print available tftp commands */
 static void print_help ( void )
 {
     printf ( "[tftp] list of available commands\n\n"
-        "       put file - upload file\n"
-        "       get file - download file\n"
-        "       help     - print help\n" "       exit     - quit session\n\n" );
+        "       put file   - upload file\n"
+        "       get file   - download file\n"
+        "       reput file - resume upload of file\n"
+        "       reget file - resume download of file\n"
+        "       join file  - download file over multicast with other clients\n"
+        "       help       - print help\n" "       exit       - quit session\n\n" );
 }
 
-/* Upload file over tftp protocol */
-static int tftp_put_file ( struct tftp_sess *sess, const char *path )
+/* Open local file and start transfer registered in event loop */
+static int tftp_begin_transfer ( struct tftp_client *client, struct tftp_loop *loop,
+    struct tftp_batch_op *op )
 {
     int fd;
-    unsigned short opcode;
-    unsigned short block;
-    size_t len;
-    size_t nblocks;
-    size_t lastread;
-    socklen_t slen;
-    const char *params[] = {
-        path,
-        "octet",
-        NULL
-    };
-    unsigned char buffer[4096];
-    struct ack_packet ack;
-
-    /* open file for reading */
-    if ( ( fd = open ( path, O_RDONLY ) ) < 0 )
+    int sock;
+    int status;
+    struct stat st;
+    struct tftp_opts opts;
+    struct tftp_xfer *xfer;
+
+    /* translated text has no byte offset to resume at */
+    if ( op->resume && client->mode == TFTP_TRANSFER_MODE_NETASCII )
     {
-        return errno;
+        tftp_log ( TFTP_LOG_ERROR, "[tftp] %s: cannot resume in netascii mode\n", op->path );
+        return EINVAL;
     }
 
-    /* prepare tftp packet */
-    if ( ( ssize_t ) ( len =
-            tftp_prepare_header ( buffer, sizeof ( buffer ), TFTP_OPCODE_WRQ, params ) ) < 0 )
+    /* open file for reading or writing, partial download is kept when resuming */
+    if ( ( fd = op->role == TFTP_XFER_ROLE_SEND ? open ( op->path, O_RDONLY )
+            : open ( op->path, O_CREAT | O_WRONLY | ( op->resume ? 0 : O_TRUNC ), 0644 ) ) < 0 )
     {
         return errno;
     }
 
-    /* send WRQ packet */
-    if ( sendto_autoretry ( sess->sock, buffer, len, 0, ( struct sockaddr * ) &sess->saddr,
-            sizeof ( sess->saddr ) ) < 0 )
+    /* each transfer uses own socket, its port becomes transfer ID */
+    if ( ( sock = socket ( AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 ) ) < 0 )
     {
+        status = errno;
         close ( fd );
-        sess->exit_flag = 1;
-        fprintf ( stderr, "[tftp] failed to send data: %i\n", errno );
-        return errno;
+        tftp_log ( TFTP_LOG_ERROR, "[tftp] failed to allocate socket: %i\n", status );
+        return status;
     }
 
-    printf ( "[tftp] write request sent.\n" );
-    printf ( "[tftp] awaiting response ...\n" );
+    /* announce upload size or ask server for download size, size of translated text
+       is not known up front */
+    opts = client->opts;
+    opts.tsize = op->role == TFTP_XFER_ROLE_SEND && fstat ( fd, &st ) >= 0 ? st.st_size : 0;
+    if ( client->mode == TFTP_TRANSFER_MODE_OCTET )
+    {
+        opts.mask |= TFTP_OPTION_TSIZE;
+    }
 
-    /* await ACK packet */
-    slen = sizeof ( sess->saddr );
-    if ( ( ssize_t ) ( len =
-            recvfrom ( sess->sock, buffer, sizeof ( buffer ), 0, ( struct sockaddr * ) &sess->saddr,
-                &slen ) ) < 0 )
+    /* continue after partial download, server reports size of partial upload */
+    if ( op->resume )
     {
-        close ( fd );
-        sess->exit_flag = 1;
-        fprintf ( stderr, "[tftp] failed to receive data: %i\n", errno );
-        return errno;
+        opts.offset = op->role == TFTP_XFER_ROLE_RECV && fstat ( fd, &st ) >= 0 ? st.st_size : 0;
+        opts.mask |= TFTP_OPTION_OFFSET;
     }
 
-    /* dump received packet */
-    tftp_dump_packet ( sess->progname, buffer, len );
+    /* server assigns multicast group, it may serve file by unicast anyway */
+    if ( op->multicast && client->mode == TFTP_TRANSFER_MODE_OCTET )
+    {
+        opts.mask |= TFTP_OPTION_MULTICAST;
+    }
 
-    /* assert packet size */
-    if ( !tftp_packet_check_length ( sess->progname, 4, len ) )
+    /* allocate transfer structure */
+    if ( !( xfer =
+            tftp_xfer_new ( sock, fd, op->role, &client->sess.addr, &opts,
+                client->sess.progname ) ) )
     {
+        close ( sock );
         close ( fd );
-        return EMSGSIZE;
+        return ENOMEM;
     }
 
-    /* extract opcode value */
-    opcode = tfp_load_ushort_ns ( buffer );
+    strncpy ( xfer->path, op->path, sizeof ( xfer->path ) - 1 );
+    xfer->quiet = client->njobs > 1;
 
-    /* opcode must be ACK */
-    if ( opcode != TFTP_OPCODE_ACK )
+    if ( client->mode == TFTP_TRANSFER_MODE_NETASCII && tftp_xfer_netascii ( xfer ) < 0 )
     {
-        close ( fd );
-        fprintf ( stderr, "[tftp] expected an ACK packet.\n" );
-        return EINVAL;
+        status = errno;
+        tftp_xfer_free ( xfer );
+        return status;
     }
 
-    /* extract block value */
-    block = tfp_load_ushort_ns ( buffer + 2 );
+    if ( tftp_loop_add ( loop, xfer ) < 0 )
+    {
+        status = errno;
+        tftp_xfer_free ( xfer );
+        return status;
+    }
+
+    op->xfer = xfer;
 
-    /* validate block number */
-    if ( block != 0 )
+    /* send RRQ or WRQ packet */
+    if ( tftp_xfer_request ( xfer, op->path ) >= 0 )
     {
-        close ( fd );
-        fprintf ( stderr, "[tftp] expected first block to be #0.\n" );
-        return EINVAL;
+        tftp_log ( TFTP_LOG_INFO, "[tftp] %s: %s request sent.\n", op->path,
+            op->role == TFTP_XFER_ROLE_SEND ? "write" : "read" );
+    }
+
+    return 0;
+}
+
+/* Release finished transfer and record its outcome */
+static void tftp_end_transfer ( struct tftp_loop *loop, struct tftp_batch_op *op )
+{
+    struct tftp_xfer *xfer = op->xfer;
+
+    tftp_loop_remove ( loop, xfer );
+
+    /* end progress line */
+    if ( xfer->progress_at )
+    {
+        tftp_log ( TFTP_LOG_INFO, "\n" );
+    }
+
+    op->status = xfer->state == TFTP_XFER_STATE_DONE ? 0 : xfer->status;
+    op->nbytes = xfer->nbytes;
+    op->elapsed = tftp_time_usec (  ) - xfer->started;
+    op->xfer = NULL;
+
+    tftp_log ( TFTP_LOG_DEBUG, "[tftp] %s: batching: sent %llu packets (%llu segmented) "
+        "in %llu calls, received %llu packets in %llu calls\n", op->path, xfer->io.tx_packets,
+        xfer->io.tx_segmented, xfer->io.tx_calls, xfer->io.rx_packets, xfer->io.rx_calls );
+    tftp_log ( TFTP_LOG_INFO, "[tftp] %s: retransmitted %llu packets after %llu timeouts, "
+        "%llu duplicates ignored\n", op->path, xfer->retx.retransmits, xfer->retx.timeouts,
+        xfer->retx.duplicates );
+
+    tftp_xfer_free ( xfer );
+}
+
+/* Find batch operation driven by transfer */
+static struct tftp_batch_op *tftp_find_op ( struct tftp_batch_op *ops, size_t nops,
+    const struct tftp_xfer *xfer )
+{
+    size_t i;
+
+    for ( i = 0; i < nops; i++ )
+    {
+        if ( ops[i].xfer == xfer )
+        {
+            return &ops[i];
+        }
     }
 
-    /* send file data */
-    for ( lastread = 0, nblocks = 0;
-        ( ssize_t ) ( len = read ( fd, buffer + 4, TFTP_BLOCKSIZE ) ) > 0
-        || lastread == TFTP_BLOCKSIZE; )
+    return NULL;
+}
+
+/* Flush queued packets, reschedule transfer or release it once finished */
+static size_t tftp_settle_transfer ( struct tftp_loop *loop, struct tftp_batch_op *ops,
+    size_t nops, struct tftp_xfer *xfer )
+{
+    /* send everything queued during this iteration at once */
+    tftp_xfer_flush ( xfer );
+
+    if ( xfer->state == TFTP_XFER_STATE_ACTIVE )
     {
-        lastread = len;
+        tftp_loop_update ( loop, xfer );
+        return 0;
+    }
 
-        /* increment block number, allow overflow */
-        block++;
+    tftp_end_transfer ( loop, tftp_find_op ( ops, nops, xfer ) );
+    return 1;
+}
 
-        /* prepare data packet */
-        tfp_store_ushort_ns ( buffer, TFTP_OPCODE_DATA );
-        tfp_store_ushort_ns ( buffer + 2, block );
+/* Get throughput in KiB per second */
+static unsigned long long tftp_rate ( unsigned long long nbytes, unsigned long long usec )
+{
+    return usec ? nbytes * 1000000 / 1024 / usec : 0;
+}
+
+/* Print per-file timing and aggregate throughput of batch */
+static void tftp_report_batch ( const struct tftp_batch_op *ops, size_t nops,
+    unsigned long long elapsed )
+{
+    size_t i;
+    size_t nfailed = 0;
+    unsigned long long nbytes = 0;
 
-        /* send DATA pakcet */
-        if ( sendto_autoretry ( sess->sock, buffer, 4 + len, 0, ( struct sockaddr * ) &sess->saddr,
-                sizeof ( sess->saddr ) ) < 0 )
+    for ( i = 0; i < nops; i++ )
+    {
+        if ( ops[i].status )
         {
-            close ( fd );
-            sess->exit_flag = 1;
-            fprintf ( stderr, "\n[tftp] failed to send data: %i\n", errno );
-            return errno;
+            nfailed++;
+            tftp_log ( TFTP_LOG_INFO, "[tftp] %s %s: failure %i (%s)\n",
+                ops[i].role == TFTP_XFER_ROLE_SEND ? "put" : "get", ops[i].path,
+                ops[i].status, strerror ( ops[i].status ) );
+            continue;
         }
 
-      recv_ack:
+        nbytes += ops[i].nbytes;
+        tftp_log ( TFTP_LOG_INFO, "[tftp] %s %s: %lu bytes in %llu ms (%llu KiB/s)\n",
+            ops[i].role == TFTP_XFER_ROLE_SEND ? "put" : "get", ops[i].path,
+            ( unsigned long ) ops[i].nbytes, ops[i].elapsed / 1000,
+            tftp_rate ( ops[i].nbytes, ops[i].elapsed ) );
+    }
+
+    tftp_log ( TFTP_LOG_INFO,
+        "[tftp] batch: %lu of %lu files, %llu bytes in %llu ms (%llu KiB/s)\n",
+        ( unsigned long ) ( nops - nfailed ), ( unsigned long ) nops, nbytes, elapsed / 1000,
+        tftp_rate ( nbytes, elapsed ) );
+}
+
+/* Run batch of transfers, at most njobs at once; returns status of last failed one */
+static int tftp_run_batch ( struct tftp_client *client, struct tftp_batch_op *ops, size_t nops )
+{
+    int i;
+    int status = 0;
+    int nevents;
+    size_t next = 0;
+    size_t nactive = 0;
+    unsigned long long started;
+    struct tftp_xfer *xfer;
+    struct tftp_loop loop;
+    struct epoll_event events[TFTP_EVENTS_LIMIT];
+
+    /* prepare event loop shared by all transfers */
+    if ( tftp_loop_init ( &loop ) < 0 )
+    {
+        return errno;
+    }
 
-        /* await ACK packet */
-        slen = sizeof ( sess->saddr );
-        if ( ( ssize_t ) ( len =
-                recvfrom ( sess->sock, &ack, sizeof ( ack ), 0, ( struct sockaddr * ) &sess->saddr,
-                    &slen ) ) < 0 )
+    started = tftp_time_usec (  );
+
+    while ( next < nops || nactive )
+    {
+        /* start queued transfers while there is room */
+        for ( ; next < nops && nactive < client->njobs; next++ )
+        {
+            if ( ( ops[next].status = tftp_begin_transfer ( client, &loop, &ops[next] ) ) )
+            {
+                continue;
+            }
+
+            nactive += !tftp_settle_transfer ( &loop, ops, nops, ops[next].xfer );
+        }
+
+        if ( !nactive )
         {
-            close ( fd );
-            sess->exit_flag = 1;
-            fprintf ( stderr, "\n[tftp] failed to receive data: %i\n", errno );
-            return errno;
+            continue;
         }
 
-        /* assert packet size */
-        if ( !tftp_packet_check_length ( sess->progname, 4, len ) )
+        if ( ( nevents = tftp_loop_wait ( &loop, events, TFTP_EVENTS_LIMIT ) ) < 0 )
         {
-            close ( fd );
-            return EMSGSIZE;
+            if ( errno == EINTR )
+            {
+                continue;
+            }
+            tftp_log ( TFTP_LOG_ERROR, "[tftp] failed to wait for events: %i\n", errno );
+            break;
         }
 
-        /* opcode must be ACK */
-        if ( ntohs ( ack.opcode ) != TFTP_OPCODE_ACK )
+        for ( i = 0; i < nevents; i++ )
         {
-            close ( fd );
-            tftp_dump_packet ( sess->progname, buffer, len );
-            fprintf ( stderr, "\n[tftp] expected an ACK packet.\n" );
-            return EINVAL;
+            xfer = ( struct tftp_xfer * ) events[i].data.ptr;
+
+            if ( events[i].events & EPOLLOUT )
+            {
+                tftp_xfer_output ( xfer );
+            }
+
+            tftp_xfer_input ( xfer, &loop.rx );
+            nactive -= tftp_settle_transfer ( &loop, ops, nops, xfer );
         }
 
-        /* skip ACK for previous blocks */
-        if ( ntohs ( ack.block ) != block )
+        /* handle retransmission timeouts */
+        while ( ( xfer = tftp_loop_expired ( &loop, tftp_time_usec (  ) ) ) )
         {
-            fprintf ( stderr, "\n[tftp] ACK: expected block #%u, got #%u - ignored.\n", block,
-                ntohs ( ack.block ) );
-            goto recv_ack;
+            tftp_xfer_timeout ( xfer );
+            nactive -= tftp_settle_transfer ( &loop, ops, nops, xfer );
         }
+    }
 
-        /* show progress */
-        printf ( "\r[tftp] progress: sent %lu blocks", ( unsigned long ) ++nblocks );
+    /* abort pending transfers */
+    while ( loop.nxfers )
+    {
+        tftp_xfer_abort ( loop.heap[0], ECANCELED );
+        tftp_end_transfer ( &loop, tftp_find_op ( ops, nops, loop.heap[0] ) );
     }
 
-    /* put new line */
-    putchar ( '\n' );
+    tftp_loop_free ( &loop );
 
-    /* close file fd */
-    close ( fd );
+    if ( nops > 1 )
+    {
+        tftp_report_batch ( ops, nops, tftp_time_usec (  ) - started );
+    }
 
-    /* check for reading failure */
-    if ( ( ssize_t ) len < 0 )
+    for ( next = 0; next < nops; next++ )
     {
-        fprintf ( stderr, "[tftp] failed to read file: %i\n", errno );
-        return EINVAL;
+        if ( ops[next].status )
+        {
+            status = ops[next].status;
+        }
     }
 
-    return 0;
+    return status;
 }
 
-/* Download file over tftp protocol */
-static int tftp_get_file ( struct tftp_sess *sess, const char *path )
+/* Prepare batch operation from get, put, reget, reput or join command */
+static int tftp_prepare_op ( struct tftp_batch_op *op, const char *command, const char *path )
 {
-    int fd;
-    unsigned short block = 1;
-    size_t nblocks = 0;
-    size_t len;
-    socklen_t slen;
-    const char *params[] = {
-        path,
-        "octet",
-        NULL
-    };
-    unsigned char buffer[65536];
+    memset ( op, '\0', sizeof ( struct tftp_batch_op ) );
 
-    /* open file for reading */
-    if ( ( fd = open ( path, O_CREAT | O_WRONLY | O_TRUNC, 0644 ) ) < 0 )
+    if ( strlen ( path ) >= sizeof ( op->path ) )
     {
-        return errno;
+        errno = ENAMETOOLONG;
+        return -1;
     }
 
-    /* prepare tftp packet */
-    if ( ( ssize_t ) ( len =
-            tftp_prepare_header ( buffer, sizeof ( buffer ), TFTP_OPCODE_RRQ, params ) ) < 0 )
+    /* resumed transfer continues partial file */
+    if ( !strncmp ( command, "re", 2 ) )
     {
-        return errno;
+        op->resume = 1;
+        command += 2;
     }
 
-    /* send RRQ packet */
-    if ( sendto_autoretry ( sess->sock, buffer, len, 0, ( struct sockaddr * ) &sess->saddr,
-            sizeof ( sess->saddr ) ) < 0 )
+    if ( !strcmp ( command, "put" ) )
     {
-        close ( fd );
-        sess->exit_flag = 1;
-        fprintf ( stderr, "[tftp] failed to send data: %i\n", errno );
-        return errno;
+        op->role = TFTP_XFER_ROLE_SEND;
+
+    } else if ( !strcmp ( command, "get" ) )
+    {
+        op->role = TFTP_XFER_ROLE_RECV;
+
+    } else if ( !strcmp ( command, "join" ) && !op->resume )
+    {
+        op->role = TFTP_XFER_ROLE_RECV;
+        op->multicast = 1;
+
+    } else
+    {
+        errno = EINVAL;
+        return -1;
     }
 
-    printf ( "[tftp] read request sent.\n" );
-    printf ( "[tftp] awaiting response ...\n" );
+    strcpy ( op->path, path );
+
+    return 0;
+}
+
+/* Load get and put operations from manifest, one per line */
+static int tftp_load_manifest ( const char *manifest, struct tftp_batch_op **ops, size_t *nops )
+{
+    FILE *file;
+    size_t len;
+    size_t lineno = 0;
+    size_t limit = 0;
+    char *path;
+    struct tftp_batch_op *op;
+    char line[TFTP_MANIFEST_LINE_LIMIT];
+
+    *ops = NULL;
+    *nops = 0;
 
-    do
+    if ( !( file = fopen ( manifest, "r" ) ) )
     {
-        /* await DATA packet */
-        slen = sizeof ( sess->saddr );
-        if ( ( ssize_t ) ( len =
-                recvfrom ( sess->sock, buffer, sizeof ( buffer ), 0,
-                    ( struct sockaddr * ) &sess->saddr, &slen ) ) < 0 )
-        {
-            close ( fd );
-            sess->exit_flag = 1;
-            fprintf ( stderr, "\n[tftp] failed to receive data: %i\n", errno );
-            return errno;
-        }
+        tftp_log ( TFTP_LOG_ERROR, "[tftp] failed to open manifest: %i\n", errno );
+        return -1;
+    }
+
+    while ( fgets ( line, sizeof ( line ), file ) )
+    {
+        lineno++;
 
-        /* assert packet size */
-        if ( !tftp_packet_check_length ( sess->progname, 4, len ) )
+        /* strip trailing new line characters */
+        for ( len = strlen ( line ); len > 0 && isspace ( ( unsigned char ) line[len - 1] );
+            len-- )
         {
-            close ( fd );
-            return errno;
+            line[len - 1] = '\0';
         }
 
-        /* opcode must be DATA */
-        if ( tfp_load_ushort_ns ( buffer ) != TFTP_OPCODE_DATA )
+        /* skip empty lines and comments */
+        if ( !len || line[0] == '#' )
         {
-            tftp_dump_packet ( sess->progname, buffer, len );
-            fprintf ( stderr, "\n[tftp] expected an DATA packet.\n" );
             continue;
         }
 
-        /* validate data block number */
-        if ( tfp_load_ushort_ns ( buffer + 2 ) != block )
+        /* grow operations table if needed */
+        if ( *nops == limit )
         {
-            fprintf ( stderr, "\n[tftp] DATA: expected block #%u, got #%u - ignored.\n", block,
-                tfp_load_ushort_ns ( buffer + 2 ) );
-            continue;
+            limit = limit ? limit * 2 : 16;
+            if ( !( op = ( struct tftp_batch_op * ) realloc ( *ops,
+                        limit * sizeof ( struct tftp_batch_op ) ) ) )
+            {
+                break;
+            }
+            *ops = op;
         }
 
-        /* write data to file */
-        if ( write ( fd, buffer + 4, len - 4 ) < 0 )
+        op = &( *ops )[*nops];
+        /* command and file name are separated by space */
+        if ( !( path = strchr ( line, '\x20' ) ) || !path[1] )
         {
-            close ( fd );
-            fprintf ( stderr, "\n[tftp] failed to write file: %i\n", errno );
-            return errno;
+            tftp_log ( TFTP_LOG_ERROR, "[tftp] manifest line %lu malformed.\n",
+                ( unsigned long ) lineno );
+            break;
         }
 
-        /* send ACK packet with block set to zero */
-        if ( tftp_send_ack_packet ( sess, block++ ) < 0 )
+        *path++ = '\0';
+
+        if ( tftp_prepare_op ( op, line, path ) < 0 )
         {
-            close ( fd );
-            return errno;
+            tftp_log ( TFTP_LOG_ERROR, "[tftp] manifest line %lu: invalid operation: %s %s\n",
+                ( unsigned long ) lineno, line, path );
+            break;
         }
 
-        /* show progress */
-        printf ( "\r[tftp] progress: received %lu blocks", ( unsigned long ) ++nblocks );
+        ( *nops )++;
+    }
+
+    /* stopped before end of file */
+    if ( !feof ( file ) )
+    {
+        fclose ( file );
+        free ( *ops );
+        *ops = NULL;
+        return -1;
+    }
+
+    fclose ( file );
+    return 0;
+}
 
-    } while ( len == 4 + TFTP_BLOCKSIZE );
+/* Run all operations listed in manifest */
+static int tftp_run_manifest ( struct tftp_client *client, const char *manifest )
+{
+    int status;
+    size_t nops;
+    struct tftp_batch_op *ops;
 
-    /* put new line */
-    putchar ( '\n' );
+    if ( tftp_load_manifest ( manifest, &ops, &nops ) < 0 )
+    {
+        return EINVAL;
+    }
 
-    /* close file fd */
-    close ( fd );
+    if ( !nops )
+    {
+        tftp_log ( TFTP_LOG_ERROR, "[tftp] manifest is empty.\n" );
+        return ENODATA;
+    }
 
-    return 0;
+    tftp_log ( TFTP_LOG_INFO, "[tftp] running %lu transfers, %u at once ...\n",
+        ( unsigned long ) nops, client->njobs );
+
+    status = tftp_run_batch ( client, ops, nops );
+    free ( ops );
+
+    return status;
 }
 
 /* Perform single tftp operation */
-static int tftp_operation ( struct tftp_sess *sess )
+static int tftp_operation ( struct tftp_client *client )
 {
     size_t len;
     char buffer[4096];
     char command[4096];
     const char *agrument = NULL;
     const char *end;
+    struct tftp_batch_op op;
+
+    struct tftp_sess *sess = &client->sess;
 
-    /* show prompt prefix */
+    /* show prompt prefix after messages of previous command */
+    tftp_log_flush (  );
     printf ( "> " );
+    fflush ( stdout );
 
     /* read input command */
     if ( ( ssize_t ) ( len = read ( 0, buffer, sizeof ( buffer ) - 1 ) ) < 0 )
     {
         sess->exit_flag = 1;
-        fprintf ( stderr, "[tftp] failed to read console input: %i\n", errno );
+        tftp_log ( TFTP_LOG_ERROR, "[tftp] failed to read console input: %i\n", errno );
         return errno;
     }
 
@@ -347,12 +522,9 @@ static int tftp_operation ( struct tftp_sess *sess )
     if ( !strcmp ( command, "exit" ) || !strcmp ( command, "q" ) )
     {
         sess->exit_flag = 1;
-    } else if ( !strcmp ( command, "put" ) )
-    {
-        return tftp_put_file ( sess, agrument );
-    } else if ( !strcmp ( command, "get" ) )
+    } else if ( agrument && tftp_prepare_op ( &op, command, agrument ) >= 0 )
     {
-        return tftp_get_file ( sess, agrument );
+        return tftp_run_batch ( client, &op, 1 );
     } else
     {
         print_help (  );
@@ -364,14 +536,26 @@ static int tftp_operation ( struct tftp_sess *sess )
 /* Program main function */
 int main ( int argc, char *argv[] )
 {
+    int i;
     int status;
+    int log_level;
     unsigned int addr;
     unsigned int port;
-    struct tftp_sess sess;
+    struct tftp_client client;
+    struct tftp_batch_op op;
+    const char *command = NULL;
+    const char *path = NULL;
+    const char *manifest = NULL;
     const char* errmsg;
 
-    setbuf ( stdout, NULL );
-    printf ( "[tftp] Little Tftp Client - ver. 1.0.01\n" );
+    tftp_log ( TFTP_LOG_INFO, "[tftp] Little Tftp Client - ver. 1.0.01\n" );
+
+    /* faults may be requested through environment by any program */
+    if ( tftp_fault_setup ( NULL ) < 0 )
+    {
+        tftp_log ( TFTP_LOG_ERROR, "[tftp] invalid %s settings\n", TFTP_FAULT_ENV );
+        return 1;
+    }
 
     /* validate arguments count */
     if ( argc < 3 )
@@ -394,37 +578,136 @@ int main ( int argc, char *argv[] )
         return 1;
     }
 
-    /* allocate cleitn socket */
-    if ( ( sess.sock = socket ( AF_INET, SOCK_DGRAM, 0 ) ) < 0 )
+    /* no options requested by default */
+    tftp_opts_init ( &client.opts );
+
+    /* transfers run one after another unless requested otherwise */
+    client.njobs = 1;
+    client.mode = TFTP_TRANSFER_MODE_OCTET;
+
+    /* parse optional arguments */
+    for ( i = 3; i + 1 < argc; i += 2 )
+    {
+        if ( !strcmp ( argv[i], "-b" ) )
+        {
+            if ( tftp_opts_parse ( &client.opts, "blksize", argv[i + 1] ) < 0 )
+            {
+                show_usage (  );
+                return 1;
+            }
+
+        } else if ( !strcmp ( argv[i], "-w" ) )
+        {
+            if ( tftp_opts_parse ( &client.opts, "windowsize", argv[i + 1] ) < 0 )
+            {
+                show_usage (  );
+                return 1;
+            }
+
+        } else if ( !strcmp ( argv[i], "-t" ) )
+        {
+            if ( tftp_opts_parse ( &client.opts, "timeout", argv[i + 1] ) < 0 )
+            {
+                show_usage (  );
+                return 1;
+            }
+
+        } else if ( !strcmp ( argv[i], "-m" ) )
+        {
+            if ( !strcmp ( argv[i + 1], "octet" ) )
+            {
+                client.mode = TFTP_TRANSFER_MODE_OCTET;
+            } else if ( !strcmp ( argv[i + 1], "netascii" ) )
+            {
+                client.mode = TFTP_TRANSFER_MODE_NETASCII;
+            } else
+            {
+                show_usage (  );
+                return 1;
+            }
+
+        } else if ( !strcmp ( argv[i], "-l" ) )
+        {
+            if ( ( log_level = tftp_log_parse_level ( argv[i + 1] ) ) < 0 )
+            {
+                show_usage (  );
+                return 1;
+            }
+            tftp_log_set_level ( log_level );
+
+        } else if ( !strcmp ( argv[i], "-F" ) )
+        {
+            if ( tftp_fault_setup ( argv[i + 1] ) < 0 )
+            {
+                show_usage (  );
+                return 1;
+            }
+
+        } else if ( !strcmp ( argv[i], "-f" ) )
+        {
+            manifest = argv[i + 1];
+
+        } else if ( !strcmp ( argv[i], "-j" ) )
+        {
+            if ( sscanf ( argv[i + 1], "%u", &client.njobs ) <= 0 || !client.njobs
+                || client.njobs > TFTP_JOBS_LIMIT )
+            {
+                show_usage (  );
+                return 1;
+            }
+
+        } else if ( !strcmp ( argv[i], "-c" ) && i + 2 < argc )
+        {
+            command = argv[i + 1];
+            path = argv[i + 2];
+            i++;
+
+        } else
+        {
+            show_usage (  );
+            return 1;
+        }
+    }
+
+    /* argument left without value */
+    if ( i < argc )
     {
-        fprintf ( stderr, "[tftp] failed to allocate socket: %i\n", errno );
+        show_usage (  );
         return 1;
     }
 
-    printf ( "[tftp] socket allocated.\n" );
+    /* messages are written by background thread from now on */
+    if ( tftp_log_start (  ) < 0 )
+    {
+        fprintf ( stderr, "[tftp] failed to start log writer: %i\n", errno );
+        return 1;
+    }
 
     /* prepare socket address */
-    memset ( &sess.saddr, '\0', sizeof ( sess.saddr ) );
-    sess.saddr.sin_family = AF_INET;
-    sess.saddr.sin_addr.s_addr = addr;
-    sess.saddr.sin_port = htons ( port );
+    memset ( &client.sess.addr, '\0', sizeof ( client.sess.addr ) );
+    client.sess.addr.sin_family = AF_INET;
+    client.sess.addr.sin_addr.s_addr = addr;
+    client.sess.addr.sin_port = htons ( port );
+
+    /* transfers allocate own sockets */
+    client.sess.sock = -1;
 
     /* set exit flag to false */
-    sess.exit_flag = 0;
+    client.sess.exit_flag = 0;
 
     /* set program name */
-    sess.progname = "tftp";
+    client.sess.progname = "tftp";
 
     /* perform command from command line if needed */
-    if ( argc > 5 && !strcmp ( argv[3], "-c" ) )
+    if ( command || manifest )
     {
-        if ( !strcmp ( argv[4], "put" ) )
+        if ( manifest )
         {
-            status = tftp_put_file ( &sess, argv[5] );
+            status = tftp_run_manifest ( &client, manifest );
 
-        } else if ( !strcmp ( argv[4], "get" ) )
+        } else if ( tftp_prepare_op ( &op, command, path ) >= 0 )
         {
-            status = tftp_get_file ( &sess, argv[5] );
+            status = tftp_run_batch ( &client, &op, 1 );
 
         } else
         {
@@ -435,33 +718,28 @@ int main ( int argc, char *argv[] )
         if ( status )
         {
             errmsg = strerror ( status );
-            fprintf ( stderr, "[tftp] status: failure %i (%s)\n", status, errmsg );
+            tftp_log ( TFTP_LOG_ERROR, "[tftp] status: failure %i (%s)\n", status, errmsg );
         } else
         {
-            fprintf ( stderr, "[tftp] status: success\n" );
+            tftp_log ( TFTP_LOG_INFO, "[tftp] status: success\n" );
         }
 
-        /* close socket */
-        close ( sess.sock );
         return 0;
     }
 
     /* perform tftp operations */
-    while ( !sess.exit_flag )
+    while ( !client.sess.exit_flag )
     {
-        status = tftp_operation ( &sess );
+        status = tftp_operation ( &client );
         if ( status )
         {
             errmsg = strerror ( status );
-            fprintf ( stderr, "[tftp] status: failure %i (%s)\n", status, errmsg );
+            tftp_log ( TFTP_LOG_ERROR, "[tftp] status: failure %i (%s)\n", status, errmsg );
         } else
         {
-            fprintf ( stderr, "[tftp] status: success\n" );
+            tftp_log ( TFTP_LOG_INFO, "[tftp] status: success\n" );
         }
     }
 
-    /* close socket */
-    close ( sess.sock );
-
     return 0;
 }
@@ -0,0 +1,455 @@
+/* ------------------------------------------------------------------
+ * Little Tftp - Fault Injection
+ * ------------------------------------------------------------------ */
+
+#include "fault.h"
+
+/* Process wide settings, fixed before any thread is started */
+static struct tftp_fault_config tftp_fault_config;
+
+/* Number of threads that drew random numbers so far */
+static unsigned int tftp_fault_nthreads;
+
+/* Held datagrams and random state of calling thread */
+static __thread struct tftp_fault_line tftp_fault_line;
+
+/* Parse probability given as fraction or percentage into parts per million */
+static int tftp_fault_parse_chance ( const char *value, unsigned int *ppm )
+{
+    char *end;
+    double chance = strtod ( value, &end );
+
+    if ( end == value )
+    {
+        return -1;
+    }
+
+    if ( *end == '%' )
+    {
+        chance /= 100;
+        end++;
+    }
+
+    if ( *end || chance < 0 || chance > 1 )
+    {
+        return -1;
+    }
+
+    *ppm = ( unsigned int ) ( chance * 1000000 + 0.5 );
+
+    return 0;
+}
+
+/* Parse time in milliseconds unless suffixed with us or s into microseconds */
+static int tftp_fault_parse_time ( const char *value, unsigned long long *usec )
+{
+    char *end;
+    unsigned long long number;
+
+    if ( !isdigit ( ( unsigned char ) *value ) )
+    {
+        return -1;
+    }
+
+    number = strtoull ( value, &end, 10 );
+
+    if ( !strcmp ( end, "us" ) )
+    {
+        *usec = number;
+
+    } else if ( !*end || !strcmp ( end, "ms" ) )
+    {
+        *usec = number * 1000;
+
+    } else if ( !strcmp ( end, "s" ) )
+    {
+        *usec = number * 1000000;
+
+    } else
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Apply single name=value setting */
+static int tftp_fault_parse_setting ( struct tftp_fault_config *config, const char *name,
+    const char *value )
+{
+    char *end;
+
+    if ( !strcmp ( name, "seed" ) )
+    {
+        config->seed = strtoull ( value, &end, 10 );
+        return *value && !*end ? 0 : -1;
+
+    } else if ( !strcmp ( name, "drop" ) )
+    {
+        return tftp_fault_parse_chance ( value, &config->drop );
+
+    } else if ( !strcmp ( name, "dup" ) )
+    {
+        return tftp_fault_parse_chance ( value, &config->dup );
+
+    } else if ( !strcmp ( name, "reorder" ) )
+    {
+        return tftp_fault_parse_chance ( value, &config->reorder );
+
+    } else if ( !strcmp ( name, "delay" ) )
+    {
+        return tftp_fault_parse_time ( value, &config->delay );
+
+    } else if ( !strcmp ( name, "jitter" ) )
+    {
+        return tftp_fault_parse_time ( value, &config->jitter );
+
+    } else if ( !strcmp ( name, "gap" ) )
+    {
+        return tftp_fault_parse_time ( value, &config->gap );
+
+    } else if ( !strcmp ( name, "dist" ) )
+    {
+        if ( !strcmp ( value, "uniform" ) )
+        {
+            config->dist = TFTP_FAULT_DIST_UNIFORM;
+            return 0;
+        }
+
+        if ( !strcmp ( value, "normal" ) )
+        {
+            config->dist = TFTP_FAULT_DIST_NORMAL;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/* Enable fault injection from settings, environment variable is used if spec is NULL */
+int tftp_fault_setup ( const char *spec )
+{
+    char *name;
+    char *value;
+    char *saveptr;
+    char buffer[256];
+    struct tftp_fault_config config;
+
+    if ( !spec && !( spec = getenv ( TFTP_FAULT_ENV ) ) )
+    {
+        return 0;
+    }
+
+    if ( strlen ( spec ) >= sizeof ( buffer ) )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset ( &config, '\0', sizeof ( config ) );
+    config.gap = TFTP_FAULT_GAP_USEC;
+    strcpy ( buffer, spec );
+
+    for ( name = strtok_r ( buffer, ",", &saveptr ); name;
+        name = strtok_r ( NULL, ",", &saveptr ) )
+    {
+        if ( !( value = strchr ( name, '=' ) ) )
+        {
+            errno = EINVAL;
+            return -1;
+        }
+
+        *value++ = '\0';
+
+        if ( tftp_fault_parse_setting ( &config, name, value ) < 0 )
+        {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    config.enabled = config.drop || config.dup || config.reorder || config.delay
+        || config.jitter;
+    tftp_fault_config = config;
+
+    return 0;
+}
+
+/* Check whether fault injection is enabled */
+int tftp_fault_enabled ( void )
+{
+    return tftp_fault_config.enabled;
+}
+
+/* Draw next random number, sequence of each thread depends on seed and thread order only */
+static unsigned long long tftp_fault_random ( struct tftp_fault_line *line )
+{
+    unsigned long long x;
+
+    /* splitmix of seed and thread number gives non-zero xorshift state */
+    if ( !line->rng )
+    {
+        x = tftp_fault_config.seed + 0x9e3779b97f4a7c15ULL
+            * ( __atomic_fetch_add ( &tftp_fault_nthreads, 1, __ATOMIC_RELAXED ) + 1 );
+        x = ( x ^ ( x >> 30 ) ) * 0xbf58476d1ce4e5b9ULL;
+        x = ( x ^ ( x >> 27 ) ) * 0x94d049bb133111ebULL;
+        line->rng = ( x ^ ( x >> 31 ) ) | 1;
+    }
+
+    /* xorshift64* */
+    line->rng ^= line->rng >> 12;
+    line->rng ^= line->rng << 25;
+    line->rng ^= line->rng >> 27;
+
+    return line->rng * 0x2545f4914f6cdd1dULL;
+}
+
+/* Decide event of given probability */
+static int tftp_fault_chance ( struct tftp_fault_line *line, unsigned int ppm )
+{
+    return ppm && tftp_fault_random ( line ) % 1000000 < ppm;
+}
+
+/* Draw delay of datagram from configured distribution */
+static unsigned long long tftp_fault_sample_delay ( struct tftp_fault_line *line )
+{
+    int i;
+    long long sum = 0;
+    long long delay = tftp_fault_config.delay;
+    long long jitter = tftp_fault_config.jitter;
+
+    if ( !jitter )
+    {
+        return delay;
+    }
+
+    if ( tftp_fault_config.dist == TFTP_FAULT_DIST_NORMAL )
+    {
+        /* sum of twelve uniform draws approximates standard normal one */
+        for ( i = 0; i < 12; i++ )
+        {
+            sum += tftp_fault_random ( line ) % 1000001;
+        }
+
+        delay += ( sum - 6000000 ) * jitter / 1000000;
+    } else
+    {
+        delay += ( long long ) ( tftp_fault_random ( line ) % ( 2 * jitter + 1 ) ) - jitter;
+    }
+
+    return delay > 0 ? delay : 0;
+}
+
+/* Check whether held datagram a is due before b */
+static int tftp_fault_before ( const struct tftp_fault_packet *a,
+    const struct tftp_fault_packet *b )
+{
+    return a->release < b->release || ( a->release == b->release && a->seq < b->seq );
+}
+
+/* Swap heap entries */
+static void tftp_fault_swap ( struct tftp_fault_line *line, size_t a, size_t b )
+{
+    struct tftp_fault_packet *packet = line->heap[a];
+
+    line->heap[a] = line->heap[b];
+    line->heap[b] = packet;
+}
+
+/* Hold copy of datagram until release time, returns -1 if it has to be sent at once */
+static int tftp_fault_hold ( struct tftp_fault_line *line, int sock, const struct msghdr *msg,
+    unsigned long long release )
+{
+    size_t i;
+    size_t len = 0;
+    struct tftp_fault_packet *packet;
+
+    if ( line->count == TFTP_FAULT_QUEUE_LIMIT )
+    {
+        return -1;
+    }
+
+    for ( i = 0; i < msg->msg_iovlen; i++ )
+    {
+        len += msg->msg_iov[i].iov_len;
+    }
+
+    if ( !( packet = ( struct tftp_fault_packet * ) malloc ( sizeof ( struct tftp_fault_packet )
+                + len ) ) )
+    {
+        return -1;
+    }
+
+    packet->release = release;
+    packet->seq = line->seq++;
+    packet->sock = sock;
+    packet->named = msg->msg_name != NULL;
+    packet->len = 0;
+
+    if ( packet->named )
+    {
+        memcpy ( &packet->addr, msg->msg_name, sizeof ( struct sockaddr_in ) );
+    }
+
+    for ( i = 0; i < msg->msg_iovlen; i++ )
+    {
+        memcpy ( packet->data + packet->len, msg->msg_iov[i].iov_base, msg->msg_iov[i].iov_len );
+        packet->len += msg->msg_iov[i].iov_len;
+    }
+
+    /* sift up */
+    i = line->count++;
+    line->heap[i] = packet;
+
+    while ( i && tftp_fault_before ( line->heap[i], line->heap[( i - 1 ) / 2] ) )
+    {
+        tftp_fault_swap ( line, i, ( i - 1 ) / 2 );
+        i = ( i - 1 ) / 2;
+    }
+
+    return 0;
+}
+
+/* Restore heap order below entry */
+static void tftp_fault_down ( struct tftp_fault_line *line, size_t i )
+{
+    size_t child;
+
+    while ( ( child = 2 * i + 1 ) < line->count )
+    {
+        if ( child + 1 < line->count
+            && tftp_fault_before ( line->heap[child + 1], line->heap[child] ) )
+        {
+            child++;
+        }
+
+        if ( !tftp_fault_before ( line->heap[child], line->heap[i] ) )
+        {
+            break;
+        }
+
+        tftp_fault_swap ( line, i, child );
+        i = child;
+    }
+}
+
+/* Remove earliest held datagram from heap */
+static struct tftp_fault_packet *tftp_fault_pop ( struct tftp_fault_line *line )
+{
+    struct tftp_fault_packet *packet = line->heap[0];
+
+    line->heap[0] = line->heap[--line->count];
+    tftp_fault_down ( line, 0 );
+
+    return packet;
+}
+
+/* Send held datagrams of calling thread whose release time has come */
+void tftp_fault_release ( unsigned long long now )
+{
+    struct tftp_fault_packet *packet;
+    struct tftp_fault_line *line = &tftp_fault_line;
+
+    while ( line->count && line->heap[0]->release <= now )
+    {
+        packet = tftp_fault_pop ( line );
+
+        /* socket may be gone meanwhile, datagram is lost then */
+        sendto ( packet->sock, packet->data, packet->len, MSG_DONTWAIT,
+            packet->named ? ( struct sockaddr * ) &packet->addr : NULL,
+            packet->named ? sizeof ( struct sockaddr_in ) : 0 );
+
+        free ( packet );
+    }
+}
+
+/* Send held datagrams of socket at once in order they were sent, it is about to be closed */
+void tftp_fault_close ( int sock )
+{
+    size_t i;
+    struct tftp_fault_line *line = &tftp_fault_line;
+
+    if ( !line->count )
+    {
+        return;
+    }
+
+    /* datagrams of socket become due and the heap is rebuilt */
+    for ( i = 0; i < line->count; i++ )
+    {
+        if ( line->heap[i]->sock == sock )
+        {
+            line->heap[i]->release = 0;
+        }
+    }
+
+    for ( i = line->count / 2; i--; )
+    {
+        tftp_fault_down ( line, i );
+    }
+
+    tftp_fault_release ( 0 );
+}
+
+/* Get release time of next held datagram of calling thread, 0 if none */
+unsigned long long tftp_fault_deadline ( void )
+{
+    return tftp_fault_line.count ? tftp_fault_line.heap[0]->release : 0;
+}
+
+/* Send datagram through fault injection, it may be dropped, duplicated or held back */
+int tftp_fault_sendmsg ( int sock, const struct msghdr *msg, unsigned long long now )
+{
+    int ncopies;
+    unsigned long long delay;
+    struct tftp_fault_line *line = &tftp_fault_line;
+
+    tftp_fault_release ( now );
+
+    /* dropped datagram counts as sent */
+    if ( tftp_fault_chance ( line, tftp_fault_config.drop ) )
+    {
+        return 0;
+    }
+
+    ncopies = 1 + tftp_fault_chance ( line, tftp_fault_config.dup );
+
+    /* reordered datagram is overtaken by those sent within gap */
+    delay = tftp_fault_sample_delay ( line );
+    if ( tftp_fault_chance ( line, tftp_fault_config.reorder ) )
+    {
+        delay += tftp_fault_config.gap;
+    }
+
+    while ( ncopies-- )
+    {
+        if ( delay && tftp_fault_hold ( line, sock, msg, now + delay ) >= 0 )
+        {
+            continue;
+        }
+
+        if ( sendmsg ( sock, msg, MSG_DONTWAIT ) < 0 )
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Send datagrams through fault injection, returns count consumed */
+int tftp_fault_sendmmsg ( int sock, struct mmsghdr *msgs, unsigned int count,
+    unsigned long long now )
+{
+    unsigned int i;
+
+    for ( i = 0; i < count; i++ )
+    {
+        if ( tftp_fault_sendmsg ( sock, &msgs[i].msg_hdr, now ) < 0 )
+        {
+            return i ? ( int ) i : -1;
+        }
+    }
+
+    return count;
+}
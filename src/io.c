@@ -0,0 +1,371 @@
+/* ------------------------------------------------------------------
+ * Little Tftp - Batched Datagram I/O
+ * ------------------------------------------------------------------ */
+
+#include "io.h"
+
+/* Allocate batch of datagram slots */
+int tftp_io_batch_init ( struct tftp_io_batch *batch, unsigned int limit, size_t slot_size )
+{
+    memset ( batch, '\0', sizeof ( struct tftp_io_batch ) );
+
+    batch->buffers = ( unsigned char * ) malloc ( limit * slot_size );
+    batch->msgs = ( struct mmsghdr * ) calloc ( limit, sizeof ( struct mmsghdr ) );
+    batch->iovs = ( struct iovec * ) calloc ( limit * TFTP_SLOT_IOVS, sizeof ( struct iovec ) );
+    batch->addrs = ( struct sockaddr_in * ) calloc ( limit, sizeof ( struct sockaddr_in ) );
+
+    if ( !batch->buffers || !batch->msgs || !batch->iovs || !batch->addrs )
+    {
+        tftp_io_batch_free ( batch );
+        errno = ENOMEM;
+        return -1;
+    }
+
+    batch->limit = limit;
+    batch->slot_size = slot_size;
+
+    return 0;
+}
+
+/* Release batch of datagram slots */
+void tftp_io_batch_free ( struct tftp_io_batch *batch )
+{
+    free ( batch->buffers );
+    free ( batch->msgs );
+    free ( batch->iovs );
+    free ( batch->addrs );
+    free ( batch->gso_msgs );
+    free ( batch->gso_nslots );
+    free ( batch->gso_cmsgs );
+    memset ( batch, '\0', sizeof ( struct tftp_io_batch ) );
+}
+
+/* Send runs of full slots as GSO super-datagrams if socket supports it */
+int tftp_io_batch_gso ( struct tftp_io_batch *batch, int sock )
+{
+    int zero = 0;
+
+    /* single slot per datagram makes segmentation pointless */
+    if ( batch->limit < 2 || TFTP_UDP_PAYLOAD_MAX / batch->slot_size < 2 )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* faults are injected per datagram */
+    if ( tftp_fault_enabled (  ) )
+    {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    /* older kernels reject the option */
+    if ( setsockopt ( sock, SOL_UDP, UDP_SEGMENT, &zero, sizeof ( zero ) ) < 0 )
+    {
+        return -1;
+    }
+
+    batch->gso_msgs = ( struct mmsghdr * ) calloc ( batch->limit, sizeof ( struct mmsghdr ) );
+    batch->gso_nslots = ( unsigned int * ) calloc ( batch->limit, sizeof ( unsigned int ) );
+    batch->gso_cmsgs =
+        ( union tftp_io_cmsg * ) calloc ( batch->limit, sizeof ( union tftp_io_cmsg ) );
+
+    if ( !batch->gso_msgs || !batch->gso_nslots || !batch->gso_cmsgs )
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    batch->gso_size = batch->slot_size;
+
+    return 0;
+}
+
+/* Get next free slot buffer, NULL if batch is full */
+unsigned char *tftp_io_batch_slot ( struct tftp_io_batch *batch )
+{
+    if ( batch->count == batch->limit )
+    {
+        return NULL;
+    }
+
+    return batch->buffers + batch->count * batch->slot_size;
+}
+
+/* Queue datagram prepared in next free slot, addr is needed on unconnected sockets */
+void tftp_io_batch_commit ( struct tftp_io_batch *batch, size_t len,
+    const struct sockaddr_in *addr )
+{
+    tftp_io_batch_commit_data ( batch, len, NULL, 0, addr );
+}
+
+/* Queue datagram made of header in next free slot followed by external data */
+void tftp_io_batch_commit_data ( struct tftp_io_batch *batch, size_t len, const void *data,
+    size_t datalen, const struct sockaddr_in *addr )
+{
+    unsigned int i = batch->count++;
+    struct iovec *iov = &batch->iovs[i * TFTP_SLOT_IOVS];
+
+    /* data is referenced, kernel copies it straight into socket buffer */
+    iov[0].iov_base = batch->buffers + i * batch->slot_size;
+    iov[0].iov_len = len;
+    iov[1].iov_base = ( void * ) data;
+    iov[1].iov_len = datalen;
+
+    memset ( &batch->msgs[i], '\0', sizeof ( struct mmsghdr ) );
+    batch->msgs[i].msg_hdr.msg_iov = iov;
+    batch->msgs[i].msg_hdr.msg_iovlen = TFTP_SLOT_IOVS;
+
+    if ( addr )
+    {
+        batch->addrs[i] = *addr;
+        batch->msgs[i].msg_hdr.msg_name = &batch->addrs[i];
+        batch->msgs[i].msg_hdr.msg_namelen = sizeof ( struct sockaddr_in );
+    }
+}
+
+/* Receive datagrams into batch, returns count received */
+int tftp_io_recv ( int sock, struct tftp_io_batch *batch, struct tftp_io_stats *stats )
+{
+    int len;
+    unsigned int i;
+
+    /* point every slot at its buffer again */
+    for ( i = 0; i < batch->limit; i++ )
+    {
+        batch->iovs[i * TFTP_SLOT_IOVS].iov_base = batch->buffers + i * batch->slot_size;
+        batch->iovs[i * TFTP_SLOT_IOVS].iov_len = batch->slot_size;
+        memset ( &batch->msgs[i], '\0', sizeof ( struct mmsghdr ) );
+        batch->msgs[i].msg_hdr.msg_iov = &batch->iovs[i * TFTP_SLOT_IOVS];
+        batch->msgs[i].msg_hdr.msg_iovlen = 1;
+        batch->msgs[i].msg_hdr.msg_name = &batch->addrs[i];
+        batch->msgs[i].msg_hdr.msg_namelen = sizeof ( struct sockaddr_in );
+    }
+
+    if ( ( len = recvmmsg ( sock, batch->msgs, batch->limit, MSG_DONTWAIT, NULL ) ) < 0 )
+    {
+        batch->count = 0;
+        return -1;
+    }
+
+    batch->count = len;
+
+    if ( stats )
+    {
+        stats->rx_calls++;
+        stats->rx_packets += len;
+    }
+
+    return len;
+}
+
+/* Get length of datagram queued in slot */
+static size_t tftp_io_slot_len ( const struct tftp_io_batch *batch, unsigned int i )
+{
+    return batch->iovs[i * TFTP_SLOT_IOVS].iov_len + batch->iovs[i * TFTP_SLOT_IOVS + 1].iov_len;
+}
+
+/* Drop sent datagrams, move unsent ones to the front */
+static void tftp_io_batch_consume ( struct tftp_io_batch *batch, unsigned int n )
+{
+    unsigned int i;
+    struct iovec *src;
+    struct iovec *dst;
+
+    for ( i = n; i < batch->count; i++ )
+    {
+        src = &batch->iovs[i * TFTP_SLOT_IOVS];
+        dst = &batch->iovs[( i - n ) * TFTP_SLOT_IOVS];
+        memmove ( batch->buffers + ( i - n ) * batch->slot_size, src[0].iov_base,
+            src[0].iov_len );
+        dst[0].iov_base = batch->buffers + ( i - n ) * batch->slot_size;
+        dst[0].iov_len = src[0].iov_len;
+        dst[1] = src[1];
+        batch->addrs[i - n] = batch->addrs[i];
+        batch->msgs[i - n] = batch->msgs[i];
+        batch->msgs[i - n].msg_hdr.msg_iov = dst;
+        if ( batch->msgs[i - n].msg_hdr.msg_name )
+        {
+            batch->msgs[i - n].msg_hdr.msg_name = &batch->addrs[i - n];
+        }
+    }
+
+    batch->count -= n;
+}
+
+/* Coalesce runs of full slots into GSO messages, returns count of messages */
+static unsigned int tftp_io_batch_coalesce ( struct tftp_io_batch *batch )
+{
+    unsigned int i;
+    unsigned int n;
+    unsigned int nslots;
+    unsigned int limit;
+    struct msghdr *hdr;
+    struct cmsghdr *cmsg;
+
+    limit = TFTP_UDP_PAYLOAD_MAX / batch->gso_size;
+    if ( limit > TFTP_GSO_SEGMENTS )
+    {
+        limit = TFTP_GSO_SEGMENTS;
+    }
+
+    for ( i = 0, n = 0; i < batch->count; i += nslots, n++ )
+    {
+        nslots = 1;
+
+        /* slots are adjacent in memory, only the last one may be short */
+        if ( !batch->msgs[i].msg_hdr.msg_name )
+        {
+            while ( i + nslots < batch->count && nslots < limit
+                && tftp_io_slot_len ( batch, i + nslots - 1 ) == batch->gso_size
+                && !batch->msgs[i + nslots].msg_hdr.msg_name )
+            {
+                nslots++;
+            }
+        }
+
+        batch->gso_msgs[n] = batch->msgs[i];
+        batch->gso_nslots[n] = nslots;
+
+        if ( nslots == 1 )
+        {
+            continue;
+        }
+
+        /* slot iovecs are adjacent, kernel splits data at segment size */
+        hdr = &batch->gso_msgs[n].msg_hdr;
+        hdr->msg_iovlen = nslots * TFTP_SLOT_IOVS;
+        hdr->msg_control = batch->gso_cmsgs[n].buffer;
+        hdr->msg_controllen = sizeof ( batch->gso_cmsgs[n].buffer );
+
+        cmsg = CMSG_FIRSTHDR ( hdr );
+        cmsg->cmsg_level = SOL_UDP;
+        cmsg->cmsg_type = UDP_SEGMENT;
+        cmsg->cmsg_len = CMSG_LEN ( sizeof ( uint16_t ) );
+        *( uint16_t * ) CMSG_DATA ( cmsg ) = batch->gso_size;
+    }
+
+    return n;
+}
+
+/* Count slots carried by first coalesced messages, segmented ones are added to counter */
+static unsigned int tftp_io_batch_nslots ( const struct tftp_io_batch *batch,
+    unsigned int nmsgs, unsigned int *segmented )
+{
+    unsigned int i;
+    unsigned int nslots = 0;
+
+    for ( i = 0; i < nmsgs; i++ )
+    {
+        nslots += batch->gso_nslots[i];
+        if ( batch->gso_nslots[i] > 1 )
+        {
+            *segmented += batch->gso_nslots[i];
+        }
+    }
+
+    return nslots;
+}
+
+/* Send queued datagrams coalescing runs of full slots, returns count of slots sent */
+static int tftp_io_flush_gso ( int sock, struct tftp_io_batch *batch, unsigned int *segmented )
+{
+    int len;
+
+    if ( ( len = sendmmsg ( sock, batch->gso_msgs, tftp_io_batch_coalesce ( batch ),
+                MSG_DONTWAIT ) ) < 0 )
+    {
+        return -1;
+    }
+
+    return tftp_io_batch_nslots ( batch, len, segmented );
+}
+
+/* Send queued datagrams, returns count sent and keeps unsent ones queued */
+int tftp_io_flush ( int sock, struct tftp_io_batch *batch, struct tftp_io_stats *stats )
+{
+    int len = -1;
+    unsigned int segmented = 0;
+
+    if ( !batch->count )
+    {
+        return 0;
+    }
+
+    /* route or device cannot segment, fall back to plain datagrams */
+    if ( batch->gso_size && ( len = tftp_io_flush_gso ( sock, batch, &segmented ) ) < 0
+        && ( errno == EINVAL || errno == EIO || errno == EOPNOTSUPP ) )
+    {
+        batch->gso_size = 0;
+    }
+
+    if ( tftp_fault_enabled (  ) )
+    {
+        len = tftp_fault_sendmmsg ( sock, batch->msgs, batch->count, tftp_time_usec (  ) );
+
+    } else if ( !batch->gso_size )
+    {
+        len = sendmmsg ( sock, batch->msgs, batch->count, MSG_DONTWAIT );
+    }
+
+    if ( len < 0 )
+    {
+        return -1;
+    }
+
+    if ( stats )
+    {
+        stats->tx_calls++;
+        stats->tx_packets += len;
+        stats->tx_segmented += segmented;
+    }
+
+    tftp_io_batch_consume ( batch, len );
+
+    return len;
+}
+
+/* Get messages sending queued datagrams, runs of full slots are coalesced under GSO */
+struct mmsghdr *tftp_io_batch_msgs ( struct tftp_io_batch *batch, unsigned int *count )
+{
+    if ( !batch->gso_size )
+    {
+        *count = batch->count;
+        return batch->msgs;
+    }
+
+    *count = tftp_io_batch_coalesce ( batch );
+    return batch->gso_msgs;
+}
+
+/* Drop datagrams of first messages sent elsewhere, unsent ones stay queued */
+void tftp_io_batch_sent ( struct tftp_io_batch *batch, unsigned int nmsgs,
+    struct tftp_io_stats *stats )
+{
+    unsigned int nslots = nmsgs;
+    unsigned int segmented = 0;
+
+    if ( batch->gso_size )
+    {
+        nslots = tftp_io_batch_nslots ( batch, nmsgs, &segmented );
+    }
+
+    if ( stats && nmsgs )
+    {
+        stats->tx_calls++;
+        stats->tx_packets += nslots;
+        stats->tx_segmented += segmented;
+    }
+
+    tftp_io_batch_consume ( batch, nslots );
+}
+
+/* Add statistics counters */
+void tftp_io_stats_add ( struct tftp_io_stats *total, const struct tftp_io_stats *stats )
+{
+    total->rx_calls += stats->rx_calls;
+    total->rx_packets += stats->rx_packets;
+    total->tx_calls += stats->tx_calls;
+    total->tx_packets += stats->tx_packets;
+    total->tx_segmented += stats->tx_segmented;
+}
@@ -0,0 +1,339 @@
+/* ------------------------------------------------------------------
+ * Little Tftp - Logging
+ * ------------------------------------------------------------------ */
+
+#include "log.h"
+
+/* Level names in order of levels */
+static const char *const tftp_log_levels[] = { "error", "info", "debug", "trace" };
+
+/* Process wide logger, messages are written at once until writer is started */
+static struct tftp_logger tftp_logger = { .level = TFTP_LOG_INFO, .wake = -1 };
+
+/* Parse log level name, returns -1 if unknown */
+int tftp_log_parse_level ( const char *name )
+{
+    int i;
+
+    for ( i = 0; i <= TFTP_LOG_TRACE; i++ )
+    {
+        if ( !strcmp ( name, tftp_log_levels[i] ) )
+        {
+            return i;
+        }
+    }
+
+    errno = EINVAL;
+    return -1;
+}
+
+/* Set level of messages to be logged */
+void tftp_log_set_level ( int level )
+{
+    __atomic_store_n ( &tftp_logger.level, level, __ATOMIC_RELAXED );
+}
+
+/* Check whether messages of level are logged */
+int tftp_log_enabled ( int level )
+{
+    return level <= __atomic_load_n ( &tftp_logger.level, __ATOMIC_RELAXED );
+}
+
+/* Write whole buffer to descriptor of message level */
+static void tftp_log_write ( int level, const char *data, size_t len )
+{
+    ssize_t written;
+    int fd = level == TFTP_LOG_ERROR ? STDERR_FILENO : STDOUT_FILENO;
+
+    while ( len )
+    {
+        if ( ( written = write ( fd, data, len ) ) < 0 )
+        {
+            if ( errno == EINTR )
+            {
+                continue;
+            }
+            return;
+        }
+
+        data += written;
+        len -= written;
+    }
+}
+
+/* Format message into text buffer, truncated message keeps its line end */
+static unsigned int tftp_log_format ( char *text, const char *format, va_list args )
+{
+    int len;
+
+    if ( ( len = vsnprintf ( text, TFTP_LOG_LINE, format, args ) ) < 0 )
+    {
+        return 0;
+    }
+
+    if ( len >= TFTP_LOG_LINE )
+    {
+        len = TFTP_LOG_LINE - 1;
+        text[len - 1] = '\n';
+    }
+
+    return len;
+}
+
+/* Claim free slot, returns NULL if all slots are taken */
+static struct tftp_log_slot *tftp_log_claim ( struct tftp_logger *logger,
+    unsigned long long *pos )
+{
+    long long diff;
+    struct tftp_log_slot *slot;
+
+    *pos = __atomic_load_n ( &logger->head, __ATOMIC_RELAXED );
+
+    for ( ;; )
+    {
+        slot = &logger->slots[*pos & ( TFTP_LOG_SLOTS - 1 )];
+        diff = ( long long ) ( __atomic_load_n ( &slot->seq, __ATOMIC_ACQUIRE ) - *pos );
+
+        if ( !diff )
+        {
+            /* failed exchange reloads position */
+            if ( __atomic_compare_exchange_n ( &logger->head, pos, *pos + 1, 1,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED ) )
+            {
+                return slot;
+            }
+
+        } else if ( diff < 0 )
+        {
+            /* slot still holds message from previous lap */
+            return NULL;
+
+        } else
+        {
+            *pos = __atomic_load_n ( &logger->head, __ATOMIC_RELAXED );
+        }
+    }
+}
+
+/* Queue formatted message for writer, it is written at once if writer is not running */
+void tftp_log ( int level, const char *format, ... )
+{
+    unsigned int len;
+    unsigned long long pos;
+    uint64_t value = 1;
+    va_list args;
+    char text[TFTP_LOG_LINE];
+    struct tftp_log_slot *slot;
+    struct tftp_logger *logger = &tftp_logger;
+
+    if ( !tftp_log_enabled ( level ) )
+    {
+        return;
+    }
+
+    if ( !logger->slots )
+    {
+        va_start ( args, format );
+        len = tftp_log_format ( text, format, args );
+        va_end ( args );
+        tftp_log_write ( level, text, len );
+        return;
+    }
+
+    if ( !( slot = tftp_log_claim ( logger, &pos ) ) )
+    {
+        __atomic_fetch_add ( &logger->dropped, 1, __ATOMIC_RELAXED );
+        return;
+    }
+
+    va_start ( args, format );
+    slot->len = tftp_log_format ( slot->text, format, args );
+    va_end ( args );
+    slot->level = level;
+
+    __atomic_store_n ( &slot->seq, pos + 1, __ATOMIC_RELEASE );
+
+    /* writer is woken only if it went to sleep on empty queue */
+    __atomic_thread_fence ( __ATOMIC_SEQ_CST );
+    if ( __atomic_load_n ( &logger->sleeping, __ATOMIC_RELAXED )
+        && __atomic_exchange_n ( &logger->sleeping, 0, __ATOMIC_RELAXED ) )
+    {
+        if ( write ( logger->wake, &value, sizeof ( value ) ) < 0 )
+        {
+            return;
+        }
+    }
+}
+
+/* Check whether next slot holds message to be written */
+static int tftp_log_ready ( struct tftp_logger *logger )
+{
+    struct tftp_log_slot *slot = &logger->slots[logger->tail & ( TFTP_LOG_SLOTS - 1 )];
+
+    return __atomic_load_n ( &slot->seq, __ATOMIC_ACQUIRE ) == logger->tail + 1;
+}
+
+/* Write queued messages in batches per descriptor, returns number of messages */
+static unsigned int tftp_log_drain ( struct tftp_logger *logger )
+{
+    int level = TFTP_LOG_INFO;
+    size_t len = 0;
+    unsigned int count = 0;
+    unsigned long long dropped;
+    struct tftp_log_slot *slot;
+
+    while ( tftp_log_ready ( logger ) )
+    {
+        slot = &logger->slots[logger->tail & ( TFTP_LOG_SLOTS - 1 )];
+
+        /* errors go to another descriptor */
+        if ( len && ( ( slot->level == TFTP_LOG_ERROR ) != ( level == TFTP_LOG_ERROR )
+                || len + slot->len > TFTP_LOG_BATCH ) )
+        {
+            tftp_log_write ( level, logger->batch, len );
+            len = 0;
+        }
+
+        level = slot->level;
+        memcpy ( logger->batch + len, slot->text, slot->len );
+        len += slot->len;
+
+        /* slot is free again for next lap */
+        __atomic_store_n ( &slot->seq, logger->tail + TFTP_LOG_SLOTS, __ATOMIC_RELEASE );
+        logger->tail++;
+        count++;
+    }
+
+    if ( len )
+    {
+        tftp_log_write ( level, logger->batch, len );
+    }
+
+    if ( ( dropped = __atomic_exchange_n ( &logger->dropped, 0, __ATOMIC_RELAXED ) ) )
+    {
+        len = snprintf ( logger->batch, TFTP_LOG_BATCH, "[log] %llu messages dropped\n",
+            dropped );
+        tftp_log_write ( TFTP_LOG_ERROR, logger->batch, len );
+    }
+
+    __atomic_store_n ( &logger->written, logger->tail, __ATOMIC_RELEASE );
+
+    return count;
+}
+
+/* Write queued messages until stopped, sleeps while queue is empty */
+static void *tftp_log_run ( void *arg )
+{
+    uint64_t value;
+    struct tftp_logger *logger = ( struct tftp_logger * ) arg;
+
+    for ( ;; )
+    {
+        if ( tftp_log_drain ( logger ) )
+        {
+            continue;
+        }
+
+        if ( __atomic_load_n ( &logger->stopping, __ATOMIC_ACQUIRE ) )
+        {
+            break;
+        }
+
+        __atomic_store_n ( &logger->sleeping, 1, __ATOMIC_RELAXED );
+        __atomic_thread_fence ( __ATOMIC_SEQ_CST );
+
+        /* message queued before flag was seen */
+        if ( tftp_log_ready ( logger ) )
+        {
+            __atomic_store_n ( &logger->sleeping, 0, __ATOMIC_RELAXED );
+            continue;
+        }
+
+        if ( read ( logger->wake, &value, sizeof ( value ) ) < 0 && errno != EINTR )
+        {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+/* Stop writer once queued messages are written */
+static void tftp_log_stop ( void )
+{
+    uint64_t value = 1;
+    struct tftp_logger *logger = &tftp_logger;
+
+    __atomic_store_n ( &logger->stopping, 1, __ATOMIC_RELEASE );
+
+    if ( write ( logger->wake, &value, sizeof ( value ) ) >= 0 )
+    {
+        pthread_join ( logger->thread, NULL );
+    }
+}
+
+/* Start background writer, queued messages are written out at exit */
+int tftp_log_start ( void )
+{
+    unsigned int i;
+    struct tftp_logger *logger = &tftp_logger;
+    struct tftp_log_slot *slots;
+
+    if ( !( slots = ( struct tftp_log_slot * ) malloc ( TFTP_LOG_SLOTS
+                * sizeof ( struct tftp_log_slot ) ) ) )
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if ( !( logger->batch = ( char * ) malloc ( TFTP_LOG_BATCH ) ) )
+    {
+        free ( slots );
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for ( i = 0; i < TFTP_LOG_SLOTS; i++ )
+    {
+        slots[i].seq = i;
+    }
+
+    if ( ( logger->wake = eventfd ( 0, EFD_CLOEXEC ) ) < 0 )
+    {
+        free ( logger->batch );
+        free ( slots );
+        return -1;
+    }
+
+    logger->slots = slots;
+
+    if ( ( errno = pthread_create ( &logger->thread, NULL, tftp_log_run, logger ) ) )
+    {
+        logger->slots = NULL;
+        close ( logger->wake );
+        free ( logger->batch );
+        free ( slots );
+        return -1;
+    }
+
+    atexit ( tftp_log_stop );
+
+    return 0;
+}
+
+/* Wait until queued messages are written */
+void tftp_log_flush ( void )
+{
+    struct tftp_logger *logger = &tftp_logger;
+
+    if ( !logger->slots )
+    {
+        return;
+    }
+
+    while ( __atomic_load_n ( &logger->written, __ATOMIC_ACQUIRE )
+        < __atomic_load_n ( &logger->head, __ATOMIC_RELAXED ) )
+    {
+        sched_yield (  );
+    }
+}
@@ -0,0 +1,1084 @@
+/* ------------------------------------------------------------------
+ * Little Tftp - Event Loop
+ * ------------------------------------------------------------------ */
+
+#include "loop.h"
+
+/* Initialize event loop */
+int tftp_loop_init ( struct tftp_loop *loop )
+{
+    memset ( loop, '\0', sizeof ( struct tftp_loop ) );
+
+    if ( ( loop->epfd = epoll_create1 ( EPOLL_CLOEXEC ) ) < 0 )
+    {
+        return -1;
+    }
+
+    /* receive batch is shared by all sockets of loop */
+    if ( tftp_io_batch_init ( &loop->rx, TFTP_BATCH_LIMIT, TFTP_DATAGRAM_LIMIT ) < 0 )
+    {
+        close ( loop->epfd );
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Drive loop by io_uring instead of epoll, must precede any watch */
+int tftp_loop_enable_uring ( struct tftp_loop *loop )
+{
+    int status;
+
+    /* sends submitted to ring would bypass fault injection */
+    if ( tftp_fault_enabled (  ) )
+    {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    if ( !( loop->uring = ( struct tftp_uring * ) malloc ( sizeof ( struct tftp_uring ) ) ) )
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if ( tftp_uring_init ( loop->uring ) < 0 )
+    {
+        status = errno;
+        free ( loop->uring );
+        loop->uring = NULL;
+        errno = status;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Pack object pointer and request kind into io_uring user data */
+static unsigned long long tftp_loop_tag ( const void *ptr, unsigned int op )
+{
+    return ( unsigned long long ) ( uintptr_t ) ptr | op;
+}
+
+/* Get object pointer of io_uring user data */
+static void *tftp_loop_untag ( unsigned long long user_data )
+{
+    return ( void * ) ( uintptr_t ) ( user_data & ~( unsigned long long ) TFTP_LOOP_OP_MASK );
+}
+
+/* Make room for submission entries, queued ones are submitted if needed */
+static int tftp_loop_reserve ( struct tftp_loop *loop, unsigned int count )
+{
+    if ( tftp_uring_space ( loop->uring ) < count && tftp_uring_enter ( loop->uring, 0, -1 ) < 0 )
+    {
+        return -1;
+    }
+
+    if ( tftp_uring_space ( loop->uring ) < count )
+    {
+        errno = EBUSY;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Run queued jobs until stopped, queue is drained first */
+static void *tftp_loop_writer_run ( void *arg )
+{
+    uint64_t value = 1;
+    struct tftp_wbuf_job *job;
+    struct tftp_loop_writer *writer = ( struct tftp_loop_writer * ) arg;
+
+    pthread_mutex_lock ( &writer->lock );
+
+    for ( ;; )
+    {
+        while ( !writer->queue && !writer->stopping )
+        {
+            pthread_cond_wait ( &writer->cond, &writer->lock );
+        }
+
+        if ( !( job = writer->queue ) )
+        {
+            break;
+        }
+
+        if ( !( writer->queue = job->queue_next ) )
+        {
+            writer->queue_tail = NULL;
+        }
+        pthread_mutex_unlock ( &writer->lock );
+
+        /* slow disk holds up this thread only */
+        tftp_wbuf_run ( job );
+
+        pthread_mutex_lock ( &writer->lock );
+        job->queue_next = writer->done;
+        writer->done = job;
+
+        if ( write ( writer->wake, &value, sizeof ( value ) ) < 0 )
+        {
+            continue;
+        }
+    }
+
+    pthread_mutex_unlock ( &writer->lock );
+
+    return NULL;
+}
+
+/* Start background writer watched by loop */
+static int tftp_loop_writer_start ( struct tftp_loop *loop )
+{
+    struct tftp_loop_writer *writer;
+
+    if ( !( writer =
+            ( struct tftp_loop_writer * ) calloc ( 1, sizeof ( struct tftp_loop_writer ) ) ) )
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if ( ( writer->wake = eventfd ( 0, EFD_NONBLOCK | EFD_CLOEXEC ) ) < 0 )
+    {
+        free ( writer );
+        return -1;
+    }
+
+    pthread_mutex_init ( &writer->lock, NULL );
+    pthread_cond_init ( &writer->cond, NULL );
+
+    if ( tftp_loop_watch ( loop, writer->wake, writer ) < 0
+        || ( errno = pthread_create ( &writer->thread, NULL, tftp_loop_writer_run, writer ) ) )
+    {
+        pthread_cond_destroy ( &writer->cond );
+        pthread_mutex_destroy ( &writer->lock );
+        close ( writer->wake );
+        free ( writer );
+        return -1;
+    }
+
+    loop->writer = writer;
+
+    return 0;
+}
+
+/* Hand job of write-behind buffer over to ring or background writer */
+static int tftp_loop_submit_write ( void *ctx, struct tftp_wbuf_job *job )
+{
+    struct tftp_loop *loop = ( struct tftp_loop * ) ctx;
+    struct tftp_loop_writer *writer;
+
+    /* sync is linked to write, it is canceled if write fails */
+    if ( loop->uring )
+    {
+        if ( tftp_loop_reserve ( loop, 2 ) < 0 )
+        {
+            return -1;
+        }
+
+        job->waiting = 0;
+
+        if ( job->len )
+        {
+            tftp_uring_write ( loop->uring, job->fd, job->data, job->len, job->offset,
+                job->sync, tftp_loop_tag ( job, TFTP_LOOP_OP_WRITE ) );
+            job->waiting++;
+        }
+
+        if ( job->sync )
+        {
+            tftp_uring_fsync ( loop->uring, job->fd, tftp_loop_tag ( job, TFTP_LOOP_OP_FSYNC ) );
+            job->waiting++;
+        }
+
+        loop->nwrites++;
+        return 0;
+    }
+
+    /* writer is started by first upload */
+    if ( !loop->writer && tftp_loop_writer_start ( loop ) < 0 )
+    {
+        return -1;
+    }
+
+    writer = loop->writer;
+    job->queue_next = NULL;
+
+    pthread_mutex_lock ( &writer->lock );
+    if ( writer->queue_tail )
+    {
+        writer->queue_tail->queue_next = job;
+    } else
+    {
+        writer->queue = job;
+    }
+    writer->queue_tail = job;
+    pthread_cond_signal ( &writer->cond );
+    pthread_mutex_unlock ( &writer->lock );
+
+    loop->nwrites++;
+
+    return 0;
+}
+
+/* Stop background writer once queued jobs have run, their buffers are gone already */
+static void tftp_loop_writer_stop ( struct tftp_loop *loop )
+{
+    struct tftp_wbuf_job *job;
+    struct tftp_loop_writer *writer = loop->writer;
+
+    pthread_mutex_lock ( &writer->lock );
+    writer->stopping = 1;
+    pthread_cond_signal ( &writer->cond );
+    pthread_mutex_unlock ( &writer->lock );
+    pthread_join ( writer->thread, NULL );
+
+    while ( ( job = writer->done ) )
+    {
+        writer->done = job->queue_next;
+        tftp_wbuf_done ( job );
+    }
+
+    pthread_cond_destroy ( &writer->cond );
+    pthread_mutex_destroy ( &writer->lock );
+    close ( writer->wake );
+    free ( writer );
+    loop->writer = NULL;
+    loop->nwrites = 0;
+}
+
+/* Account completion of job submitted to ring, returns transfer to go on once job has run */
+static void *tftp_loop_write_done ( struct tftp_loop *loop, const struct io_uring_cqe *cqe )
+{
+    struct tftp_wbuf_job *job = ( struct tftp_wbuf_job * ) tftp_loop_untag ( cqe->user_data );
+
+    if ( cqe->res < 0 )
+    {
+        if ( cqe->res != -ECANCELED && !job->status )
+        {
+            job->status = -cqe->res;
+        }
+
+    } else if ( ( cqe->user_data & TFTP_LOOP_OP_MASK ) == TFTP_LOOP_OP_WRITE
+        && ( size_t ) cqe->res < job->len && !job->status )
+    {
+        /* regular file is written short once disk is full */
+        job->status = ENOSPC;
+    }
+
+    if ( --job->waiting )
+    {
+        return NULL;
+    }
+
+    loop->nwrites--;
+
+    return tftp_wbuf_done ( job );
+}
+
+/* Wait for jobs still running on ring, their buffers are gone already */
+static void tftp_loop_drain_writes ( struct tftp_loop *loop )
+{
+    unsigned int i;
+    unsigned int op;
+    unsigned int ready;
+    struct io_uring_cqe *cqe;
+
+    while ( loop->nwrites )
+    {
+        if ( tftp_uring_enter ( loop->uring, 1, -1 ) < 0 && errno != EINTR )
+        {
+            break;
+        }
+
+        ready = tftp_uring_ready ( loop->uring );
+        for ( i = 0; i < ready; i++ )
+        {
+            cqe = tftp_uring_cqe ( loop->uring, i );
+            op = cqe->user_data & TFTP_LOOP_OP_MASK;
+
+            if ( op == TFTP_LOOP_OP_WRITE || op == TFTP_LOOP_OP_FSYNC )
+            {
+                tftp_loop_write_done ( loop, cqe );
+            }
+        }
+
+        tftp_uring_advance ( loop->uring, ready );
+    }
+}
+
+/* Release event loop resources */
+void tftp_loop_free ( struct tftp_loop *loop )
+{
+    if ( loop->writer )
+    {
+        tftp_loop_writer_stop ( loop );
+    }
+
+    if ( loop->uring )
+    {
+        tftp_loop_drain_writes ( loop );
+        tftp_uring_free ( loop->uring );
+        free ( loop->uring );
+        loop->uring = NULL;
+    }
+
+    close ( loop->epfd );
+    tftp_io_batch_free ( &loop->rx );
+    free ( loop->heap );
+    loop->heap = NULL;
+    loop->nxfers = 0;
+    loop->limit = 0;
+}
+
+/* Watch file descriptor for input, ptr is passed back with events */
+int tftp_loop_watch ( struct tftp_loop *loop, int fd, void *ptr )
+{
+    struct epoll_event event;
+    struct tftp_loop_watch *watch;
+
+    if ( loop->uring )
+    {
+        if ( loop->nwatches == TFTP_LOOP_WATCHES )
+        {
+            errno = ENOSPC;
+            return -1;
+        }
+
+        if ( tftp_loop_reserve ( loop, 1 ) < 0 )
+        {
+            return -1;
+        }
+
+        /* multishot poll reports every wakeup until canceled */
+        watch = &loop->watches[loop->nwatches++];
+        watch->fd = fd;
+        watch->ptr = ptr;
+
+        return tftp_uring_poll ( loop->uring, fd, EPOLLIN, 1,
+            tftp_loop_tag ( watch, TFTP_LOOP_OP_WATCH ) );
+    }
+
+    event.events = EPOLLIN;
+    event.data.ptr = ptr;
+
+    return epoll_ctl ( loop->epfd, EPOLL_CTL_ADD, fd, &event );
+}
+
+/* Swap two timer heap entries */
+static void tftp_heap_swap ( struct tftp_loop *loop, size_t a, size_t b )
+{
+    struct tftp_xfer *xfer;
+
+    xfer = loop->heap[a];
+    loop->heap[a] = loop->heap[b];
+    loop->heap[b] = xfer;
+    loop->heap[a]->heap_index = a;
+    loop->heap[b]->heap_index = b;
+}
+
+/* Move timer heap entry towards root */
+static void tftp_heap_up ( struct tftp_loop *loop, size_t i )
+{
+    while ( i > 0 && loop->heap[i]->deadline < loop->heap[( i - 1 ) / 2]->deadline )
+    {
+        tftp_heap_swap ( loop, i, ( i - 1 ) / 2 );
+        i = ( i - 1 ) / 2;
+    }
+}
+
+/* Move timer heap entry towards leaves */
+static void tftp_heap_down ( struct tftp_loop *loop, size_t i )
+{
+    size_t min;
+    size_t child;
+
+    for ( ;; )
+    {
+        min = i;
+
+        for ( child = 2 * i + 1; child <= 2 * i + 2 && child < loop->nxfers; child++ )
+        {
+            if ( loop->heap[child]->deadline < loop->heap[min]->deadline )
+            {
+                min = child;
+            }
+        }
+
+        if ( min == i )
+        {
+            break;
+        }
+
+        tftp_heap_swap ( loop, i, min );
+        i = min;
+    }
+}
+
+/* Get peer lookup bucket index */
+static size_t tftp_loop_bucket ( const struct sockaddr_in *peer )
+{
+    return ( ( peer->sin_addr.s_addr ^ peer->sin_port * 0x9e3779b1u ) >> 7 )
+        % TFTP_LOOP_BUCKETS;
+}
+
+/* Register transfer in event loop */
+int tftp_loop_add ( struct tftp_loop *loop, struct tftp_xfer *xfer )
+{
+    size_t limit;
+    struct tftp_xfer **heap;
+
+    /* grow timer heap if needed */
+    if ( loop->nxfers == loop->limit )
+    {
+        limit = loop->limit ? loop->limit * 2 : 64;
+        if ( !( heap = ( struct tftp_xfer ** ) realloc ( loop->heap,
+                    limit * sizeof ( struct tftp_xfer * ) ) ) )
+        {
+            return -1;
+        }
+        loop->heap = heap;
+        loop->limit = limit;
+    }
+
+    if ( loop->uring )
+    {
+        if ( tftp_loop_reserve ( loop, 2 ) < 0 )
+        {
+            return -1;
+        }
+
+        /* datagrams are received into provided buffers as they arrive */
+        tftp_uring_recv ( loop->uring, xfer->sock, tftp_loop_tag ( xfer, TFTP_LOOP_OP_RECV ) );
+
+        if ( xfer->msock >= 0 )
+        {
+            tftp_uring_recv ( loop->uring, xfer->msock,
+                tftp_loop_tag ( xfer, TFTP_LOOP_OP_MRECV ) );
+        }
+
+    } else
+    {
+        /* watch transfer socket */
+        if ( tftp_loop_watch ( loop, xfer->sock, xfer ) < 0 )
+        {
+            return -1;
+        }
+
+        /* multicast group socket feeds the same transfer */
+        if ( xfer->msock >= 0 && tftp_loop_watch ( loop, xfer->msock, xfer ) < 0 )
+        {
+            epoll_ctl ( loop->epfd, EPOLL_CTL_DEL, xfer->sock, NULL );
+            return -1;
+        }
+    }
+
+    xfer->events = EPOLLIN;
+
+    /* received data is written off loop */
+    if ( xfer->role == TFTP_XFER_ROLE_RECV )
+    {
+        tftp_wbuf_async ( &xfer->wbuf, tftp_loop_submit_write, loop, xfer );
+    }
+
+    /* insert transfer into timer heap */
+    xfer->heap_index = loop->nxfers++;
+    loop->heap[xfer->heap_index] = xfer;
+    tftp_heap_up ( loop, xfer->heap_index );
+
+    /* insert transfer into peer lookup */
+    xfer->bucket = tftp_loop_bucket ( &xfer->peer );
+    xfer->bucket_next = loop->buckets[xfer->bucket];
+    loop->buckets[xfer->bucket] = xfer;
+
+    return 0;
+}
+
+/* Cancel io_uring requests of transfer, completions already posted are marked stale */
+static void tftp_loop_cancel ( struct tftp_loop *loop, struct tftp_xfer *xfer )
+{
+    unsigned int i;
+    unsigned int ready;
+    struct io_uring_cqe *cqe;
+    struct tftp_xfer **link;
+
+    tftp_uring_cancel ( loop->uring, xfer->sock );
+
+    if ( xfer->msock >= 0 )
+    {
+        tftp_uring_cancel ( loop->uring, xfer->msock );
+    }
+
+    ready = tftp_uring_ready ( loop->uring );
+    for ( i = 0; i < ready; i++ )
+    {
+        cqe = tftp_uring_cqe ( loop->uring, i );
+
+        /* provided buffer of stale completion is still recycled */
+        if ( tftp_loop_untag ( cqe->user_data ) == xfer )
+        {
+            cqe->user_data = TFTP_LOOP_OP_STALE;
+        }
+    }
+
+    /* drop deferred sends */
+    for ( link = &loop->flush; xfer->flush_queued && *link; link = &( *link )->flush_next )
+    {
+        if ( *link == xfer )
+        {
+            *link = xfer->flush_next;
+            xfer->flush_queued = 0;
+            break;
+        }
+    }
+}
+
+/* Unregister transfer from event loop */
+void tftp_loop_remove ( struct tftp_loop *loop, struct tftp_xfer *xfer )
+{
+    size_t i;
+    struct tftp_xfer **link;
+
+    if ( loop->uring )
+    {
+        tftp_loop_cancel ( loop, xfer );
+
+    } else
+    {
+        epoll_ctl ( loop->epfd, EPOLL_CTL_DEL, xfer->sock, NULL );
+
+        if ( xfer->msock >= 0 )
+        {
+            epoll_ctl ( loop->epfd, EPOLL_CTL_DEL, xfer->msock, NULL );
+        }
+    }
+
+    /* unlink transfer from peer lookup */
+    for ( link = &loop->buckets[xfer->bucket]; *link; link = &( *link )->bucket_next )
+    {
+        if ( *link == xfer )
+        {
+            *link = xfer->bucket_next;
+            break;
+        }
+    }
+
+    /* replace removed entry with the last one */
+    i = xfer->heap_index;
+    if ( i != --loop->nxfers )
+    {
+        tftp_heap_swap ( loop, i, loop->nxfers );
+        tftp_heap_up ( loop, i );
+        tftp_heap_down ( loop, i );
+    }
+}
+
+/* Reschedule transfer after its deadline or output interest has changed */
+void tftp_loop_update ( struct tftp_loop *loop, struct tftp_xfer *xfer )
+{
+    struct epoll_event event;
+
+    /* wait for writable socket while window is blocked */
+    event.events = EPOLLIN | ( xfer->want_output ? EPOLLOUT : 0 );
+    event.data.ptr = xfer;
+
+    if ( loop->uring )
+    {
+        /* one shot poll reports writable socket once */
+        if ( xfer->want_output && !( xfer->events & EPOLLOUT )
+            && tftp_loop_reserve ( loop, 1 ) >= 0 )
+        {
+            tftp_uring_poll ( loop->uring, xfer->sock, EPOLLOUT, 0,
+                tftp_loop_tag ( xfer, TFTP_LOOP_OP_OUTPUT ) );
+            xfer->events |= EPOLLOUT;
+        }
+
+    } else if ( event.events != xfer->events
+        && epoll_ctl ( loop->epfd, EPOLL_CTL_MOD, xfer->sock, &event ) >= 0 )
+    {
+        xfer->events = event.events;
+    }
+
+    tftp_heap_up ( loop, xfer->heap_index );
+    tftp_heap_down ( loop, xfer->heap_index );
+}
+
+/* Receive pending packets of transfer, io_uring engine has processed them already */
+void tftp_loop_input ( struct tftp_loop *loop, struct tftp_xfer *xfer )
+{
+    if ( !loop->uring )
+    {
+        tftp_xfer_input ( xfer, &loop->rx );
+    }
+}
+
+/* Send packets queued by transfer, io_uring engine batches them into next wait */
+void tftp_loop_flush ( struct tftp_loop *loop, struct tftp_xfer *xfer )
+{
+    /* finished transfer is released before next wait, blocked one waits for output */
+    if ( !loop->uring || xfer->state != TFTP_XFER_STATE_ACTIVE || xfer->want_output )
+    {
+        tftp_xfer_flush ( xfer );
+        return;
+    }
+
+    if ( xfer->tx.count && !xfer->flush_queued )
+    {
+        xfer->flush_queued = 1;
+        xfer->flush_next = loop->flush;
+        loop->flush = xfer;
+    }
+}
+
+/* Find transfer by peer address, NULL if none */
+struct tftp_xfer *tftp_loop_find ( const struct tftp_loop *loop, const struct sockaddr_in *peer )
+{
+    struct tftp_xfer *xfer;
+
+    for ( xfer = loop->buckets[tftp_loop_bucket ( peer )]; xfer; xfer = xfer->bucket_next )
+    {
+        if ( xfer->peer.sin_addr.s_addr == peer->sin_addr.s_addr
+            && xfer->peer.sin_port == peer->sin_port )
+        {
+            return xfer;
+        }
+    }
+
+    return NULL;
+}
+
+/* Get milliseconds until nearest deadline, -1 if none */
+int tftp_loop_timeout ( const struct tftp_loop *loop )
+{
+    unsigned long long now;
+    unsigned long long deadline = 0;
+    unsigned long long release;
+
+    if ( loop->nxfers )
+    {
+        deadline = loop->heap[0]->deadline;
+    }
+
+    /* owner of loop has work scheduled too */
+    if ( loop->wakeup && ( !deadline || loop->wakeup < deadline ) )
+    {
+        deadline = loop->wakeup;
+    }
+
+    /* held datagrams must go out in time */
+    if ( ( release = tftp_fault_deadline (  ) ) && ( !deadline || release < deadline ) )
+    {
+        deadline = release;
+    }
+
+    if ( !deadline )
+    {
+        return -1;
+    }
+
+    now = tftp_time_usec (  );
+
+    if ( deadline <= now )
+    {
+        return 0;
+    }
+
+    /* round up to avoid busy waiting */
+    return ( deadline - now + 999 ) / 1000;
+}
+
+/* Get transfer with expired deadline, NULL if none */
+struct tftp_xfer *tftp_loop_expired ( const struct tftp_loop *loop, unsigned long long now )
+{
+    if ( loop->nxfers && loop->heap[0]->deadline <= now )
+    {
+        return loop->heap[0];
+    }
+
+    return NULL;
+}
+
+/* Merge events of the same transfer, handling them twice could release it twice */
+static int tftp_loop_merge ( struct epoll_event *events, int nevents )
+{
+    int i;
+    int j;
+    int n = 0;
+
+    for ( i = 0; i < nevents; i++ )
+    {
+        for ( j = 0; j < n; j++ )
+        {
+            if ( events[j].data.ptr == events[i].data.ptr )
+            {
+                events[j].events |= events[i].events;
+                break;
+            }
+        }
+
+        if ( j == n )
+        {
+            events[n++] = events[i];
+        }
+    }
+
+    return n;
+}
+
+/* Add event of transfer, events of the same transfer are merged */
+static int tftp_loop_emit ( struct epoll_event *events, int n, void *ptr, unsigned int flags )
+{
+    int i;
+
+    for ( i = 0; i < n; i++ )
+    {
+        if ( events[i].data.ptr == ptr )
+        {
+            events[i].events |= flags;
+            return n;
+        }
+    }
+
+    events[n].events = flags;
+    events[n].data.ptr = ptr;
+
+    return n + 1;
+}
+
+/* Settle jobs that have run, their transfers go on and get events of their own */
+static int tftp_loop_writes_done ( struct tftp_loop *loop, struct epoll_event *events, int n,
+    int limit )
+{
+    uint64_t value;
+    void *owner;
+    struct tftp_wbuf_job *job;
+    struct tftp_wbuf_job *done;
+    struct tftp_loop_writer *writer = loop->writer;
+
+    if ( read ( writer->wake, &value, sizeof ( value ) ) < 0 && errno != EAGAIN )
+    {
+        return n;
+    }
+
+    pthread_mutex_lock ( &writer->lock );
+    done = writer->done;
+    writer->done = NULL;
+    pthread_mutex_unlock ( &writer->lock );
+
+    while ( ( job = done ) && n < limit )
+    {
+        done = job->queue_next;
+        loop->nwrites--;
+
+        if ( ( owner = tftp_wbuf_done ( job ) ) )
+        {
+            tftp_xfer_written ( ( struct tftp_xfer * ) owner );
+            n = tftp_loop_emit ( events, n, owner, EPOLLIN );
+        }
+    }
+
+    /* jobs left over are settled with next wait */
+    if ( done )
+    {
+        pthread_mutex_lock ( &writer->lock );
+        for ( job = done; job->queue_next; job = job->queue_next )
+        {
+        }
+        job->queue_next = writer->done;
+        writer->done = done;
+        pthread_mutex_unlock ( &writer->lock );
+
+        value = 1;
+        if ( write ( writer->wake, &value, sizeof ( value ) ) < 0 )
+        {
+            return n;
+        }
+    }
+
+    return n;
+}
+
+/* Replace wakeup of background writer by events of transfers whose jobs have run */
+static int tftp_loop_collect ( struct tftp_loop *loop, struct epoll_event *events, int n,
+    int limit )
+{
+    int i;
+
+    for ( i = 0; loop->writer && i < n; i++ )
+    {
+        if ( events[i].data.ptr == loop->writer )
+        {
+            events[i] = events[--n];
+            return tftp_loop_writes_done ( loop, events, n, limit );
+        }
+    }
+
+    return n;
+}
+
+/* Submit deferred sends of up to limit transfers as linked chains, returns count of entries */
+static unsigned int tftp_loop_submit_sends ( struct tftp_loop *loop, struct tftp_xfer **sending,
+    int limit )
+{
+    int n;
+    unsigned int i;
+    unsigned int count;
+    unsigned int nsends = 0;
+    struct mmsghdr *msgs;
+    struct tftp_xfer *xfer;
+
+    for ( n = 0; n < limit && ( xfer = loop->flush ); n++ )
+    {
+        loop->flush = xfer->flush_next;
+        xfer->flush_queued = 0;
+        xfer->flush_next = *sending;
+        *sending = xfer;
+
+        msgs = tftp_io_batch_msgs ( &xfer->tx, &count );
+        xfer->flush_sent = 0;
+        xfer->flush_status = 0;
+
+        /* transfer whose chain does not fit is sent directly later */
+        if ( tftp_loop_reserve ( loop, count ) < 0 )
+        {
+            xfer->flush_status = EBUSY;
+            continue;
+        }
+
+        /* send after failed one is canceled, order of packets is kept */
+        for ( i = 0; i < count; i++ )
+        {
+            tftp_uring_sendmsg ( loop->uring, xfer->sock, &msgs[i].msg_hdr, i + 1 < count,
+                tftp_loop_tag ( xfer, TFTP_LOOP_OP_SEND ) );
+        }
+
+        nsends += count;
+    }
+
+    return nsends;
+}
+
+/* Collect completions of submitted sends, messages stay referenced until they are all in */
+static int tftp_loop_reap_sends ( struct tftp_loop *loop, unsigned int nsends )
+{
+    unsigned int i = 0;
+    unsigned int ready;
+    struct io_uring_cqe *cqe;
+    struct tftp_xfer *xfer;
+
+    while ( nsends )
+    {
+        for ( ready = tftp_uring_ready ( loop->uring ); i < ready; i++ )
+        {
+            cqe = tftp_uring_cqe ( loop->uring, i );
+
+            if ( ( cqe->user_data & TFTP_LOOP_OP_MASK ) != TFTP_LOOP_OP_SEND )
+            {
+                continue;
+            }
+
+            /* sends of chain behind failed one are canceled */
+            xfer = ( struct tftp_xfer * ) tftp_loop_untag ( cqe->user_data );
+            if ( cqe->res >= 0 )
+            {
+                xfer->flush_sent++;
+
+            } else if ( cqe->res != -ECANCELED && !xfer->flush_status )
+            {
+                xfer->flush_status = -cqe->res;
+            }
+
+            cqe->user_data = TFTP_LOOP_OP_STALE;
+            nsends--;
+        }
+
+        if ( nsends && tftp_uring_enter ( loop->uring, ready + 1, -1 ) < 0 && errno != EINTR )
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Drop sent packets of transfers, packets of failed chains are sent directly */
+static int tftp_loop_settle_sends ( struct tftp_xfer *sending, struct epoll_event *events )
+{
+    int n = 0;
+    struct tftp_xfer *xfer;
+
+    for ( xfer = sending; xfer; xfer = xfer->flush_next )
+    {
+        tftp_io_batch_sent ( &xfer->tx, xfer->flush_sent, &xfer->io );
+
+        /* full socket buffer or failure is handled as with plain sends */
+        if ( xfer->flush_status && xfer->tx.count && tftp_xfer_flush ( xfer ) )
+        {
+            n = tftp_loop_emit ( events, n, xfer, EPOLLERR );
+        }
+    }
+
+    return n;
+}
+
+/* Handle datagram completion of transfer, receive is armed again once it ends */
+static void tftp_loop_receive ( struct tftp_loop *loop, struct tftp_xfer *xfer,
+    const struct io_uring_cqe *cqe )
+{
+    int sock;
+    size_t len;
+    struct sockaddr_in addr;
+    const unsigned char *packet;
+
+    if ( xfer->state != TFTP_XFER_STATE_ACTIVE )
+    {
+        return;
+    }
+
+    if ( cqe->res >= 0 )
+    {
+        /* truncated datagram is dropped */
+        if ( ( packet = tftp_uring_datagram ( loop->uring, cqe, &addr, &len ) ) )
+        {
+            xfer->io.rx_packets++;
+            tftp_xfer_receive ( xfer, &addr, packet, len );
+        }
+
+    } else if ( cqe->res == -ECANCELED )
+    {
+        return;
+
+    } else if ( cqe->res != -ENOBUFS )
+    {
+        xfer->state = TFTP_XFER_STATE_FAILED;
+        xfer->status = -cqe->res;
+        tftp_log ( TFTP_LOG_ERROR, "\n[%s] failed to receive data: %i\n", xfer->progname,
+            xfer->status );
+        return;
+    }
+
+    /* receive ends once provided buffers run out */
+    if ( !( cqe->flags & IORING_CQE_F_MORE ) && xfer->state == TFTP_XFER_STATE_ACTIVE
+        && tftp_loop_reserve ( loop, 1 ) >= 0 )
+    {
+        sock = ( cqe->user_data & TFTP_LOOP_OP_MASK ) == TFTP_LOOP_OP_RECV
+            ? xfer->sock : xfer->msock;
+        tftp_uring_recv ( loop->uring, sock, cqe->user_data );
+    }
+}
+
+/* Turn ready completions into events, remaining ones are left for next wait */
+static int tftp_loop_complete ( struct tftp_loop *loop, struct epoll_event *events, int n,
+    int limit )
+{
+    unsigned int i;
+    unsigned int ready;
+    struct io_uring_cqe *cqe;
+    struct tftp_xfer *xfer;
+    struct tftp_loop_watch *watch;
+
+    ready = tftp_uring_ready ( loop->uring );
+    for ( i = 0; i < ready && n < limit; i++ )
+    {
+        cqe = tftp_uring_cqe ( loop->uring, i );
+        xfer = ( struct tftp_xfer * ) tftp_loop_untag ( cqe->user_data );
+
+        switch ( cqe->user_data & TFTP_LOOP_OP_MASK )
+        {
+        case TFTP_LOOP_OP_WATCH:
+            watch = ( struct tftp_loop_watch * ) tftp_loop_untag ( cqe->user_data );
+            n = tftp_loop_emit ( events, n, watch->ptr, EPOLLIN );
+
+            /* poll ends on overflow of completion queue */
+            if ( !( cqe->flags & IORING_CQE_F_MORE ) && tftp_loop_reserve ( loop, 1 ) >= 0 )
+            {
+                tftp_uring_poll ( loop->uring, watch->fd, EPOLLIN, 1, cqe->user_data );
+            }
+            break;
+        case TFTP_LOOP_OP_RECV:
+        case TFTP_LOOP_OP_MRECV:
+            tftp_loop_receive ( loop, xfer, cqe );
+            n = tftp_loop_emit ( events, n, xfer, EPOLLIN );
+            break;
+        case TFTP_LOOP_OP_OUTPUT:
+            xfer->events &= ~EPOLLOUT;
+            n = tftp_loop_emit ( events, n, xfer, EPOLLOUT );
+            break;
+        case TFTP_LOOP_OP_WRITE:
+        case TFTP_LOOP_OP_FSYNC:
+            if ( ( xfer = ( struct tftp_xfer * ) tftp_loop_write_done ( loop, cqe ) ) )
+            {
+                tftp_xfer_written ( xfer );
+                n = tftp_loop_emit ( events, n, xfer, EPOLLIN );
+            }
+            break;
+        }
+
+        tftp_uring_recycle ( loop->uring, cqe );
+    }
+
+    tftp_uring_advance ( loop->uring, i );
+
+    return n;
+}
+
+/* Wait for io_uring completions, sends deferred by transfers go out first */
+static int tftp_loop_wait_uring ( struct tftp_loop *loop, struct epoll_event *events, int limit )
+{
+    int n;
+    int timeout;
+    int status = 0;
+    unsigned int nsends;
+    struct tftp_xfer *sending = NULL;
+
+    nsends = tftp_loop_submit_sends ( loop, &sending, limit );
+
+    /* completions left over from last wait are handled at once */
+    timeout = tftp_uring_ready ( loop->uring ) ? 0 : tftp_loop_timeout ( loop );
+
+    /* sends complete while being submitted, wait for one completion more */
+    if ( tftp_uring_enter ( loop->uring, nsends + 1, timeout < 0 ? -1 : timeout * 1000LL ) < 0
+        && errno != EINTR )
+    {
+        status = errno;
+    }
+
+    if ( tftp_loop_reap_sends ( loop, nsends ) < 0 )
+    {
+        return -1;
+    }
+
+    n = tftp_loop_settle_sends ( sending, events );
+
+    if ( status )
+    {
+        errno = status;
+        return -1;
+    }
+
+    return tftp_loop_collect ( loop, events, tftp_loop_complete ( loop, events, n, limit ),
+        limit );
+}
+
+/* Wait for events */
+int tftp_loop_wait ( struct tftp_loop *loop, struct epoll_event *events, int limit )
+{
+    int nevents;
+
+    if ( loop->uring )
+    {
+        return tftp_loop_wait_uring ( loop, events, limit );
+    }
+
+    tftp_fault_release ( tftp_time_usec (  ) );
+
+    if ( ( nevents = epoll_wait ( loop->epfd, events, limit, tftp_loop_timeout ( loop ) ) ) < 0 )
+    {
+        return -1;
+    }
+
+    /* transfer socket and its multicast group socket report separately */
+    return tftp_loop_collect ( loop, events, tftp_loop_merge ( events, nevents ), limit );
+}
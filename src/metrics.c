@@ -0,0 +1,405 @@
+/* ------------------------------------------------------------------
+ * Little Tftp - Server Metrics
+ * ------------------------------------------------------------------ */
+
+#include "metrics.h"
+
+/* Request to first DATA latency bounds in microseconds */
+static const unsigned long long tftp_latency_bounds[] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000,
+    2500000, 5000000
+};
+
+/* Transfer throughput bounds in bytes per second */
+static const unsigned long long tftp_throughput_bounds[] = {
+    65536, 262144, 1048576, 4194304, 16777216, 67108864, 268435456, 1073741824
+};
+
+/* Opcode label values */
+static const char *const tftp_opcode_names[TFTP_METRICS_OPCODES] = {
+    "unknown", "rrq", "wrq", "data", "ack", "error", "oack"
+};
+
+/* Rate limit scope label values */
+static const char *const tftp_scope_names[TFTP_SHAPE_SCOPES] = {
+    "transfer", "subnet", "global"
+};
+
+/* Initialize histogram with bucket bounds */
+static void tftp_histogram_init ( struct tftp_histogram *histogram,
+    const unsigned long long *bounds, unsigned int nbounds, double scale )
+{
+    memset ( histogram, '\0', sizeof ( struct tftp_histogram ) );
+    histogram->bounds = bounds;
+    histogram->nbounds = nbounds;
+    histogram->scale = scale;
+}
+
+/* Initialize metrics with empty counters */
+void tftp_metrics_init ( struct tftp_metrics *metrics )
+{
+    memset ( metrics, '\0', sizeof ( struct tftp_metrics ) );
+    metrics->sock = -1;
+
+    tftp_histogram_init ( &metrics->first_data, tftp_latency_bounds,
+        sizeof ( tftp_latency_bounds ) / sizeof ( tftp_latency_bounds[0] ), 1e-6 );
+    tftp_histogram_init ( &metrics->throughput, tftp_throughput_bounds,
+        sizeof ( tftp_throughput_bounds ) / sizeof ( tftp_throughput_bounds[0] ), 1.0 );
+}
+
+/* Add value to counter, wrapping addition subtracts from gauge */
+void tftp_metrics_add ( unsigned long long *counter, unsigned long long value )
+{
+    __atomic_fetch_add ( counter, value, __ATOMIC_RELAXED );
+}
+
+/* Read counter updated by workers */
+static unsigned long long tftp_metrics_load ( const unsigned long long *counter )
+{
+    return __atomic_load_n ( counter, __ATOMIC_RELAXED );
+}
+
+/* Record observation in histogram */
+void tftp_metrics_observe ( struct tftp_histogram *histogram, unsigned long long value )
+{
+    unsigned int i;
+
+    for ( i = 0; i < histogram->nbounds; i++ )
+    {
+        if ( value <= histogram->bounds[i] )
+        {
+            break;
+        }
+    }
+
+    tftp_metrics_add ( &histogram->counts[i], 1 );
+    tftp_metrics_add ( &histogram->sum, value );
+    tftp_metrics_add ( &histogram->count, 1 );
+}
+
+/* Append formatted text to response, output past limit is dropped */
+static size_t tftp_metrics_append ( char *buffer, size_t limit, size_t len, const char *format,
+    ... )
+{
+    int ret;
+    va_list args;
+
+    if ( len >= limit )
+    {
+        return len;
+    }
+
+    va_start ( args, format );
+    ret = vsnprintf ( buffer + len, limit - len, format, args );
+    va_end ( args );
+
+    if ( ret < 0 )
+    {
+        return len;
+    }
+
+    return len + ret < limit ? len + ret : limit;
+}
+
+/* Append metric family header */
+static size_t tftp_metrics_header ( char *buffer, size_t limit, size_t len, const char *name,
+    const char *type, const char *help )
+{
+    return tftp_metrics_append ( buffer, limit, len, "# HELP %s %s\n# TYPE %s %s\n", name, help,
+        name, type );
+}
+
+/* Append single value metric */
+static size_t tftp_metrics_value ( char *buffer, size_t limit, size_t len, const char *name,
+    const char *type, const char *help, const unsigned long long *counter )
+{
+    len = tftp_metrics_header ( buffer, limit, len, name, type, help );
+
+    return tftp_metrics_append ( buffer, limit, len, "%s %llu\n", name,
+        tftp_metrics_load ( counter ) );
+}
+
+/* Append histogram with cumulative buckets */
+static size_t tftp_metrics_histogram ( char *buffer, size_t limit, size_t len, const char *name,
+    const char *help, const struct tftp_histogram *histogram )
+{
+    unsigned int i;
+    unsigned long long count = 0;
+
+    len = tftp_metrics_header ( buffer, limit, len, name, "histogram", help );
+
+    for ( i = 0; i < histogram->nbounds; i++ )
+    {
+        count += tftp_metrics_load ( &histogram->counts[i] );
+        len = tftp_metrics_append ( buffer, limit, len, "%s_bucket{le=\"%.12g\"} %llu\n", name,
+            histogram->bounds[i] * histogram->scale, count );
+    }
+
+    count += tftp_metrics_load ( &histogram->counts[i] );
+    len = tftp_metrics_append ( buffer, limit, len, "%s_bucket{le=\"+Inf\"} %llu\n", name,
+        count );
+    len = tftp_metrics_append ( buffer, limit, len, "%s_sum %.12g\n", name,
+        tftp_metrics_load ( &histogram->sum ) * histogram->scale );
+
+    return tftp_metrics_append ( buffer, limit, len, "%s_count %llu\n", name,
+        tftp_metrics_load ( &histogram->count ) );
+}
+
+/* Format metrics in Prometheus text format, returns length */
+size_t tftp_metrics_format ( struct tftp_metrics *metrics, char *buffer, size_t limit )
+{
+    unsigned int i;
+    size_t len = 0;
+
+    len = tftp_metrics_value ( buffer, limit, len, "tftp_active_transfers", "gauge",
+        "Transfers in progress.", &metrics->active );
+
+    len = tftp_metrics_header ( buffer, limit, len, "tftp_requests_total", "counter",
+        "Packets received on listening socket by opcode." );
+    for ( i = 0; i < TFTP_METRICS_OPCODES; i++ )
+    {
+        len = tftp_metrics_append ( buffer, limit, len,
+            "tftp_requests_total{opcode=\"%s\"} %llu\n", tftp_opcode_names[i],
+            tftp_metrics_load ( &metrics->requests[i] ) );
+    }
+
+    len = tftp_metrics_header ( buffer, limit, len, "tftp_transfers_total", "counter",
+        "Finished transfers by result." );
+    len = tftp_metrics_append ( buffer, limit, len,
+        "tftp_transfers_total{result=\"success\"} %llu\n"
+        "tftp_transfers_total{result=\"failure\"} %llu\n",
+        tftp_metrics_load ( &metrics->succeeded ), tftp_metrics_load ( &metrics->failed ) );
+
+    len = tftp_metrics_value ( buffer, limit, len, "tftp_sent_bytes_total", "counter",
+        "File bytes acknowledged by clients.", &metrics->bytes_sent );
+    len = tftp_metrics_value ( buffer, limit, len, "tftp_received_bytes_total", "counter",
+        "File bytes received from clients.", &metrics->bytes_received );
+    len = tftp_metrics_value ( buffer, limit, len, "tftp_retransmits_total", "counter",
+        "Packets sent again after loss.", &metrics->retransmits );
+    len = tftp_metrics_value ( buffer, limit, len, "tftp_duplicates_total", "counter",
+        "Duplicate ACK and DATA packets ignored.", &metrics->duplicates );
+    len = tftp_metrics_value ( buffer, limit, len, "tftp_timeouts_total", "counter",
+        "Retransmission timeouts.", &metrics->timeouts );
+
+    len = tftp_metrics_header ( buffer, limit, len, "tftp_errors_total", "counter",
+        "Failed requests and transfers by TFTP error code." );
+    for ( i = 0; i < TFTP_METRICS_CODES; i++ )
+    {
+        len = tftp_metrics_append ( buffer, limit, len, "tftp_errors_total{code=\"%u\"} %llu\n",
+            i, tftp_metrics_load ( &metrics->errors[i] ) );
+    }
+
+    len = tftp_metrics_header ( buffer, limit, len, "tftp_shaping_limit_bytes_per_second",
+        "gauge", "Configured rate limits by scope, zero means unlimited." );
+    for ( i = 0; i < TFTP_SHAPE_SCOPES; i++ )
+    {
+        len = tftp_metrics_append ( buffer, limit, len,
+            "tftp_shaping_limit_bytes_per_second{scope=\"%s\"} %llu\n", tftp_scope_names[i],
+            tftp_metrics_load ( &metrics->shape_limits[i] ) );
+    }
+
+    len = tftp_metrics_header ( buffer, limit, len, "tftp_shaping_throttled_total", "counter",
+        "Transfers held back for tokens by scope of limit holding them." );
+    for ( i = 0; i < TFTP_SHAPE_SCOPES; i++ )
+    {
+        len = tftp_metrics_append ( buffer, limit, len,
+            "tftp_shaping_throttled_total{scope=\"%s\"} %llu\n", tftp_scope_names[i],
+            tftp_metrics_load ( &metrics->throttled[i] ) );
+    }
+
+    len = tftp_metrics_header ( buffer, limit, len, "tftp_shaping_delay_seconds_total", "counter",
+        "Time transfers were held back for tokens." );
+    len = tftp_metrics_append ( buffer, limit, len, "tftp_shaping_delay_seconds_total %.6f\n",
+        tftp_metrics_load ( &metrics->shaped_usec ) * 1e-6 );
+
+    len = tftp_metrics_histogram ( buffer, limit, len, "tftp_first_data_seconds",
+        "Time from request to first DATA sent or received.", &metrics->first_data );
+
+    return tftp_metrics_histogram ( buffer, limit, len,
+        "tftp_transfer_throughput_bytes_per_second",
+        "Throughput of successful transfers.", &metrics->throughput );
+}
+
+/* Listen for scrapes on TCP [address:]port or Unix socket path, remote ones only if public */
+int tftp_metrics_listen ( struct tftp_metrics *metrics, const char *endpoint,
+    int public )
+{
+    int status;
+    unsigned int yes = 1;
+    unsigned int port;
+    char host[32];
+    struct sockaddr_in addr;
+    struct sockaddr_un path;
+    struct sockaddr *saddr;
+    socklen_t saddr_len;
+
+    memset ( &addr, '\0', sizeof ( addr ) );
+    memset ( &path, '\0', sizeof ( path ) );
+
+    /* absolute path names Unix socket */
+    if ( *endpoint == '/' )
+    {
+        if ( strlen ( endpoint ) >= sizeof ( path.sun_path ) )
+        {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+
+        path.sun_family = AF_UNIX;
+        strcpy ( path.sun_path, endpoint );
+        saddr = ( struct sockaddr * ) &path;
+        saddr_len = sizeof ( path );
+
+        /* socket left behind by previous run */
+        unlink ( endpoint );
+
+    } else
+    {
+        /* bare port listens on loopback */
+        if ( !strchr ( endpoint, ':' ) )
+        {
+            snprintf ( host, sizeof ( host ), "127.0.0.1" );
+            status = sscanf ( endpoint, "%u", &port ) == 1;
+        } else
+        {
+            status = sscanf ( endpoint, "%31[^:]:%u", host, &port ) == 2;
+        }
+
+        if ( !status || !port || port > 65535 || inet_pton ( AF_INET, host, &addr.sin_addr ) <= 0 )
+        {
+            errno = EINVAL;
+            return -1;
+        }
+
+        /* scrapes are not authenticated */
+        if ( !public && ( ntohl ( addr.sin_addr.s_addr ) >> 24 ) != IN_LOOPBACKNET )
+        {
+            errno = EPERM;
+            return -1;
+        }
+
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons ( port );
+        saddr = ( struct sockaddr * ) &addr;
+        saddr_len = sizeof ( addr );
+    }
+
+    if ( ( metrics->sock = socket ( saddr->sa_family, SOCK_STREAM | SOCK_CLOEXEC, 0 ) ) < 0 )
+    {
+        return -1;
+    }
+
+    setsockopt ( metrics->sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof ( yes ) );
+
+    if ( bind ( metrics->sock, saddr, saddr_len ) < 0
+        || listen ( metrics->sock, TFTP_METRICS_BACKLOG ) < 0 )
+    {
+        status = errno;
+        close ( metrics->sock );
+        metrics->sock = -1;
+        errno = status;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Answer single scrape, request itself is not inspected */
+static void tftp_metrics_serve ( struct tftp_metrics *metrics, int conn, char *body )
+{
+    char request[1024];
+    char header[128];
+    size_t len;
+    int hlen;
+    struct timeval tv;
+
+    /* slow client does not hold up next scrape for long */
+    tv.tv_sec = 1;
+    tv.tv_usec = 0;
+    setsockopt ( conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof ( tv ) );
+    setsockopt ( conn, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof ( tv ) );
+
+    if ( recv ( conn, request, sizeof ( request ), 0 ) < 0 )
+    {
+        return;
+    }
+
+    len = tftp_metrics_format ( metrics, body, TFTP_METRICS_RESPONSE_LIMIT );
+    hlen = snprintf ( header, sizeof ( header ), "HTTP/1.0 200 OK\r\n"
+        "Content-Type: text/plain; version=0.0.4\r\n"
+        "Content-Length: %lu\r\n\r\n", ( unsigned long ) len );
+
+    if ( send ( conn, header, hlen, MSG_NOSIGNAL ) == hlen )
+    {
+        send ( conn, body, len, MSG_NOSIGNAL );
+    }
+}
+
+/* Accept scrapes until process exits */
+static void *tftp_metrics_run ( void *arg )
+{
+    int conn;
+    char *body;
+    unsigned long long now;
+    unsigned long long logged = 0;
+    unsigned long long failures = 0;
+    struct tftp_metrics *metrics = ( struct tftp_metrics * ) arg;
+
+    if ( !( body = ( char * ) malloc ( TFTP_METRICS_RESPONSE_LIMIT ) ) )
+    {
+        return NULL;
+    }
+
+    for ( ;; )
+    {
+        if ( ( conn = accept4 ( metrics->sock, NULL, NULL, SOCK_CLOEXEC ) ) < 0 )
+        {
+            if ( errno == EINTR || errno == ECONNABORTED )
+            {
+                continue;
+            }
+
+            /* listening socket itself is unusable */
+            if ( errno == EBADF || errno == EINVAL || errno == ENOTSOCK )
+            {
+                tftp_log ( TFTP_LOG_ERROR, "[lsrv] failed to accept metrics scrape: %i\n",
+                    errno );
+                break;
+            }
+
+            /* out of descriptors or memory under load, pending scrape is retried */
+            failures++;
+            now = tftp_time_usec (  );
+            if ( !logged || now - logged >= TFTP_METRICS_LOG_USEC )
+            {
+                tftp_log ( TFTP_LOG_ERROR, "[lsrv] failed to accept metrics scrape: %i "
+                    "(%llu failures)\n", errno, failures );
+                logged = now;
+                failures = 0;
+            }
+
+            usleep ( TFTP_METRICS_BACKOFF_USEC );
+            continue;
+        }
+
+        tftp_metrics_serve ( metrics, conn, body );
+        close ( conn );
+    }
+
+    free ( body );
+
+    return NULL;
+}
+
+/* Serve scrapes from background thread */
+int tftp_metrics_start ( struct tftp_metrics *metrics )
+{
+    if ( ( errno = pthread_create ( &metrics->thread, NULL, tftp_metrics_run, metrics ) ) )
+    {
+        return -1;
+    }
+
+    pthread_detach ( metrics->thread );
+
+    return 0;
+}
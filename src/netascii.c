@@ -0,0 +1,258 @@
+/* ------------------------------------------------------------------
+ * Little Tftp - Netascii Translation
+ * ------------------------------------------------------------------ */
+
+#include "netascii.h"
+
+/* Scanner names in order of kernels */
+static const char *const tftp_netascii_names[] = { "scalar", "sse2", "avx2" };
+
+/* Scanner in use, chosen on first translation unless selected */
+static int tftp_netascii_kernel = -1;
+
+/* Find first byte equal to a or b one byte at a time */
+static size_t tftp_netascii_scan_scalar ( const unsigned char *data, size_t len, int a, int b )
+{
+    size_t i;
+
+    for ( i = 0; i < len; i++ )
+    {
+        if ( data[i] == a || data[i] == b )
+        {
+            break;
+        }
+    }
+
+    return i;
+}
+
+#if defined ( __x86_64__ )
+
+/* Find first byte equal to a or b sixteen bytes at a time */
+static size_t tftp_netascii_scan_sse2 ( const unsigned char *data, size_t len, int a, int b )
+{
+    size_t i;
+    unsigned int mask;
+    __m128i chunk;
+    __m128i va = _mm_set1_epi8 ( ( char ) a );
+    __m128i vb = _mm_set1_epi8 ( ( char ) b );
+
+    for ( i = 0; i + 16 <= len; i += 16 )
+    {
+        chunk = _mm_loadu_si128 ( ( const __m128i * ) ( data + i ) );
+        mask = _mm_movemask_epi8 ( _mm_or_si128 ( _mm_cmpeq_epi8 ( chunk, va ),
+                _mm_cmpeq_epi8 ( chunk, vb ) ) );
+
+        if ( mask )
+        {
+            return i + __builtin_ctz ( mask );
+        }
+    }
+
+    return i + tftp_netascii_scan_scalar ( data + i, len - i, a, b );
+}
+
+/* Find first byte equal to a or b thirty-two bytes at a time */
+__attribute__ ( ( target ( "avx2" ) ) )
+static size_t tftp_netascii_scan_avx2 ( const unsigned char *data, size_t len, int a, int b )
+{
+    size_t i;
+    unsigned int mask;
+    __m256i chunk;
+    __m256i va = _mm256_set1_epi8 ( ( char ) a );
+    __m256i vb = _mm256_set1_epi8 ( ( char ) b );
+
+    for ( i = 0; i + 32 <= len; i += 32 )
+    {
+        chunk = _mm256_loadu_si256 ( ( const __m256i * ) ( data + i ) );
+        mask = _mm256_movemask_epi8 ( _mm256_or_si256 ( _mm256_cmpeq_epi8 ( chunk, va ),
+                _mm256_cmpeq_epi8 ( chunk, vb ) ) );
+
+        if ( mask )
+        {
+            return i + __builtin_ctz ( mask );
+        }
+    }
+
+    if ( i == len || len < 32 )
+    {
+        return i + tftp_netascii_scan_sse2 ( data + i, len - i, a, b );
+    }
+
+    /* last chunk overlaps scanned bytes, their bits are shifted out */
+    chunk = _mm256_loadu_si256 ( ( const __m256i * ) ( data + len - 32 ) );
+    mask = ( unsigned int ) _mm256_movemask_epi8 ( _mm256_or_si256 ( _mm256_cmpeq_epi8 ( chunk,
+                va ), _mm256_cmpeq_epi8 ( chunk, vb ) ) ) >> ( i - ( len - 32 ) );
+
+    return mask ? i + __builtin_ctz ( mask ) : len;
+}
+
+#endif
+
+/* Get name of scanner */
+const char *tftp_netascii_name ( int kernel )
+{
+    return kernel >= 0 && kernel < TFTP_NETASCII_KERNELS ? tftp_netascii_names[kernel] : "none";
+}
+
+/* Check whether CPU supports scanner */
+int tftp_netascii_supported ( int kernel )
+{
+    switch ( kernel )
+    {
+    case TFTP_NETASCII_SCALAR:
+        return 1;
+#if defined ( __x86_64__ )
+    case TFTP_NETASCII_SSE2:
+        return 1;
+    case TFTP_NETASCII_AVX2:
+        __builtin_cpu_init (  );
+        return __builtin_cpu_supports ( "avx2" );
+#endif
+    }
+
+    return 0;
+}
+
+/* Use given scanner from now on, returns -1 if CPU does not support it */
+int tftp_netascii_select ( int kernel )
+{
+    if ( !tftp_netascii_supported ( kernel ) )
+    {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    __atomic_store_n ( &tftp_netascii_kernel, kernel, __ATOMIC_RELAXED );
+
+    return 0;
+}
+
+/* Get scanner in use, widest supported one is chosen first time */
+static tftp_netascii_scan_t tftp_netascii_scanner ( void )
+{
+    int kernel;
+
+    if ( ( kernel = __atomic_load_n ( &tftp_netascii_kernel, __ATOMIC_RELAXED ) ) < 0 )
+    {
+        kernel = TFTP_NETASCII_KERNELS - 1;
+        while ( !tftp_netascii_supported ( kernel ) )
+        {
+            kernel--;
+        }
+
+        __atomic_store_n ( &tftp_netascii_kernel, kernel, __ATOMIC_RELAXED );
+    }
+
+    switch ( kernel )
+    {
+#if defined ( __x86_64__ )
+    case TFTP_NETASCII_SSE2:
+        return tftp_netascii_scan_sse2;
+    case TFTP_NETASCII_AVX2:
+        return tftp_netascii_scan_avx2;
+#endif
+    default:
+        return tftp_netascii_scan_scalar;
+    }
+}
+
+/* Translate local text into netascii until block is full, returns length of block */
+size_t tftp_netascii_encode ( const unsigned char *src, size_t len, size_t *consumed,
+    unsigned char *dst, size_t limit, int *split )
+{
+    size_t n;
+    size_t i = 0;
+    size_t out = 0;
+    tftp_netascii_scan_t scan = tftp_netascii_scanner (  );
+
+    /* line end split by previous block is completed first */
+    if ( *split && limit )
+    {
+        dst[out++] = *split == '\n' ? '\n' : '\0';
+        *split = 0;
+    }
+
+    while ( i < len && out < limit )
+    {
+        /* text between line ends is copied as it is */
+        n = scan ( src + i, len - i, '\n', '\r' );
+        if ( n > limit - out )
+        {
+            n = limit - out;
+        }
+
+        memcpy ( dst + out, src + i, n );
+        i += n;
+        out += n;
+
+        if ( i == len || out == limit )
+        {
+            break;
+        }
+
+        /* LF becomes CR LF and bare CR becomes CR NUL */
+        dst[out++] = '\r';
+
+        if ( out < limit )
+        {
+            dst[out++] = src[i] == '\n' ? '\n' : '\0';
+        } else
+        {
+            *split = src[i];
+        }
+
+        i++;
+    }
+
+    *consumed = i;
+
+    return out;
+}
+
+/* Translate netascii block into local text, dst holds len + 1 bytes; returns its length */
+size_t tftp_netascii_decode ( const unsigned char *src, size_t len, unsigned char *dst,
+    int *cr )
+{
+    size_t n;
+    size_t i = 0;
+    size_t out = 0;
+    tftp_netascii_scan_t scan = tftp_netascii_scanner (  );
+
+    /* CR ending previous block pairs with first byte of this one */
+    if ( *cr && len )
+    {
+        *cr = 0;
+        dst[out++] = src[0] == '\n' ? '\n' : '\r';
+
+        if ( src[0] == '\n' || src[0] == '\0' )
+        {
+            i++;
+        }
+    }
+
+    while ( i < len )
+    {
+        n = scan ( src + i, len - i, '\r', '\r' );
+        memcpy ( dst + out, src + i, n );
+        i += n;
+        out += n;
+
+        if ( i == len )
+        {
+            break;
+        }
+
+        if ( i + 1 == len )
+        {
+            *cr = 1;
+            break;
+        }
+
+        /* CR LF becomes LF and CR NUL becomes CR, stray CR is kept */
+        dst[out++] = src[i + 1] == '\n' ? '\n' : '\r';
+        i += src[i + 1] == '\n' || src[i + 1] == '\0' ? 2 : 1;
+    }
+
+    return out;
+}
@@ -0,0 +1,135 @@
+/* ------------------------------------------------------------------
+ * Little Tftp - Read-Ahead Buffer
+ * ------------------------------------------------------------------ */
+
+#include "rbuf.h"
+
+/* Initialize read-ahead buffer of file, memory is allocated on first read */
+void tftp_rbuf_init ( struct tftp_rbuf *rbuf, int fd )
+{
+    memset ( rbuf, '\0', sizeof ( struct tftp_rbuf ) );
+    rbuf->fd = fd;
+}
+
+/* Size chunks read at once, file is then hinted to be read sequentially */
+void tftp_rbuf_setup ( struct tftp_rbuf *rbuf, size_t size )
+{
+    if ( size < TFTP_RBUF_MIN )
+    {
+        size = TFTP_RBUF_MIN;
+
+    } else if ( size > TFTP_RBUF_MAX )
+    {
+        size = TFTP_RBUF_MAX;
+    }
+
+    rbuf->size = size;
+
+    /* kernel doubles its own read-ahead window */
+    posix_fadvise ( rbuf->fd, 0, 0, POSIX_FADV_SEQUENTIAL );
+}
+
+/* Ask kernel to read chunk following offset in background, file needs no buffer then */
+void tftp_rbuf_advise ( struct tftp_rbuf *rbuf, unsigned long long offset )
+{
+    unsigned long long start;
+
+    /* hinted range is renewed once less than a chunk is left ahead */
+    if ( offset + rbuf->size <= rbuf->advised )
+    {
+        return;
+    }
+
+    start = rbuf->advised > offset ? rbuf->advised : offset;
+    rbuf->advised = offset + 2 * rbuf->size;
+
+    posix_fadvise ( rbuf->fd, ( off_t ) start, ( off_t ) ( rbuf->advised - start ),
+        POSIX_FADV_WILLNEED );
+}
+
+/* Read chunk starting at offset with as few calls as possible */
+static int tftp_rbuf_fill ( struct tftp_rbuf *rbuf, unsigned long long offset )
+{
+    ssize_t len;
+
+    rbuf->offset = offset;
+    rbuf->len = 0;
+    rbuf->eof = 0;
+
+    while ( rbuf->len < rbuf->size )
+    {
+        if ( ( len = pread ( rbuf->fd, rbuf->data + rbuf->len, rbuf->size - rbuf->len,
+                    ( off_t ) ( offset + rbuf->len ) ) ) < 0 )
+        {
+            if ( errno == EINTR )
+            {
+                continue;
+            }
+            rbuf->len = 0;
+            return -1;
+        }
+
+        if ( !len )
+        {
+            rbuf->eof = 1;
+            break;
+        }
+
+        rbuf->len += len;
+    }
+
+    return 0;
+}
+
+/* Copy file data at offset from buffer, chunk holding it is read first; returns length */
+ssize_t tftp_rbuf_read ( struct tftp_rbuf *rbuf, void *dst, size_t len,
+    unsigned long long offset )
+{
+    size_t avail;
+
+    if ( !rbuf->size )
+    {
+        tftp_rbuf_setup ( rbuf, len );
+    }
+
+    if ( !rbuf->data && !( rbuf->data = ( unsigned char * ) malloc ( rbuf->size ) ) )
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    /* block lies outside of chunk, end of file is not read again */
+    if ( offset < rbuf->offset || offset > rbuf->offset + rbuf->len
+        || ( offset + len > rbuf->offset + rbuf->len && !rbuf->eof ) )
+    {
+        if ( tftp_rbuf_fill ( rbuf, offset ) < 0 )
+        {
+            return -1;
+        }
+
+        /* next chunk is on its way while this one is sent */
+        if ( !rbuf->eof )
+        {
+            posix_fadvise ( rbuf->fd, ( off_t ) ( offset + rbuf->len ), ( off_t ) rbuf->size,
+                POSIX_FADV_WILLNEED );
+        }
+    }
+
+    avail = rbuf->offset + rbuf->len - offset;
+    if ( len > avail )
+    {
+        len = avail;
+    }
+
+    memcpy ( dst, rbuf->data + ( offset - rbuf->offset ), len );
+
+    return len;
+}
+
+/* Release read-ahead buffer */
+void tftp_rbuf_free ( struct tftp_rbuf *rbuf )
+{
+    free ( rbuf->data );
+    rbuf->data = NULL;
+    rbuf->len = 0;
+}
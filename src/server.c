@@ -7,7 +7,12 @@
 /* Show program usage message */
 static void show_usage ( void )
 {
-    fprintf ( stderr, "usage: tftpd addr port [root]\n" );
+    fprintf ( stderr,
+        "usage: tftpd [-j workers] [-c cache_size[k|m|g]] [-p preload_list] [-t min:max]\n"
+        "             [-m group:port] [-s none|end|sync_period[k|m|g]] [-u]\n"
+        "             [-M [metrics_addr:]port|metrics_path] [-P] [-l error|info|debug|trace]\n"
+        "             [-F fault_spec] [-r rate[:burst]] [-R rate[:burst][/prefix]]\n"
+        "             [-g rate[:burst]] addr port [root]\n" );
 }
 
 /* Format IPv4 address to string */
@@ -99,155 +104,590 @@ static int tftp_validate_path ( const char *path )
     return strchr ( path, '/' ) != path && strstr ( path, "../" ) == NULL;
 }
 
+/* Negotiate options requested after transfer mode */
+static void tftp_negotiate_options ( const struct tftp_server *server,
+    char params[][TFTP_PARAMS_STRLIMIT], size_t nparams, struct tftp_opts *opts )
+{
+    size_t i;
+    int status;
+
+    tftp_opts_init ( opts );
+
+    for ( i = 2; i + 1 < nparams; i += 2 )
+    {
+        if ( ( status = tftp_opts_parse ( opts, params[i], params[i + 1] ) ) < 0 )
+        {
+            tftp_log ( TFTP_LOG_DEBUG, "[lsrv] invalid option ignored: %s=%s\n", params[i],
+                params[i + 1] );
+
+        } else if ( status > 0 )
+        {
+            tftp_log ( TFTP_LOG_DEBUG, "[lsrv] unknown option ignored: %s\n", params[i] );
+        }
+    }
+
+    /* print negotiated block size */
+    if ( opts->mask & TFTP_OPTION_BLKSIZE )
+    {
+        tftp_log ( TFTP_LOG_DEBUG, "[lsrv] blksize : %lu\n", ( unsigned long ) opts->blksize );
+    }
+
+    /* print negotiated window size */
+    if ( opts->mask & TFTP_OPTION_WINDOWSIZE )
+    {
+        tftp_log ( TFTP_LOG_DEBUG, "[lsrv] windowsize : %u\n", opts->windowsize );
+    }
+
+    /* timeout cannot be negotiated down, leave it unacknowledged if out of limits */
+    if ( opts->mask & TFTP_OPTION_TIMEOUT && ( opts->timeout < server->timeout_min
+            || opts->timeout > server->timeout_max ) )
+    {
+        tftp_log ( TFTP_LOG_DEBUG, "[lsrv] timeout ignored, %u not within %u..%u seconds\n",
+            opts->timeout, server->timeout_min, server->timeout_max );
+        opts->mask &= ~TFTP_OPTION_TIMEOUT;
+        opts->timeout = 0;
+    }
+
+    /* print negotiated timeout */
+    if ( opts->mask & TFTP_OPTION_TIMEOUT )
+    {
+        tftp_log ( TFTP_LOG_DEBUG, "[lsrv] timeout : %u\n", opts->timeout );
+    }
+
+    /* print announced transfer size */
+    if ( opts->mask & TFTP_OPTION_TSIZE )
+    {
+        tftp_log ( TFTP_LOG_DEBUG, "[lsrv] tsize : %llu\n", opts->tsize );
+    }
+
+    /* print requested resume offset */
+    if ( opts->mask & TFTP_OPTION_OFFSET )
+    {
+        tftp_log ( TFTP_LOG_DEBUG, "[lsrv] offset : %llu\n", opts->offset );
+    }
+
+    /* print multicast request */
+    if ( opts->mask & TFTP_OPTION_MULTICAST )
+    {
+        tftp_log ( TFTP_LOG_DEBUG, "[lsrv] multicast requested\n" );
+    }
+}
+
+/* Check if file system holding path has room for given number of bytes, blocks of file
+   replaced by truncation count as free */
+static int tftp_check_space ( const char *path, unsigned long long size, int truncate )
+{
+    char *slash;
+    char dir[TFTP_PARAMS_STRLIMIT];
+    unsigned long long avail;
+    struct statvfs st;
+    struct stat fst;
+
+    /* file does not exist yet, look at its directory */
+    strncpy ( dir, path, sizeof ( dir ) - 1 );
+    dir[sizeof ( dir ) - 1] = '\0';
+
+    if ( ( slash = strrchr ( dir, '/' ) ) )
+    {
+        *slash = '\0';
+    } else
+    {
+        strcpy ( dir, "." );
+    }
+
+    if ( statvfs ( dir, &st ) < 0 )
+    {
+        return -1;
+    }
+
+    avail = ( unsigned long long ) st.f_bavail * st.f_frsize;
+
+    /* st_blocks is counted in 512 byte units whatever the block size */
+    if ( truncate && stat ( path, &fst ) >= 0 && S_ISREG ( fst.st_mode ) )
+    {
+        avail += ( unsigned long long ) fst.st_blocks * 512;
+    }
+
+    if ( size > avail )
+    {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Publish transfer progress made since last report to metrics */
+static void tftp_report_transfer ( struct tftp_server *server, struct tftp_xfer *xfer )
+{
+    struct tftp_metrics *metrics = server->metrics;
+
+    /* first DATA block sent or received ends request latency */
+    if ( !xfer->first_data && ( xfer->sent || xfer->received ) )
+    {
+        xfer->first_data = 1;
+        tftp_metrics_observe ( &metrics->first_data, tftp_time_usec (  ) - xfer->started );
+    }
+
+    if ( xfer->nbytes > xfer->reported_bytes )
+    {
+        tftp_metrics_add ( xfer->role == TFTP_XFER_ROLE_SEND ? &metrics->bytes_sent
+            : &metrics->bytes_received, xfer->nbytes - xfer->reported_bytes );
+        xfer->reported_bytes = xfer->nbytes;
+    }
+
+    if ( xfer->retx.retransmits != xfer->reported_retransmits )
+    {
+        tftp_metrics_add ( &metrics->retransmits,
+            xfer->retx.retransmits - xfer->reported_retransmits );
+        xfer->reported_retransmits = xfer->retx.retransmits;
+    }
+
+    if ( xfer->retx.duplicates != xfer->reported_duplicates )
+    {
+        tftp_metrics_add ( &metrics->duplicates,
+            xfer->retx.duplicates - xfer->reported_duplicates );
+        xfer->reported_duplicates = xfer->retx.duplicates;
+    }
+
+    if ( xfer->retx.timeouts != xfer->reported_timeouts )
+    {
+        tftp_metrics_add ( &metrics->timeouts, xfer->retx.timeouts - xfer->reported_timeouts );
+        xfer->reported_timeouts = xfer->retx.timeouts;
+    }
+
+    if ( xfer->shape_delay != xfer->reported_shape_delay )
+    {
+        tftp_metrics_add ( &metrics->shaped_usec, xfer->shape_delay - xfer->reported_shape_delay );
+        xfer->reported_shape_delay = xfer->shape_delay;
+    }
+}
+
+/* Publish throttling seen by worker scheduler since last report */
+static void tftp_report_shaping ( struct tftp_server *server )
+{
+    unsigned int i;
+
+    for ( i = 0; i < TFTP_SHAPE_SCOPES; i++ )
+    {
+        if ( server->shaper.throttled[i] )
+        {
+            tftp_metrics_add ( &server->metrics->throttled[i], server->shaper.throttled[i] );
+            server->shaper.throttled[i] = 0;
+        }
+    }
+}
+
+/* Release finished transfer and report its status */
+static void tftp_finish_transfer ( struct tftp_server *server, struct tftp_xfer *xfer )
+{
+    unsigned long long elapsed;
+    char addrbuf[32];
+    struct tftp_cache_entry *entry;
+
+    tftp_loop_remove ( &server->loop, xfer );
+    tftp_shaper_remove ( &server->shaper, xfer );
+
+    /* active gauge goes down by one */
+    tftp_report_transfer ( server, xfer );
+    tftp_metrics_add ( &server->metrics->active, ( unsigned long long ) -1 );
+    elapsed = tftp_time_usec (  ) - xfer->started;
+
+    if ( xfer->state == TFTP_XFER_STATE_DONE )
+    {
+        tftp_metrics_add ( &server->metrics->succeeded, 1 );
+        tftp_metrics_observe ( &server->metrics->throughput,
+            elapsed ? xfer->nbytes * 1000000ULL / elapsed : xfer->nbytes );
+    } else
+    {
+        tftp_metrics_add ( &server->metrics->failed, 1 );
+        tftp_metrics_add ( &server->metrics->errors[tftp_errno_to_code ( xfer->status )], 1 );
+    }
+
+    /* end progress line */
+    if ( xfer->progress_at )
+    {
+        tftp_log ( TFTP_LOG_INFO, "\n" );
+    }
+
+    inet_ntoa_s ( xfer->peer.sin_addr, addrbuf, sizeof ( addrbuf ) );
+
+    tftp_log ( TFTP_LOG_INFO, "[lsrv] access: peer=%s:%u op=%s path=%s status=%s error=%i "
+        "bytes=%llu duration_ms=%llu retransmits=%llu timeouts=%llu duplicates=%llu "
+        "shaped_ms=%llu\n",
+        addrbuf, ntohs ( xfer->peer.sin_port ), xfer->role == TFTP_XFER_ROLE_SEND ? "read"
+        : "write", xfer->path, xfer->state == TFTP_XFER_STATE_DONE ? "success" : "failure",
+        xfer->state == TFTP_XFER_STATE_DONE ? 0 : xfer->status,
+        xfer->opts.offset + xfer->nbytes, elapsed / 1000, xfer->retx.retransmits,
+        xfer->retx.timeouts, xfer->retx.duplicates, xfer->shape_delay / 1000 );
+
+    tftp_log ( TFTP_LOG_DEBUG, "[lsrv] %s: batching: sent %llu packets (%llu segmented) "
+        "in %llu calls, received %llu packets in %llu calls\n", xfer->path, xfer->io.tx_packets,
+        xfer->io.tx_segmented, xfer->io.tx_calls, xfer->io.rx_packets, xfer->io.rx_calls );
+
+    if ( xfer->role == TFTP_XFER_ROLE_RECV )
+    {
+        tftp_log ( TFTP_LOG_DEBUG, "[lsrv] %s: stored in %llu writes, %llu syncs\n",
+            xfer->path, xfer->wbuf.writes, xfer->wbuf.syncs );
+    }
+
+    tftp_io_stats_add ( &server->io, &xfer->io );
+
+    /* cached contents outlive queued packets */
+    entry = xfer->cached;
+    tftp_xfer_free ( xfer );
+
+    if ( entry )
+    {
+        tftp_cache_release ( server->cache, entry );
+    }
+}
+
+/* Reschedule transfer or release it once finished */
+static void tftp_settle_transfer ( struct tftp_server *server, struct tftp_xfer *xfer )
+{
+    /* send everything queued during this iteration at once */
+    tftp_loop_flush ( &server->loop, xfer );
+
+    if ( xfer->state == TFTP_XFER_STATE_ACTIVE )
+    {
+        tftp_report_transfer ( server, xfer );
+        tftp_loop_update ( &server->loop, xfer );
+    } else
+    {
+        tftp_finish_transfer ( server, xfer );
+    }
+}
+
+/* Attach cached file contents to transfer if file is cacheable */
+static void tftp_attach_cache ( struct tftp_server *server, struct tftp_xfer *xfer )
+{
+    struct tftp_cache_entry *entry;
+    struct tftp_cache_stats stats;
+
+    if ( ( entry = tftp_cache_acquire ( server->cache, xfer->fd ) ) )
+    {
+        tftp_xfer_attach ( xfer, entry, entry->data, entry->size );
+    }
+
+    tftp_cache_get_stats ( server->cache, &stats );
+    tftp_log ( TFTP_LOG_DEBUG,
+        "[lsrv] cache: %s, %llu hits, %llu misses, %llu evictions, %lu of %lu bytes used\n",
+        entry ? "serving from memory" : "serving from file", stats.hits, stats.misses,
+        stats.evictions, ( unsigned long ) stats.used, ( unsigned long ) stats.budget );
+}
+
+/* Allocate transfer for accepted request and register it in event loop */
+static int tftp_start_transfer ( struct tftp_server *server, int fd, int role, int mode,
+    const char *path, const struct tftp_opts *opts )
+{
+    int sock;
+    int status;
+    struct tftp_xfer *xfer;
+
+    /* allocate transfer socket, its port becomes transfer ID; multicast session
+       talks to several members */
+    if ( ( sock = opts->mask & TFTP_OPTION_MULTICAST
+                ? tftp_xfer_mcast_socket ( &server->sess.addr )
+                : tftp_xfer_socket ( &server->sess.addr, &server->sess.saddr ) ) < 0 )
+    {
+        status = errno;
+        close ( fd );
+        tftp_log ( TFTP_LOG_ERROR, "[lsrv] failed to allocate socket: %i\n", status );
+        return status;
+    }
+
+    /* allocate transfer structure */
+    if ( !( xfer =
+            tftp_xfer_new ( sock, fd, role, &server->sess.saddr, opts,
+                server->sess.progname ) ) )
+    {
+        close ( sock );
+        close ( fd );
+        return ENOMEM;
+    }
+
+    strncpy ( xfer->path, path, sizeof ( xfer->path ) - 1 );
+
+    if ( mode == TFTP_TRANSFER_MODE_NETASCII && tftp_xfer_netascii ( xfer ) < 0 )
+    {
+        status = errno;
+        tftp_xfer_free ( xfer );
+        return status;
+    }
+
+    /* serve hot files from memory shared by all workers */
+    if ( role == TFTP_XFER_ROLE_SEND && server->cache )
+    {
+        tftp_attach_cache ( server, xfer );
+    }
+
+    /* keep answering retransmitted final DATA until client is gone */
+    xfer->dally = role == TFTP_XFER_ROLE_RECV;
+    tftp_wbuf_policy ( &xfer->wbuf, server->sync_policy, server->sync_period );
+
+    /* rate limits apply to both directions */
+    if ( server->shaper.shape->enabled )
+    {
+        tftp_shaper_attach ( &server->shaper, xfer );
+    }
+
+    /* register transfer in event loop */
+    if ( tftp_loop_add ( &server->loop, xfer ) < 0 )
+    {
+        status = errno;
+        tftp_xfer_free ( xfer );
+        return status;
+    }
+
+    tftp_log ( TFTP_LOG_DEBUG, "[lsrv] transfer started.\n" );
+    tftp_metrics_add ( &server->metrics->active, 1 );
+
+    /* send first packet from transfer socket */
+    tftp_xfer_start ( xfer );
+    tftp_settle_transfer ( server, xfer );
+
+    return 0;
+}
+
 /* Handle write request */
-static int tftp_handle_wrq ( struct tftp_sess *sess, const unsigned char *request, size_t len )
+static int tftp_handle_wrq ( struct tftp_server *server, const unsigned char *request,
+    size_t len )
 {
     int fd;
+    int status;
     int transfer_mode = TFTP_TRANSFER_MODE_OCTET;
-    unsigned short block = 0;
     size_t nparams;
-    size_t nblocks = 0;
-    socklen_t slen;
+    struct tftp_opts opts;
+    struct stat st;
     char params[TFTP_PARAMS_NLIMIT][TFTP_PARAMS_STRLIMIT];
-    unsigned char buffer[65536];
 
     /* split parameters */
     if ( ( ssize_t ) ( nparams =
             tftp_params_split ( request + 2, len - 2, ( char * ) params, TFTP_PARAMS_NLIMIT,
                 TFTP_PARAMS_STRLIMIT ) ) < 0 )
     {
-        fprintf ( stderr, "[lsrv] failed to split params: %i\n", errno );
+        tftp_log ( TFTP_LOG_ERROR, "[lsrv] failed to split params: %i\n", errno );
         return errno;
     }
 
     /* verify params count */
     if ( !nparams )
     {
-        fprintf ( stderr, "[lsrv] file path not found in request.\n" );
+        tftp_log ( TFTP_LOG_ERROR, "[lsrv] file path not found in request.\n" );
         return ENODATA;
     }
 
     /* print file path */
-    printf ( "[lsrv] path : %s\n", params[0] );
+    tftp_log ( TFTP_LOG_DEBUG, "[lsrv] path : %s\n", params[0] );
 
     /* parse transfer mode */
     if ( nparams == 1 )
     {
-        printf ( "[lsrv] assuming octet mode\n" );
+        tftp_log ( TFTP_LOG_DEBUG, "[lsrv] assuming octet mode\n" );
 
     } else
     {
-        if ( ( transfer_mode = tftp_parse_transfer_mode ( params[1] ) ) < 0
-            || transfer_mode != TFTP_TRANSFER_MODE_OCTET )
+        if ( ( transfer_mode = tftp_parse_transfer_mode ( params[1] ) ) < 0 )
         {
-            printf ( "[lsrv] unsupported mode: %s\n", params[1] );
+            tftp_log ( TFTP_LOG_DEBUG, "[lsrv] unsupported mode: %s\n", params[1] );
             return EINVAL;
         }
 
-        printf ( "[lsrv] mode : %s\n",
+        tftp_log ( TFTP_LOG_DEBUG, "[lsrv] mode : %s\n",
             transfer_mode == TFTP_TRANSFER_MODE_OCTET ? "octet" : "netascii" );
     }
 
+    /* negotiate transfer options */
+    tftp_negotiate_options ( server, params, nparams, &opts );
+
+    /* translated text has no byte offset to resume at */
+    if ( transfer_mode == TFTP_TRANSFER_MODE_NETASCII )
+    {
+        opts.mask &= ~TFTP_OPTION_OFFSET;
+    }
+
     /* validate path */
     if ( !tftp_validate_path ( params[0] ) )
     {
-        fprintf ( stderr, "[lsrv] path not allowed: %i\n", errno );
+        tftp_log ( TFTP_LOG_ERROR, "[lsrv] path not allowed: %i\n", errno );
         return EACCES;
     }
 
-    /* open file for writing */
-    if ( ( fd = open ( params[0], O_CREAT | O_WRONLY | O_TRUNC, 0644 ) ) < 0 )
+    /* resume partial upload from its current size */
+    if ( opts.mask & TFTP_OPTION_OFFSET )
+    {
+        opts.offset = stat ( params[0], &st ) >= 0 && S_ISREG ( st.st_mode ) ? st.st_size : 0;
+        tftp_log ( TFTP_LOG_DEBUG, "[lsrv] resuming at offset : %llu\n", opts.offset );
+    }
+
+    /* refuse upload that cannot fit, checked before existing file is truncated */
+    if ( opts.mask & TFTP_OPTION_TSIZE && opts.tsize > opts.offset
+        && tftp_check_space ( params[0], opts.tsize - opts.offset,
+            !( opts.mask & TFTP_OPTION_OFFSET ) ) < 0 && errno == ENOSPC )
+    {
+        tftp_log ( TFTP_LOG_ERROR, "[lsrv] not enough space for %llu bytes\n", opts.tsize );
+        return ENOSPC;
+    }
+
+    /* open file for writing, partial upload is kept */
+    if ( ( fd = open ( params[0], O_CREAT | O_WRONLY
+                | ( opts.mask & TFTP_OPTION_OFFSET ? 0 : O_TRUNC ), 0644 ) ) < 0 )
     {
-        fprintf ( stderr, "[lsrv] failed to open file: %i\n", errno );
+        tftp_log ( TFTP_LOG_ERROR, "[lsrv] failed to open file: %i\n", errno );
         return errno;
     }
 
-    if ( tftp_send_ack_packet ( sess, block++ ) < 0 )
+    /* allocate whole file at once instead of block by block */
+    if ( opts.mask & TFTP_OPTION_TSIZE && tftp_preallocate ( fd, opts.tsize ) < 0 )
     {
+        status = errno;
         close ( fd );
-        return errno;
+        tftp_log ( TFTP_LOG_ERROR, "[lsrv] failed to reserve %llu bytes: %i\n", opts.tsize,
+            status );
+        return status;
     }
 
-    printf ( "[lsrv] transfer acknowledged.\n" );
+    return tftp_start_transfer ( server, fd, TFTP_XFER_ROLE_RECV, transfer_mode, params[0],
+        &opts );
+}
 
-    do
+/* Find running multicast session of file that can serve options of new member */
+static struct tftp_xfer *tftp_find_session ( const struct tftp_server *server, const char *path,
+    const struct tftp_opts *opts )
+{
+    size_t i;
+    struct tftp_xfer *xfer;
+
+    for ( i = 0; i < server->loop.nxfers; i++ )
     {
-        /* await DATA packet */
-        slen = sizeof ( sess->saddr );
-        if ( ( ssize_t ) ( len =
-                recvfrom ( sess->sock, buffer, sizeof ( buffer ), 0,
-                    ( struct sockaddr * ) &sess->saddr, &slen ) ) < 0 )
+        xfer = server->loop.heap[i];
+
+        /* member cannot be sent options it did not request or larger than requested */
+        if ( xfer->members && xfer->state == TFTP_XFER_STATE_ACTIVE
+            && !strcmp ( xfer->path, path ) && !( xfer->opts.mask & ~opts->mask )
+            && xfer->opts.blksize <= opts->blksize && xfer->opts.windowsize <= opts->windowsize
+            && ( !( xfer->opts.mask & TFTP_OPTION_TIMEOUT )
+                || xfer->opts.timeout == opts->timeout ) )
         {
-            close ( fd );
-            sess->exit_flag = 1;
-            fprintf ( stderr, "\n[lsrv] failed to receive data: %i\n", errno );
-            return errno;
+            return xfer;
         }
+    }
 
-        /* assert packet size */
-        if ( !tftp_packet_check_length ( sess->progname, 4, len ) )
-        {
-            close ( fd );
-            return errno;
-        }
+    return NULL;
+}
 
-        /* opcode must be DATA */
-        if ( tfp_load_ushort_ns ( buffer ) != TFTP_OPCODE_DATA )
-        {
-            tftp_dump_packet ( sess->progname, buffer, len );
-            fprintf ( stderr, "\n[lsrv] expected an ACK packet.\n" );
-            continue;
-        }
+/* Add client to multicast session of requested file or start new session */
+static int tftp_handle_multicast ( struct tftp_server *server, int fd, const char *path,
+    struct tftp_opts *opts, const struct stat *st )
+{
+    int status;
+    char addrbuf[32];
+    struct tftp_xfer *xfer;
 
-        /* validate data block number */
-        if ( tfp_load_ushort_ns ( buffer + 2 ) != block )
-        {
-            fprintf ( stderr, "\n[lsrv] DATA: expected block #%u, got #%u - ignored.\n", block,
-                tfp_load_ushort_ns ( buffer + 2 ) );
-            continue;
-        }
+    /* block numbers of multicast session never wrap around, larger files go unicast */
+    if ( !server->mcast.sin_port || ( unsigned long long ) st->st_size / opts->blksize + 1
+        > TFTP_MCAST_BLOCKS_MAX )
+    {
+        tftp_log ( TFTP_LOG_DEBUG, "[lsrv] multicast %s, serving unicast\n",
+            server->mcast.sin_port ? "file too large" : "disabled" );
+        opts->mask &= ~TFTP_OPTION_MULTICAST;
+        return tftp_start_transfer ( server, fd, TFTP_XFER_ROLE_SEND, TFTP_TRANSFER_MODE_OCTET,
+            path, opts );
+    }
 
-        /* write data to file */
-        if ( write ( fd, buffer + 4, len - 4 ) < 0 )
-        {
-            close ( fd );
-            fprintf ( stderr, "\n[lsrv] failed to write file: %i\n", errno );
-            return errno;
-        }
+    /* whole file goes to group, it cannot be resumed */
+    opts->mask &= ~TFTP_OPTION_OFFSET;
+    opts->offset = 0;
+
+    if ( ( xfer = tftp_find_session ( server, path, opts ) ) )
+    {
+        close ( fd );
 
-        /* send ACK packet with block set to zero */
-        if ( tftp_send_ack_packet ( sess, block++ ) < 0 )
+        if ( ( status = tftp_xfer_join ( xfer, &server->sess.saddr ) ) )
         {
-            close ( fd );
-            return errno;
+            return status;
         }
 
-        /* show progress */
-        printf ( "\r[lsrv] progress: received %lu blocks", ( unsigned long ) ++nblocks );
+        tftp_log ( TFTP_LOG_DEBUG, "[lsrv] member joined session, %lu members\n",
+            ( unsigned long ) xfer->nmembers );
+        tftp_settle_transfer ( server, xfer );
+        return 0;
+    }
+
+    /* sessions take group ports in turn */
+    opts->mcast_addr = server->mcast.sin_addr;
+    opts->mcast_port = ntohs ( server->mcast.sin_port )
+        + __sync_fetch_and_add ( server->mcast_seq, 1 ) % TFTP_MCAST_PORTS;
+    opts->mcast_master = 1;
+
+    inet_ntoa_s ( opts->mcast_addr, addrbuf, sizeof ( addrbuf ) );
+    tftp_log ( TFTP_LOG_DEBUG, "[lsrv] multicast group : %s:%u\n", addrbuf, opts->mcast_port );
+
+    return tftp_start_transfer ( server, fd, TFTP_XFER_ROLE_SEND, TFTP_TRANSFER_MODE_OCTET, path,
+        opts );
+}
+
+/* Queue multicast request for worker owning sessions */
+static int tftp_hand_over ( struct tftp_server *server, const unsigned char *request,
+    size_t len )
+{
+    uint64_t value = 1;
+    struct tftp_handoff *handoff;
+    struct tftp_hub *hub = server->hub;
+
+    if ( !( handoff = ( struct tftp_handoff * ) malloc ( sizeof ( struct tftp_handoff ) + len ) ) )
+    {
+        return ENOMEM;
+    }
+
+    handoff->peer = server->sess.saddr;
+    handoff->len = len;
+    handoff->request = ( unsigned char * ) ( handoff + 1 );
+    handoff->next = NULL;
+    memcpy ( handoff->request, request, len );
+
+    pthread_mutex_lock ( &hub->lock );
+
+    /* client retries once owner catches up */
+    if ( hub->nqueued == TFTP_HANDOFF_LIMIT )
+    {
+        pthread_mutex_unlock ( &hub->lock );
+        free ( handoff );
+        return EBUSY;
+    }
+
+    if ( hub->queue_tail )
+    {
+        hub->queue_tail->next = handoff;
+    } else
+    {
+        hub->queue = handoff;
+    }
+    hub->queue_tail = handoff;
+    hub->nqueued++;
 
-    } while ( len == 4 + TFTP_BLOCKSIZE );
+    pthread_mutex_unlock ( &hub->lock );
 
-    /* put new line */
-    putchar ( '\n' );
+    if ( write ( hub->wake, &value, sizeof ( value ) ) < 0 )
+    {
+        tftp_log ( TFTP_LOG_ERROR, "[lsrv] failed to wake session owner: %i\n", errno );
+    }
 
-    /* close file fd */
-    close ( fd );
+    tftp_log ( TFTP_LOG_DEBUG, "[lsrv] multicast request handed over\n" );
 
     return 0;
 }
 
 /* Handle read request */
-static int tftp_handle_rrq ( struct tftp_sess *sess, const unsigned char *request, size_t len )
+static int tftp_handle_rrq ( struct tftp_server *server, const unsigned char *request,
+    size_t len )
 {
     int fd;
     int transfer_mode = TFTP_TRANSFER_MODE_OCTET;
-    unsigned short block = 1;
     size_t nparams;
-    size_t nblocks = 0;
-    size_t lastread;
-    socklen_t slen;
-    struct ack_packet ack;
-    unsigned char buffer[4096];
+    struct tftp_opts opts;
+    struct stat st;
     char params[TFTP_PARAMS_NLIMIT][TFTP_PARAMS_STRLIMIT];
 
     /* split parameters */
@@ -255,42 +695,50 @@ static int tftp_handle_rrq ( struct tftp_sess *sess, const unsigned char *reques
             tftp_params_split ( request + 2, len - 2, ( char * ) params, TFTP_PARAMS_NLIMIT,
                 TFTP_PARAMS_STRLIMIT ) ) < 0 )
     {
-        fprintf ( stderr, "[lsrv] failed to split params: %i\n", errno );
+        tftp_log ( TFTP_LOG_ERROR, "[lsrv] failed to split params: %i\n", errno );
         return errno;
     }
 
     /* verify params count */
     if ( !nparams )
     {
-        fprintf ( stderr, "[lsrv] file path not found in request.\n" );
+        tftp_log ( TFTP_LOG_ERROR, "[lsrv] file path not found in request.\n" );
         return ENODATA;
     }
 
     /* print file path */
-    printf ( "[lsrv] path : %s\n", params[0] );
+    tftp_log ( TFTP_LOG_DEBUG, "[lsrv] path : %s\n", params[0] );
 
     /* parse transfer mode */
     if ( nparams == 1 )
     {
-        printf ( "[lsrv] assuming octet mode\n" );
+        tftp_log ( TFTP_LOG_DEBUG, "[lsrv] assuming octet mode\n" );
 
     } else
     {
         if ( ( transfer_mode = tftp_parse_transfer_mode ( params[1] ) ) < 0 )
         {
-            printf ( "[lsrv] unsupported mode: %s\n",
-                transfer_mode == TFTP_TRANSFER_MODE_OCTET ? "octet" : "netascii" );
+            tftp_log ( TFTP_LOG_DEBUG, "[lsrv] unsupported mode: %s\n", params[1] );
             return EINVAL;
         }
 
-        printf ( "[lsrv] mode : %s\n",
+        tftp_log ( TFTP_LOG_DEBUG, "[lsrv] mode : %s\n",
             transfer_mode == TFTP_TRANSFER_MODE_OCTET ? "octet" : "netascii" );
     }
 
+    /* negotiate transfer options */
+    tftp_negotiate_options ( server, params, nparams, &opts );
+
+    /* sessions live on first worker, so clients steered elsewhere still share them */
+    if ( opts.mask & TFTP_OPTION_MULTICAST && server->hub && server->id )
+    {
+        return tftp_hand_over ( server, request, len );
+    }
+
     /* validate path */
     if ( !tftp_validate_path ( params[0] ) )
     {
-        fprintf ( stderr, "[lsrv] path not allowed: %i\n", errno );
+        tftp_log ( TFTP_LOG_ERROR, "[lsrv] path not allowed: %i\n", errno );
         return EACCES;
     }
 
@@ -298,115 +746,53 @@ static int tftp_handle_rrq ( struct tftp_sess *sess, const unsigned char *reques
     /* open file for reading */
     if ( ( fd = open ( params[0], O_RDONLY ) ) < 0 )
     {
-        fprintf ( stderr, "[lsrv] failed to open file: %i\n", errno );
+        tftp_log ( TFTP_LOG_ERROR, "[lsrv] failed to open file: %i\n", errno );
         return errno;
     }
 
-    /* send file data */
-    for ( lastread = 0, nblocks = 0;
-        ( ssize_t ) ( len = read ( fd, buffer + 4, TFTP_BLOCKSIZE ) ) > 0
-        || lastread == TFTP_BLOCKSIZE; block++ )
+    /* size of special files and translated text is not known up front, blocks of translated
+       text are produced in order */
+    if ( fstat ( fd, &st ) < 0 || !S_ISREG ( st.st_mode )
+        || transfer_mode == TFTP_TRANSFER_MODE_NETASCII )
     {
-        /* save last read data count */
-        lastread = len;
-
-        /* prepare data packet */
-        tfp_store_ushort_ns ( buffer, TFTP_OPCODE_DATA );
-        tfp_store_ushort_ns ( buffer + 2, block );
-
-        /* send DATA pakcet */
-        if ( sendto_autoretry ( sess->sock, buffer, 4 + len, 0, ( struct sockaddr * ) &sess->saddr,
-                sizeof ( sess->saddr ) ) < 0 )
-        {
-            close ( fd );
-            sess->exit_flag = 1;
-            fprintf ( stderr, "\n[lsrv] failed to send data: %i\n", errno );
-            return errno;
-        }
-
-      recv_ack:
-
-        /* await ACK packet */
-        slen = sizeof ( sess->saddr );
-        if ( ( ssize_t ) ( len =
-                recvfrom ( sess->sock, &ack, sizeof ( ack ), 0, ( struct sockaddr * ) &sess->saddr,
-                    &slen ) ) < 0 )
-        {
-            close ( fd );
-            sess->exit_flag = 1;
-            fprintf ( stderr, "\n[lsrv] failed to receive data: %i\n", errno );
-            return errno;
-        }
-
-        /* assert packet size */
-        if ( !tftp_packet_check_length ( sess->progname, 4, len ) )
-        {
-            close ( fd );
-            return EMSGSIZE;
-        }
-
-        /* opcode must be ACK */
-        if ( ntohs ( ack.opcode ) != TFTP_OPCODE_ACK )
-        {
-            close ( fd );
-            tftp_dump_packet ( sess->progname, buffer, len );
-            fprintf ( stderr, "\n[lsrv] expected an ACK packet.\n" );
-            return EINVAL;
-        }
-
-        /* skip ACK for previous blocks */
-        if ( ntohs ( ack.block ) != block )
-        {
-            fprintf ( stderr, "\n[lsrv] ACK: expected block #%u, got #%u - ignored.\n", block,
-                ntohs ( ack.block ) );
-            goto recv_ack;
-        }
-
-        /* show progress */
-        printf ( "\r[lsrv] progress: sent %lu blocks", ( unsigned long ) ++nblocks );
+        opts.mask &= ~( TFTP_OPTION_TSIZE | TFTP_OPTION_OFFSET | TFTP_OPTION_MULTICAST );
     }
 
-    /* put new line */
-    putchar ( '\n' );
+    /* report file size */
+    if ( opts.mask & TFTP_OPTION_TSIZE )
+    {
+        opts.tsize = st.st_size;
+        tftp_log ( TFTP_LOG_DEBUG, "[lsrv] reporting tsize : %llu\n", opts.tsize );
+    }
 
-    /* close file fd */
-    close ( fd );
+    /* client resumes download, offset past end of file is left unacknowledged */
+    if ( opts.mask & TFTP_OPTION_OFFSET && opts.offset > ( unsigned long long ) st.st_size )
+    {
+        tftp_log ( TFTP_LOG_DEBUG, "[lsrv] offset %llu past end of file ignored\n", opts.offset );
+        opts.mask &= ~TFTP_OPTION_OFFSET;
+        opts.offset = 0;
+    }
 
-    /* check for reading failure */
-    if ( ( ssize_t ) len < 0 )
+    /* join running session or start new one */
+    if ( opts.mask & TFTP_OPTION_MULTICAST )
     {
-        fprintf ( stderr, "[lsrv] failed to read file: %i\n", errno );
-        return EINVAL;
+        return tftp_handle_multicast ( server, fd, params[0], &opts, &st );
     }
 
-    return 0;
+    return tftp_start_transfer ( server, fd, TFTP_XFER_ROLE_SEND, transfer_mode, params[0],
+        &opts );
 }
 
 /* Accept client peer and handle tftp operation */
-static int tftp_handle_operation ( struct tftp_sess *sess )
+static int tftp_handle_operation ( struct tftp_server *server, const unsigned char *buffer,
+    size_t len )
 {
     unsigned short opcode;
-    size_t len;
-    socklen_t slen;
     char addrbuf[32];
-    unsigned char buffer[4096];
-
-    /* receive datagram from remote peer */
-    slen = sizeof ( sess->saddr );
-    if ( ( ssize_t ) ( len =
-            recvfrom ( sess->sock, buffer, sizeof ( buffer ), 0, ( struct sockaddr * ) &sess->saddr,
-                &slen ) ) < 0 )
-    {
-        fprintf ( stderr, "[lsrv] failed to receive data: %i\n", errno );
-        sess->exit_flag = 1;
-    }
+    struct tftp_sess *sess = &server->sess;
 
-    /* validate client address length */
-    if ( slen == sizeof ( sess->saddr ) )
-    {
-        inet_ntoa_s ( sess->saddr.sin_addr, addrbuf, sizeof ( addrbuf ) );
-        printf ( "[lsrv] accepted peer %s\n", addrbuf );
-    }
+    inet_ntoa_s ( sess->saddr.sin_addr, addrbuf, sizeof ( addrbuf ) );
+    tftp_log ( TFTP_LOG_DEBUG, "[lsrv] accepted peer %s\n", addrbuf );
 
     /* assert packet size */
     if ( !tftp_packet_check_length ( sess->progname, 2, len ) )
@@ -419,36 +805,545 @@ static int tftp_handle_operation ( struct tftp_sess *sess )
 
     /* extract opcode value */
     opcode = tfp_load_ushort_ns ( buffer );
+    tftp_metrics_add ( &server->metrics->requests[opcode < TFTP_METRICS_OPCODES ? opcode : 0],
+        1 );
+
+    /* retransmitted request, transfer is already running */
+    if ( ( opcode == TFTP_OPCODE_RRQ || opcode == TFTP_OPCODE_WRQ )
+        && tftp_loop_find ( &server->loop, &sess->saddr ) )
+    {
+        tftp_log ( TFTP_LOG_DEBUG, "[lsrv] duplicate request ignored.\n" );
+        return 0;
+    }
 
     /* branch according to opcode */
     switch ( opcode )
     {
     case TFTP_OPCODE_WRQ:
-        printf ( "[lsrv] handling write request ...\n" );
-        return tftp_handle_wrq ( sess, buffer, len );
+        tftp_log ( TFTP_LOG_DEBUG, "[lsrv] handling write request ...\n" );
+        return tftp_handle_wrq ( server, buffer, len );
         break;
     case TFTP_OPCODE_RRQ:
-        printf ( "[lsrv] handling read request ...\n" );
-        return tftp_handle_rrq ( sess, buffer, len );
+        tftp_log ( TFTP_LOG_DEBUG, "[lsrv] handling read request ...\n" );
+        return tftp_handle_rrq ( server, buffer, len );
         break;
     default:
-        fprintf ( stderr, "[lsrv] packet has been ignored.\n" );
+        tftp_log ( TFTP_LOG_DEBUG, "[lsrv] packet has been ignored.\n" );
         return EINVAL;
     }
 }
 
-/* Program main function */
-int main ( int argc, char *argv[] )
+/* Queue ERROR reply to client of listening socket */
+static void tftp_queue_error ( struct tftp_server *server, int status )
 {
+    ssize_t len;
+    unsigned char *slot;
+
+    /* send batch is full, make room first */
+    if ( !( slot = tftp_io_batch_slot ( &server->tx ) ) )
+    {
+        tftp_io_flush ( server->sess.sock, &server->tx, &server->io );
+        server->tx.count = 0;
+        slot = tftp_io_batch_slot ( &server->tx );
+    }
+
+    tftp_metrics_add ( &server->metrics->errors[tftp_errno_to_code ( status )], 1 );
+
+    if ( ( len = tftp_prepare_error ( slot, server->tx.slot_size,
+                tftp_errno_to_code ( status ) ) ) >= 0 )
+    {
+        tftp_io_batch_commit ( &server->tx, len, &server->sess.saddr );
+    }
+}
+
+/* Send queued ERROR replies at once, lost ones are retried by clients */
+static void tftp_flush_errors ( struct tftp_server *server )
+{
+    if ( tftp_io_flush ( server->sess.sock, &server->tx, &server->io ) < 0
+        && errno != EAGAIN && errno != EWOULDBLOCK )
+    {
+        tftp_log ( TFTP_LOG_ERROR, "[lsrv] failed to send data: %i\n", errno );
+    }
+
+    server->tx.count = 0;
+}
+
+/* Accept all pending requests on listening socket */
+static void tftp_accept_requests ( struct tftp_server *server )
+{
+    int i;
+    int count;
     int status;
+    struct tftp_io_batch *rx = &server->loop.rx;
+
+    do
+    {
+        /* receive datagrams from remote peers */
+        if ( ( count = tftp_io_recv ( server->sess.sock, rx, &server->io ) ) < 0 )
+        {
+            if ( errno != EAGAIN && errno != EWOULDBLOCK )
+            {
+                tftp_log ( TFTP_LOG_ERROR, "[lsrv] failed to receive data: %i\n", errno );
+                server->sess.exit_flag = 1;
+            }
+            break;
+        }
+
+        for ( i = 0; i < count; i++ )
+        {
+            server->sess.saddr = rx->addrs[i];
+
+            if ( !( status =
+                    tftp_handle_operation ( server, rx->buffers + i * rx->slot_size,
+                        rx->msgs[i].msg_len ) ) )
+            {
+                continue;
+            }
+
+            tftp_log ( TFTP_LOG_ERROR, "[lsrv] status: failure %i (%s)\n", status,
+                strerror ( status ) );
+            tftp_queue_error ( server, status );
+        }
+
+        /* short batch means socket has been drained */
+    } while ( ( unsigned int ) count == rx->limit );
+
+    tftp_flush_errors ( server );
+}
+
+/* Start or join multicast sessions of requests handed over by other workers */
+static void tftp_accept_handoffs ( struct tftp_server *server )
+{
+    int status;
+    uint64_t value;
+    struct tftp_handoff *handoff;
+    struct tftp_handoff *next;
+    struct tftp_hub *hub = server->hub;
+
+    /* counter is reset by read, empty one fails with EAGAIN */
+    if ( read ( hub->wake, &value, sizeof ( value ) ) < 0 && errno != EAGAIN )
+    {
+        tftp_log ( TFTP_LOG_ERROR, "[lsrv] failed to read handoff wakeup: %i\n", errno );
+    }
+
+    pthread_mutex_lock ( &hub->lock );
+    handoff = hub->queue;
+    hub->queue = NULL;
+    hub->queue_tail = NULL;
+    hub->nqueued = 0;
+    pthread_mutex_unlock ( &hub->lock );
+
+    for ( ; handoff; handoff = next )
+    {
+        next = handoff->next;
+        server->sess.saddr = handoff->peer;
+
+        /* retransmitted request, transfer is already running */
+        if ( !tftp_loop_find ( &server->loop, &server->sess.saddr )
+            && ( status = tftp_handle_rrq ( server, handoff->request, handoff->len ) ) )
+        {
+            tftp_log ( TFTP_LOG_ERROR, "[lsrv] status: failure %i (%s)\n", status,
+                strerror ( status ) );
+            tftp_queue_error ( server, status );
+        }
+
+        free ( handoff );
+    }
+
+    tftp_flush_errors ( server );
+}
+
+/* Raise open files limit to allow many concurrent transfers */
+static void tftp_raise_nofile_limit ( void )
+{
+    struct rlimit rlim;
+
+    if ( getrlimit ( RLIMIT_NOFILE, &rlim ) >= 0 && rlim.rlim_cur < rlim.rlim_max )
+    {
+        rlim.rlim_cur = rlim.rlim_max;
+        setrlimit ( RLIMIT_NOFILE, &rlim );
+    }
+}
+
+/* Allocate listening socket and event loop of worker */
+static int tftp_server_open ( struct tftp_server *server, unsigned int addr, unsigned int port,
+    int reuseport )
+{
     unsigned int yes = 1;
+
+    /* allocate server socket */
+    if ( ( server->sess.sock =
+            socket ( AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 ) ) < 0 )
+    {
+        tftp_log ( TFTP_LOG_ERROR, "[lsrv] failed to allocate socket: %i\n", errno );
+        return -1;
+    }
+
+    /* allow reusing socket address */
+    setsockopt ( server->sess.sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof ( yes ) );
+
+    /* workers share address, kernel spreads requests among them */
+    if ( reuseport
+        && setsockopt ( server->sess.sock, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof ( yes ) ) < 0 )
+    {
+        close ( server->sess.sock );
+        tftp_log ( TFTP_LOG_ERROR, "[lsrv] failed to enable port reuse: %i\n", errno );
+        return -1;
+    }
+
+    /* prepare socket address */
+    memset ( &server->sess.addr, '\0', sizeof ( server->sess.addr ) );
+    server->sess.addr.sin_family = AF_INET;
+    server->sess.addr.sin_addr.s_addr = addr;
+    server->sess.addr.sin_port = htons ( port );
+
+    /* bind socket to address */
+    if ( bind ( server->sess.sock, ( struct sockaddr * ) &server->sess.addr,
+            sizeof ( server->sess.addr ) ) < 0 )
+    {
+        close ( server->sess.sock );
+        tftp_log ( TFTP_LOG_ERROR, "[lsrv] failed to bind socket: %i\n", errno );
+        return -1;
+    }
+
+    if ( tftp_loop_init ( &server->loop ) < 0 )
+    {
+        close ( server->sess.sock );
+        tftp_log ( TFTP_LOG_ERROR, "[lsrv] failed to prepare event loop: %i\n", errno );
+        return -1;
+    }
+
+    /* kernel without io_uring support keeps epoll engine */
+    if ( server->uring && tftp_loop_enable_uring ( &server->loop ) < 0 )
+    {
+        tftp_log ( TFTP_LOG_ERROR, "[lsrv] io_uring unavailable, using epoll: %i\n", errno );
+    }
+
+    /* watch listening socket and prepare ERROR replies batch */
+    if ( tftp_loop_watch ( &server->loop, server->sess.sock, NULL ) < 0
+        || tftp_io_batch_init ( &server->tx, TFTP_BATCH_LIMIT,
+            sizeof ( struct error_packet ) ) < 0 )
+    {
+        close ( server->sess.sock );
+        tftp_log ( TFTP_LOG_ERROR, "[lsrv] failed to prepare event loop: %i\n", errno );
+        return -1;
+    }
+
+    /* set exit flag to false */
+    server->sess.exit_flag = 0;
+
+    /* set program name */
+    server->sess.progname = "lsrv";
+
+    /* reset session address */
+    memset ( &server->sess.saddr, '\0', sizeof ( server->sess.saddr ) );
+
+    return 0;
+}
+
+/* Steer requests to workers by hash of client address */
+static int tftp_steer_by_source ( int sock, unsigned int nworkers )
+{
+    struct sock_filter code[] = {
+        /* load IPv4 source address */
+        BPF_STMT ( BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 12 ),
+        /* multiplicative hash keeps nearby addresses apart */
+        BPF_STMT ( BPF_ALU | BPF_MUL | BPF_K, 0x9e3779b1 ),
+        BPF_STMT ( BPF_ALU | BPF_RSH | BPF_K, 16 ),
+        /* pick socket index within reuseport group */
+        BPF_STMT ( BPF_ALU | BPF_MOD | BPF_K, nworkers ),
+        BPF_STMT ( BPF_RET | BPF_A, 0 )
+    };
+    struct sock_fprog prog;
+
+    prog.len = sizeof ( code ) / sizeof ( struct sock_filter );
+    prog.filter = code;
+
+    return setsockopt ( sock, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof ( prog ) );
+}
+
+/* Accept peers and drive transfers until exit flag is set */
+static void *tftp_server_run ( void *arg )
+{
+    int i;
+    int nevents;
+    struct tftp_xfer *xfer;
+    struct tftp_server *server = ( struct tftp_server * ) arg;
+    struct epoll_event events[TFTP_EVENTS_LIMIT];
+
+    while ( !server->sess.exit_flag )
+    {
+        if ( ( nevents = tftp_loop_wait ( &server->loop, events, TFTP_EVENTS_LIMIT ) ) < 0 )
+        {
+            if ( errno == EINTR )
+            {
+                continue;
+            }
+            tftp_log ( TFTP_LOG_ERROR, "[lsrv] failed to wait for events: %i\n", errno );
+            break;
+        }
+
+        for ( i = 0; i < nevents; i++ )
+        {
+            /* listening socket has no transfer attached */
+            if ( !( xfer = ( struct tftp_xfer * ) events[i].data.ptr ) )
+            {
+                tftp_accept_requests ( server );
+                continue;
+            }
+
+            /* multicast requests of other workers */
+            if ( server->hub && events[i].data.ptr == server->hub )
+            {
+                tftp_accept_handoffs ( server );
+                continue;
+            }
+
+            if ( events[i].events & EPOLLOUT )
+            {
+                tftp_xfer_output ( xfer );
+            }
+
+            tftp_loop_input ( &server->loop, xfer );
+            tftp_settle_transfer ( server, xfer );
+        }
+
+        /* handle retransmission timeouts */
+        while ( ( xfer = tftp_loop_expired ( &server->loop, tftp_time_usec (  ) ) ) )
+        {
+            tftp_xfer_timeout ( xfer );
+            tftp_settle_transfer ( server, xfer );
+        }
+
+        /* shaped transfers take turns, loop wakes up once tokens are back */
+        tftp_shaper_run ( &server->shaper, tftp_time_usec (  ) );
+        while ( ( xfer = tftp_shaper_next ( &server->shaper ) ) )
+        {
+            tftp_settle_transfer ( server, xfer );
+        }
+
+        server->loop.wakeup = server->shaper.deadline;
+        tftp_report_shaping ( server );
+    }
+
+    /* abort pending transfers */
+    while ( server->loop.nxfers )
+    {
+        xfer = server->loop.heap[0];
+        tftp_xfer_abort ( xfer, ECANCELED );
+        tftp_finish_transfer ( server, xfer );
+    }
+
+    tftp_log ( TFTP_LOG_INFO, "[lsrv] worker %u: sent %llu packets (%llu segmented) in %llu calls, "
+        "received %llu packets in %llu calls\n", server->id, server->io.tx_packets,
+        server->io.tx_segmented, server->io.tx_calls, server->io.rx_packets, server->io.rx_calls );
+
+    if ( server->loop.uring )
+    {
+        tftp_log ( TFTP_LOG_INFO,
+            "[lsrv] worker %u: io_uring submitted %llu requests in %llu calls\n",
+            server->id, server->loop.uring->submitted, server->loop.uring->enters );
+    }
+
+    /* close socket */
+    tftp_io_batch_free ( &server->tx );
+    tftp_loop_free ( &server->loop );
+    close ( server->sess.sock );
+
+    return NULL;
+}
+
+/* Load files named in preload list into cache */
+static void tftp_preload_files ( struct tftp_cache *cache, FILE * list )
+{
+    size_t len;
+    char line[TFTP_PRELOAD_LINE_LIMIT];
+
+    while ( fgets ( line, sizeof ( line ), list ) )
+    {
+        /* strip line ending */
+        for ( len = strlen ( line ); len && isspace ( ( unsigned char ) line[len - 1] ); len-- )
+        {
+            line[len - 1] = '\0';
+        }
+
+        /* skip blank lines and comments */
+        if ( !len || line[0] == '#' )
+        {
+            continue;
+        }
+
+        if ( !tftp_validate_path ( line ) )
+        {
+            tftp_log ( TFTP_LOG_ERROR, "[lsrv] preload path not allowed: %s\n", line );
+            continue;
+        }
+
+        if ( tftp_cache_preload ( cache, line ) < 0 )
+        {
+            tftp_log ( TFTP_LOG_ERROR, "[lsrv] failed to preload %s: %i\n", line, errno );
+            continue;
+        }
+
+        tftp_log ( TFTP_LOG_INFO, "[lsrv] preloaded %s\n", line );
+    }
+}
+
+/* Program main function */
+int main ( int argc, char *argv[] )
+{
+    int opt;
+    int uring = 0;
+    int log_level;
+    int sync_policy = TFTP_SYNC_NONE;
+    unsigned int i;
     unsigned int addr;
     unsigned int port;
-    struct tftp_sess sess;
-    const char* errmsg;
+    unsigned int nworkers = 1;
+    unsigned int timeout_min = TFTP_TIMEOUT_MIN_SEC;
+    unsigned int timeout_max = TFTP_TIMEOUT_MAX_SEC;
+    unsigned int mcast_port = 0;
+    unsigned int mcast_seq = 0;
+    size_t cache_size = 0;
+    size_t sync_period = 0;
+    unsigned int prefix = TFTP_SHAPE_PREFIX;
+    char mcast_group[32];
+    struct in_addr mcast_addr;
+    const char *preload = NULL;
+    const char *metrics_endpoint = NULL;
+    int metrics_public = 0;
+    FILE *list = NULL;
+    struct tftp_cache cache;
+    struct tftp_metrics metrics;
+    struct tftp_shape shape;
+    struct tftp_hub hub;
+    struct tftp_handoff *handoff;
+    struct tftp_shape_rate limits[TFTP_SHAPE_SCOPES];
+    struct tftp_cache_stats stats;
+    struct tftp_server *servers;
+
+    tftp_log ( TFTP_LOG_INFO, "[lsrv] Little Tftp Server - ver. 1.0.01\n" );
+
+    /* faults may be requested through environment by any program */
+    if ( tftp_fault_setup ( NULL ) < 0 )
+    {
+        tftp_log ( TFTP_LOG_ERROR, "[lsrv] invalid %s settings\n", TFTP_FAULT_ENV );
+        return 1;
+    }
+
+    memset ( limits, '\0', sizeof ( limits ) );
+
+    /* parse optional arguments */
+    while ( ( opt = getopt ( argc, argv, "j:c:p:t:m:s:uM:PF:r:R:g:l:" ) ) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'j':
+            if ( sscanf ( optarg, "%u", &nworkers ) <= 0 || !nworkers
+                || nworkers > TFTP_WORKERS_LIMIT )
+            {
+                show_usage (  );
+                return 1;
+            }
+            break;
+        case 'c':
+            if ( tftp_parse_size ( optarg, &cache_size ) < 0 )
+            {
+                show_usage (  );
+                return 1;
+            }
+            break;
+        case 'p':
+            preload = optarg;
+            break;
+        case 't':
+            if ( sscanf ( optarg, "%u:%u", &timeout_min, &timeout_max ) != 2
+                || timeout_min < TFTP_TIMEOUT_MIN_SEC || timeout_max > TFTP_TIMEOUT_MAX_SEC
+                || timeout_min > timeout_max )
+            {
+                show_usage (  );
+                return 1;
+            }
+            break;
+        case 'm':
+            if ( sscanf ( optarg, "%31[^:]:%u", mcast_group, &mcast_port ) != 2
+                || inet_pton ( AF_INET, mcast_group, &mcast_addr ) <= 0
+                || !IN_MULTICAST ( ntohl ( mcast_addr.s_addr ) ) || !mcast_port
+                || mcast_port + TFTP_MCAST_PORTS > 65536 )
+            {
+                show_usage (  );
+                return 1;
+            }
+            break;
+        case 's':
+            if ( !strcmp ( optarg, "none" ) )
+            {
+                sync_policy = TFTP_SYNC_NONE;
+            } else if ( !strcmp ( optarg, "end" ) )
+            {
+                sync_policy = TFTP_SYNC_END;
+            } else if ( tftp_parse_size ( optarg, &sync_period ) >= 0 && sync_period )
+            {
+                sync_policy = TFTP_SYNC_PERIODIC;
+            } else
+            {
+                show_usage (  );
+                return 1;
+            }
+            break;
+        case 'u':
+            uring = 1;
+            break;
+        case 'M':
+            metrics_endpoint = optarg;
+            break;
+        case 'P':
+            metrics_public = 1;
+            break;
+        case 'F':
+            if ( tftp_fault_setup ( optarg ) < 0 )
+            {
+                show_usage (  );
+                return 1;
+            }
+            break;
+        case 'r':
+            if ( tftp_shape_parse ( optarg, &limits[TFTP_SHAPE_TRANSFER], NULL ) < 0 )
+            {
+                show_usage (  );
+                return 1;
+            }
+            break;
+        case 'R':
+            if ( tftp_shape_parse ( optarg, &limits[TFTP_SHAPE_SUBNET], &prefix ) < 0 )
+            {
+                show_usage (  );
+                return 1;
+            }
+            break;
+        case 'g':
+            if ( tftp_shape_parse ( optarg, &limits[TFTP_SHAPE_GLOBAL], NULL ) < 0 )
+            {
+                show_usage (  );
+                return 1;
+            }
+            break;
+        case 'l':
+            if ( ( log_level = tftp_log_parse_level ( optarg ) ) < 0 )
+            {
+                show_usage (  );
+                return 1;
+            }
+            tftp_log_set_level ( log_level );
+            break;
+        default:
+            show_usage (  );
+            return 1;
+        }
+    }
 
-    setbuf ( stdout, NULL );
-    printf ( "[lsrv] Little Tftp Server - ver. 1.0.01\n" );
+    argc -= optind - 1;
+    argv += optind - 1;
 
     /* validate arguments count */
     if ( argc < 3 )
@@ -457,22 +1352,88 @@ int main ( int argc, char *argv[] )
         return 1;
     }
 
+    /* messages are written by background thread from now on */
+    if ( tftp_log_start (  ) < 0 )
+    {
+        fprintf ( stderr, "[lsrv] failed to start log writer: %i\n", errno );
+        return 1;
+    }
+
+    if ( tftp_fault_enabled (  ) )
+    {
+        tftp_log ( TFTP_LOG_INFO, "[lsrv] fault injection enabled\n" );
+    }
+
+    tftp_metrics_init ( &metrics );
+
+    /* buckets of subnets and whole server are shared by workers */
+    if ( tftp_shape_init ( &shape, limits, prefix ) < 0 )
+    {
+        tftp_log ( TFTP_LOG_ERROR, "[lsrv] failed to prepare shaping: %i\n", errno );
+        return 1;
+    }
+
+    for ( i = 0; i < TFTP_SHAPE_SCOPES; i++ )
+    {
+        metrics.shape_limits[i] = limits[i].rate;
+    }
+
+    if ( shape.enabled )
+    {
+        tftp_log ( TFTP_LOG_INFO, "[lsrv] shaping: transfer %lu, subnet /%u %lu, global %lu "
+            "bytes/s\n", ( unsigned long ) limits[TFTP_SHAPE_TRANSFER].rate, prefix,
+            ( unsigned long ) limits[TFTP_SHAPE_SUBNET].rate,
+            ( unsigned long ) limits[TFTP_SHAPE_GLOBAL].rate );
+    }
+
+    /* metrics socket path lives outside of root */
+    if ( metrics_endpoint )
+    {
+        if ( tftp_metrics_listen ( &metrics, metrics_endpoint, metrics_public ) < 0 )
+        {
+            if ( errno == EPERM )
+            {
+                tftp_log ( TFTP_LOG_ERROR, "[lsrv] metrics address is not loopback, "
+                    "-P is needed to serve it\n" );
+                return 1;
+            }
+
+            tftp_log ( TFTP_LOG_ERROR, "[lsrv] failed to serve metrics: %i\n", errno );
+            return 1;
+        }
+
+        if ( tftp_metrics_start ( &metrics ) < 0 )
+        {
+            tftp_log ( TFTP_LOG_ERROR, "[lsrv] failed to serve metrics: %i\n", errno );
+            return 1;
+        }
+
+        tftp_log ( TFTP_LOG_INFO, "[lsrv] metrics served on %s\n", metrics_endpoint );
+    }
+
+    /* preload list lives outside of root */
+    if ( preload && !( list = fopen ( preload, "r" ) ) )
+    {
+        tftp_log ( TFTP_LOG_ERROR, "[lsrv] failed to open preload list: %i\n", errno );
+        return 1;
+    }
+
     /* change root if needed */
     if ( argc > 3 )
     {
         if ( chdir ( argv[3] ) < 0 )
         {
-            fprintf ( stderr, "[lsrv] failed to change directory: %i\n", errno );
+            tftp_log ( TFTP_LOG_ERROR, "[lsrv] failed to change directory: %i\n", errno );
             return 1;
         }
 
         if ( chroot ( argv[3] ) < 0 )
         {
-            fprintf ( stderr, "[lsrv] failed to change root: %i\n", errno );
+            tftp_log ( TFTP_LOG_ERROR, "[lsrv] failed to change root: %i\n", errno );
             return 1;
         } else
         {
-            printf ( "[lsrv] root changed to %s\n", argv[3] );
+            tftp_log ( TFTP_LOG_INFO, "[lsrv] root changed to %s\n", argv[3] );
         }
     }
 
@@ -490,77 +1451,158 @@ int main ( int argc, char *argv[] )
         return 1;
     }
 
-    /* allocate server socket */
-    if ( ( sess.sock = socket ( AF_INET, SOCK_DGRAM, 0 ) ) < 0 )
+    /* prepare file cache shared by workers */
+    if ( cache_size )
     {
-        fprintf ( stderr, "[lsrv] failed to allocate socket: %i\n", errno );
+        if ( tftp_cache_init ( &cache, cache_size ) < 0 )
+        {
+            tftp_log ( TFTP_LOG_ERROR, "[lsrv] failed to prepare cache: %i\n", errno );
+            return 1;
+        }
+
+        tftp_log ( TFTP_LOG_INFO, "[lsrv] cache size: %lu bytes\n", ( unsigned long ) cache_size );
+    }
+
+    if ( list )
+    {
+        if ( cache_size )
+        {
+            tftp_preload_files ( &cache, list );
+        } else
+        {
+            tftp_log ( TFTP_LOG_ERROR, "[lsrv] cache disabled, preload list ignored.\n" );
+        }
+        fclose ( list );
+    }
+
+    /* missed files are read into cache off worker loops */
+    if ( cache_size && tftp_cache_start ( &cache ) < 0 )
+    {
+        tftp_log ( TFTP_LOG_ERROR, "[lsrv] failed to start cache filler: %i\n", errno );
         return 1;
     }
 
-    printf ( "[lsrv] socket allocated.\n" );
+    /* each transfer holds a socket and a file open */
+    tftp_raise_nofile_limit (  );
 
-    /* allow reusing socket address */
-    setsockopt ( sess.sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof ( yes ) );
+    /* allocate worker contexts */
+    if ( !( servers =
+            ( struct tftp_server * ) calloc ( nworkers, sizeof ( struct tftp_server ) ) ) )
+    {
+        tftp_log ( TFTP_LOG_ERROR, "[lsrv] failed to allocate workers: %i\n", errno );
+        return 1;
+    }
 
-    /* prepare socket address */
-    memset ( &sess.saddr, '\0', sizeof ( sess.saddr ) );
-    sess.saddr.sin_family = AF_INET;
-    sess.saddr.sin_addr.s_addr = addr;
-    sess.saddr.sin_port = htons ( port );
+    /* multicast requests steered to other workers join sessions of first one */
+    if ( mcast_port && nworkers > 1 )
+    {
+        memset ( &hub, '\0', sizeof ( hub ) );
+        pthread_mutex_init ( &hub.lock, NULL );
 
-    /* bind socket to address */
-    if ( bind ( sess.sock, ( struct sockaddr * ) &sess.saddr, sizeof ( sess.saddr ) ) < 0 )
+        if ( ( hub.wake = eventfd ( 0, EFD_NONBLOCK | EFD_CLOEXEC ) ) < 0 )
+        {
+            tftp_log ( TFTP_LOG_ERROR, "[lsrv] failed to prepare session handoff: %i\n", errno );
+            return 1;
+        }
+    }
+
+    /* bind sockets in order, it defines worker index in reuseport group */
+    for ( i = 0; i < nworkers; i++ )
     {
-        close ( sess.sock );
-        fprintf ( stderr, "[lsrv] failed to bind socket: %i\n", errno );
+        servers[i].id = i;
+        servers[i].cache = cache_size ? &cache : NULL;
+        servers[i].timeout_min = timeout_min;
+        servers[i].timeout_max = timeout_max;
+        servers[i].mcast_seq = &mcast_seq;
+        servers[i].uring = uring;
+        servers[i].sync_policy = sync_policy;
+        servers[i].sync_period = sync_period;
+        servers[i].metrics = &metrics;
+        tftp_shaper_init ( &servers[i].shaper, &shape );
+
+        /* zero port leaves multicast disabled */
+        if ( mcast_port )
+        {
+            servers[i].mcast.sin_family = AF_INET;
+            servers[i].mcast.sin_addr = mcast_addr;
+            servers[i].mcast.sin_port = htons ( mcast_port );
+            servers[i].hub = nworkers > 1 ? &hub : NULL;
+        }
+
+        if ( tftp_server_open ( &servers[i], addr, port, nworkers > 1 ) < 0 )
+        {
+            return 1;
+        }
+    }
+
+    if ( servers[0].hub && tftp_loop_watch ( &servers[0].loop, hub.wake, &hub ) < 0 )
+    {
+        tftp_log ( TFTP_LOG_ERROR, "[lsrv] failed to prepare session handoff: %i\n", errno );
         return 1;
     }
 
-    printf ( "[lsrv] listenning on socket ...\n" );
+    tftp_log ( TFTP_LOG_INFO, "[lsrv] socket allocated.\n" );
 
-    /* set exit flag to false */
-    sess.exit_flag = 0;
+    /* retransmitted requests must reach the same worker */
+    if ( nworkers > 1 && tftp_steer_by_source ( servers[0].sess.sock, nworkers ) < 0 )
+    {
+        tftp_log ( TFTP_LOG_ERROR, "[lsrv] source steering unavailable, using kernel hash: %i\n",
+            errno );
+    }
 
-    /* set program name */
-    sess.progname = "lsrv";
+    tftp_log ( TFTP_LOG_INFO, "[lsrv] listenning on socket ...\n" );
 
-    /* reset session address */
-    memset ( &sess.saddr, '\0', sizeof ( sess.saddr ) );
+    /* run single worker in main thread */
+    if ( nworkers == 1 )
+    {
+        tftp_server_run ( &servers[0] );
 
-    /* accept and handle peers */
-    while ( !sess.exit_flag )
+    } else
     {
-        status = tftp_handle_operation ( &sess );
-        if ( !status )
+        tftp_log ( TFTP_LOG_INFO, "[lsrv] starting %u workers ...\n", nworkers );
+
+        for ( i = 0; i < nworkers; i++ )
         {
-            fprintf ( stderr, "[lsrv] status: success\n" );
-            continue;
+            if ( ( errno =
+                    pthread_create ( &servers[i].thread, NULL, tftp_server_run,
+                        &servers[i] ) ) )
+            {
+                tftp_log ( TFTP_LOG_ERROR, "[lsrv] failed to start worker: %i\n", errno );
+                return 1;
+            }
         }
 
-        errmsg = strerror ( status );
-        fprintf ( stderr, "[lsrv] status: failure %i (%s)\n", status, errmsg );
+        for ( i = 0; i < nworkers; i++ )
+        {
+            pthread_join ( servers[i].thread, NULL );
+        }
+    }
 
-        switch ( status )
+    /* requests queued after owner stopped are dropped */
+    if ( servers[0].hub )
+    {
+        while ( ( handoff = hub.queue ) )
         {
-        case EINVAL:
-            tftp_send_error_packet ( &sess, TFTP_ERROR_ILLEGAL_OPERATION );
-            break;
-        case EPERM:
-        case EACCES:
-            tftp_send_error_packet ( &sess, TFTP_ERROR_ACCESS_VIOLATION );
-            break;
-        case EDQUOT:
-            tftp_send_error_packet ( &sess, TFTP_ERROR_DISK_FULL );
-            break;
-        default:
-            tftp_send_error_packet ( &sess, TFTP_ERROR_NOT_DEFINED );
+            hub.queue = handoff->next;
+            free ( handoff );
         }
+
+        close ( hub.wake );
+        pthread_mutex_destroy ( &hub.lock );
     }
 
-    /* close socket */
-    close ( sess.sock );
+    free ( servers );
+    tftp_shape_free ( &shape );
+
+    if ( cache_size )
+    {
+        tftp_cache_get_stats ( &cache, &stats );
+        tftp_log ( TFTP_LOG_INFO, "[lsrv] cache: %llu hits, %llu misses, %llu evictions\n",
+            stats.hits, stats.misses, stats.evictions );
+        tftp_cache_free ( &cache );
+    }
 
-    printf ( "[lsrv] server stopped.\n" );
+    tftp_log ( TFTP_LOG_INFO, "[lsrv] server stopped.\n" );
 
     return 0;
 }
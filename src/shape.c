@@ -0,0 +1,490 @@
+/* ------------------------------------------------------------------
+ * Little Tftp - Bandwidth Shaping
+ * ------------------------------------------------------------------ */
+
+#include "xfer.h"
+
+/* Parse rate[:burst] limit with optional /prefix length if prefix is requested */
+int tftp_shape_parse ( const char *spec, struct tftp_shape_rate *limit, unsigned int *prefix )
+{
+    char *sep;
+    char *end;
+    char buffer[64];
+    unsigned long length;
+
+    if ( strlen ( spec ) >= sizeof ( buffer ) )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    strcpy ( buffer, spec );
+
+    /* prefix length follows slash */
+    if ( ( sep = strchr ( buffer, '/' ) ) )
+    {
+        *sep++ = '\0';
+
+        if ( !prefix || !isdigit ( ( unsigned char ) *sep )
+            || ( length = strtoul ( sep, &end, 10 ) ) > 32 || *end )
+        {
+            errno = EINVAL;
+            return -1;
+        }
+
+        *prefix = length;
+    }
+
+    limit->burst = 0;
+
+    /* burst follows colon */
+    if ( ( sep = strchr ( buffer, ':' ) ) )
+    {
+        *sep++ = '\0';
+
+        if ( tftp_parse_size ( sep, &limit->burst ) < 0 || !limit->burst )
+        {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    if ( tftp_parse_size ( buffer, &limit->rate ) < 0 || !limit->rate )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Prepare bucket for rate limit, burst is converted to time at that rate */
+static void tftp_bucket_init ( struct tftp_bucket *bucket, const struct tftp_shape_rate *limit )
+{
+    bucket->rate = limit->rate;
+    bucket->burst = limit->rate && limit->burst
+        ? ( unsigned long long ) ( limit->burst * 1e9 / limit->rate )
+        : TFTP_SHAPE_BURST_USEC * 1000ULL;
+    bucket->tat = 0;
+}
+
+/* Get microseconds until bucket lets next packet through */
+static unsigned long long tftp_bucket_wait ( const struct tftp_bucket *bucket,
+    unsigned long long now )
+{
+    unsigned long long tat;
+    unsigned long long limit;
+
+    if ( !bucket->rate )
+    {
+        return 0;
+    }
+
+    tat = __atomic_load_n ( &bucket->tat, __ATOMIC_RELAXED );
+    limit = now * 1000 + bucket->burst;
+
+    return tat > limit ? ( tat - limit + 999 ) / 1000 : 0;
+}
+
+/* Take bytes out of bucket, debt is allowed and delays following packets */
+static void tftp_bucket_charge ( struct tftp_bucket *bucket, size_t len, unsigned long long now )
+{
+    unsigned long long tat;
+    unsigned long long next;
+    unsigned long long cost;
+
+    if ( !bucket->rate )
+    {
+        return;
+    }
+
+    now *= 1000;
+    cost = len * 1000000000ULL / bucket->rate;
+    tat = __atomic_load_n ( &bucket->tat, __ATOMIC_RELAXED );
+
+    /* buckets shared by workers are updated without locks */
+    do
+    {
+        next = ( tat > now ? tat : now ) + cost;
+    } while ( !__atomic_compare_exchange_n ( &bucket->tat, &tat, next, 1, __ATOMIC_RELAXED,
+            __ATOMIC_RELAXED ) );
+}
+
+/* Prepare buckets shared by workers for limits given by scope */
+int tftp_shape_init ( struct tftp_shape *shape, const struct tftp_shape_rate *limits,
+    unsigned int prefix )
+{
+    unsigned int i;
+
+    memset ( shape, '\0', sizeof ( struct tftp_shape ) );
+    memcpy ( shape->limits, limits, sizeof ( shape->limits ) );
+    shape->prefix = prefix;
+
+    for ( i = 0; i < TFTP_SHAPE_SCOPES; i++ )
+    {
+        if ( limits[i].rate )
+        {
+            shape->enabled = 1;
+        }
+    }
+
+    tftp_bucket_init ( &shape->global, &limits[TFTP_SHAPE_GLOBAL] );
+
+    if ( !limits[TFTP_SHAPE_SUBNET].rate )
+    {
+        return 0;
+    }
+
+    if ( !( shape->subnets = ( struct tftp_shape_subnet * ) calloc ( TFTP_SHAPE_SUBNETS,
+                sizeof ( struct tftp_shape_subnet ) ) ) )
+    {
+        return -1;
+    }
+
+    for ( i = 0; i < TFTP_SHAPE_SUBNETS; i++ )
+    {
+        tftp_bucket_init ( &shape->subnets[i].bucket, &limits[TFTP_SHAPE_SUBNET] );
+    }
+
+    return 0;
+}
+
+/* Release shared buckets */
+void tftp_shape_free ( struct tftp_shape *shape )
+{
+    free ( shape->subnets );
+    shape->subnets = NULL;
+}
+
+/* Find bucket of subnet address belongs to, its slot is taken on first use */
+static struct tftp_bucket *tftp_shape_subnet ( struct tftp_shape *shape,
+    const struct in_addr *addr )
+{
+    unsigned int i;
+    unsigned int n;
+    unsigned int key;
+    unsigned int first;
+    unsigned long long tag;
+    unsigned long long seen;
+
+    key = shape->prefix ? ntohl ( addr->s_addr ) & ( 0xffffffffU << ( 32 - shape->prefix ) ) : 0;
+    tag = ( ( unsigned long long ) key << 1 ) | 1;
+    first = ( ( key * 0x9e3779b1u ) >> 16 ) % TFTP_SHAPE_SUBNETS;
+
+    /* slots are claimed by workers without locks and never given back */
+    for ( n = 0, i = first; n < TFTP_SHAPE_SUBNETS; n++, i = ( i + 1 ) % TFTP_SHAPE_SUBNETS )
+    {
+        seen = 0;
+        if ( __atomic_compare_exchange_n ( &shape->subnets[i].tag, &seen, tag, 0,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED ) || seen == tag )
+        {
+            return &shape->subnets[i].bucket;
+        }
+    }
+
+    /* every slot is taken, subnet shares bucket with another one */
+    return &shape->subnets[first].bucket;
+}
+
+/* Initialize worker scheduler */
+void tftp_shaper_init ( struct tftp_shaper *shaper, struct tftp_shape *shape )
+{
+    memset ( shaper, '\0', sizeof ( struct tftp_shaper ) );
+    shaper->shape = shape;
+}
+
+/* Shape transfer from now on, its buckets are chosen by peer address */
+void tftp_shaper_attach ( struct tftp_shaper *shaper, struct tftp_xfer *xfer )
+{
+    xfer->shaper = shaper;
+    tftp_bucket_init ( &xfer->shape_bucket, &shaper->shape->limits[TFTP_SHAPE_TRANSFER] );
+
+    if ( shaper->shape->subnets )
+    {
+        xfer->shape_subnet = tftp_shape_subnet ( shaper->shape, &xfer->peer.sin_addr );
+    }
+}
+
+/* Get buckets limiting transfer by scope, missing ones are NULL */
+static void tftp_shaper_buckets ( struct tftp_shaper *shaper, struct tftp_xfer *xfer,
+    struct tftp_bucket **buckets )
+{
+    buckets[TFTP_SHAPE_TRANSFER] = &xfer->shape_bucket;
+    buckets[TFTP_SHAPE_SUBNET] = xfer->shape_subnet;
+    buckets[TFTP_SHAPE_GLOBAL] = &shaper->shape->global;
+}
+
+/* Get microseconds until every bucket of transfer lets next packet through, scope tells
+   which one holds it back longest */
+static unsigned long long tftp_shaper_wait ( struct tftp_shaper *shaper, struct tftp_xfer *xfer,
+    unsigned long long now, int *scope )
+{
+    int i;
+    unsigned long long wait;
+    unsigned long long longest = 0;
+    struct tftp_bucket *buckets[TFTP_SHAPE_SCOPES];
+
+    tftp_shaper_buckets ( shaper, xfer, buckets );
+
+    for ( i = 0; i < TFTP_SHAPE_SCOPES; i++ )
+    {
+        if ( buckets[i] && ( wait = tftp_bucket_wait ( buckets[i], now ) ) > longest )
+        {
+            longest = wait;
+            *scope = i;
+        }
+    }
+
+    return longest;
+}
+
+/* Charge buckets of transfer with bytes sent or received */
+void tftp_shaper_charge ( struct tftp_shaper *shaper, struct tftp_xfer *xfer, size_t len,
+    unsigned long long now )
+{
+    int i;
+    struct tftp_bucket *buckets[TFTP_SHAPE_SCOPES];
+
+    tftp_shaper_buckets ( shaper, xfer, buckets );
+
+    for ( i = 0; i < TFTP_SHAPE_SCOPES; i++ )
+    {
+        if ( buckets[i] )
+        {
+            tftp_bucket_charge ( buckets[i], len, now );
+        }
+    }
+}
+
+/* Link transfer at end of queue */
+static void tftp_shaper_append ( struct tftp_shaper *shaper, struct tftp_xfer *xfer )
+{
+    xfer->shape_prev = shaper->tail;
+    xfer->shape_next = NULL;
+
+    if ( shaper->tail )
+    {
+        shaper->tail->shape_next = xfer;
+    } else
+    {
+        shaper->head = xfer;
+    }
+
+    shaper->tail = xfer;
+    shaper->count++;
+}
+
+/* Link transfer at head of queue */
+static void tftp_shaper_prepend ( struct tftp_shaper *shaper, struct tftp_xfer *xfer )
+{
+    xfer->shape_prev = NULL;
+    xfer->shape_next = shaper->head;
+
+    if ( shaper->head )
+    {
+        shaper->head->shape_prev = xfer;
+    } else
+    {
+        shaper->tail = xfer;
+    }
+
+    shaper->head = xfer;
+    shaper->count++;
+}
+
+/* Unlink transfer from queue */
+static void tftp_shaper_unlink ( struct tftp_shaper *shaper, struct tftp_xfer *xfer )
+{
+    if ( xfer->shape_prev )
+    {
+        xfer->shape_prev->shape_next = xfer->shape_next;
+    } else
+    {
+        shaper->head = xfer->shape_next;
+    }
+
+    if ( xfer->shape_next )
+    {
+        xfer->shape_next->shape_prev = xfer->shape_prev;
+    } else
+    {
+        shaper->tail = xfer->shape_prev;
+    }
+
+    shaper->count--;
+}
+
+/* Stop counting time transfer is held back */
+static void tftp_shaper_unblock ( struct tftp_xfer *xfer, unsigned long long now )
+{
+    if ( xfer->shape_blocked )
+    {
+        xfer->shape_delay += now - xfer->shape_blocked;
+        xfer->shape_blocked = 0;
+    }
+}
+
+/* Take transfer out of queue until it is woken again, deficit is kept for rest of its turn */
+static void tftp_shaper_release ( struct tftp_shaper *shaper, struct tftp_xfer *xfer,
+    unsigned long long now )
+{
+    tftp_shaper_unlink ( shaper, xfer );
+    tftp_shaper_unblock ( xfer, now );
+    xfer->shape_queued = 0;
+}
+
+/* Queue transfer having packets to send, it is sent on its turn */
+void tftp_shaper_wake ( struct tftp_shaper *shaper, struct tftp_xfer *xfer )
+{
+    size_t len;
+
+    if ( xfer->shape_queued )
+    {
+        return;
+    }
+
+    xfer->shape_queued = 1;
+
+    /* turn paused waiting for ACK goes on before others, new one waits for all of them */
+    if ( ( len = tftp_xfer_pending ( xfer ) ) && len <= xfer->shape_deficit )
+    {
+        tftp_shaper_prepend ( shaper, xfer );
+    } else
+    {
+        tftp_shaper_append ( shaper, xfer );
+    }
+}
+
+/* Take transfer out of queue, it is about to be released */
+void tftp_shaper_remove ( struct tftp_shaper *shaper, struct tftp_xfer *xfer )
+{
+    if ( xfer->shape_queued )
+    {
+        tftp_shaper_release ( shaper, xfer, tftp_time_usec (  ) );
+    }
+}
+
+/* Remember transfer that queued packets, they are flushed after run */
+static void tftp_shaper_sent ( struct tftp_shaper *shaper, struct tftp_xfer *xfer )
+{
+    if ( !xfer->shape_sent )
+    {
+        xfer->shape_sent = 1;
+        xfer->shape_sent_next = shaper->sent;
+        shaper->sent = xfer;
+    }
+}
+
+/* Check whether transfer may send now, time it is held back is counted otherwise */
+static int tftp_shaper_admit ( struct tftp_shaper *shaper, struct tftp_xfer *xfer,
+    unsigned long long now )
+{
+    int scope = TFTP_SHAPE_TRANSFER;
+    unsigned long long wait;
+
+    if ( !( wait = tftp_shaper_wait ( shaper, xfer, now, &scope ) ) )
+    {
+        tftp_shaper_unblock ( xfer, now );
+        return 1;
+    }
+
+    if ( !xfer->shape_blocked )
+    {
+        xfer->shape_blocked = now;
+        shaper->throttled[scope]++;
+    }
+
+    /* run is repeated once first of missing tokens are back */
+    if ( !shaper->deadline || now + wait < shaper->deadline )
+    {
+        shaper->deadline = now + wait;
+    }
+
+    return 0;
+}
+
+/* Give queued transfers turns while tokens last, deadline tells when missing ones are back */
+void tftp_shaper_run ( struct tftp_shaper *shaper, unsigned long long now )
+{
+    size_t len;
+    ssize_t cost;
+    struct tftp_xfer *xfer;
+    struct tftp_xfer *next;
+
+    shaper->deadline = 0;
+
+    /* tokens are only spent during run, transfer once held back stays so till its end */
+    for ( xfer = shaper->head; xfer; xfer = next )
+    {
+        next = xfer->shape_next;
+
+        /* window is full or socket buffer is, transfer is woken again later */
+        if ( !( len = tftp_xfer_pending ( xfer ) ) )
+        {
+            tftp_shaper_release ( shaper, xfer, now );
+            continue;
+        }
+
+        /* transfer keeps its place while tokens are missing */
+        if ( !tftp_shaper_admit ( shaper, xfer, now ) )
+        {
+            continue;
+        }
+
+        /* turn starts with quantum added to deficit */
+        if ( len > xfer->shape_deficit )
+        {
+            xfer->shape_deficit += TFTP_SHAPE_QUANTUM;
+        }
+
+        /* send while deficit covers next packet and tokens last */
+        while ( len && len <= xfer->shape_deficit && tftp_shaper_admit ( shaper, xfer, now ) )
+        {
+            tftp_shaper_sent ( shaper, xfer );
+
+            if ( ( cost = tftp_xfer_send_next ( xfer ) ) < 0 )
+            {
+                break;
+            }
+
+            /* uploaded data was charged as it arrived */
+            if ( xfer->role == TFTP_XFER_ROLE_SEND )
+            {
+                tftp_shaper_charge ( shaper, xfer, cost, now );
+            }
+
+            xfer->shape_deficit -= cost;
+            len = tftp_xfer_pending ( xfer );
+        }
+
+        if ( !( len = tftp_xfer_pending ( xfer ) ) )
+        {
+            tftp_shaper_release ( shaper, xfer, now );
+
+        } else if ( len > xfer->shape_deficit )
+        {
+            /* turn is over, next one comes after all others */
+            tftp_shaper_unlink ( shaper, xfer );
+            tftp_shaper_append ( shaper, xfer );
+
+            if ( !next )
+            {
+                next = xfer;
+            }
+        }
+    }
+}
+
+/* Get next transfer that queued packets during run, NULL if none is left */
+struct tftp_xfer *tftp_shaper_next ( struct tftp_shaper *shaper )
+{
+    struct tftp_xfer *xfer;
+
+    if ( ( xfer = shaper->sent ) )
+    {
+        shaper->sent = xfer->shape_sent_next;
+        xfer->shape_sent = 0;
+    }
+
+    return xfer;
+}
@@ -0,0 +1,438 @@
+/* ------------------------------------------------------------------
+ * Little Tftp - io_uring Ring
+ * ------------------------------------------------------------------ */
+
+#include "uring.h"
+
+/* Hand provided buffer back to kernel by its ID */
+static void tftp_uring_provide ( struct tftp_uring *ring, unsigned short bid )
+{
+    unsigned short tail = ring->buf_ring->tail;
+    struct io_uring_buf *buf = &ring->buf_ring->bufs[tail & ( TFTP_URING_BUFFERS - 1 )];
+
+    buf->addr = ( unsigned long long ) ( uintptr_t ) ( ring->buffers
+        + ( size_t ) bid * TFTP_URING_BUFFER_SIZE );
+    buf->len = TFTP_URING_BUFFER_SIZE;
+    buf->bid = bid;
+
+    __atomic_store_n ( &ring->buf_ring->tail, tail + 1, __ATOMIC_RELEASE );
+}
+
+/* Map submission and completion rings shared with kernel */
+static int tftp_uring_map ( struct tftp_uring *ring, const struct io_uring_params *params )
+{
+    void *map;
+
+    /* both rings share one mapping on kernels that support it */
+    ring->sq_ring_size = params->sq_off.array + params->sq_entries * sizeof ( unsigned int );
+    ring->cq_ring_size = params->cq_off.cqes
+        + params->cq_entries * sizeof ( struct io_uring_cqe );
+
+    if ( params->features & IORING_FEAT_SINGLE_MMAP && ring->cq_ring_size > ring->sq_ring_size )
+    {
+        ring->sq_ring_size = ring->cq_ring_size;
+    }
+
+    if ( ( map = mmap ( NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING ) ) == MAP_FAILED )
+    {
+        return -1;
+    }
+    ring->sq_ring = map;
+
+    if ( params->features & IORING_FEAT_SINGLE_MMAP )
+    {
+        ring->cq_ring = ring->sq_ring;
+
+    } else
+    {
+        if ( ( map = mmap ( NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING ) ) == MAP_FAILED )
+        {
+            return -1;
+        }
+        ring->cq_ring = map;
+    }
+
+    ring->sqes_size = params->sq_entries * sizeof ( struct io_uring_sqe );
+    if ( ( map = mmap ( NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES ) ) == MAP_FAILED )
+    {
+        return -1;
+    }
+    ring->sqes = ( struct io_uring_sqe * ) map;
+
+    ring->sq_head = ( unsigned int * ) ( ( char * ) ring->sq_ring + params->sq_off.head );
+    ring->sq_tail = ( unsigned int * ) ( ( char * ) ring->sq_ring + params->sq_off.tail );
+    ring->sq_array = ( unsigned int * ) ( ( char * ) ring->sq_ring + params->sq_off.array );
+    ring->sq_mask = *( unsigned int * ) ( ( char * ) ring->sq_ring + params->sq_off.ring_mask );
+    ring->cq_head = ( unsigned int * ) ( ( char * ) ring->cq_ring + params->cq_off.head );
+    ring->cq_tail = ( unsigned int * ) ( ( char * ) ring->cq_ring + params->cq_off.tail );
+    ring->cq_mask = *( unsigned int * ) ( ( char * ) ring->cq_ring + params->cq_off.ring_mask );
+    ring->cqes = ( struct io_uring_cqe * ) ( ( char * ) ring->cq_ring + params->cq_off.cqes );
+
+    return 0;
+}
+
+/* Register buffers kernel picks from for each datagram received */
+static int tftp_uring_buffers ( struct tftp_uring *ring )
+{
+    unsigned short i;
+    void *map;
+    struct io_uring_buf_reg reg;
+
+    /* buffer ring must be page aligned */
+    ring->buf_ring_size = TFTP_URING_BUFFERS * sizeof ( struct io_uring_buf );
+    if ( ( map = mmap ( NULL, ring->buf_ring_size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 ) ) == MAP_FAILED )
+    {
+        return -1;
+    }
+    ring->buf_ring = ( struct io_uring_buf_ring * ) map;
+
+    if ( !( ring->buffers =
+            ( unsigned char * ) malloc ( TFTP_URING_BUFFERS * TFTP_URING_BUFFER_SIZE ) ) )
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    memset ( &reg, '\0', sizeof ( reg ) );
+    reg.ring_addr = ( unsigned long long ) ( uintptr_t ) ring->buf_ring;
+    reg.ring_entries = TFTP_URING_BUFFERS;
+    reg.bgid = TFTP_URING_BUFFER_GROUP;
+
+    if ( syscall ( __NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1 ) < 0 )
+    {
+        return -1;
+    }
+
+    for ( i = 0; i < TFTP_URING_BUFFERS; i++ )
+    {
+        tftp_uring_provide ( ring, i );
+    }
+
+    /* each buffer starts with source address of datagram */
+    ring->recv_msg.msg_namelen = sizeof ( struct sockaddr_in );
+
+    return 0;
+}
+
+/* Set up ring with provided buffers for received datagrams */
+int tftp_uring_init ( struct tftp_uring *ring )
+{
+    int status;
+    struct io_uring_params params;
+
+    memset ( ring, '\0', sizeof ( struct tftp_uring ) );
+    memset ( &params, '\0', sizeof ( params ) );
+
+    if ( ( ring->fd = syscall ( __NR_io_uring_setup, TFTP_URING_ENTRIES, &params ) ) < 0 )
+    {
+        return -1;
+    }
+
+    /* multishot receive came along with synchronous cancel, probe the latter on ring itself */
+    if ( tftp_uring_map ( ring, &params ) < 0 || tftp_uring_buffers ( ring ) < 0
+        || tftp_uring_cancel ( ring, ring->fd ) < 0 )
+    {
+        status = errno;
+        tftp_uring_free ( ring );
+        errno = status;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Release ring, pending requests are dropped */
+void tftp_uring_free ( struct tftp_uring *ring )
+{
+    if ( ring->sqes )
+    {
+        munmap ( ring->sqes, ring->sqes_size );
+    }
+
+    if ( ring->cq_ring && ring->cq_ring != ring->sq_ring )
+    {
+        munmap ( ring->cq_ring, ring->cq_ring_size );
+    }
+
+    if ( ring->sq_ring )
+    {
+        munmap ( ring->sq_ring, ring->sq_ring_size );
+    }
+
+    if ( ring->fd >= 0 )
+    {
+        close ( ring->fd );
+    }
+
+    /* kernel drops buffer ring along with its file */
+    if ( ring->buf_ring )
+    {
+        munmap ( ring->buf_ring, ring->buf_ring_size );
+    }
+
+    free ( ring->buffers );
+    memset ( ring, '\0', sizeof ( struct tftp_uring ) );
+    ring->fd = -1;
+}
+
+/* Get free submission entry, NULL if queue is full */
+struct io_uring_sqe *tftp_uring_sqe ( struct tftp_uring *ring )
+{
+    unsigned int tail = *ring->sq_tail + ring->pending;
+    struct io_uring_sqe *sqe;
+
+    if ( tail - __atomic_load_n ( ring->sq_head, __ATOMIC_ACQUIRE ) > ring->sq_mask )
+    {
+        return NULL;
+    }
+
+    sqe = &ring->sqes[tail & ring->sq_mask];
+    memset ( sqe, '\0', sizeof ( struct io_uring_sqe ) );
+    ring->sq_array[tail & ring->sq_mask] = tail & ring->sq_mask;
+    ring->pending++;
+
+    return sqe;
+}
+
+/* Get count of free submission entries */
+unsigned int tftp_uring_space ( const struct tftp_uring *ring )
+{
+    return ring->sq_mask + 1 - ( *ring->sq_tail + ring->pending
+        - __atomic_load_n ( ring->sq_head, __ATOMIC_ACQUIRE ) );
+}
+
+/* Prepare readiness poll, multishot poll keeps reporting until canceled */
+int tftp_uring_poll ( struct tftp_uring *ring, int fd, unsigned int events, int multishot,
+    unsigned long long user_data )
+{
+    struct io_uring_sqe *sqe;
+
+    if ( !( sqe = tftp_uring_sqe ( ring ) ) )
+    {
+        errno = EBUSY;
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    sqe->len = multishot ? IORING_POLL_ADD_MULTI : 0;
+    sqe->user_data = user_data;
+
+    return 0;
+}
+
+/* Prepare multishot receive, each datagram completes into provided buffer */
+int tftp_uring_recv ( struct tftp_uring *ring, int fd, unsigned long long user_data )
+{
+    struct io_uring_sqe *sqe;
+
+    if ( !( sqe = tftp_uring_sqe ( ring ) ) )
+    {
+        errno = EBUSY;
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = fd;
+    sqe->addr = ( unsigned long long ) ( uintptr_t ) &ring->recv_msg;
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = TFTP_URING_BUFFER_GROUP;
+    sqe->user_data = user_data;
+
+    return 0;
+}
+
+/* Prepare send of message, linked send runs only once previous one succeeded */
+int tftp_uring_sendmsg ( struct tftp_uring *ring, int fd, const struct msghdr *msg, int link,
+    unsigned long long user_data )
+{
+    struct io_uring_sqe *sqe;
+
+    if ( !( sqe = tftp_uring_sqe ( ring ) ) )
+    {
+        errno = EBUSY;
+        return -1;
+    }
+
+    /* full socket buffer fails send instead of waiting for room */
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = ( unsigned long long ) ( uintptr_t ) msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_DONTWAIT;
+    sqe->flags = link ? IOSQE_IO_LINK : 0;
+    sqe->user_data = user_data;
+
+    return 0;
+}
+
+/* Prepare write of data at file offset, linked entry runs only once write succeeded */
+int tftp_uring_write ( struct tftp_uring *ring, int fd, const void *data, size_t len,
+    unsigned long long offset, int link, unsigned long long user_data )
+{
+    struct io_uring_sqe *sqe;
+
+    if ( !( sqe = tftp_uring_sqe ( ring ) ) )
+    {
+        errno = EBUSY;
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->addr = ( unsigned long long ) ( uintptr_t ) data;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->flags = link ? IOSQE_IO_LINK : 0;
+    sqe->user_data = user_data;
+
+    return 0;
+}
+
+/* Prepare sync of file data written so far */
+int tftp_uring_fsync ( struct tftp_uring *ring, int fd, unsigned long long user_data )
+{
+    struct io_uring_sqe *sqe;
+
+    if ( !( sqe = tftp_uring_sqe ( ring ) ) )
+    {
+        errno = EBUSY;
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_FSYNC;
+    sqe->fd = fd;
+    sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    sqe->user_data = user_data;
+
+    return 0;
+}
+
+/* Submit pending entries and wait for completions or timeout, negative timeout waits forever */
+int tftp_uring_enter ( struct tftp_uring *ring, unsigned int min_complete,
+    long long timeout_usec )
+{
+    int ret;
+    unsigned int flags = 0;
+    unsigned int to_submit;
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+
+    /* publish prepared entries, kernel consumes them up to tail */
+    __atomic_store_n ( ring->sq_tail, *ring->sq_tail + ring->pending, __ATOMIC_RELEASE );
+    ring->pending = 0;
+    to_submit = *ring->sq_tail - __atomic_load_n ( ring->sq_head, __ATOMIC_ACQUIRE );
+
+    if ( min_complete )
+    {
+        flags |= IORING_ENTER_GETEVENTS;
+    }
+
+    memset ( &arg, '\0', sizeof ( arg ) );
+    arg.sigmask_sz = _NSIG / 8;
+
+    if ( timeout_usec >= 0 )
+    {
+        ts.tv_sec = timeout_usec / 1000000;
+        ts.tv_nsec = ( timeout_usec % 1000000 ) * 1000;
+        arg.ts = ( unsigned long long ) ( uintptr_t ) &ts;
+    }
+
+    ret = syscall ( __NR_io_uring_enter, ring->fd, to_submit, min_complete,
+        flags | IORING_ENTER_EXT_ARG, &arg, sizeof ( arg ) );
+    ring->enters++;
+
+    if ( ret < 0 )
+    {
+        /* nothing was submitted and wait timed out */
+        return errno == ETIME ? 0 : -1;
+    }
+
+    ring->submitted += ret;
+
+    return ret;
+}
+
+/* Get count of completions ready */
+unsigned int tftp_uring_ready ( const struct tftp_uring *ring )
+{
+    return __atomic_load_n ( ring->cq_tail, __ATOMIC_ACQUIRE ) - *ring->cq_head;
+}
+
+/* Get ready completion by its index */
+struct io_uring_cqe *tftp_uring_cqe ( struct tftp_uring *ring, unsigned int i )
+{
+    return &ring->cqes[( *ring->cq_head + i ) & ring->cq_mask];
+}
+
+/* Release completions that were handled */
+void tftp_uring_advance ( struct tftp_uring *ring, unsigned int count )
+{
+    __atomic_store_n ( ring->cq_head, *ring->cq_head + count, __ATOMIC_RELEASE );
+}
+
+/* Locate datagram in provided buffer of completion, NULL if it was truncated */
+const unsigned char *tftp_uring_datagram ( const struct tftp_uring *ring,
+    const struct io_uring_cqe *cqe, struct sockaddr_in *addr, size_t *len )
+{
+    const unsigned char *buffer;
+    const struct io_uring_recvmsg_out *out;
+
+    buffer = ring->buffers + ( size_t ) ( cqe->flags >> IORING_CQE_BUFFER_SHIFT )
+        * TFTP_URING_BUFFER_SIZE;
+    out = ( const struct io_uring_recvmsg_out * ) buffer;
+
+    if ( out->flags & MSG_TRUNC || out->namelen < sizeof ( struct sockaddr_in ) )
+    {
+        return NULL;
+    }
+
+    memcpy ( addr, out + 1, sizeof ( struct sockaddr_in ) );
+    *len = out->payloadlen;
+
+    /* payload follows address and control space requested */
+    return buffer + sizeof ( struct io_uring_recvmsg_out ) + ring->recv_msg.msg_namelen
+        + ring->recv_msg.msg_controllen;
+}
+
+/* Hand provided buffer of completion back to kernel */
+void tftp_uring_recycle ( struct tftp_uring *ring, const struct io_uring_cqe *cqe )
+{
+    if ( cqe->flags & IORING_CQE_F_BUFFER )
+    {
+        tftp_uring_provide ( ring, cqe->flags >> IORING_CQE_BUFFER_SHIFT );
+    }
+}
+
+/* Cancel all requests of file descriptor and wait until they are gone */
+int tftp_uring_cancel ( struct tftp_uring *ring, int fd )
+{
+    struct io_uring_sync_cancel_reg reg;
+
+    /* requests still waiting in submission queue are submitted first */
+    if ( ring->pending && tftp_uring_enter ( ring, 0, -1 ) < 0 )
+    {
+        return -1;
+    }
+
+    memset ( &reg, '\0', sizeof ( reg ) );
+    reg.fd = fd;
+    reg.flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    reg.timeout.tv_sec = -1;
+    reg.timeout.tv_nsec = -1;
+
+    if ( syscall ( __NR_io_uring_register, ring->fd, IORING_REGISTER_SYNC_CANCEL, &reg, 1 ) < 0
+        && errno != ENOENT )
+    {
+        return -1;
+    }
+
+    return 0;
+}
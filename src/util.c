@@ -31,7 +31,8 @@ ssize_t tftp_prepare_header ( unsigned char *header, size_t limit, unsigned shor
         len = strlen ( params[i] );
         if ( offset + len >= limit )
         {
-            return ENOBUFS;
+            errno = ENOBUFS;
+            return -1;
         }
         memcpy ( header + offset, params[i], len );
         offset += len;
@@ -41,13 +42,330 @@ ssize_t tftp_prepare_header ( unsigned char *header, size_t limit, unsigned shor
     return offset;
 }
 
+/* Initialize options with protocol defaults */
+void tftp_opts_init ( struct tftp_opts *opts )
+{
+    memset ( opts, '\0', sizeof ( struct tftp_opts ) );
+    opts->blksize = TFTP_BLOCKSIZE;
+    opts->windowsize = 1;
+}
+
+/* Parse decimal option value */
+static int tftp_opts_number ( const char *value, unsigned long long *number )
+{
+    char *end;
+
+    if ( !isdigit ( ( unsigned char ) *value ) )
+    {
+        return -1;
+    }
+
+    errno = 0;
+    *number = strtoull ( value, &end, 10 );
+
+    if ( *end || errno )
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Parse multicast option value made of group address, port and master flag */
+static int tftp_opts_multicast ( struct tftp_opts *opts, const char *value )
+{
+    unsigned int port;
+    unsigned int master;
+    const char *comma;
+    char addr[INET_ADDRSTRLEN];
+
+    if ( !( comma = strchr ( value, ',' ) ) || ( size_t ) ( comma - value ) >= sizeof ( addr ) )
+    {
+        return -1;
+    }
+
+    memcpy ( addr, value, comma - value );
+    addr[comma - value] = '\0';
+
+    if ( inet_pton ( AF_INET, addr, &opts->mcast_addr ) <= 0
+        || !IN_MULTICAST ( ntohl ( opts->mcast_addr.s_addr ) )
+        || sscanf ( comma + 1, "%u,%u", &port, &master ) != 2 || !port || port > 65535
+        || master > 1 )
+    {
+        return -1;
+    }
+
+    opts->mcast_port = port;
+    opts->mcast_master = master;
+
+    return 0;
+}
+
+/* Parse single option name and value, returns 1 if option is unknown */
+int tftp_opts_parse ( struct tftp_opts *opts, const char *name, const char *value )
+{
+    unsigned long long number;
+
+    if ( !strcasecmp ( name, "blksize" ) )
+    {
+        if ( tftp_opts_number ( value, &number ) < 0 || number < TFTP_BLOCKSIZE_MIN )
+        {
+            errno = EINVAL;
+            return -1;
+        }
+
+        /* larger block size is negotiated down */
+        opts->blksize = number < TFTP_BLOCKSIZE_MAX ? number : TFTP_BLOCKSIZE_MAX;
+        opts->mask |= TFTP_OPTION_BLKSIZE;
+        return 0;
+    }
+
+    if ( !strcasecmp ( name, "windowsize" ) )
+    {
+        if ( tftp_opts_number ( value, &number ) < 0 || number < 1 )
+        {
+            errno = EINVAL;
+            return -1;
+        }
+
+        /* larger window size is negotiated down */
+        opts->windowsize = number < TFTP_WINDOWSIZE_MAX ? number : TFTP_WINDOWSIZE_MAX;
+        opts->mask |= TFTP_OPTION_WINDOWSIZE;
+        return 0;
+    }
+
+    if ( !strcasecmp ( name, "timeout" ) )
+    {
+        if ( tftp_opts_number ( value, &number ) < 0 || number < TFTP_TIMEOUT_MIN_SEC
+            || number > TFTP_TIMEOUT_MAX_SEC )
+        {
+            errno = EINVAL;
+            return -1;
+        }
+
+        /* value is not negotiable, peer either accepts it or ignores option */
+        opts->timeout = number;
+        opts->mask |= TFTP_OPTION_TIMEOUT;
+        return 0;
+    }
+
+    if ( !strcasecmp ( name, "tsize" ) )
+    {
+        if ( tftp_opts_number ( value, &number ) < 0 )
+        {
+            errno = EINVAL;
+            return -1;
+        }
+
+        /* zero in read request asks for file size */
+        opts->tsize = number;
+        opts->mask |= TFTP_OPTION_TSIZE;
+        return 0;
+    }
+
+    if ( !strcasecmp ( name, "offset" ) )
+    {
+        if ( tftp_opts_number ( value, &number ) < 0 )
+        {
+            errno = EINVAL;
+            return -1;
+        }
+
+        /* ltftp extension, zero in write request asks for size of partial upload */
+        opts->offset = number;
+        opts->mask |= TFTP_OPTION_OFFSET;
+        return 0;
+    }
+
+    if ( !strcasecmp ( name, "multicast" ) )
+    {
+        /* value is empty in request, server assigns group */
+        if ( *value && tftp_opts_multicast ( opts, value ) < 0 )
+        {
+            errno = EINVAL;
+            return -1;
+        }
+
+        opts->mask |= TFTP_OPTION_MULTICAST;
+        return 0;
+    }
+
+    return 1;
+}
+
+/* Load options from name and value string pairs */
+int tftp_opts_load ( struct tftp_opts *opts, const unsigned char *buffer, size_t len )
+{
+    size_t offset;
+    const char *name;
+    const char *value;
+
+    /* options list must be terminated */
+    if ( len && buffer[len - 1] != '\0' )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for ( offset = 0; offset < len; )
+    {
+        name = ( const char * ) buffer + offset;
+        offset += strlen ( name ) + 1;
+
+        /* each option needs a value */
+        if ( offset >= len )
+        {
+            errno = EINVAL;
+            return -1;
+        }
+
+        value = ( const char * ) buffer + offset;
+        offset += strlen ( value ) + 1;
+
+        /* unknown options are not allowed here */
+        if ( tftp_opts_parse ( opts, name, value ) )
+        {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Append option name and value to buffer */
+static ssize_t tftp_opts_append ( unsigned char *buffer, size_t limit, size_t offset,
+    const char *name, unsigned long long value )
+{
+    int len;
+
+    len = snprintf ( ( char * ) buffer + offset, limit - offset, "%s%c%llu", name, '\0',
+        value );
+
+    if ( len < 0 || offset + len + 1 > limit )
+    {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    return offset + len + 1;
+}
+
+/* Append multicast option, its value is empty until group is assigned */
+static ssize_t tftp_opts_append_multicast ( unsigned char *buffer, size_t limit, size_t offset,
+    const struct tftp_opts *opts )
+{
+    int len;
+    char addr[INET_ADDRSTRLEN];
+
+    if ( !opts->mcast_port )
+    {
+        len = snprintf ( ( char * ) buffer + offset, limit - offset, "multicast%c", '\0' );
+
+    } else
+    {
+        inet_ntop ( AF_INET, &opts->mcast_addr, addr, sizeof ( addr ) );
+        len = snprintf ( ( char * ) buffer + offset, limit - offset, "multicast%c%s,%u,%u", '\0',
+            addr, opts->mcast_port, opts->mcast_master );
+    }
+
+    if ( len < 0 || offset + len + 1 > limit )
+    {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    return offset + len + 1;
+}
+
+/* Store options as name and value string pairs */
+ssize_t tftp_opts_store ( const struct tftp_opts *opts, unsigned char *buffer, size_t limit )
+{
+    ssize_t offset = 0;
+
+    if ( opts->mask & TFTP_OPTION_BLKSIZE )
+    {
+        if ( ( offset =
+                tftp_opts_append ( buffer, limit, offset, "blksize", opts->blksize ) ) < 0 )
+        {
+            return -1;
+        }
+    }
+
+    if ( opts->mask & TFTP_OPTION_WINDOWSIZE )
+    {
+        if ( ( offset =
+                tftp_opts_append ( buffer, limit, offset, "windowsize",
+                    opts->windowsize ) ) < 0 )
+        {
+            return -1;
+        }
+    }
+
+    if ( opts->mask & TFTP_OPTION_TIMEOUT )
+    {
+        if ( ( offset =
+                tftp_opts_append ( buffer, limit, offset, "timeout", opts->timeout ) ) < 0 )
+        {
+            return -1;
+        }
+    }
+
+    if ( opts->mask & TFTP_OPTION_TSIZE )
+    {
+        if ( ( offset =
+                tftp_opts_append ( buffer, limit, offset, "tsize", opts->tsize ) ) < 0 )
+        {
+            return -1;
+        }
+    }
+
+    if ( opts->mask & TFTP_OPTION_OFFSET )
+    {
+        if ( ( offset =
+                tftp_opts_append ( buffer, limit, offset, "offset", opts->offset ) ) < 0 )
+        {
+            return -1;
+        }
+    }
+
+    if ( opts->mask & TFTP_OPTION_MULTICAST )
+    {
+        if ( ( offset = tftp_opts_append_multicast ( buffer, limit, offset, opts ) ) < 0 )
+        {
+            return -1;
+        }
+    }
+
+    return offset;
+}
+
+/* Prepare OACK packet */
+ssize_t tftp_prepare_oack ( unsigned char *packet, size_t limit, const struct tftp_opts *opts )
+{
+    ssize_t len;
+    ssize_t optlen;
+
+    if ( ( len = tftp_prepare_header ( packet, limit, TFTP_OPCODE_OACK, NULL ) ) < 0 )
+    {
+        return -1;
+    }
+
+    if ( ( optlen = tftp_opts_store ( opts, packet + len, limit - len ) ) < 0 )
+    {
+        return -1;
+    }
+
+    return len + optlen;
+}
+
 /* Validate packet length */
 int tftp_packet_check_length ( const char *prefix, size_t expected, size_t got )
 {
     if ( got < expected )
     {
-        fprintf ( stderr, "[%s] received %lu bytes, expected %lu bytes at least.\n", prefix,
-            ( unsigned long ) got, ( unsigned long ) expected );
+        tftp_log ( TFTP_LOG_ERROR, "[%s] received %lu bytes, expected %lu bytes at least.\n",
+            prefix, ( unsigned long ) got, ( unsigned long ) expected );
         return 0;
     }
 
@@ -87,17 +405,203 @@ static const char *tftp_get_errmsg ( int code )
         return "File already exists.";
     case TFTP_ERROR_NO_SUCH_USER:
         return "No such user.";
+    case TFTP_ERROR_OPTION_NEGOTIATION:
+        return "Option negotiation failed.";
     default:
         return "Unknown";
     }
 }
 
+/* Map errno value to tftp error code */
+unsigned short tftp_errno_to_code ( int status )
+{
+    switch ( status )
+    {
+    case EINVAL:
+        return TFTP_ERROR_ILLEGAL_OPERATION;
+    case ENOENT:
+        return TFTP_ERROR_FILE_NOT_FOUND;
+    case EPERM:
+    case EACCES:
+        return TFTP_ERROR_ACCESS_VIOLATION;
+    case ENOSPC:
+    case EDQUOT:
+    case EFBIG:
+        return TFTP_ERROR_DISK_FULL;
+    case EEXIST:
+        return TFTP_ERROR_FILE_ALREADY_EXISTS;
+    default:
+        return TFTP_ERROR_NOT_DEFINED;
+    }
+}
+
+/* Reserve disk space for file of given size, unsupported file systems are skipped */
+int tftp_preallocate ( int fd, unsigned long long size )
+{
+    /* file grows with written data, short transfer leaves no zero tail */
+    if ( size && fallocate ( fd, FALLOC_FL_KEEP_SIZE, 0, ( off_t ) size ) < 0
+        && errno != EOPNOTSUPP && errno != ENOSYS )
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Get monotonic time in microseconds */
+unsigned long long tftp_time_usec ( void )
+{
+    struct timespec ts;
+
+    clock_gettime ( CLOCK_MONOTONIC, &ts );
+
+    return ( unsigned long long ) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Initialize round trip estimator with initial timeout */
+void tftp_rtt_init ( struct tftp_rtt *rtt )
+{
+    memset ( rtt, '\0', sizeof ( struct tftp_rtt ) );
+    rtt->rto = TFTP_TIMEOUT_MSEC * 1000ULL;
+    rtt->rto_max = TFTP_RTO_MAX_MSEC * 1000ULL;
+}
+
+/* Start timing reply to packet unless another one is being timed */
+void tftp_rtt_start ( struct tftp_rtt *rtt, unsigned long long seq, unsigned long long now )
+{
+    if ( !rtt->start )
+    {
+        rtt->start = now;
+        rtt->seq = seq;
+    }
+}
+
+/* Finish timing if reply covers timed packet and update timeout */
+void tftp_rtt_complete ( struct tftp_rtt *rtt, unsigned long long seq, unsigned long long now )
+{
+    unsigned long long sample;
+    unsigned long long delta;
+
+    if ( !rtt->start || seq < rtt->seq )
+    {
+        return;
+    }
+
+    sample = now > rtt->start ? now - rtt->start : 1;
+    rtt->start = 0;
+
+    /* smoothed round trip and its variance as in RFC 6298 */
+    if ( !rtt->srtt )
+    {
+        rtt->srtt = sample;
+        rtt->rttvar = sample / 2;
+    } else
+    {
+        delta = rtt->srtt > sample ? rtt->srtt - sample : sample - rtt->srtt;
+        rtt->rttvar = ( 3 * rtt->rttvar + delta ) / 4;
+        rtt->srtt = ( 7 * rtt->srtt + sample ) / 8;
+    }
+
+    rtt->rto = rtt->srtt + 4 * rtt->rttvar;
+
+    if ( rtt->rto < TFTP_RTO_MIN_MSEC * 1000ULL )
+    {
+        rtt->rto = TFTP_RTO_MIN_MSEC * 1000ULL;
+    }
+
+    if ( rtt->rto > rtt->rto_max )
+    {
+        rtt->rto = rtt->rto_max;
+    }
+}
+
+/* Double timeout after expiry, timed packet is ambiguous now */
+void tftp_rtt_backoff ( struct tftp_rtt *rtt )
+{
+    rtt->start = 0;
+    rtt->rto *= 2;
+
+    if ( rtt->rto > rtt->rto_max )
+    {
+        rtt->rto = rtt->rto_max;
+    }
+}
+
+/* Limit timeout, limit is also used as timeout until round trip is measured */
+void tftp_rtt_bound ( struct tftp_rtt *rtt, unsigned long long limit )
+{
+    rtt->rto_max = limit;
+
+    if ( !rtt->srtt || rtt->rto > limit )
+    {
+        rtt->rto = limit;
+    }
+}
+
+/* Map wire block number to newest sequence not above top */
+unsigned long long tftp_block_seq ( unsigned long long top, unsigned short block )
+{
+    unsigned short distance;
+
+    distance = ( unsigned short ) top - block;
+
+    return distance <= top ? top - distance : 0;
+}
+
+/* Initialize retransmission state awaiting reply for given block */
+void tftp_retx_init ( struct tftp_retx *retx, unsigned long long expected )
+{
+    memset ( retx, '\0', sizeof ( struct tftp_retx ) );
+    tftp_rtt_init ( &retx->rtt );
+    retx->expected = expected;
+}
+
+/* Classify reply by its block, duplicates are counted and never answered by resending */
+int tftp_retx_match ( struct tftp_retx *retx, unsigned long long seq )
+{
+    if ( seq < retx->expected )
+    {
+        retx->duplicates++;
+        return TFTP_RETX_DUPLICATE;
+    }
+
+    return seq == retx->expected ? TFTP_RETX_EXPECTED : TFTP_RETX_AHEAD;
+}
+
+/* Accept reply for given block, reply for the following one is awaited next */
+void tftp_retx_accept ( struct tftp_retx *retx, unsigned long long seq, unsigned long long now )
+{
+    retx->expected = seq + 1;
+    retx->retries = 0;
+    tftp_rtt_complete ( &retx->rtt, seq, now );
+}
+
+/* Handle expired timer, returns -1 once retries are exhausted */
+int tftp_retx_expire ( struct tftp_retx *retx )
+{
+    if ( ++retx->retries > TFTP_RETRIES_LIMIT )
+    {
+        return -1;
+    }
+
+    retx->timeouts++;
+    tftp_rtt_backoff ( &retx->rtt );
+
+    return 0;
+}
+
+/* Count packets sent again */
+void tftp_retx_resent ( struct tftp_retx *retx, unsigned int count )
+{
+    retx->retransmits += count;
+}
+
 /* Dump tftp packet */
 void tftp_dump_packet ( const char *prefix, const unsigned char *packet, size_t len )
 {
     unsigned short opcode;
 
-    if ( !tftp_packet_check_length ( prefix, 2, len ) )
+    if ( !tftp_log_enabled ( TFTP_LOG_TRACE ) || !tftp_packet_check_length ( prefix, 2, len ) )
     {
         return;
     }
@@ -107,17 +611,18 @@ void tftp_dump_packet ( const char *prefix, const unsigned char *packet, size_t
     switch ( opcode )
     {
     case TFTP_OPCODE_RRQ:
-        printf ( "[%s] received packet: RRQ\n", prefix );
+        tftp_log ( TFTP_LOG_TRACE, "[%s] received packet: RRQ\n", prefix );
         break;
     case TFTP_OPCODE_WRQ:
-        printf ( "[%s] received packet: WRQ\n", prefix );
+        tftp_log ( TFTP_LOG_TRACE, "[%s] received packet: WRQ\n", prefix );
         break;
     case TFTP_OPCODE_DATA:
         if ( !tftp_packet_check_length ( prefix, 4, len ) )
         {
             return;
         }
-        printf ( "[%s] received packet: DATA\n       block : #%u\n       size  : %lu\n\n", prefix,
+        tftp_log ( TFTP_LOG_TRACE,
+            "[%s] received packet: DATA\n       block : #%u\n       size  : %lu\n\n", prefix,
             tfp_load_ushort_ns ( packet + 2 ), len - 4 );
         break;
     case TFTP_OPCODE_ACK:
@@ -125,9 +630,13 @@ void tftp_dump_packet ( const char *prefix, const unsigned char *packet, size_t
         {
             return;
         }
-        printf ( "[%s] received packet: ACK\n       block : #%u\n\n", prefix,
+        tftp_log ( TFTP_LOG_TRACE, "[%s] received packet: ACK\n       block : #%u\n\n", prefix,
             tfp_load_ushort_ns ( packet + 2 ) );
         break;
+    case TFTP_OPCODE_OACK:
+        tftp_log ( TFTP_LOG_TRACE, "[%s] received packet: OACK\n       size  : %lu\n\n", prefix,
+            ( unsigned long ) len );
+        break;
     case TFTP_OPCODE_ERROR:
         if ( !tftp_packet_check_length ( prefix, 4, len ) )
         {
@@ -136,23 +645,48 @@ void tftp_dump_packet ( const char *prefix, const unsigned char *packet, size_t
 
         if ( len > 4 && packet[len - 1] == '\0' )
         {
-            printf ( "[%s] received packet: ERROR\n       code : %u %s\n       desc : %s\n",
+            tftp_log ( TFTP_LOG_TRACE,
+                "[%s] received packet: ERROR\n       code : %u %s\n       desc : %s\n",
                 prefix, tfp_load_ushort_ns ( packet + 2 ),
                 tftp_get_errmsg ( tfp_load_ushort_ns ( packet + 2 ) ), packet + 4 );
         } else
         {
-            printf ( "[%s] received packet: ERROR\n       code : %u %s\n\n", prefix,
-                tfp_load_ushort_ns ( packet + 2 ),
+            tftp_log ( TFTP_LOG_TRACE, "[%s] received packet: ERROR\n       code : %u %s\n\n",
+                prefix, tfp_load_ushort_ns ( packet + 2 ),
                 tftp_get_errmsg ( tfp_load_ushort_ns ( packet + 2 ) ) );
         }
         break;
 
     default:
-        printf ( "[%s] received packet: UNKNOWN\n       opcode : %u\n       size   : %lu\n\n",
+        tftp_log ( TFTP_LOG_TRACE,
+            "[%s] received packet: UNKNOWN\n       opcode : %u\n       size   : %lu\n\n",
             prefix, opcode, ( unsigned long ) len );
     }
 }
 
+/* Send datagram to session peer, through fault injection if enabled */
+static ssize_t tftp_send_datagram ( struct tftp_sess *sess, void *data, size_t len )
+{
+    struct iovec iov;
+    struct msghdr msg;
+
+    if ( !tftp_fault_enabled (  ) )
+    {
+        return sendto ( sess->sock, data, len, 0, ( struct sockaddr * ) &sess->saddr,
+            sizeof ( sess->saddr ) );
+    }
+
+    iov.iov_base = data;
+    iov.iov_len = len;
+    memset ( &msg, '\0', sizeof ( msg ) );
+    msg.msg_name = &sess->saddr;
+    msg.msg_namelen = sizeof ( sess->saddr );
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    return tftp_fault_sendmsg ( sess->sock, &msg, tftp_time_usec (  ) );
+}
+
 /* Send ACK packet over tftp protocol */
 int tftp_send_ack_packet ( struct tftp_sess *sess, unsigned short block )
 {
@@ -163,84 +697,96 @@ int tftp_send_ack_packet ( struct tftp_sess *sess, unsigned short block )
     packet.block = htons ( block );
 
     /* send ACK packet */
-    if ( sendto ( sess->sock, &packet, sizeof ( packet ), 0, ( struct sockaddr * ) &sess->saddr,
-            sizeof ( sess->saddr ) ) < 0 )
+    if ( tftp_send_datagram ( sess, &packet, sizeof ( packet ) ) < 0 )
     {
         sess->exit_flag = 1;
-        fprintf ( stderr, "[%s] failed to send data: %i\n", sess->progname, errno );
+        tftp_log ( TFTP_LOG_ERROR, "[%s] failed to send data: %i\n", sess->progname, errno );
         return -1;
     }
 
     return 0;
 }
 
-/* Send ERROR packet over tftp protocol */
-int tftp_send_error_packet ( struct tftp_sess *sess, unsigned short code )
+/* Prepare ERROR packet for error code */
+ssize_t tftp_prepare_error ( unsigned char *packet, size_t limit, unsigned short code )
 {
     size_t len;
-    struct error_packet packet;
     const char *message;
 
-    /* prepare ACK packet */
-    packet.opcode = htons ( TFTP_OPCODE_ERROR );
-    packet.block = htons ( code );
-
     /* obtain error message */
     message = tftp_get_errmsg ( code );
 
     /* validate error message length */
-    if ( ( len = strlen ( message ) ) >= sizeof ( packet.message ) )
+    if ( 4 + ( len = strlen ( message ) ) + 1 > limit )
     {
         errno = E2BIG;
         return -1;
     }
 
-    /* place error message into packet */
-    memcpy ( packet.message, message, len );
-    packet.message[len] = '\0';
+    /* place error code and message into packet */
+    tfp_store_ushort_ns ( packet, TFTP_OPCODE_ERROR );
+    tfp_store_ushort_ns ( packet + 2, code );
+    memcpy ( packet + 4, message, len + 1 );
+
+    return 4 + len + 1;
+}
+
+/* Send ERROR packet over tftp protocol */
+int tftp_send_error_packet ( struct tftp_sess *sess, unsigned short code )
+{
+    ssize_t len;
+    struct error_packet packet;
+
+    /* prepare ERROR packet */
+    if ( ( len = tftp_prepare_error ( ( unsigned char * ) &packet, sizeof ( packet ), code ) ) < 0 )
+    {
+        return -1;
+    }
 
     /* send ERROR packet */
-    if ( sendto ( sess->sock, &packet, 4 + len + 1, 0, ( struct sockaddr * ) &sess->saddr,
-            sizeof ( sess->saddr ) ) < 0 )
+    if ( tftp_send_datagram ( sess, &packet, len ) < 0 )
     {
         sess->exit_flag = 1;
-        fprintf ( stderr, "[%s] failed to send data: %i\n", sess->progname, errno );
+        tftp_log ( TFTP_LOG_ERROR, "[%s] failed to send data: %i\n", sess->progname, errno );
         return -1;
     }
 
     return 0;
 }
 
-/* Sendto with autoretry on timeout feature */
-ssize_t sendto_autoretry ( int sockfd, const void *buf, size_t len, int flags,
-    const struct sockaddr * dest_addr, socklen_t addrlen )
+/* Parse size with optional binary unit suffix */
+int tftp_parse_size ( const char *str, size_t *size )
 {
-    int status;
-    ssize_t ret = 0;
-    struct pollfd fds[1];
+    char *end;
+    unsigned long long value;
 
-    /* Preapre poll fd list */
-    fds[0].fd = sockfd;
-    fds[0].events = POLLIN;
+    if ( !isdigit ( ( unsigned char ) *str ) )
+    {
+        return -1;
+    }
 
-  retry:
+    value = strtoull ( str, &end, 10 );
 
-    /* Request sending data to remote peer */
-    if ( ( ret = sendto ( sockfd, buf, len, flags, dest_addr, addrlen ) ) < 0 )
+    switch ( tolower ( ( unsigned char ) *end ) )
     {
-        return ret;
+    case 'g':
+        value <<= 10;
+        /* fall through */
+    case 'm':
+        value <<= 10;
+        /* fall through */
+    case 'k':
+        value <<= 10;
+        end++;
+        break;
     }
 
-    /* Perform poll operation */
-    if ((status = poll ( fds, sizeof ( fds ) / sizeof ( struct pollfd ), TFTP_TIMEOUT_MSEC )) < 0
-        || fds[0].revents & POLLHUP)
+    if ( *end || value > ( size_t ) -1 )
     {
         return -1;
-
-    } else if ( !status )
-    {
-        goto retry;
     }
 
-    return ret;
+    *size = value;
+
+    return 0;
 }
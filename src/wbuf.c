@@ -0,0 +1,407 @@
+/* ------------------------------------------------------------------
+ * Little Tftp - Write-Behind Buffer
+ * ------------------------------------------------------------------ */
+
+#include "wbuf.h"
+
+/* Initialize write-behind buffer of file, memory is allocated on first write */
+void tftp_wbuf_init ( struct tftp_wbuf *wbuf, int fd )
+{
+    memset ( wbuf, '\0', sizeof ( struct tftp_wbuf ) );
+    wbuf->fd = fd;
+}
+
+/* Set durability policy, periodic one syncs after each period of bytes written */
+void tftp_wbuf_policy ( struct tftp_wbuf *wbuf, int policy, size_t period )
+{
+    wbuf->policy = policy;
+    wbuf->period = period;
+}
+
+/* Write in background from now on, jobs of buffer run one at a time in order */
+void tftp_wbuf_async ( struct tftp_wbuf *wbuf, tftp_wbuf_submit_t submit, void *ctx,
+    void *owner )
+{
+    wbuf->submit = submit;
+    wbuf->submit_ctx = ctx;
+    wbuf->owner = owner;
+}
+
+/* Write whole range to file at offset */
+static int tftp_wbuf_pwrite ( int fd, const unsigned char *data, size_t len,
+    unsigned long long offset )
+{
+    ssize_t written;
+
+    while ( len )
+    {
+        if ( ( written = pwrite ( fd, data, len, ( off_t ) offset ) ) < 0 )
+        {
+            if ( errno == EINTR )
+            {
+                continue;
+            }
+            return -1;
+        }
+
+        data += written;
+        len -= written;
+        offset += written;
+    }
+
+    return 0;
+}
+
+/* Run job in calling thread, status tells result */
+void tftp_wbuf_run ( struct tftp_wbuf_job *job )
+{
+    job->status = 0;
+
+    if ( job->len && tftp_wbuf_pwrite ( job->fd, job->data, job->len, job->offset ) < 0 )
+    {
+        job->status = errno;
+        return;
+    }
+
+    if ( job->sync && fdatasync ( job->fd ) < 0 )
+    {
+        job->status = errno;
+    }
+}
+
+/* Release job with its data and file descriptor */
+static void tftp_wbuf_release ( struct tftp_wbuf_job *job )
+{
+    close ( job->fd );
+    free ( job->data );
+    free ( job );
+}
+
+/* Remove job that has run from buffer, first failure is kept */
+static void tftp_wbuf_settle ( struct tftp_wbuf *wbuf, struct tftp_wbuf_job *job )
+{
+    wbuf->running = 0;
+    wbuf->backlog -= job->len;
+
+    if ( !( wbuf->jobs = job->next ) )
+    {
+        wbuf->jobs_tail = NULL;
+    }
+
+    if ( job->status )
+    {
+        if ( !wbuf->status )
+        {
+            wbuf->status = job->status;
+        }
+
+    } else
+    {
+        wbuf->writes += job->len ? 1 : 0;
+        wbuf->syncs += job->sync ? 1 : 0;
+    }
+
+    tftp_wbuf_release ( job );
+}
+
+/* Start first queued job unless one is running, job that cannot be handed over runs here */
+static void tftp_wbuf_start ( struct tftp_wbuf *wbuf )
+{
+    struct tftp_wbuf_job *job;
+
+    while ( ( job = wbuf->jobs ) && !wbuf->running )
+    {
+        wbuf->running = 1;
+
+        if ( wbuf->submit ( wbuf->submit_ctx, job ) >= 0 )
+        {
+            return;
+        }
+
+        tftp_wbuf_run ( job );
+        tftp_wbuf_settle ( wbuf, job );
+    }
+}
+
+/* Queue job writing first len buffered bytes, buffer goes with job; returns -1 if background
+   writes failed */
+static int tftp_wbuf_queue ( struct tftp_wbuf *wbuf, size_t len, int sync )
+{
+    unsigned char *data = NULL;
+    struct tftp_wbuf_job *job;
+
+    if ( !( job = ( struct tftp_wbuf_job * ) calloc ( 1, sizeof ( struct tftp_wbuf_job ) ) ) )
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    /* bytes past len stay buffered in fresh buffer */
+    if ( len && !( data = ( unsigned char * ) malloc ( TFTP_WBUF_SIZE + TFTP_BLOCKSIZE_MAX ) ) )
+    {
+        free ( job );
+        errno = ENOMEM;
+        return -1;
+    }
+
+    /* transfer may close its file before job has run */
+    if ( ( job->fd = fcntl ( wbuf->fd, F_DUPFD_CLOEXEC, 0 ) ) < 0 )
+    {
+        free ( data );
+        free ( job );
+        return -1;
+    }
+
+    if ( len )
+    {
+        memcpy ( data, wbuf->data + len, wbuf->len - len );
+        job->data = wbuf->data;
+        wbuf->data = data;
+    }
+
+    job->len = len;
+    job->offset = wbuf->offset;
+    job->sync = sync;
+    job->wbuf = wbuf;
+    job->owner = wbuf->owner;
+
+    wbuf->offset += len;
+    wbuf->len -= len;
+    wbuf->backlog += len;
+
+    if ( wbuf->jobs_tail )
+    {
+        wbuf->jobs_tail->next = job;
+    } else
+    {
+        wbuf->jobs = job;
+    }
+    wbuf->jobs_tail = job;
+
+    tftp_wbuf_start ( wbuf );
+
+    if ( wbuf->status )
+    {
+        errno = wbuf->status;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Settle job that has run, next one of its buffer is started; returns owner of buffer or
+   NULL if buffer is gone already */
+void *tftp_wbuf_done ( struct tftp_wbuf_job *job )
+{
+    struct tftp_wbuf *wbuf = job->wbuf;
+
+    if ( !wbuf )
+    {
+        tftp_wbuf_release ( job );
+        return NULL;
+    }
+
+    tftp_wbuf_settle ( wbuf, job );
+    tftp_wbuf_start ( wbuf );
+
+    return wbuf->owner;
+}
+
+/* Make written data durable once period is over */
+static int tftp_wbuf_sync ( struct tftp_wbuf *wbuf, size_t period )
+{
+    if ( wbuf->unsynced < period || !wbuf->unsynced )
+    {
+        return 0;
+    }
+
+    if ( fdatasync ( wbuf->fd ) < 0 )
+    {
+        return -1;
+    }
+
+    wbuf->syncs++;
+    wbuf->unsynced = 0;
+
+    return 0;
+}
+
+/* Buffer data to be written at file offset, non-adjacent data flushes buffer first */
+int tftp_wbuf_write ( struct tftp_wbuf *wbuf, const void *data, size_t len,
+    unsigned long long offset )
+{
+    /* block arrived out of order or buffer was not flushed when due */
+    if ( wbuf->len && ( offset != wbuf->offset + wbuf->len
+            || wbuf->len + len > TFTP_WBUF_SIZE + TFTP_BLOCKSIZE_MAX )
+        && tftp_wbuf_flush ( wbuf, 1 ) < 0 )
+    {
+        return -1;
+    }
+
+    if ( !wbuf->data && !( wbuf->data =
+            ( unsigned char * ) malloc ( TFTP_WBUF_SIZE + TFTP_BLOCKSIZE_MAX ) ) )
+    {
+        /* no memory for buffer, write through */
+        wbuf->unsynced += len;
+        if ( tftp_wbuf_pwrite ( wbuf->fd, ( const unsigned char * ) data, len, offset ) < 0 )
+        {
+            return -1;
+        }
+        wbuf->writes++;
+        return 0;
+    }
+
+    if ( !wbuf->len )
+    {
+        wbuf->offset = offset;
+    }
+
+    memcpy ( wbuf->data + wbuf->len, data, len );
+    wbuf->len += len;
+
+    return 0;
+}
+
+/* Check whether enough data is buffered to be written */
+int tftp_wbuf_due ( const struct tftp_wbuf *wbuf )
+{
+    return wbuf->len >= TFTP_WBUF_SIZE;
+}
+
+/* Check whether background writes fall so far behind that sender should wait */
+int tftp_wbuf_busy ( const struct tftp_wbuf *wbuf )
+{
+    return wbuf->backlog > TFTP_WBUF_BACKLOG;
+}
+
+/* Check whether background writes are still pending */
+int tftp_wbuf_pending ( const struct tftp_wbuf *wbuf )
+{
+    return wbuf->jobs != NULL;
+}
+
+/* Write buffered data up to aligned file offset, all of it if tail is set */
+int tftp_wbuf_flush ( struct tftp_wbuf *wbuf, int tail )
+{
+    int sync;
+    size_t len = wbuf->len;
+    unsigned long long end;
+
+    /* partial page at the end is completed by next blocks */
+    if ( !tail )
+    {
+        end = ( wbuf->offset + wbuf->len ) & ~( unsigned long long ) ( TFTP_WBUF_ALIGN - 1 );
+        len = end > wbuf->offset ? end - wbuf->offset : 0;
+    }
+
+    if ( !len )
+    {
+        return 0;
+    }
+
+    /* period is synced by job ending it */
+    if ( wbuf->submit )
+    {
+        wbuf->unsynced += len;
+        if ( ( sync = wbuf->policy == TFTP_SYNC_PERIODIC && wbuf->unsynced >= wbuf->period ) )
+        {
+            wbuf->unsynced = 0;
+        }
+
+        return tftp_wbuf_queue ( wbuf, len, sync );
+    }
+
+    if ( tftp_wbuf_pwrite ( wbuf->fd, wbuf->data, len, wbuf->offset ) < 0 )
+    {
+        return -1;
+    }
+
+    wbuf->writes++;
+    memmove ( wbuf->data, wbuf->data + len, wbuf->len - len );
+    wbuf->offset += len;
+    wbuf->len -= len;
+    wbuf->unsynced += len;
+
+    if ( wbuf->policy == TFTP_SYNC_PERIODIC )
+    {
+        return tftp_wbuf_sync ( wbuf, wbuf->period );
+    }
+
+    return 0;
+}
+
+/* Write all buffered data and make it durable as policy demands, returns 1 if background
+   writes are still pending */
+int tftp_wbuf_finish ( struct tftp_wbuf *wbuf )
+{
+    int sync = wbuf->policy != TFTP_SYNC_NONE;
+
+    if ( !wbuf->submit )
+    {
+        if ( tftp_wbuf_flush ( wbuf, 1 ) < 0 )
+        {
+            return -1;
+        }
+
+        return sync ? tftp_wbuf_sync ( wbuf, 0 ) : 0;
+    }
+
+    /* last job syncs whole file */
+    wbuf->unsynced += wbuf->len;
+    if ( ( wbuf->len || ( sync && wbuf->unsynced ) )
+        && tftp_wbuf_queue ( wbuf, wbuf->len, sync ) < 0 )
+    {
+        return -1;
+    }
+
+    if ( sync )
+    {
+        wbuf->unsynced = 0;
+    }
+
+    if ( wbuf->status )
+    {
+        errno = wbuf->status;
+        return -1;
+    }
+
+    return tftp_wbuf_pending ( wbuf );
+}
+
+/* Release write-behind buffer, data still buffered is written out first */
+void tftp_wbuf_free ( struct tftp_wbuf *wbuf )
+{
+    struct tftp_wbuf_job *job;
+    struct tftp_wbuf_job *next;
+
+    /* partial file stays resumable */
+    if ( wbuf->len )
+    {
+        tftp_wbuf_flush ( wbuf, 1 );
+    }
+
+    /* pending jobs outlive buffer, waiting ones are handed over at once */
+    for ( job = wbuf->jobs; job; job = next )
+    {
+        next = job->next;
+        job->wbuf = NULL;
+
+        if ( job == wbuf->jobs && wbuf->running )
+        {
+            continue;
+        }
+
+        if ( wbuf->submit ( wbuf->submit_ctx, job ) < 0 )
+        {
+            tftp_wbuf_run ( job );
+            tftp_wbuf_release ( job );
+        }
+    }
+
+    wbuf->jobs = NULL;
+    wbuf->jobs_tail = NULL;
+    wbuf->running = 0;
+    free ( wbuf->data );
+    wbuf->data = NULL;
+    wbuf->len = 0;
+}
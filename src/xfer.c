@@ -0,0 +1,1807 @@
+/* ------------------------------------------------------------------
+ * Little Tftp - Transfer State Machine
+ * ------------------------------------------------------------------ */
+
+#include "xfer.h"
+
+/* Allocate transfer socket bound to local address and connected to peer */
+int tftp_xfer_socket ( const struct sockaddr_in *laddr, const struct sockaddr_in *peer )
+{
+    int sock;
+    struct sockaddr_in addr;
+
+    /* allocate non-blocking socket */
+    if ( ( sock = socket ( AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 ) ) < 0 )
+    {
+        return -1;
+    }
+
+    /* bind socket to ephemeral port, it becomes transfer ID */
+    memset ( &addr, '\0', sizeof ( addr ) );
+    addr.sin_family = AF_INET;
+    addr.sin_addr = laddr->sin_addr;
+    addr.sin_port = 0;
+
+    if ( bind ( sock, ( struct sockaddr * ) &addr, sizeof ( addr ) ) < 0 )
+    {
+        close ( sock );
+        return -1;
+    }
+
+    /* accept datagrams from transfer peer only */
+    if ( peer && connect ( sock, ( const struct sockaddr * ) peer, sizeof ( *peer ) ) < 0 )
+    {
+        close ( sock );
+        return -1;
+    }
+
+    return sock;
+}
+
+/* Allocate unconnected transfer socket sending to multicast group over local interface */
+int tftp_xfer_mcast_socket ( const struct sockaddr_in *laddr )
+{
+    int sock;
+    unsigned char loop = 1;
+
+    /* members talk to session from different ports */
+    if ( ( sock = tftp_xfer_socket ( laddr, NULL ) ) < 0 )
+    {
+        return -1;
+    }
+
+    /* members on this host receive group datagrams as well */
+    if ( setsockopt ( sock, IPPROTO_IP, IP_MULTICAST_IF, &laddr->sin_addr,
+            sizeof ( laddr->sin_addr ) ) < 0
+        || setsockopt ( sock, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof ( loop ) ) < 0 )
+    {
+        close ( sock );
+        return -1;
+    }
+
+    return sock;
+}
+
+/* Grow socket buffer to fit given number of whole windows of data packets */
+static void tftp_xfer_window_buffer ( struct tftp_xfer *xfer, int sock, unsigned int nwindows )
+{
+    int size;
+    int current;
+    int optname;
+    socklen_t optlen;
+    unsigned long long window;
+
+    /* kernel also accounts bookkeeping of each datagram */
+    window = ( unsigned long long ) nwindows * xfer->opts.windowsize
+        * ( 1024 + xfer->opts.blksize );
+    size = window < TFTP_WINDOW_BUFFER_MAX ? window : TFTP_WINDOW_BUFFER_MAX;
+    optname = xfer->role == TFTP_XFER_ROLE_SEND ? SO_SNDBUF : SO_RCVBUF;
+
+    /* never shrink default buffer, whole window arrives at once */
+    optlen = sizeof ( current );
+    if ( getsockopt ( sock, SOL_SOCKET, optname, &current, &optlen ) >= 0 && current >= size )
+    {
+        return;
+    }
+
+    setsockopt ( sock, SOL_SOCKET, optname, &size, sizeof ( size ) );
+}
+
+/* Map file read-only, blocks are then sent straight from page cache */
+static void tftp_xfer_map ( struct tftp_xfer *xfer )
+{
+    void *map;
+    struct stat st;
+
+    /* empty or special files are read as usual */
+    if ( fstat ( xfer->fd, &st ) < 0 || !S_ISREG ( st.st_mode ) || !st.st_size )
+    {
+        return;
+    }
+
+    if ( ( map = mmap ( NULL, st.st_size, PROT_READ, MAP_SHARED, xfer->fd, 0 ) ) == MAP_FAILED )
+    {
+        return;
+    }
+
+    madvise ( map, st.st_size, MADV_SEQUENTIAL );
+
+    xfer->map = ( const unsigned char * ) map;
+    xfer->map_size = st.st_size;
+    xfer->map_mtime = st.st_mtim;
+}
+
+/* Map file to be sent, translated file is read instead and only its size is noted */
+static void tftp_xfer_prepare_file ( struct tftp_xfer *xfer )
+{
+    struct stat st;
+
+    /* read of truncated file is short where mapping would fault */
+    if ( xfer->netascii )
+    {
+        if ( fstat ( xfer->fd, &st ) >= 0 && S_ISREG ( st.st_mode ) )
+        {
+            xfer->ascii_size = st.st_size;
+        }
+        return;
+    }
+
+    tftp_xfer_map ( xfer );
+}
+
+/* Apply negotiated timeout to retransmission timer or restore default limit */
+static void tftp_xfer_bound_timeout ( struct tftp_xfer *xfer )
+{
+    if ( xfer->opts.mask & TFTP_OPTION_TIMEOUT )
+    {
+        tftp_rtt_bound ( &xfer->retx.rtt, xfer->opts.timeout * 1000000ULL );
+    } else
+    {
+        xfer->retx.rtt.rto_max = TFTP_RTO_MAX_MSEC * 1000ULL;
+    }
+}
+
+/* Prepare multicast session of sender or group socket of receiver */
+static int tftp_xfer_mcast_init ( struct tftp_xfer *xfer )
+{
+    /* requesting peer is first master of session */
+    if ( xfer->role == TFTP_XFER_ROLE_SEND )
+    {
+        if ( !( xfer->members =
+                ( struct sockaddr_in * ) malloc ( sizeof ( struct sockaddr_in ) ) ) )
+        {
+            return -1;
+        }
+
+        xfer->members[0] = xfer->peer;
+        xfer->nmembers = 1;
+        xfer->members_limit = 1;
+
+        memset ( &xfer->group, '\0', sizeof ( xfer->group ) );
+        xfer->group.sin_family = AF_INET;
+        xfer->group.sin_addr = xfer->opts.mcast_addr;
+        xfer->group.sin_port = htons ( xfer->opts.mcast_port );
+        return 0;
+    }
+
+    /* group socket is bound once server assigns group, it is watched from the start */
+    return ( xfer->msock = socket ( AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 ) );
+}
+
+/* Allocate transfer structure with packet buffer fitting block size */
+struct tftp_xfer *tftp_xfer_new ( int sock, int fd, int role,
+    const struct sockaddr_in *peer, const struct tftp_opts *opts, const char *progname )
+{
+    size_t limit;
+    unsigned int nslots;
+    struct tftp_xfer *xfer;
+
+    /* packet buffer also holds OACK and request packets */
+    limit = 4 + ( opts->blksize > TFTP_BLOCKSIZE ? opts->blksize : TFTP_BLOCKSIZE );
+
+    /* send batch holds whole window within memory budget */
+    nslots = opts->windowsize < TFTP_BATCH_LIMIT ? opts->windowsize : TFTP_BATCH_LIMIT;
+    if ( nslots > TFTP_BATCH_BYTES / limit )
+    {
+        nslots = TFTP_BATCH_BYTES / limit;
+    }
+    if ( !nslots )
+    {
+        nslots = 1;
+    }
+
+    if ( !( xfer = ( struct tftp_xfer * ) malloc ( sizeof ( struct tftp_xfer ) + limit ) ) )
+    {
+        return NULL;
+    }
+
+    memset ( xfer, '\0', sizeof ( struct tftp_xfer ) );
+    xfer->sock = sock;
+    xfer->msock = -1;
+    xfer->fd = fd;
+    xfer->role = role;
+    xfer->state = TFTP_XFER_STATE_ACTIVE;
+    xfer->opts = *opts;
+    xfer->peer = *peer;
+    tftp_retx_init ( &xfer->retx, 1 );
+    tftp_xfer_bound_timeout ( xfer );
+    xfer->progname = progname;
+    xfer->packet = ( unsigned char * ) ( xfer + 1 );
+    xfer->packet_limit = limit;
+    tftp_wbuf_init ( &xfer->wbuf, fd );
+    tftp_rbuf_init ( &xfer->rbuf, fd );
+
+    if ( tftp_io_batch_init ( &xfer->tx, nslots, limit ) < 0 )
+    {
+        free ( xfer );
+        return NULL;
+    }
+
+    if ( opts->mask & TFTP_OPTION_MULTICAST && tftp_xfer_mcast_init ( xfer ) < 0 )
+    {
+        tftp_io_batch_free ( &xfer->tx );
+        free ( xfer->members );
+        free ( xfer );
+        return NULL;
+    }
+
+    /* socket buffer should hold whole window, sent as few datagrams as possible */
+    if ( opts->windowsize > 1 )
+    {
+        tftp_xfer_window_buffer ( xfer, sock, 1 );
+
+        if ( role == TFTP_XFER_ROLE_SEND )
+        {
+            tftp_io_batch_gso ( &xfer->tx, sock );
+        }
+    }
+
+    return xfer;
+}
+
+/* Release transfer structure, its socket and file */
+void tftp_xfer_free ( struct tftp_xfer *xfer )
+{
+    tftp_wbuf_free ( &xfer->wbuf );
+    tftp_rbuf_free ( &xfer->rbuf );
+
+    if ( xfer->fd >= 0 )
+    {
+        close ( xfer->fd );
+    }
+
+    /* queued packets may still reference the mapping */
+    tftp_io_batch_free ( &xfer->tx );
+
+    if ( xfer->map && !xfer->cached )
+    {
+        munmap ( ( void * ) xfer->map, xfer->map_size );
+    }
+
+    /* datagrams held back by fault injection are in flight already */
+    if ( tftp_fault_enabled (  ) )
+    {
+        tftp_fault_close ( xfer->msock );
+        tftp_fault_close ( xfer->sock );
+    }
+
+    if ( xfer->msock >= 0 )
+    {
+        close ( xfer->msock );
+    }
+
+    close ( xfer->sock );
+    free ( xfer->ascii_marks );
+    free ( xfer->ascii );
+    free ( xfer->blocks );
+    free ( xfer->members );
+    free ( xfer );
+}
+
+/* Arm retransmission timer */
+static void tftp_xfer_arm ( struct tftp_xfer *xfer )
+{
+    unsigned long long timeout = xfer->retx.rtt.rto;
+    unsigned long long dally;
+
+    /* dallying receiver outwaits retransmission of final block */
+    dally = xfer->opts.mask & TFTP_OPTION_TIMEOUT ? xfer->opts.timeout * 1000000ULL
+        : TFTP_TIMEOUT_MSEC * 1000ULL;
+
+    if ( xfer->role == TFTP_XFER_ROLE_RECV && xfer->lastseq && timeout < dally )
+    {
+        timeout = dally;
+    }
+
+    xfer->deadline = tftp_time_usec (  ) + timeout;
+}
+
+/* Send all queued packets at once, returns 1 if socket buffer is full */
+int tftp_xfer_flush ( struct tftp_xfer *xfer )
+{
+    if ( tftp_io_flush ( xfer->sock, &xfer->tx, &xfer->io ) < 0 )
+    {
+        /* resume once socket becomes writable */
+        if ( errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS )
+        {
+            xfer->want_output = 1;
+            return 1;
+        }
+
+        /* mapped file was truncated below queued blocks */
+        if ( errno == EFAULT && xfer->map && !xfer->cached
+            && xfer->state == TFTP_XFER_STATE_ACTIVE )
+        {
+            tftp_log ( TFTP_LOG_ERROR, "\n[%s] file truncated while being sent.\n",
+                xfer->progname );
+            tftp_xfer_abort ( xfer, ESTALE );
+            return -1;
+        }
+
+        if ( xfer->state == TFTP_XFER_STATE_ACTIVE )
+        {
+            xfer->state = TFTP_XFER_STATE_FAILED;
+            xfer->status = errno;
+            tftp_log ( TFTP_LOG_ERROR, "\n[%s] failed to send data: %i\n", xfer->progname, errno );
+        }
+
+        xfer->tx.count = 0;
+        return -1;
+    }
+
+    /* some packets did not fit into socket buffer */
+    xfer->want_output = xfer->tx.count > 0;
+
+    return xfer->want_output;
+}
+
+/* Get free send slot, full batch is flushed first; NULL if socket buffer is full */
+static unsigned char *tftp_xfer_slot ( struct tftp_xfer *xfer )
+{
+    unsigned char *slot;
+
+    if ( !( slot = tftp_io_batch_slot ( &xfer->tx ) ) && !tftp_xfer_flush ( xfer ) )
+    {
+        slot = tftp_io_batch_slot ( &xfer->tx );
+    }
+
+    return slot;
+}
+
+/* Queue packet prepared in free send slot to given address and arm retransmission timer */
+static void tftp_xfer_commit_to ( struct tftp_xfer *xfer, size_t len, const void *data,
+    size_t datalen, const struct sockaddr_in *addr )
+{
+    tftp_io_batch_commit_data ( &xfer->tx, len, data, datalen, addr );
+    tftp_xfer_arm ( xfer );
+}
+
+/* Queue packet prepared in free send slot followed by data and arm retransmission timer */
+static void tftp_xfer_commit ( struct tftp_xfer *xfer, size_t len, const void *data,
+    size_t datalen )
+{
+    /* request goes to server port, transfer ID is not known yet; multicast master
+       is addressed on unconnected socket */
+    tftp_xfer_commit_to ( xfer, len, data, datalen,
+        xfer->request || xfer->members ? &xfer->peer : NULL );
+}
+
+/* Abort transfer and notify peer with ERROR packet */
+void tftp_xfer_abort ( struct tftp_xfer *xfer, int status )
+{
+    ssize_t len;
+    unsigned char *slot;
+
+    xfer->state = TFTP_XFER_STATE_FAILED;
+    xfer->status = status;
+
+    /* pending packets are pointless now, send ERROR alone */
+    xfer->tx.count = 0;
+    slot = tftp_io_batch_slot ( &xfer->tx );
+
+    if ( ( len = tftp_prepare_error ( slot, xfer->tx.slot_size,
+                tftp_errno_to_code ( status ) ) ) >= 0 )
+    {
+        /* whole multicast session is told at once */
+        if ( xfer->members )
+        {
+            tftp_xfer_commit_to ( xfer, len, NULL, 0, &xfer->group );
+        } else
+        {
+            tftp_xfer_commit ( xfer, len, NULL, 0 );
+        }
+        tftp_xfer_flush ( xfer );
+    }
+}
+
+/* Queue current packet, returns 1 if socket buffer is full */
+static int tftp_xfer_transmit ( struct tftp_xfer *xfer )
+{
+    unsigned char *slot;
+
+    if ( !( slot = tftp_xfer_slot ( xfer ) ) )
+    {
+        /* retransmission timer recovers packet that did not fit */
+        tftp_xfer_arm ( xfer );
+        return xfer->state == TFTP_XFER_STATE_ACTIVE ? 1 : -1;
+    }
+
+    memcpy ( slot, xfer->packet, xfer->packet_len );
+    tftp_xfer_commit ( xfer, xfer->packet_len, NULL, 0 );
+
+    return 0;
+}
+
+/* Restart sending from given block, queued blocks are dropped and sent again */
+static void tftp_xfer_rewind ( struct tftp_xfer *xfer, unsigned long long seq )
+{
+    xfer->sent = seq;
+    xfer->tx.count = 0;
+}
+
+/* Translate block following previous one into send slot, returns length of block */
+static ssize_t tftp_xfer_encode_block ( struct tftp_xfer *xfer, unsigned char *slot,
+    unsigned long long seq )
+{
+    size_t len;
+    size_t consumed;
+    ssize_t avail;
+    const unsigned char *src;
+    struct tftp_netascii_mark mark = xfer->ascii_marks[seq % xfer->ascii_nmarks];
+
+    /* every byte of file takes one byte of block at least */
+    if ( xfer->cached )
+    {
+        src = xfer->map + mark.offset;
+        avail = xfer->map_size - mark.offset;
+        if ( ( size_t ) avail > xfer->opts.blksize )
+        {
+            avail = xfer->opts.blksize;
+        }
+
+    } else
+    {
+        if ( ( avail = tftp_rbuf_read ( &xfer->rbuf, xfer->ascii, xfer->opts.blksize,
+                    mark.offset ) ) < 0 )
+        {
+            return -1;
+        }
+
+        /* file was truncated below block */
+        if ( ( size_t ) avail < xfer->opts.blksize && mark.offset + avail < xfer->ascii_size )
+        {
+            errno = ESTALE;
+            return -1;
+        }
+
+        src = xfer->ascii;
+    }
+
+    len = tftp_netascii_encode ( src, avail, &consumed, slot + 4, xfer->opts.blksize,
+        &mark.split );
+
+    /* next block starts where this one ended, it is resent from there too */
+    mark.offset += consumed;
+    xfer->ascii_marks[( seq + 1 ) % xfer->ascii_nmarks] = mark;
+
+    return len;
+}
+
+/* Read data block with given sequence number into send slot and queue it */
+static int tftp_xfer_load_block ( struct tftp_xfer *xfer, unsigned char *slot,
+    unsigned long long seq )
+{
+    ssize_t len;
+    off_t offset;
+
+    offset = ( off_t ) ( xfer->opts.offset + ( seq - 1 ) * xfer->opts.blksize );
+
+    /* file is read ahead by window worth of blocks at least */
+    if ( !xfer->rbuf.size && !xfer->cached )
+    {
+        tftp_rbuf_setup ( &xfer->rbuf, xfer->opts.blksize * xfer->opts.windowsize );
+    }
+
+    if ( xfer->netascii )
+    {
+        /* translated block is sent from slot */
+        if ( ( len = tftp_xfer_encode_block ( xfer, slot, seq ) ) < 0 )
+        {
+            tftp_log ( TFTP_LOG_ERROR, "\n[%s] failed to read file: %i\n", xfer->progname, errno );
+            tftp_xfer_abort ( xfer, errno );
+            return -1;
+        }
+
+    } else if ( xfer->map )
+    {
+        /* block is referenced in mapping, never touched here */
+        len = ( size_t ) offset < xfer->map_size ? xfer->map_size - offset : 0;
+        if ( ( size_t ) len > xfer->opts.blksize )
+        {
+            len = xfer->opts.blksize;
+        }
+
+        /* pages are faulted in by kernel ahead of sends */
+        if ( !xfer->cached )
+        {
+            tftp_rbuf_advise ( &xfer->rbuf, offset );
+        }
+
+    } else
+    {
+        /* cut block from chunk read at once */
+        if ( ( len = tftp_rbuf_read ( &xfer->rbuf, slot + 4, xfer->opts.blksize, offset ) ) < 0 )
+        {
+            tftp_log ( TFTP_LOG_ERROR, "\n[%s] failed to read file: %i\n", xfer->progname, errno );
+            tftp_xfer_abort ( xfer, errno );
+            return -1;
+        }
+    }
+
+    /* short block terminates transfer */
+    if ( ( size_t ) len < xfer->opts.blksize )
+    {
+        xfer->lastseq = seq;
+        xfer->lastlen = len;
+    }
+
+    /* prepare data packet, block number wraps around */
+    tfp_store_ushort_ns ( slot, TFTP_OPCODE_DATA );
+    tfp_store_ushort_ns ( slot + 2, ( unsigned short ) seq );
+
+    /* multicast blocks go to whole group */
+    if ( xfer->map && !xfer->netascii )
+    {
+        tftp_xfer_commit_to ( xfer, 4, len ? xfer->map + offset : NULL, len,
+            xfer->members ? &xfer->group : NULL );
+    } else
+    {
+        tftp_xfer_commit_to ( xfer, 4 + len, NULL, 0, xfer->members ? &xfer->group : NULL );
+    }
+
+    return 0;
+}
+
+/* Verify mapped file keeps size and modification time it was mapped with */
+static int tftp_xfer_check_map ( struct tftp_xfer *xfer )
+{
+    struct stat st;
+
+    if ( fstat ( xfer->fd, &st ) < 0 )
+    {
+        return -1;
+    }
+
+    if ( ( size_t ) st.st_size != xfer->map_size
+        || st.st_mtim.tv_sec != xfer->map_mtime.tv_sec
+        || st.st_mtim.tv_nsec != xfer->map_mtime.tv_nsec )
+    {
+        errno = ESTALE;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Check whether window has room for next block */
+static int tftp_xfer_window_open ( const struct tftp_xfer *xfer )
+{
+    return xfer->sent - xfer->acked < xfer->opts.windowsize
+        && ( !xfer->lastseq || xfer->sent < xfer->lastseq );
+}
+
+/* Queue block following last one sent, returns -1 if it could not be queued */
+static int tftp_xfer_send_block ( struct tftp_xfer *xfer )
+{
+    unsigned char *slot;
+
+    /* output resumes once socket becomes writable */
+    if ( !( slot = tftp_xfer_slot ( xfer ) )
+        || tftp_xfer_load_block ( xfer, slot, xfer->sent + 1 ) < 0 )
+    {
+        return -1;
+    }
+
+    /* time blocks sent for the first time only, replies to resent ones are ambiguous */
+    if ( ++xfer->sent > xfer->frontier )
+    {
+        xfer->frontier = xfer->sent;
+        tftp_rtt_start ( &xfer->retx.rtt, xfer->sent, tftp_time_usec (  ) );
+    } else
+    {
+        tftp_retx_resent ( &xfer->retx, 1 );
+    }
+
+    return 0;
+}
+
+/* Queue data blocks until window is full */
+static void tftp_xfer_send_window ( struct tftp_xfer *xfer )
+{
+    /* file modified while mapped, blocks would mix old and new content */
+    if ( xfer->map && !xfer->cached && tftp_xfer_check_map ( xfer ) < 0 )
+    {
+        tftp_log ( TFTP_LOG_ERROR, "\n[%s] file changed while being sent.\n", xfer->progname );
+        tftp_xfer_abort ( xfer, errno );
+        return;
+    }
+
+    /* shaped transfer sends its window block by block on its turns */
+    if ( xfer->shaper )
+    {
+        tftp_shaper_wake ( xfer->shaper, xfer );
+        return;
+    }
+
+    while ( tftp_xfer_window_open ( xfer ) )
+    {
+        if ( tftp_xfer_send_block ( xfer ) < 0 )
+        {
+            return;
+        }
+    }
+}
+
+/* Send ACK packet for last block received in order */
+static int tftp_xfer_send_ack ( struct tftp_xfer *xfer )
+{
+    xfer->wincount = 0;
+    xfer->shape_ack = 0;
+
+    tfp_store_ushort_ns ( xfer->packet, TFTP_OPCODE_ACK );
+    tfp_store_ushort_ns ( xfer->packet + 2, ( unsigned short ) xfer->received );
+    xfer->packet_len = 4;
+
+    return tftp_xfer_transmit ( xfer ) < 0 ? -1 : 0;
+}
+
+/* Acknowledge whole window, round trip is timed until next DATA */
+static int tftp_xfer_send_window_ack ( struct tftp_xfer *xfer )
+{
+    tftp_rtt_start ( &xfer->retx.rtt, xfer->received + 1, tftp_time_usec (  ) );
+
+    return tftp_xfer_send_ack ( xfer );
+}
+
+/* Get bytes next packet held back by shaper accounts for, 0 if there is none */
+size_t tftp_xfer_pending ( const struct tftp_xfer *xfer )
+{
+    if ( xfer->state != TFTP_XFER_STATE_ACTIVE || xfer->want_output )
+    {
+        return 0;
+    }
+
+    /* ACK lets sender go on with next window */
+    if ( xfer->role == TFTP_XFER_ROLE_RECV )
+    {
+        return xfer->shape_ack ? xfer->wincount * ( 4 + xfer->opts.blksize ) : 0;
+    }
+
+    return !xfer->handshake && tftp_xfer_window_open ( xfer ) ? 4 + xfer->opts.blksize : 0;
+}
+
+/* Queue next packet held back by shaper, returns bytes it accounts for or -1 if it was not
+   queued */
+ssize_t tftp_xfer_send_next ( struct tftp_xfer *xfer )
+{
+    size_t len;
+
+    if ( xfer->role == TFTP_XFER_ROLE_RECV )
+    {
+        len = tftp_xfer_pending ( xfer );
+        return tftp_xfer_send_window_ack ( xfer ) < 0 ? -1 : ( ssize_t ) len;
+    }
+
+    if ( tftp_xfer_send_block ( xfer ) < 0 )
+    {
+        return -1;
+    }
+
+    return 4 + ( xfer->sent == xfer->lastseq ? xfer->lastlen : xfer->opts.blksize );
+}
+
+/* Translate file contents from and to netascii, must precede start of transfer */
+int tftp_xfer_netascii ( struct tftp_xfer *xfer )
+{
+    /* sender keeps file position of every block it may have to resend */
+    if ( xfer->role == TFTP_XFER_ROLE_SEND )
+    {
+        xfer->ascii_nmarks = xfer->opts.windowsize + 1;
+        if ( !( xfer->ascii_marks = ( struct tftp_netascii_mark * ) calloc ( xfer->ascii_nmarks,
+                    sizeof ( struct tftp_netascii_mark ) ) ) )
+        {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+
+    /* unmapped file is read into it, received block is decoded into it */
+    if ( !( xfer->ascii = ( unsigned char * ) malloc ( xfer->packet_limit + 1 ) ) )
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    xfer->netascii = 1;
+
+    return 0;
+}
+
+/* Send cached file contents instead of mapping file, entry reference is kept by caller */
+void tftp_xfer_attach ( struct tftp_xfer *xfer, struct tftp_cache_entry *entry,
+    const unsigned char *data, size_t size )
+{
+    xfer->cached = entry;
+    xfer->map = data;
+    xfer->map_size = size;
+}
+
+/* Position received file at negotiated offset, anything past it is dropped */
+static int tftp_xfer_seek ( struct tftp_xfer *xfer )
+{
+    if ( ftruncate ( xfer->fd, ( off_t ) xfer->opts.offset ) < 0
+        || lseek ( xfer->fd, ( off_t ) xfer->opts.offset, SEEK_SET ) < 0 )
+    {
+        tftp_log ( TFTP_LOG_ERROR, "\n[%s] failed to seek file: %i\n", xfer->progname, errno );
+        tftp_xfer_abort ( xfer, errno );
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Start transfer by sending first OACK, DATA or ACK packet */
+int tftp_xfer_start ( struct tftp_xfer *xfer )
+{
+    ssize_t len;
+
+    xfer->started = tftp_time_usec (  );
+
+    if ( xfer->role == TFTP_XFER_ROLE_SEND && !xfer->map )
+    {
+        tftp_xfer_prepare_file ( xfer );
+    }
+
+    /* partial upload is appended to */
+    if ( xfer->role == TFTP_XFER_ROLE_RECV && xfer->opts.mask & TFTP_OPTION_OFFSET
+        && tftp_xfer_seek ( xfer ) < 0 )
+    {
+        return -1;
+    }
+
+    /* acknowledge options, peer replies with ACK or DATA for block #1 */
+    if ( xfer->opts.mask )
+    {
+        if ( ( len = tftp_prepare_oack ( xfer->packet, xfer->packet_limit, &xfer->opts ) ) < 0 )
+        {
+            tftp_xfer_abort ( xfer, errno );
+            return -1;
+        }
+
+        xfer->handshake = 1;
+        xfer->packet_len = len;
+
+        /* sender awaits ACK for block #0, receiver DATA for block #1 */
+        xfer->retx.expected = xfer->role == TFTP_XFER_ROLE_SEND ? 0 : 1;
+        tftp_rtt_start ( &xfer->retx.rtt, xfer->retx.expected, xfer->started );
+        return tftp_xfer_transmit ( xfer ) < 0 ? -1 : 0;
+    }
+
+    if ( xfer->role == TFTP_XFER_ROLE_SEND )
+    {
+        tftp_xfer_send_window ( xfer );
+        return xfer->state == TFTP_XFER_STATE_ACTIVE ? 0 : -1;
+    }
+
+    tftp_rtt_start ( &xfer->retx.rtt, 1, xfer->started );
+    return tftp_xfer_send_ack ( xfer );
+}
+
+/* Start transfer by sending RRQ or WRQ packet to request address */
+int tftp_xfer_request ( struct tftp_xfer *xfer, const char *path )
+{
+    ssize_t len;
+    ssize_t optlen;
+    const char *params[] = {
+        path,
+        xfer->netascii ? "netascii" : "octet",
+        NULL
+    };
+
+    if ( xfer->role == TFTP_XFER_ROLE_SEND && !xfer->map )
+    {
+        tftp_xfer_prepare_file ( xfer );
+    }
+
+    xfer->started = tftp_time_usec (  );
+    xfer->request = 1;
+    xfer->handshake = 1;
+
+    /* prepare tftp packet */
+    if ( ( len =
+            tftp_prepare_header ( xfer->packet, xfer->packet_limit,
+                xfer->role == TFTP_XFER_ROLE_SEND ? TFTP_OPCODE_WRQ : TFTP_OPCODE_RRQ,
+                params ) ) < 0
+        || ( optlen =
+            tftp_opts_store ( &xfer->opts, xfer->packet + len,
+                xfer->packet_limit - len ) ) < 0 )
+    {
+        xfer->state = TFTP_XFER_STATE_FAILED;
+        xfer->status = errno;
+        return -1;
+    }
+
+    xfer->packet_len = len + optlen;
+
+    /* any reply from server completes round trip */
+    xfer->retx.expected = 0;
+    tftp_rtt_start ( &xfer->retx.rtt, 0, xfer->started );
+
+    return tftp_xfer_transmit ( xfer ) < 0 ? -1 : 0;
+}
+
+/* Show progress at most once per interval, share of file is known once its size was negotiated */
+static void tftp_xfer_progress ( struct tftp_xfer *xfer, const char *verb )
+{
+    unsigned long long now;
+    unsigned long long nbytes = xfer->opts.offset + xfer->nbytes;
+
+    /* concurrent transfers would overwrite each other's line */
+    if ( xfer->quiet || !tftp_log_enabled ( TFTP_LOG_INFO ) )
+    {
+        return;
+    }
+
+    /* short transfers show no progress at all */
+    now = tftp_time_usec (  );
+    if ( now - ( xfer->progress_at ? xfer->progress_at : xfer->started )
+        < TFTP_LOG_PROGRESS_USEC )
+    {
+        return;
+    }
+
+    xfer->progress_at = now;
+
+    if ( xfer->opts.mask & TFTP_OPTION_TSIZE && xfer->opts.tsize )
+    {
+        /* last block is counted as full one until it is acknowledged */
+        if ( nbytes > xfer->opts.tsize )
+        {
+            nbytes = xfer->opts.tsize;
+        }
+
+        tftp_log ( TFTP_LOG_INFO, "\r[%s] progress: %s %lu blocks (%llu%%)", xfer->progname,
+            verb, ( unsigned long ) xfer->nblocks, nbytes * 100 / xfer->opts.tsize );
+    } else
+    {
+        tftp_log ( TFTP_LOG_INFO, "\r[%s] progress: %s %lu blocks", xfer->progname, verb,
+            ( unsigned long ) xfer->nblocks );
+    }
+}
+
+/* Hand multicast session over to next member, returns -1 if no member is left */
+static int tftp_xfer_promote ( struct tftp_xfer *xfer )
+{
+    ssize_t len;
+
+    /* current master is done or gone */
+    memmove ( xfer->members, xfer->members + 1,
+        --xfer->nmembers * sizeof ( struct sockaddr_in ) );
+    if ( !xfer->nmembers )
+    {
+        return -1;
+    }
+
+    xfer->peer = xfer->members[0];
+    xfer->opts.mcast_master = 1;
+
+    if ( ( len = tftp_prepare_oack ( xfer->packet, xfer->packet_limit, &xfer->opts ) ) < 0 )
+    {
+        tftp_xfer_abort ( xfer, errno );
+        return 0;
+    }
+
+    tftp_log ( TFTP_LOG_INFO, "\n[%s] multicast master handed over, %lu members left.\n",
+        xfer->progname, ( unsigned long ) xfer->nmembers );
+
+    /* new master replies with ACK for blocks it already has */
+    xfer->handshake = 1;
+    xfer->packet_len = len;
+    xfer->retx.retries = 0;
+    tftp_rtt_init ( &xfer->retx.rtt );
+    tftp_xfer_bound_timeout ( xfer );
+    tftp_rtt_start ( &xfer->retx.rtt, 0, tftp_time_usec (  ) );
+    tftp_xfer_transmit ( xfer );
+
+    return 0;
+}
+
+/* Find multicast session member by address, count of members if none */
+static size_t tftp_xfer_find_member ( const struct tftp_xfer *xfer,
+    const struct sockaddr_in *peer )
+{
+    size_t i;
+
+    for ( i = 0; i < xfer->nmembers; i++ )
+    {
+        if ( xfer->members[i].sin_addr.s_addr == peer->sin_addr.s_addr
+            && xfer->members[i].sin_port == peer->sin_port )
+        {
+            break;
+        }
+    }
+
+    return i;
+}
+
+/* Add member to multicast session and send it OACK, master is chosen by session */
+int tftp_xfer_join ( struct tftp_xfer *xfer, const struct sockaddr_in *peer )
+{
+    size_t i;
+    size_t limit;
+    ssize_t len;
+    unsigned char *slot;
+    struct tftp_opts opts;
+    struct sockaddr_in *members;
+
+    /* master retransmitted request, its OACK is resent by timer anyway */
+    if ( !( i = tftp_xfer_find_member ( xfer, peer ) ) )
+    {
+        if ( xfer->handshake )
+        {
+            tftp_retx_resent ( &xfer->retx, 1 );
+            tftp_xfer_transmit ( xfer );
+        }
+        return 0;
+    }
+
+    if ( i == xfer->nmembers )
+    {
+        if ( xfer->nmembers == xfer->members_limit )
+        {
+            limit = xfer->members_limit * 2;
+            if ( !( members = ( struct sockaddr_in * ) realloc ( xfer->members,
+                        limit * sizeof ( struct sockaddr_in ) ) ) )
+            {
+                return ENOMEM;
+            }
+            xfer->members = members;
+            xfer->members_limit = limit;
+        }
+
+        xfer->members[xfer->nmembers++] = *peer;
+    }
+
+    /* member listens to group until it becomes master, its OACK is not retransmitted */
+    if ( !( slot = tftp_xfer_slot ( xfer ) ) )
+    {
+        return 0;
+    }
+
+    opts = xfer->opts;
+    opts.mcast_master = 0;
+
+    if ( ( len = tftp_prepare_oack ( slot, xfer->tx.slot_size, &opts ) ) < 0 )
+    {
+        return errno;
+    }
+
+    tftp_io_batch_commit_data ( &xfer->tx, len, NULL, 0, peer );
+
+    return 0;
+}
+
+/* Handle packet of multicast member other than master, members leave once done */
+static void tftp_xfer_process_member ( struct tftp_xfer *xfer, const struct sockaddr_in *addr,
+    const unsigned char *packet, size_t len )
+{
+    size_t i;
+
+    if ( !tftp_packet_check_length ( xfer->progname, 4, len )
+        || !( i = tftp_xfer_find_member ( xfer, addr ) ) || i == xfer->nmembers )
+    {
+        return;
+    }
+
+    if ( tfp_load_ushort_ns ( packet ) == TFTP_OPCODE_ERROR
+        || ( tfp_load_ushort_ns ( packet ) == TFTP_OPCODE_ACK && xfer->lastseq
+            && tfp_load_ushort_ns ( packet + 2 ) == xfer->lastseq ) )
+    {
+        memmove ( xfer->members + i, xfer->members + i + 1,
+            ( --xfer->nmembers - i ) * sizeof ( struct sockaddr_in ) );
+    }
+}
+
+/* Handle ACK packet as data sender */
+static void tftp_xfer_process_ack ( struct tftp_xfer *xfer, const unsigned char *packet,
+    size_t len )
+{
+    unsigned short block;
+    unsigned long long seq;
+
+    /* OACK retransmitted before our DATA arrived */
+    if ( tfp_load_ushort_ns ( packet ) == TFTP_OPCODE_OACK )
+    {
+        xfer->retx.duplicates++;
+        return;
+    }
+
+    /* opcode must be ACK */
+    if ( tfp_load_ushort_ns ( packet ) != TFTP_OPCODE_ACK )
+    {
+        tftp_dump_packet ( xfer->progname, packet, len );
+        tftp_log ( TFTP_LOG_ERROR, "\n[%s] expected an ACK packet.\n", xfer->progname );
+        tftp_xfer_abort ( xfer, EINVAL );
+        return;
+    }
+
+    block = tfp_load_ushort_ns ( packet + 2 );
+
+    if ( xfer->members )
+    {
+        /* multicast blocks never wrap around, new master acknowledges blocks it already has */
+        seq = block;
+        if ( seq > xfer->frontier || ( !xfer->handshake
+                && tftp_retx_match ( &xfer->retx, seq ) == TFTP_RETX_DUPLICATE ) )
+        {
+            return;
+        }
+        xfer->handshake = 0;
+
+    } else if ( xfer->handshake )
+    {
+        /* OACK or WRQ acknowledged as block #0 */
+        if ( block != 0 )
+        {
+            tftp_log ( TFTP_LOG_DEBUG, "\n[%s] ACK: expected block #0, got #%u - ignored.\n",
+                xfer->progname, block );
+            return;
+        }
+
+        xfer->handshake = 0;
+        tftp_retx_accept ( &xfer->retx, 0, tftp_time_usec (  ) );
+        tftp_xfer_send_window ( xfer );
+        return;
+
+    } else
+    {
+        /* map block number onto blocks sent so far, it may have wrapped around */
+        seq = tftp_block_seq ( xfer->sent, block );
+
+        /* stale ACK, resending on it would duplicate every following block */
+        if ( tftp_retx_match ( &xfer->retx, seq ) == TFTP_RETX_DUPLICATE )
+        {
+            return;
+        }
+    }
+
+    xfer->acked = seq;
+    tftp_retx_accept ( &xfer->retx, seq, tftp_time_usec (  ) );
+    xfer->nblocks = seq;
+    xfer->nbytes = seq * xfer->opts.blksize;
+
+    tftp_xfer_progress ( xfer, "sent" );
+
+    /* last block acknowledged, multicast session goes on while members are left */
+    if ( xfer->lastseq && seq == xfer->lastseq )
+    {
+        xfer->nbytes -= xfer->opts.blksize - xfer->lastlen;
+        if ( !xfer->members || tftp_xfer_promote ( xfer ) < 0 )
+        {
+            xfer->state = TFTP_XFER_STATE_DONE;
+        }
+        return;
+    }
+
+    /* receiver reports gap or multicast master has later blocks, continue after its ACK */
+    if ( seq != xfer->sent )
+    {
+        tftp_xfer_rewind ( xfer, seq );
+    }
+
+    tftp_xfer_send_window ( xfer );
+}
+
+/* Buffer received data to be written at file offset */
+static int tftp_xfer_write ( struct tftp_xfer *xfer, const unsigned char *data, size_t len,
+    unsigned long long offset )
+{
+    if ( tftp_wbuf_write ( &xfer->wbuf, data, len, offset ) < 0 )
+    {
+        tftp_log ( TFTP_LOG_ERROR, "\n[%s] failed to write file: %i\n", xfer->progname, errno );
+        tftp_xfer_abort ( xfer, errno );
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Decode received netascii block and buffer it after text decoded so far */
+static int tftp_xfer_write_ascii ( struct tftp_xfer *xfer, const unsigned char *data, size_t len,
+    int last )
+{
+    size_t n;
+
+    n = tftp_netascii_decode ( data, len, xfer->ascii, &xfer->ascii_cr );
+
+    /* CR ending file has nothing to pair with */
+    if ( last && xfer->ascii_cr )
+    {
+        xfer->ascii[n++] = '\r';
+        xfer->ascii_cr = 0;
+    }
+
+    if ( tftp_xfer_write ( xfer, xfer->ascii, n, xfer->opts.offset + xfer->ascii_offset ) < 0 )
+    {
+        return -1;
+    }
+
+    xfer->ascii_offset += n;
+
+    return 0;
+}
+
+/* Write out received file before final ACK, returns 1 if it is being stored in background */
+static int tftp_xfer_store ( struct tftp_xfer *xfer )
+{
+    if ( ( xfer->storing = tftp_wbuf_finish ( &xfer->wbuf ) ) < 0 )
+    {
+        xfer->storing = 0;
+        tftp_log ( TFTP_LOG_ERROR, "\n[%s] failed to store file: %i\n", xfer->progname, errno );
+        tftp_xfer_abort ( xfer, errno );
+        return -1;
+    }
+
+    return xfer->storing;
+}
+
+/* Acknowledge final block of stored file, transfer succeeds only then */
+static void tftp_xfer_ack_final ( struct tftp_xfer *xfer )
+{
+    /* final ACK may get lost, dally for one timeout if requested */
+    if ( tftp_xfer_send_ack ( xfer ) >= 0 && !xfer->dally )
+    {
+        xfer->state = TFTP_XFER_STATE_DONE;
+    }
+}
+
+/* Acknowledge full window, shaped upload is slowed down by holding ACK back until data fits
+   limits */
+static void tftp_xfer_ack_window ( struct tftp_xfer *xfer )
+{
+    if ( xfer->shaper )
+    {
+        xfer->shape_ack = 1;
+        tftp_shaper_wake ( xfer->shaper, xfer );
+        tftp_xfer_arm ( xfer );
+
+    } else
+    {
+        tftp_xfer_send_window_ack ( xfer );
+    }
+}
+
+/* Go on with transfer once background write of received data has run */
+void tftp_xfer_written ( struct tftp_xfer *xfer )
+{
+    if ( xfer->state != TFTP_XFER_STATE_ACTIVE )
+    {
+        return;
+    }
+
+    if ( xfer->wbuf.status )
+    {
+        tftp_log ( TFTP_LOG_ERROR, "\n[%s] failed to store file: %i\n", xfer->progname,
+            xfer->wbuf.status );
+        tftp_xfer_abort ( xfer, xfer->wbuf.status );
+        return;
+    }
+
+    /* sender learns file is stored from final ACK */
+    if ( xfer->storing )
+    {
+        if ( !tftp_wbuf_pending ( &xfer->wbuf ) )
+        {
+            xfer->storing = 0;
+            tftp_xfer_ack_final ( xfer );
+        }
+        return;
+    }
+
+    if ( xfer->store_ack && !tftp_wbuf_busy ( &xfer->wbuf ) )
+    {
+        xfer->store_ack = 0;
+        tftp_xfer_ack_window ( xfer );
+    }
+}
+
+/* Handle DATA packet of multicast session, blocks may arrive in any order */
+static void tftp_xfer_process_mcast ( struct tftp_xfer *xfer, const unsigned char *packet,
+    size_t len )
+{
+    unsigned long long seq;
+    unsigned long long advance;
+    struct tftp_opts opts;
+
+    /* session hands mastership over, first ACK reports blocks we already have */
+    if ( tfp_load_ushort_ns ( packet ) == TFTP_OPCODE_OACK )
+    {
+        tftp_opts_init ( &opts );
+        if ( tftp_opts_load ( &opts, packet + 2, len - 2 ) >= 0
+            && opts.mask & TFTP_OPTION_MULTICAST && opts.mcast_master )
+        {
+            if ( xfer->opts.mcast_master )
+            {
+                tftp_retx_resent ( &xfer->retx, 1 );
+            }
+            xfer->opts.mcast_master = 1;
+            tftp_rtt_start ( &xfer->retx.rtt, xfer->received + 1, tftp_time_usec (  ) );
+            tftp_xfer_send_ack ( xfer );
+        }
+        return;
+    }
+
+    /* opcode must be DATA */
+    if ( tfp_load_ushort_ns ( packet ) != TFTP_OPCODE_DATA )
+    {
+        tftp_dump_packet ( xfer->progname, packet, len );
+        tftp_log ( TFTP_LOG_ERROR, "\n[%s] expected a DATA packet.\n", xfer->progname );
+        return;
+    }
+
+    /* block size cannot be exceeded */
+    if ( len > 4 + xfer->opts.blksize )
+    {
+        tftp_log ( TFTP_LOG_ERROR, "\n[%s] DATA: block too large: %lu bytes\n", xfer->progname,
+            ( unsigned long ) ( len - 4 ) );
+        tftp_xfer_abort ( xfer, EINVAL );
+        return;
+    }
+
+    /* block numbers of multicast session never wrap around */
+    seq = tfp_load_ushort_ns ( packet + 2 );
+    if ( !seq || ( xfer->lastseq && seq > xfer->lastseq ) )
+    {
+        return;
+    }
+
+    /* block sent again for another member, master re-acknowledges resent window once */
+    if ( xfer->blocks[seq >> 3] & ( 1 << ( seq & 7 ) ) )
+    {
+        xfer->retx.duplicates++;
+        if ( xfer->opts.mcast_master && seq == xfer->received )
+        {
+            tftp_retx_resent ( &xfer->retx, 1 );
+            tftp_xfer_send_ack ( xfer );
+        }
+        return;
+    }
+
+    /* write data to file at its block */
+    if ( tftp_xfer_write ( xfer, packet + 4, len - 4,
+            xfer->opts.offset + ( seq - 1 ) * xfer->opts.blksize ) < 0 )
+    {
+        return;
+    }
+
+    xfer->blocks[seq >> 3] |= 1 << ( seq & 7 );
+    xfer->nblocks++;
+    xfer->nbytes += len - 4;
+
+    /* short block terminates file */
+    if ( len < 4 + xfer->opts.blksize )
+    {
+        xfer->lastseq = seq;
+    }
+
+    /* blocks received in order so far */
+    for ( advance = 0; xfer->received < ( xfer->lastseq ? xfer->lastseq : TFTP_MCAST_BLOCKS_MAX )
+        && xfer->blocks[( xfer->received + 1 ) >> 3] & ( 1 << ( ( xfer->received + 1 ) & 7 ) );
+        advance++ )
+    {
+        xfer->received++;
+    }
+
+    if ( advance )
+    {
+        tftp_retx_accept ( &xfer->retx, xfer->received, tftp_time_usec (  ) );
+        xfer->gap_acked = 0;
+    } else
+    {
+        xfer->retx.retries = 0;
+    }
+
+    tftp_xfer_progress ( xfer, "received" );
+
+    /* every member acknowledges last block, others leave session that way */
+    if ( xfer->lastseq && xfer->received == xfer->lastseq )
+    {
+        if ( !xfer->storing && !tftp_xfer_store ( xfer ) )
+        {
+            tftp_xfer_ack_final ( xfer );
+        }
+        return;
+    }
+
+    if ( !xfer->opts.mcast_master )
+    {
+        tftp_xfer_arm ( xfer );
+
+    } else if ( !advance )
+    {
+        /* earlier block was lost, session rolls back to it */
+        if ( !xfer->gap_acked )
+        {
+            xfer->gap_acked = 1;
+            tftp_xfer_send_ack ( xfer );
+        } else
+        {
+            tftp_xfer_arm ( xfer );
+        }
+
+    } else if ( ( xfer->wincount += advance ) >= xfer->opts.windowsize )
+    {
+        /* acknowledge once window worth of blocks completes in order */
+        tftp_rtt_start ( &xfer->retx.rtt, xfer->received + 1, tftp_time_usec (  ) );
+        tftp_xfer_send_ack ( xfer );
+    } else
+    {
+        tftp_xfer_arm ( xfer );
+    }
+}
+
+/* Handle DATA packet as data receiver */
+static void tftp_xfer_process_data ( struct tftp_xfer *xfer, const unsigned char *packet,
+    size_t len )
+{
+    unsigned short block;
+    unsigned long long seq;
+
+    if ( xfer->blocks )
+    {
+        tftp_xfer_process_mcast ( xfer, packet, len );
+        return;
+    }
+
+    /* OACK retransmitted, our ACK for block #0 was lost */
+    if ( tfp_load_ushort_ns ( packet ) == TFTP_OPCODE_OACK && !xfer->received )
+    {
+        tftp_retx_resent ( &xfer->retx, 1 );
+        tftp_xfer_send_ack ( xfer );
+        return;
+    }
+
+    /* opcode must be DATA */
+    if ( tfp_load_ushort_ns ( packet ) != TFTP_OPCODE_DATA )
+    {
+        tftp_dump_packet ( xfer->progname, packet, len );
+        tftp_log ( TFTP_LOG_ERROR, "\n[%s] expected a DATA packet.\n", xfer->progname );
+        return;
+    }
+
+    /* block size cannot be exceeded */
+    if ( len > 4 + xfer->opts.blksize )
+    {
+        tftp_log ( TFTP_LOG_ERROR, "\n[%s] DATA: block too large: %lu bytes\n", xfer->progname,
+            ( unsigned long ) ( len - 4 ) );
+        tftp_xfer_abort ( xfer, EINVAL );
+        return;
+    }
+
+    block = tfp_load_ushort_ns ( packet + 2 );
+
+    /* map block number onto current window, it may have wrapped around */
+    seq = tftp_block_seq ( xfer->received + xfer->opts.windowsize, block );
+
+    switch ( tftp_retx_match ( &xfer->retx, seq ) )
+    {
+    case TFTP_RETX_DUPLICATE:
+        /* sender timed out, our ACK was lost; resent window is acknowledged once unless ACK
+           waits for data to be stored */
+        if ( seq == xfer->received && !xfer->handshake && !xfer->storing && !xfer->store_ack )
+        {
+            tftp_retx_resent ( &xfer->retx, 1 );
+            tftp_xfer_send_ack ( xfer );
+        }
+        return;
+    case TFTP_RETX_AHEAD:
+        /* earlier block was lost, sender rolls back to it if anything new arrived */
+        if ( xfer->wincount && !xfer->handshake && !xfer->gap_acked && !xfer->lastseq )
+        {
+            xfer->gap_acked = 1;
+            tftp_xfer_send_ack ( xfer );
+
+        } else if ( xfer->handshake )
+        {
+            tftp_log ( TFTP_LOG_DEBUG, "\n[%s] DATA: expected block #%u, got #%u - ignored.\n",
+                xfer->progname, ( unsigned short ) xfer->retx.expected, block );
+        }
+        return;
+    }
+
+    /* dallying after last block, only its retransmission is answered */
+    if ( xfer->lastseq )
+    {
+        return;
+    }
+
+    /* write data to file */
+    if ( xfer->netascii ? tftp_xfer_write_ascii ( xfer, packet + 4, len - 4,
+            len < 4 + xfer->opts.blksize ) < 0
+        : tftp_xfer_write ( xfer, packet + 4, len - 4, xfer->opts.offset + xfer->nbytes ) < 0 )
+    {
+        return;
+    }
+
+    xfer->received++;
+    tftp_retx_accept ( &xfer->retx, xfer->received, tftp_time_usec (  ) );
+    xfer->handshake = 0;
+    xfer->gap_acked = 0;
+    xfer->nblocks++;
+    xfer->nbytes += len - 4;
+
+    if ( xfer->shaper )
+    {
+        tftp_shaper_charge ( xfer->shaper, xfer, len, tftp_time_usec (  ) );
+    }
+
+    tftp_xfer_progress ( xfer, "received" );
+
+    /* short block terminates transfer */
+    if ( len < 4 + xfer->opts.blksize )
+    {
+        xfer->lastseq = xfer->received;
+
+        /* file being stored in background is acknowledged once written */
+        if ( !tftp_xfer_store ( xfer ) )
+        {
+            tftp_xfer_ack_final ( xfer );
+        } else
+        {
+            tftp_xfer_arm ( xfer );
+        }
+        return;
+    }
+
+    /* acknowledge last block of window only, next DATA completes round trip */
+    if ( ++xfer->wincount < xfer->opts.windowsize )
+    {
+        tftp_xfer_arm ( xfer );
+
+    } else if ( tftp_wbuf_busy ( &xfer->wbuf ) )
+    {
+        /* disk falls behind, sender waits until backlog is written */
+        xfer->store_ack = 1;
+        tftp_xfer_arm ( xfer );
+
+    } else
+    {
+        tftp_xfer_ack_window ( xfer );
+    }
+}
+
+/* Process single packet received from peer */
+static void tftp_xfer_process ( struct tftp_xfer *xfer, const unsigned char *packet, size_t len )
+{
+    /* assert packet size */
+    if ( !tftp_packet_check_length ( xfer->progname, 4, len ) )
+    {
+        return;
+    }
+
+    /* peer aborted transfer, multicast session goes on with next member */
+    if ( tfp_load_ushort_ns ( packet ) == TFTP_OPCODE_ERROR )
+    {
+        tftp_dump_packet ( xfer->progname, packet, len );
+        if ( xfer->members && tftp_xfer_promote ( xfer ) >= 0 )
+        {
+            return;
+        }
+        xfer->state = TFTP_XFER_STATE_FAILED;
+        xfer->status = ECONNABORTED;
+        return;
+    }
+
+    if ( xfer->role == TFTP_XFER_ROLE_SEND )
+    {
+        tftp_xfer_process_ack ( xfer, packet, len );
+    } else
+    {
+        tftp_xfer_process_data ( xfer, packet, len );
+    }
+}
+
+/* Listen to multicast group assigned by server */
+static int tftp_xfer_mcast_join ( struct tftp_xfer *xfer )
+{
+    int on = 1;
+    socklen_t addrlen;
+    struct sockaddr_in addr;
+    struct ip_mreq mreq;
+
+    /* one bit per block */
+    if ( !( xfer->blocks = ( unsigned char * ) calloc ( 1, ( TFTP_MCAST_BLOCKS_MAX + 1 ) / 8 ) ) )
+    {
+        return -1;
+    }
+
+    /* group is joined over interface talking to server */
+    addrlen = sizeof ( addr );
+    if ( getsockname ( xfer->sock, ( struct sockaddr * ) &addr, &addrlen ) < 0 )
+    {
+        return -1;
+    }
+
+    mreq.imr_multiaddr = xfer->opts.mcast_addr;
+    mreq.imr_interface = addr.sin_addr;
+
+    /* other members on this host share group port */
+    memset ( &addr, '\0', sizeof ( addr ) );
+    addr.sin_family = AF_INET;
+    addr.sin_addr = xfer->opts.mcast_addr;
+    addr.sin_port = htons ( xfer->opts.mcast_port );
+
+    if ( setsockopt ( xfer->msock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof ( on ) ) < 0
+        || bind ( xfer->msock, ( struct sockaddr * ) &addr, sizeof ( addr ) ) < 0
+        || setsockopt ( xfer->msock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof ( mreq ) ) < 0 )
+    {
+        return -1;
+    }
+
+    /* blocks resent for other members arrive on top of our window */
+    tftp_xfer_window_buffer ( xfer, xfer->msock, 2 );
+
+    return 0;
+}
+
+/* Apply options acknowledged by server */
+static void tftp_xfer_process_oack ( struct tftp_xfer *xfer, const unsigned char *packet,
+    size_t len )
+{
+    int resume;
+    struct stat st;
+    struct tftp_opts opts;
+
+    tftp_opts_init ( &opts );
+
+    /* server may only accept requested options and lower their values */
+    if ( tftp_opts_load ( &opts, packet + 2, len - 2 ) < 0 || ( opts.mask & ~xfer->opts.mask )
+        || opts.blksize > xfer->opts.blksize || opts.windowsize > xfer->opts.windowsize
+        || ( opts.mask & TFTP_OPTION_TIMEOUT && opts.timeout != xfer->opts.timeout )
+        || ( opts.mask & TFTP_OPTION_OFFSET && xfer->role == TFTP_XFER_ROLE_RECV
+            && opts.offset != xfer->opts.offset )
+        || ( opts.mask & TFTP_OPTION_MULTICAST && !opts.mcast_port ) )
+    {
+        tftp_log ( TFTP_LOG_ERROR, "[%s] invalid options acknowledged.\n", xfer->progname );
+        tftp_xfer_abort ( xfer, ENOPROTOOPT );
+        return;
+    }
+
+    /* server resumes partial upload, it cannot be longer than our file */
+    if ( opts.mask & TFTP_OPTION_OFFSET && xfer->role == TFTP_XFER_ROLE_SEND
+        && ( fstat ( xfer->fd, &st ) < 0 || opts.offset > ( unsigned long long ) st.st_size ) )
+    {
+        tftp_log ( TFTP_LOG_ERROR, "[%s] cannot resume upload at offset %llu.\n", xfer->progname,
+            opts.offset );
+        tftp_xfer_abort ( xfer, EINVAL );
+        return;
+    }
+
+    resume = xfer->opts.mask & TFTP_OPTION_OFFSET;
+    xfer->opts = opts;
+    xfer->handshake = 0;
+    tftp_xfer_bound_timeout ( xfer );
+
+    if ( xfer->role == TFTP_XFER_ROLE_SEND )
+    {
+        tftp_xfer_send_window ( xfer );
+        return;
+    }
+
+    /* server may have ignored resume request, partial file is downloaded again then */
+    if ( resume && tftp_xfer_seek ( xfer ) < 0 )
+    {
+        return;
+    }
+
+    /* reserve space for file reported by server, refuse it early if it does not fit */
+    if ( opts.mask & TFTP_OPTION_TSIZE && tftp_preallocate ( xfer->fd, opts.tsize ) < 0 )
+    {
+        tftp_log ( TFTP_LOG_ERROR, "[%s] failed to reserve %llu bytes: %i\n", xfer->progname,
+            opts.tsize, errno );
+        tftp_xfer_abort ( xfer, errno );
+        return;
+    }
+
+    if ( opts.mask & TFTP_OPTION_MULTICAST )
+    {
+        if ( tftp_xfer_mcast_join ( xfer ) < 0 )
+        {
+            tftp_log ( TFTP_LOG_ERROR, "[%s] failed to join multicast group: %i\n", xfer->progname,
+                errno );
+            tftp_xfer_abort ( xfer, errno );
+            return;
+        }
+
+        /* other members only listen until session makes them master */
+        if ( !opts.mcast_master )
+        {
+            tftp_xfer_arm ( xfer );
+            return;
+        }
+    }
+
+    tftp_rtt_start ( &xfer->retx.rtt, 1, tftp_time_usec (  ) );
+    tftp_xfer_send_ack ( xfer );
+}
+
+/* Handle first reply to request, it reveals server transfer ID */
+static void tftp_xfer_process_reply ( struct tftp_xfer *xfer, const struct sockaddr_in *saddr,
+    const unsigned char *packet, size_t len )
+{
+    int resume;
+
+    /* replies must come from requested host */
+    if ( saddr->sin_addr.s_addr != xfer->peer.sin_addr.s_addr
+        || !tftp_packet_check_length ( xfer->progname, 4, len ) )
+    {
+        return;
+    }
+
+    /* accept datagrams from server transfer ID only */
+    if ( connect ( xfer->sock, ( const struct sockaddr * ) saddr, sizeof ( *saddr ) ) < 0 )
+    {
+        xfer->state = TFTP_XFER_STATE_FAILED;
+        xfer->status = errno;
+        return;
+    }
+
+    xfer->peer = *saddr;
+    xfer->request = 0;
+    tftp_retx_accept ( &xfer->retx, 0, tftp_time_usec (  ) );
+
+    if ( tfp_load_ushort_ns ( packet ) == TFTP_OPCODE_OACK )
+    {
+        tftp_xfer_process_oack ( xfer, packet, len );
+        return;
+    }
+
+    /* server ignored options, fall back to defaults */
+    resume = xfer->opts.mask & TFTP_OPTION_OFFSET;
+    tftp_opts_init ( &xfer->opts );
+    tftp_xfer_bound_timeout ( xfer );
+
+    /* partial file is downloaded again from its start */
+    if ( resume && xfer->role == TFTP_XFER_ROLE_RECV && tftp_xfer_seek ( xfer ) < 0 )
+    {
+        return;
+    }
+    tftp_xfer_process ( xfer, packet, len );
+}
+
+/* Process datagram received on transfer or multicast group socket */
+void tftp_xfer_receive ( struct tftp_xfer *xfer, const struct sockaddr_in *addr,
+    const unsigned char *packet, size_t len )
+{
+    if ( xfer->request )
+    {
+        tftp_xfer_process_reply ( xfer, addr, packet, len );
+
+    } else if ( addr->sin_port == xfer->peer.sin_port
+        && addr->sin_addr.s_addr == xfer->peer.sin_addr.s_addr )
+    {
+        /* datagrams queued before connecting may come from other ports */
+        tftp_xfer_process ( xfer, packet, len );
+
+    } else if ( xfer->members )
+    {
+        tftp_xfer_process_member ( xfer, addr, packet, len );
+    }
+
+    /* buffered blocks go to disk once ACK queued for them is on its way */
+    if ( tftp_wbuf_due ( &xfer->wbuf ) && xfer->state == TFTP_XFER_STATE_ACTIVE )
+    {
+        tftp_xfer_flush ( xfer );
+
+        if ( tftp_wbuf_flush ( &xfer->wbuf, 0 ) < 0 )
+        {
+            tftp_log ( TFTP_LOG_ERROR, "\n[%s] failed to write file: %i\n", xfer->progname, errno );
+            tftp_xfer_abort ( xfer, errno );
+        }
+    }
+}
+
+/* Receive and process all packets pending on socket */
+static void tftp_xfer_drain ( struct tftp_xfer *xfer, int sock, struct tftp_io_batch *rx )
+{
+    int i;
+    int count;
+
+    do
+    {
+        if ( ( count = tftp_io_recv ( sock, rx, &xfer->io ) ) < 0 )
+        {
+            if ( errno != EAGAIN && errno != EWOULDBLOCK )
+            {
+                xfer->state = TFTP_XFER_STATE_FAILED;
+                xfer->status = errno;
+                tftp_log ( TFTP_LOG_ERROR, "\n[%s] failed to receive data: %i\n", xfer->progname,
+                    errno );
+            }
+            break;
+        }
+
+        for ( i = 0; i < count && xfer->state == TFTP_XFER_STATE_ACTIVE; i++ )
+        {
+            tftp_xfer_receive ( xfer, &rx->addrs[i], rx->buffers + i * rx->slot_size,
+                rx->msgs[i].msg_len );
+        }
+
+        /* short batch means socket has been drained */
+    } while ( xfer->state == TFTP_XFER_STATE_ACTIVE && ( unsigned int ) count == rx->limit );
+}
+
+/* Receive and process all pending packets using given receive batch */
+void tftp_xfer_input ( struct tftp_xfer *xfer, struct tftp_io_batch *rx )
+{
+    tftp_xfer_drain ( xfer, xfer->sock, rx );
+
+    /* multicast blocks arrive on group socket */
+    if ( xfer->msock >= 0 && xfer->state == TFTP_XFER_STATE_ACTIVE )
+    {
+        tftp_xfer_drain ( xfer, xfer->msock, rx );
+    }
+}
+
+/* Continue sending window once socket becomes writable */
+void tftp_xfer_output ( struct tftp_xfer *xfer )
+{
+    /* packets left over from last flush go first */
+    if ( xfer->state == TFTP_XFER_STATE_ACTIVE && !tftp_xfer_flush ( xfer )
+        && xfer->role == TFTP_XFER_ROLE_SEND && !xfer->handshake )
+    {
+        tftp_xfer_send_window ( xfer );
+    }
+}
+
+/* Handle transfer retransmission timeout */
+void tftp_xfer_timeout ( struct tftp_xfer *xfer )
+{
+    /* ACK waits for data being stored, nothing was lost */
+    if ( xfer->storing || xfer->store_ack )
+    {
+        tftp_xfer_arm ( xfer );
+        return;
+    }
+
+    /* dallying is over, sender got final ACK */
+    if ( xfer->role == TFTP_XFER_ROLE_RECV && xfer->lastseq && !xfer->blocks )
+    {
+        xfer->state = TFTP_XFER_STATE_DONE;
+        return;
+    }
+
+    /* packets held back by shaper are not lost */
+    if ( xfer->shape_queued && tftp_xfer_pending ( xfer ) )
+    {
+        tftp_xfer_arm ( xfer );
+        return;
+    }
+
+    /* give up after too many retries, reply is awaited twice as long otherwise */
+    if ( tftp_retx_expire ( &xfer->retx ) < 0 )
+    {
+        /* unresponsive multicast master is dropped */
+        if ( xfer->members && tftp_xfer_promote ( xfer ) >= 0 )
+        {
+            return;
+        }
+
+        tftp_log ( TFTP_LOG_ERROR, "\n[%s] transfer timed out.\n", xfer->progname );
+        tftp_xfer_abort ( xfer, ETIMEDOUT );
+        return;
+    }
+
+    /* resend request or OACK */
+    if ( xfer->handshake )
+    {
+        tftp_retx_resent ( &xfer->retx, 1 );
+        tftp_xfer_transmit ( xfer );
+
+    } else if ( xfer->role == TFTP_XFER_ROLE_SEND )
+    {
+        /* resend whole window from first unacknowledged block */
+        tftp_xfer_rewind ( xfer, xfer->acked );
+        tftp_xfer_send_window ( xfer );
+
+    } else if ( !xfer->blocks || xfer->opts.mcast_master )
+    {
+        tftp_retx_resent ( &xfer->retx, 1 );
+        tftp_xfer_send_ack ( xfer );
+
+    } else
+    {
+        /* listening member has nothing to resend */
+        tftp_xfer_arm ( xfer );
+    }
+}